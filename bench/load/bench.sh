@@ -0,0 +1,34 @@
+#!/bin/sh
+
+# Runs the load scenarios against the example servers and writes a JSON
+# array of the results. Run from this directory after the examples are
+# built. DURATION, THREADS, and CONNECTIONS override the defaults.
+
+DURATION=${DURATION:-5}
+THREADS=${THREADS:-2}
+CONNECTIONS=${CONNECTIONS:-32}
+LOAD="./loadgen -t $THREADS -d $DURATION"
+
+SIMPLE=http://127.0.0.1:6464
+SONGS=http://127.0.0.1:3000
+
+QUERY='{"query":"{artist(name:\"Fazerdaze\"){name songs{name duration likes}}}"}'
+LIKE='{"query":"mutation{like(artist:\"Fazerdaze\",song:\"Jennifer\"){likes}}"}'
+SUBSCRIBE='/graphql?query=subscription%7Bliked%7Bname%20likes%7D%7D'
+
+(cd ../../example/simple && exec ./simple) > /dev/null 2>&1 &
+simple_pid=$!
+(cd ../../example/graphql/songs && exec ./app) > /dev/null 2>&1 &
+songs_pid=$!
+trap 'kill $simple_pid $songs_pid 2> /dev/null' EXIT INT TERM
+sleep 1
+
+echo "["
+$LOAD -c $CONNECTIONS -s empty $SIMPLE/empty; echo ","
+$LOAD -c $CONNECTIONS -D 16 -s empty-pipelined $SIMPLE/empty; echo ","
+$LOAD -c $CONNECTIONS -k -s empty-close $SIMPLE/empty; echo ","
+$LOAD -c $CONNECTIONS -s static $SIMPLE/index.html; echo ","
+$LOAD -c $CONNECTIONS -b '{"name":"bench"}' -s post $SIMPLE/user; echo ","
+$LOAD -c $CONNECTIONS -b "$QUERY" -s graphql $SONGS/graphql; echo ","
+$LOAD -c $CONNECTIONS -b "$LIKE" -w /graphql -s ws-fanout $SONGS$SUBSCRIBE
+echo "]"
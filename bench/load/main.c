@@ -0,0 +1,765 @@
+// Copyright 2018 by Peter Ohler, All Rights Reserved
+
+// A loopback load generator. Each thread drives its share of the connections
+// with its own epoll set. Requests are pipelined up to the depth given and
+// the latency of each is from when it was queued for writing until the whole
+// response was read. Results are written as a single JSON object so runs can
+// be compared by scripts.
+//
+// In fan-out mode the connections are WebSocket subscribers. A single
+// publisher connection posts the body given and each published message
+// carries a likes count that identifies the publish so the latency is from
+// the publish to the delivery to each subscriber.
+
+// for memmem()
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_DEPTH	256
+#define MAX_EVENTS	256
+#define READ_SIZE	65536
+// Latencies are kept in microseconds with 64 buckets for each power of two
+// so the percentiles are within about 1.5%.
+#define HIST_SUB	64
+#define HIST_BUCKETS	(HIST_SUB * 40)
+// Publish send times indexed by the likes count.
+#define PUB_RING	4096
+
+typedef enum {
+    CON_HTTP	= 'h',
+    CON_UPGRADE	= 'u',
+    CON_WS	= 'w',
+} ConKind;
+
+typedef struct _hist {
+    uint64_t	counts[HIST_BUCKETS];
+    uint64_t	cnt;
+    uint64_t	sum;
+    uint64_t	max;
+} *Hist;
+
+typedef struct _con {
+    int		fd;
+    ConKind	kind;
+    bool	pub;
+    bool	writing;
+    const char	*req; // the batch for plain HTTP connections
+    size_t	rlen;
+    size_t	wpos;  // into the batch being written
+    size_t	wend;
+    int		inflight;
+    int		head;
+    int64_t	sent[MAX_DEPTH];
+    char	*buf;
+    size_t	blen;
+    size_t	bcap;
+} *Con;
+
+typedef struct _loader {
+    pthread_t		thread;
+    int			id;
+    int			epoll;
+    Con			cons;
+    int			ccnt;
+    char		*batch; // the request repeated depth times
+    struct _hist	hist;
+    uint64_t		responses;
+    uint64_t		non2xx;
+    uint64_t		errors;
+    uint64_t		messages;
+    uint64_t		bytes;
+} *Loader;
+
+static const char	*host = "127.0.0.1";
+static const char	*port = "6464";
+static const char	*path = "/";
+static const char	*method = NULL;
+static const char	*body = NULL;
+static const char	*ctype = "application/json";
+static const char	*scenario = "load";
+static const char	*pub_path = NULL;
+static int		depth = 1;
+static bool		keep_alive = true;
+static struct addrinfo	*addr = NULL;
+
+static char		*req_str = NULL;
+static size_t		req_len = 0;
+static char		*pub_str = NULL;
+static size_t		pub_len = 0;
+
+static atomic_bool	done = false;
+static atomic_int	subscribed = 0;
+static int		sub_cnt = 0;
+static atomic_llong	pub_sent[PUB_RING];
+static atomic_llong	pub_likes[PUB_RING];
+static long long	pub_next = 0; // likes count of the next publish, 0 until known
+
+static int64_t
+now_us() {
+    struct timespec	ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * 1000000LL + (int64_t)ts.tv_nsec / 1000LL;
+}
+
+static int
+hist_index(uint64_t v) {
+    int	shift;
+    int	i;
+
+    if (v < HIST_SUB * 2) {
+	return (int)v;
+    }
+    shift = 63 - __builtin_clzll(v) - 6;
+    i = shift * HIST_SUB + (int)(v >> shift);
+    if (HIST_BUCKETS <= i) {
+	i = HIST_BUCKETS - 1;
+    }
+    return i;
+}
+
+static uint64_t
+hist_value(int i) {
+    int	shift;
+
+    if (i < HIST_SUB * 2) {
+	return (uint64_t)i;
+    }
+    shift = i / HIST_SUB - 1;
+
+    return (uint64_t)(i - shift * HIST_SUB) << shift;
+}
+
+static void
+hist_add(Hist h, int64_t us) {
+    if (us < 0) {
+	us = 0;
+    }
+    h->counts[hist_index((uint64_t)us)]++;
+    h->cnt++;
+    h->sum += (uint64_t)us;
+    if (h->max < (uint64_t)us) {
+	h->max = (uint64_t)us;
+    }
+}
+
+static void
+hist_merge(Hist to, Hist from) {
+    int	i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+	to->counts[i] += from->counts[i];
+    }
+    to->cnt += from->cnt;
+    to->sum += from->sum;
+    if (to->max < from->max) {
+	to->max = from->max;
+    }
+}
+
+static uint64_t
+hist_percentile(Hist h, double p) {
+    uint64_t	target = (uint64_t)((double)h->cnt * p);
+    uint64_t	sum = 0;
+    int		i;
+
+    if (0 == h->cnt) {
+	return 0;
+    }
+    for (i = 0; i < HIST_BUCKETS; i++) {
+	sum += h->counts[i];
+	if (target < sum) {
+	    uint64_t	v = hist_value(i);
+
+	    return v < h->max ? v : h->max;
+	}
+    }
+    return h->max;
+}
+
+static char*
+build_request(const char *meth, const char *p, const char *b, bool upgrade) {
+    char	*s;
+    size_t	blen = (NULL == b) ? 0 : strlen(b);
+    size_t	size = strlen(meth) + strlen(p) + strlen(host) + blen + 512;
+    int		len;
+
+    if (NULL == (s = (char*)malloc(size))) {
+	return NULL;
+    }
+    if (upgrade) {
+	len = snprintf(s, size,
+		       "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: Upgrade\r\nUpgrade: websocket\r\n"
+		       "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n",
+		       p, host);
+    } else if (0 < blen) {
+	len = snprintf(s, size, "%s %s HTTP/1.1\r\nHost: %s\r\n%sContent-Type: %s\r\nContent-Length: %lu\r\n\r\n%s",
+		       meth, p, host, keep_alive ? "" : "Connection: close\r\n", ctype, (unsigned long)blen, b);
+    } else {
+	len = snprintf(s, size, "%s %s HTTP/1.1\r\nHost: %s\r\n%s\r\n",
+		       meth, p, host, keep_alive ? "" : "Connection: close\r\n");
+    }
+    if (len < 0 || size <= (size_t)len) {
+	free(s);
+	return NULL;
+    }
+    return s;
+}
+
+static void
+want_write(Loader ld, Con c, bool on) {
+    struct epoll_event	ev;
+
+    if (c->writing == on) {
+	return;
+    }
+    c->writing = on;
+    ev.events = on ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    ev.data.ptr = c;
+    epoll_ctl(ld->epoll, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static int
+con_open(Loader ld, Con c) {
+    struct epoll_event	ev;
+    int			optval = 1;
+
+    if (0 > (c->fd = socket(addr->ai_family, SOCK_STREAM, IPPROTO_TCP))) {
+	return -1;
+    }
+    fcntl(c->fd, F_SETFL, O_NONBLOCK);
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    if (0 != connect(c->fd, addr->ai_addr, addr->ai_addrlen) && EINPROGRESS != errno) {
+	close(c->fd);
+	c->fd = -1;
+	return -1;
+    }
+    c->inflight = 0;
+    c->head = 0;
+    c->blen = 0;
+    c->wpos = 0;
+    c->wend = 0;
+    c->writing = true;
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = c;
+    epoll_ctl(ld->epoll, EPOLL_CTL_ADD, c->fd, &ev);
+
+    return 0;
+}
+
+static void
+con_reopen(Loader ld, Con c) {
+    if (0 <= c->fd) {
+	epoll_ctl(ld->epoll, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	c->fd = -1;
+    }
+    if (CON_WS == c->kind) {
+	c->kind = CON_UPGRADE;
+	atomic_fetch_sub(&subscribed, 1);
+    }
+    if (!atomic_load(&done) && 0 != con_open(ld, c)) {
+	ld->errors++;
+    }
+}
+
+// Queues as many requests as the depth allows. The batch is the request
+// repeated so a run of requests goes out in one write.
+static void
+con_fill(Loader ld, Con c) {
+    int64_t	now;
+    int		n;
+
+    if (c->wpos < c->wend || atomic_load(&done)) {
+	return;
+    }
+    if (CON_WS == c->kind) {
+	return;
+    }
+    if (CON_UPGRADE == c->kind) {
+	if (0 < c->inflight) {
+	    return;
+	}
+	n = 1;
+    } else if (c->pub) {
+	// Publishing waits for every subscriber and then goes one at a time
+	// so the likes count of each publish is known before it is sent.
+	if (0 < c->inflight || atomic_load(&subscribed) < sub_cnt) {
+	    return;
+	}
+	n = 1;
+    } else {
+	n = (keep_alive ? depth : 1) - c->inflight;
+    }
+    if (n <= 0) {
+	return;
+    }
+    now = now_us();
+    if (c->pub && 0 < pub_next) {
+	int	slot = (int)(pub_next % PUB_RING);
+
+	atomic_store(&pub_sent[slot], now);
+	atomic_store(&pub_likes[slot], pub_next);
+    }
+    for (int i = 0; i < n; i++) {
+	c->sent[(c->head + c->inflight) % MAX_DEPTH] = now;
+	c->inflight++;
+    }
+    c->wpos = 0;
+    c->wend = c->rlen * n;
+    want_write(ld, c, true);
+}
+
+static bool
+con_write(Loader ld, Con c) {
+    ssize_t	cnt;
+
+    while (c->wpos < c->wend) {
+	if (0 > (cnt = write(c->fd, c->req + c->wpos, c->wend - c->wpos))) {
+	    if (EAGAIN == errno) {
+		return true;
+	    }
+	    return false;
+	}
+	c->wpos += cnt;
+    }
+    c->wpos = 0;
+    c->wend = 0;
+    want_write(ld, c, false);
+
+    return true;
+}
+
+static long long
+find_likes(const char *s, size_t len) {
+    const char	*end = s + len;
+    const char	*p;
+
+    for (p = s; p + 8 < end; p++) {
+	if ('"' == *p && 0 == strncmp(p, "\"likes\":", 8)) {
+	    return strtoll(p + 8, NULL, 10);
+	}
+    }
+    return 0;
+}
+
+// Returns the length of the response at the start of the buffer or 0 if
+// not all of it has been read.
+static size_t
+response_len(Con c, int *status) {
+    char	*hend;
+    char	*h;
+    size_t	hlen;
+    long	clen = 0;
+    bool	chunked = false;
+
+    if (c->blen < 12 || NULL == (hend = memmem(c->buf, c->blen, "\r\n\r\n", 4))) {
+	return 0;
+    }
+    hlen = hend - c->buf + 4;
+    *status = atoi(c->buf + 9);
+    for (h = memchr(c->buf, '\n', hlen); NULL != h && h < hend; h = memchr(h, '\n', hend - h)) {
+	h++;
+	if (0 == strncasecmp(h, "content-length:", 15)) {
+	    clen = strtol(h + 15, NULL, 10);
+	} else if (0 == strncasecmp(h, "transfer-encoding:", 18) && NULL != strstr(h, "chunked")) {
+	    chunked = true;
+	}
+    }
+    if (101 == *status) {
+	return hlen;
+    }
+    if (chunked) {
+	char	*last = memmem(c->buf + hlen - 2, c->blen - hlen + 2, "\r\n0\r\n\r\n", 7);
+
+	if (NULL == last) {
+	    return 0;
+	}
+	return last - c->buf + 7;
+    }
+    if (c->blen < hlen + clen) {
+	return 0;
+    }
+    return hlen + clen;
+}
+
+// Returns the length of the frame at the start of the buffer or 0 if not
+// all of it has been read.
+static size_t
+frame_len(Con c, size_t *off) {
+    uint8_t	*b = (uint8_t*)c->buf;
+    uint64_t	plen;
+
+    if (c->blen < 2) {
+	return 0;
+    }
+    plen = b[1] & 0x7F;
+    *off = 2;
+    if (126 == plen) {
+	if (c->blen < 4) {
+	    return 0;
+	}
+	plen = ((uint64_t)b[2] << 8) | b[3];
+	*off = 4;
+    } else if (127 == plen) {
+	if (c->blen < 10) {
+	    return 0;
+	}
+	plen = 0;
+	for (int i = 2; i < 10; i++) {
+	    plen = (plen << 8) | b[i];
+	}
+	*off = 10;
+    }
+    if (0 != (b[1] & 0x80)) {
+	*off += 4;
+    }
+    if (c->blen < *off + plen) {
+	return 0;
+    }
+    return *off + plen;
+}
+
+static void
+ws_message(Loader ld, Con c, const char *msg, size_t len) {
+    long long	likes = find_likes(msg, len);
+    int		slot = (int)(likes % PUB_RING);
+
+    ld->messages++;
+    if (0 < likes && likes == atomic_load(&pub_likes[slot])) {
+	hist_add(&ld->hist, now_us() - (int64_t)atomic_load(&pub_sent[slot]));
+    }
+}
+
+static bool
+con_read(Loader ld, Con c) {
+    ssize_t	cnt;
+    size_t	len;
+    size_t	off;
+    int		status;
+
+    if (c->bcap - c->blen < READ_SIZE) {
+	c->bcap = c->blen + READ_SIZE * 2;
+	if (NULL == (c->buf = (char*)realloc(c->buf, c->bcap))) {
+	    return false;
+	}
+    }
+    if (0 > (cnt = read(c->fd, c->buf + c->blen, c->bcap - c->blen))) {
+	return EAGAIN == errno;
+    }
+    if (0 == cnt) {
+	if (0 < c->inflight || CON_HTTP != c->kind) {
+	    ld->errors++;
+	}
+	return false;
+    }
+    c->blen += cnt;
+    ld->bytes += cnt;
+    while (0 < c->blen) {
+	if (CON_WS == c->kind) {
+	    if (0 == (len = frame_len(c, &off))) {
+		break;
+	    }
+	    if (0x01 == (c->buf[0] & 0x0F)) {
+		ws_message(ld, c, c->buf + off, len - off);
+	    } else if (0x08 == (c->buf[0] & 0x0F)) {
+		return false;
+	    }
+	} else {
+	    if (0 == (len = response_len(c, &status))) {
+		break;
+	    }
+	    if (0 < c->inflight) {
+		if (CON_UPGRADE == c->kind) {
+		    if (101 != status) {
+			ld->errors++;
+			return false;
+		    }
+		    c->kind = CON_WS;
+		    atomic_fetch_add(&subscribed, 1);
+		} else {
+		    if (c->pub) {
+			pub_next = find_likes(c->buf, len) + 1;
+		    } else {
+			hist_add(&ld->hist, now_us() - c->sent[c->head]);
+		    }
+		    ld->responses++;
+		    if (status < 200 || 300 <= status) {
+			ld->non2xx++;
+		    }
+		}
+		c->head = (c->head + 1) % MAX_DEPTH;
+		c->inflight--;
+	    }
+	}
+	memmove(c->buf, c->buf + len, c->blen - len);
+	c->blen -= len;
+	if (CON_HTTP == c->kind && !keep_alive && 0 == c->inflight) {
+	    return false;
+	}
+    }
+    return true;
+}
+
+static void*
+load_loop(void *ptr) {
+    Loader		ld = (Loader)ptr;
+    struct epoll_event	events[MAX_EVENTS];
+    int			cnt;
+    int			i;
+
+    for (i = 0; i < ld->ccnt; i++) {
+	if (0 != con_open(ld, &ld->cons[i])) {
+	    ld->errors++;
+	}
+    }
+    while (!atomic_load(&done)) {
+	for (i = 0; i < ld->ccnt; i++) {
+	    if (0 <= ld->cons[i].fd) {
+		con_fill(ld, &ld->cons[i]);
+	    }
+	}
+	if (0 > (cnt = epoll_wait(ld->epoll, events, MAX_EVENTS, 10))) {
+	    if (EINTR == errno) {
+		continue;
+	    }
+	    break;
+	}
+	for (i = 0; i < cnt; i++) {
+	    Con	c = (Con)events[i].data.ptr;
+
+	    if (0 != (events[i].events & (EPOLLERR | EPOLLHUP)) && 0 == (events[i].events & EPOLLIN)) {
+		ld->errors++;
+		con_reopen(ld, c);
+		continue;
+	    }
+	    if (0 != (events[i].events & EPOLLIN) && !con_read(ld, c)) {
+		con_reopen(ld, c);
+		continue;
+	    }
+	    if (0 != (events[i].events & EPOLLOUT) && !con_write(ld, c)) {
+		ld->errors++;
+		con_reopen(ld, c);
+	    }
+	}
+    }
+    for (i = 0; i < ld->ccnt; i++) {
+	if (0 <= ld->cons[i].fd) {
+	    close(ld->cons[i].fd);
+	}
+	free(ld->cons[i].buf);
+    }
+    close(ld->epoll);
+
+    return NULL;
+}
+
+static int
+parse_url(char *url) {
+    char	*s = url;
+    char	*p;
+
+    if (0 == strncmp(s, "http://", 7)) {
+	s += 7;
+    } else if (0 == strncmp(s, "ws://", 5)) {
+	s += 5;
+    }
+    if (NULL != (p = strchr(s, '/'))) {
+	path = strdup(p);
+	*p = '\0';
+    }
+    if (NULL != (p = strrchr(s, ':'))) {
+	*p = '\0';
+	port = p + 1;
+    }
+    if ('\0' != *s) {
+	host = s;
+    }
+    return 0;
+}
+
+static void
+usage(const char *app) {
+    printf("%s [-t <threads>] [-c <connections>] [-d <seconds>] [-D <pipeline depth>] [-k] [-m <method>]\n"
+	   "  [-b <body>] [-T <content type>] [-w <publish path>] [-s <scenario name>] <url>\n"
+	   "  -k turns off keep-alive, -w runs WebSocket fan-out with the connections subscribing to the url\n", app);
+}
+
+int
+main(int argc, char **argv) {
+    struct addrinfo	hints;
+    struct _hist	hist;
+    Loader		loaders;
+    int			tcnt = 2;
+    int			ccnt = 16;
+    double		duration = 5.0;
+    uint64_t		responses = 0;
+    uint64_t		non2xx = 0;
+    uint64_t		errors = 0;
+    uint64_t		messages = 0;
+    uint64_t		bytes = 0;
+    int64_t		start;
+    double		dt;
+    int			opt;
+    int			i;
+
+    while (-1 != (opt = getopt(argc, argv, "t:c:d:D:km:b:T:w:s:h"))) {
+	switch (opt) {
+	case 't': tcnt = atoi(optarg);		break;
+	case 'c': ccnt = atoi(optarg);		break;
+	case 'd': duration = atof(optarg);	break;
+	case 'D': depth = atoi(optarg);		break;
+	case 'k': keep_alive = false;		break;
+	case 'm': method = optarg;		break;
+	case 'b': body = optarg;		break;
+	case 'T': ctype = optarg;		break;
+	case 'w': pub_path = optarg;		break;
+	case 's': scenario = optarg;		break;
+	default:
+	    usage(*argv);
+	    return 1;
+	}
+    }
+    if (optind < argc) {
+	parse_url(argv[optind]);
+    }
+    if (tcnt < 1 || ccnt < 1 || duration <= 0.0 || depth < 1 || MAX_DEPTH < depth) {
+	usage(*argv);
+	return 1;
+    }
+    if (tcnt > ccnt) {
+	tcnt = ccnt;
+    }
+    if (NULL == method) {
+	method = (NULL == body) ? "GET" : "POST";
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (0 != getaddrinfo(host, port, &hints, &addr)) {
+	printf("failed to resolve %s:%s\n", host, port);
+	return 1;
+    }
+    if (NULL == pub_path) {
+	req_str = build_request(method, path, body, false);
+    } else {
+	req_str = build_request("GET", path, NULL, true);
+	pub_str = build_request("POST", pub_path, body, false);
+	sub_cnt = ccnt;
+	depth = 1;
+    }
+    if (NULL == req_str || (NULL != pub_path && NULL == pub_str)) {
+	printf("request too large\n");
+	return 1;
+    }
+    req_len = strlen(req_str);
+    if (NULL != pub_str) {
+	pub_len = strlen(pub_str);
+    }
+    if (NULL == (loaders = (Loader)calloc(tcnt, sizeof(struct _loader)))) {
+	printf("out of memory\n");
+	return 1;
+    }
+    for (i = 0; i < tcnt; i++) {
+	Loader	ld = &loaders[i];
+	int	n = ccnt / tcnt + (i < ccnt % tcnt ? 1 : 0);
+
+	// The publisher rides along with the first thread.
+	if (0 == i && NULL != pub_str) {
+	    n++;
+	}
+	ld->id = i;
+	ld->ccnt = n;
+	ld->epoll = epoll_create1(0);
+	ld->cons = (Con)calloc(n, sizeof(struct _con));
+	ld->batch = (char*)malloc(req_len * depth);
+	if (NULL == ld->cons || NULL == ld->batch) {
+	    printf("out of memory\n");
+	    return 1;
+	}
+	for (int j = 0; j < depth; j++) {
+	    memcpy(ld->batch + req_len * j, req_str, req_len);
+	}
+	for (int j = 0; j < n; j++) {
+	    Con	c = &ld->cons[j];
+
+	    c->fd = -1;
+	    if (0 == i && 0 == j && NULL != pub_str) {
+		c->pub = true;
+		c->kind = CON_HTTP;
+		c->req = pub_str;
+		c->rlen = pub_len;
+	    } else if (NULL == pub_path) {
+		c->kind = CON_HTTP;
+		c->req = ld->batch;
+		c->rlen = req_len;
+	    } else {
+		c->kind = CON_UPGRADE;
+		c->req = req_str;
+		c->rlen = req_len;
+	    }
+	}
+    }
+    start = now_us();
+    for (i = 0; i < tcnt; i++) {
+	pthread_create(&loaders[i].thread, NULL, load_loop, &loaders[i]);
+    }
+    usleep((useconds_t)(duration * 1000000.0));
+    atomic_store(&done, true);
+    memset(&hist, 0, sizeof(hist));
+    for (i = 0; i < tcnt; i++) {
+	pthread_join(loaders[i].thread, NULL);
+	hist_merge(&hist, &loaders[i].hist);
+	responses += loaders[i].responses;
+	non2xx += loaders[i].non2xx;
+	errors += loaders[i].errors;
+	messages += loaders[i].messages;
+	bytes += loaders[i].bytes;
+	free(loaders[i].cons);
+	free(loaders[i].batch);
+    }
+    dt = (double)(now_us() - start) / 1000000.0;
+
+    printf("{\"scenario\":\"%s\",\"url\":\"http://%s:%s%s\",\"threads\":%d,\"connections\":%d,\"depth\":%d,"
+	   "\"keep_alive\":%s,\"duration\":%.3f,\"requests\":%llu,\"non2xx\":%llu,\"errors\":%llu,"
+	   "\"rps\":%.1f,\"bytes_per_sec\":%.1f,",
+	   scenario, host, port, path, tcnt, ccnt, depth, keep_alive ? "true" : "false", dt,
+	   (unsigned long long)responses, (unsigned long long)non2xx, (unsigned long long)errors,
+	   (double)responses / dt, (double)bytes / dt);
+    if (NULL != pub_path) {
+	printf("\"subscribers\":%d,\"subscribed\":%d,\"messages\":%llu,\"messages_per_sec\":%.1f,",
+	       sub_cnt, atomic_load(&subscribed), (unsigned long long)messages, (double)messages / dt);
+    }
+    printf("\"latency_us\":{\"count\":%llu,\"mean\":%.1f,\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}}\n",
+	   (unsigned long long)hist.cnt,
+	   0 == hist.cnt ? 0.0 : (double)hist.sum / (double)hist.cnt,
+	   (unsigned long long)hist_percentile(&hist, 0.5),
+	   (unsigned long long)hist_percentile(&hist, 0.99),
+	   (unsigned long long)hist_percentile(&hist, 0.999),
+	   (unsigned long long)hist.max);
+
+    freeaddrinfo(addr);
+    free(req_str);
+    free(pub_str);
+    free(loaders);
+
+    return 0;
+}
@@ -0,0 +1,38 @@
+// Copyright 2015, 2016, 2018 by Peter Ohler, All Rights Reserved
+
+#ifndef LEGACY_QUEUE_H
+#define LEGACY_QUEUE_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <agoo/atomic.h>
+
+typedef void	*legacyQItem;
+
+typedef struct _legacyQueue {
+    legacyQItem		*q;
+    legacyQItem		*end;
+    _Atomic(legacyQItem*)	head;
+    _Atomic(legacyQItem*)	tail;
+    bool		multi_push;
+    bool		multi_pop;
+    atomic_flag		push_lock; // set to true when push in progress
+    atomic_flag		pop_lock; // set to true when push in progress
+    atomic_int		wait_state;
+    int			rsock;
+    int			wsock;
+} *legacyQueue;
+
+extern int		legacy_queue_init(legacyQueue q, size_t qsize);
+extern int		legacy_queue_multi_init(legacyQueue q, size_t qsize, bool multi_push, bool multi_pop);
+extern void		legacy_queue_cleanup(legacyQueue q);
+extern void		legacy_queue_push(legacyQueue q, legacyQItem item);
+extern legacyQItem	legacy_queue_pop(legacyQueue q, double timeout);
+extern bool		legacy_queue_empty(legacyQueue q);
+extern int		legacy_queue_listen(legacyQueue q);
+extern void		legacy_queue_release(legacyQueue q);
+extern int		legacy_queue_count(legacyQueue q);
+extern void		legacy_queue_wakeup(legacyQueue q);
+
+#endif // LEGACY_QUEUE_H
@@ -0,0 +1,222 @@
+// Copyright 2018 by Peter Ohler, All Rights Reserved
+
+// Compares the agooQueue against the earlier spin and sleep queue. Items
+// carry the time they were pushed so the consumer can record the handoff
+// latency. The throughput run pushes as fast as possible so latency there is
+// mostly time spent in a full queue. The paced run spaces pushes out so the
+// latency is the handoff to a waiting consumer.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <agoo/err.h>
+#include <agoo/queue.h>
+
+#include "legacy.h"
+
+typedef struct _item {
+    int64_t	pushed; // nanoseconds
+} *Item;
+
+typedef struct _bench {
+    const char	*name;
+    void	*q;
+    void	(*push)(void *q, void *item);
+    void*	(*pop)(void *q, double timeout);
+    Item	items;
+    int64_t	*lats;
+    long	icnt;
+    int64_t	interval; // nanoseconds between pushes by one producer
+    int		pcnt;
+    int		ccnt;
+    atomic_int	popped;
+} *Bench;
+
+typedef struct _worker {
+    Bench	b;
+    int		id;
+} *Worker;
+
+static int64_t
+now_ns() {
+    struct timespec	ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * 1000000000LL + (int64_t)ts.tv_nsec;
+}
+
+static void
+agoo_push(void *q, void *item) {
+    agoo_queue_push((agooQueue)q, item);
+}
+
+static void*
+agoo_pop(void *q, double timeout) {
+    return agoo_queue_pop((agooQueue)q, timeout);
+}
+
+static void
+legacy_push(void *q, void *item) {
+    legacy_queue_push((legacyQueue)q, item);
+}
+
+static void*
+legacy_pop(void *q, double timeout) {
+    return legacy_queue_pop((legacyQueue)q, timeout);
+}
+
+static void*
+produce(void *x) {
+    Worker	w = (Worker)x;
+    Bench	b = w->b;
+    int64_t	next = now_ns();
+    long	i;
+
+    for (i = w->id; i < b->icnt; i += b->pcnt) {
+	Item	item = b->items + i;
+
+	if (0 < b->interval) {
+	    next += b->interval;
+	    while (now_ns() < next) {
+	    }
+	}
+	item->pushed = now_ns();
+	b->push(b->q, item);
+    }
+    return NULL;
+}
+
+static void*
+consume(void *x) {
+    Worker	w = (Worker)x;
+    Bench	b = w->b;
+    Item	item;
+
+    while ((long)atomic_load(&b->popped) < b->icnt) {
+	if (NULL != (item = (Item)b->pop(b->q, 0.01))) {
+	    int	n = atomic_fetch_add(&b->popped, 1);
+
+	    b->lats[n] = now_ns() - item->pushed;
+	}
+    }
+    return NULL;
+}
+
+static int
+cmp_lat(const void *a, const void *b) {
+    int64_t	x = *(const int64_t*)a;
+    int64_t	y = *(const int64_t*)b;
+
+    return (x < y) ? -1 : (x > y);
+}
+
+static void
+run(Bench b, const char *mode) {
+    pthread_t		threads[b->pcnt + b->ccnt];
+    struct _worker	workers[b->pcnt + b->ccnt];
+    int64_t		start;
+    double		dt;
+    int			i;
+
+    atomic_init(&b->popped, 0);
+    start = now_ns();
+    for (i = 0; i < b->ccnt; i++) {
+	workers[i].b = b;
+	workers[i].id = i;
+	pthread_create(&threads[i], NULL, consume, &workers[i]);
+    }
+    for (i = 0; i < b->pcnt; i++) {
+	workers[b->ccnt + i].b = b;
+	workers[b->ccnt + i].id = i;
+	pthread_create(&threads[b->ccnt + i], NULL, produce, &workers[b->ccnt + i]);
+    }
+    for (i = 0; i < b->pcnt + b->ccnt; i++) {
+	pthread_join(threads[i], NULL);
+    }
+    dt = (double)(now_ns() - start) / 1000000000.0;
+    qsort(b->lats, b->icnt, sizeof(int64_t), cmp_lat);
+
+    printf("%-8s %-6s %10.0f items/sec  p50 %8.1f usec  p99 %8.1f usec  max %9.1f usec\n",
+	   b->name, mode, (double)b->icnt / dt,
+	   (double)b->lats[b->icnt / 2] / 1000.0,
+	   (double)b->lats[b->icnt * 99 / 100] / 1000.0,
+	   (double)b->lats[b->icnt - 1] / 1000.0);
+}
+
+static void
+usage(const char *app) {
+    printf("%s [-p <producers>] [-c <consumers>] [-n <items>] [-s <queue size>] [-i <paced interval usec>]\n", app);
+}
+
+int
+main(int argc, char **argv) {
+    struct _agooErr	err = AGOO_ERR_INIT;
+    struct _agooQueue	aq;
+    struct _legacyQueue	lq;
+    struct _bench	b;
+    int			qsize = 1024;
+    int64_t		interval = 20000;
+    int			opt;
+
+    memset(&b, 0, sizeof(b));
+    b.icnt = 200000;
+    b.pcnt = 4;
+    b.ccnt = 4;
+    while (-1 != (opt = getopt(argc, argv, "p:c:n:s:i:h"))) {
+	switch (opt) {
+	case 'p': b.pcnt = atoi(optarg);	break;
+	case 'c': b.ccnt = atoi(optarg);	break;
+	case 'n': b.icnt = atol(optarg);	break;
+	case 's': qsize = atoi(optarg);		break;
+	case 'i': interval = atol(optarg) * 1000;	break;
+	default:
+	    usage(*argv);
+	    return 1;
+	}
+    }
+    if (b.pcnt < 1 || b.ccnt < 1 || b.icnt < 1) {
+	usage(*argv);
+	return 1;
+    }
+    b.items = (Item)calloc(b.icnt, sizeof(struct _item));
+    b.lats = (int64_t*)calloc(b.icnt, sizeof(int64_t));
+    printf("%d producers, %d consumers, %ld items, queue size %d\n", b.pcnt, b.ccnt, b.icnt, qsize);
+
+    if (AGOO_ERR_OK != agoo_queue_multi_init(&err, &aq, qsize, true, true)) {
+	printf("%s\n", err.msg);
+	return err.code;
+    }
+    b.name = "agoo";
+    b.q = &aq;
+    b.push = agoo_push;
+    b.pop = agoo_pop;
+    b.interval = 0;
+    run(&b, "full");
+    b.interval = interval;
+    run(&b, "paced");
+    agoo_queue_cleanup(&aq);
+
+    if (0 != legacy_queue_multi_init(&lq, qsize, true, true)) {
+	printf("legacy queue init failed\n");
+	return 1;
+    }
+    b.name = "legacy";
+    b.q = &lq;
+    b.push = legacy_push;
+    b.pop = legacy_pop;
+    b.interval = 0;
+    run(&b, "full");
+    b.interval = interval;
+    run(&b, "paced");
+    legacy_queue_cleanup(&lq);
+
+    free(b.items);
+    free(b.lats);
+
+    return 0;
+}
@@ -351,12 +351,16 @@ mutation_like(agooErr err, gqlDoc doc, gqlCobj obj, gqlField field, gqlSel sel,
 	    break;
 	}
     }
-    if (NULL == found) {
+    if (NULL == found || NULL == found->name) {
 	return gql_object_set(err, result, key, gql_null_create(err));
     }
     struct _gqlCobj	child = { .clas = &song_class, .ptr = (void*)found };
     gqlValue		co;
 
+    // Subscribers to liked get the song.
+    if (AGOO_ERR_OK != agoo_server_gpublish(err, "liked", (gqlRef)&child)) {
+	return err->code;
+    }
     if (NULL == (co = gql_object_create(err)) ||
 	AGOO_ERR_OK != gql_object_set(err, result, key, co)) {
 	return err->code;
@@ -379,6 +383,28 @@ static struct _gqlCobj	mutation_obj = {
     .ptr = &moo,
 };
 
+///// Subscription type setup
+
+static int
+subscription_liked(agooErr err, gqlDoc doc, gqlCobj obj, gqlField field, gqlSel sel, gqlValue result, int depth) {
+    return gql_object_set(err, result, "subject", gql_string_create(err, "liked", -1));
+}
+
+static struct _gqlCmethod	subscription_methods[] = {
+    { .key = "liked", .func = subscription_liked },
+    { .key = NULL,    .func = NULL },
+};
+
+static struct _gqlCclass	subscription_class = {
+    .name = "subscription",
+    .methods = subscription_methods,
+};
+
+static struct _gqlCobj	subscription_obj = {
+    .clas = &subscription_class,
+    .ptr = NULL,
+};
+
 int
 main(int argc, char **argv) {
     struct _agooErr	err = AGOO_ERR_INIT;
@@ -401,6 +427,7 @@ main(int argc, char **argv) {
     }
     agoo_query_object = &query_obj;
     agoo_mutation_object = &mutation_obj;
+    agoo_subscription_object = &subscription_obj;
 
     // set up hooks or routes
     if (AGOO_ERR_OK != agoo_add_func_hook(&err, AGOO_GET, "/", empty_handler, true)) {
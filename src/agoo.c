@@ -15,6 +15,7 @@
 #include "agoo/graphql.h"
 #include "agoo/http.h"
 #include "agoo/log.h"
+#include "agoo/metrics.h"
 #include "agoo/req.h"
 #include "agoo/res.h"
 #include "agoo/sdl.h"
@@ -80,8 +81,35 @@ agoo_add_func_hook(agooErr	err,
     return agoo_server_add_func_hook(err, method, pattern, func, &agoo_server.eval_queue, quick);
 }
 
+int
+agoo_add_workers_hook(agooErr		err,
+		      agooWorkers	workers,
+		      agooMethod	method,
+		      const char	*pattern,
+		      void		(*func)(agooReq req)) {
+
+    return agoo_server_add_workers_hook(err, method, pattern, func, workers);
+}
+
+int
+agoo_add_metrics(agooErr err, const char *path) {
+    if (AGOO_ERR_OK != agoo_server_add_func_hook(err, AGOO_GET, path, agoo_metrics_hook, &agoo_server.eval_queue, false) ||
+	AGOO_ERR_OK != agoo_server_hook_priority(err, AGOO_GET, path, AGOO_PRIORITY_HIGH)) {
+	return err->code;
+    }
+    agoo_metrics_on = true;
+
+    return AGOO_ERR_OK;
+}
+
+int
+agoo_set_priority(agooErr err, agooMethod method, const char *pattern, int priority) {
+    return agoo_server_hook_priority(err, method, pattern, priority);
+}
+
 gqlRef	agoo_query_object = NULL;
 gqlRef	agoo_mutation_object = NULL;
+gqlRef	agoo_subscription_object = NULL;
 
 static int
 schema_query(agooErr err, gqlDoc doc, gqlCobj obj, gqlField field, gqlSel sel, gqlValue result, int depth) {
@@ -93,10 +121,16 @@ schema_mutation(agooErr err, gqlDoc doc, gqlCobj obj, gqlField field, gqlSel sel
     return gql_eval_sels(err, doc, (gqlRef)agoo_mutation_object, field, sel->sels, result, depth + 1);
 }
 
+static int
+schema_subscription(agooErr err, gqlDoc doc, gqlCobj obj, gqlField field, gqlSel sel, gqlValue result, int depth) {
+    return gql_eval_sels(err, doc, (gqlRef)agoo_subscription_object, field, sel->sels, result, depth + 1);
+}
+
 static struct _gqlCmethod	schema_methods[] = {
-    { .key = "query",    .func = schema_query },
-    { .key = "mutation", .func = schema_mutation },
-    { .key = NULL,       .func = NULL },
+    { .key = "query",        .func = schema_query },
+    { .key = "mutation",     .func = schema_mutation },
+    { .key = "subscription", .func = schema_subscription },
+    { .key = NULL,           .func = NULL },
 };
 
 static struct _gqlCclass	schema_class = {
@@ -117,6 +151,8 @@ root_op(const char *op) {
 	ref = agoo_query_object;
     } else if (0 == strcmp("mutation", op)) {
 	ref = agoo_mutation_object;
+    } else if (0 == strcmp("subscription", op)) {
+	ref = agoo_subscription_object;
     }
     return ref;
 }
@@ -192,6 +228,7 @@ agoo_setup_graphql(agooErr err, const char *path, ...) {
     gqlType	schema;
     gqlType	query = NULL;
     gqlType	mutation = NULL;
+    gqlType	subscription = NULL;
 
     if (NULL == (schema = gql_type_get("schema"))) {
 	if (NULL == (schema = gql_schema_create(err, NULL, 0))) {
@@ -208,6 +245,11 @@ agoo_setup_graphql(agooErr err, const char *path, ...) {
 		return err->code;
 	    }
 	}
+	if (NULL != (subscription = gql_type_get("Subscription"))) {
+	    if (NULL == gql_type_field(err, schema, "subscription", subscription, NULL, NULL, 0, false)) {
+		return err->code;
+	    }
+	}
     } else {
 	gqlField	f = gql_type_get_field(schema, "query");
 
@@ -290,13 +332,14 @@ eval_loop(void *ptr) {
 	    }
 	    switch (req->hook->type) {
 	    case FUNC_HOOK:
-		req->hook->func(req);
+		if (!agoo_shed_expired(req)) {
+		    agoo_metrics_call(req);
+		}
 		break;
 	    default:
 		bad_request(req, 404, __LINE__, NULL);
 		break;
 	    }
-	    agoo_queue_wakeup(&agoo_server.con_queue);
 	    agoo_req_destroy(req);
 	}
     }
@@ -322,6 +365,11 @@ agoo_start(agooErr err, const char *version) {
 	    return err->code;
 	}
     }
+    for (agooWorkers w = agoo_server.workers; NULL != w; w = w->next) {
+	if (AGOO_ERR_OK != agoo_workers_start(err, w)) {
+	    return err->code;
+	}
+    }
     // TBD wait for threads to be started?
     // TBD is running reset?
 
@@ -381,3 +429,90 @@ agoo_respond(int status, const char *body, int blen, agooKeyVal headers) {
     }
     return t;
 }
+
+int
+agoo_stream_open(agooErr err, agooReq req, int status, long len, agooKeyVal headers) {
+    agooText	t;
+    agooKeyVal	h;
+
+    if (NULL == req->res) {
+	return agoo_err_set(err, AGOO_ERR_ARG, "request has no response to stream to");
+    }
+    if (NULL == (t = agoo_text_allocate(256))) {
+	return AGOO_ERR_MEM(err, "Stream");
+    }
+    if (0 > len) {
+	t->len = snprintf(t->text, 256, "HTTP/1.1 %d %s\r\nTransfer-Encoding: chunked\r\n", status, agoo_http_code_message(status));
+    } else {
+	t->len = snprintf(t->text, 256, "HTTP/1.1 %d %s\r\nContent-Length: %ld\r\n", status, agoo_http_code_message(status), len);
+    }
+    if (NULL != headers) {
+	for (h = headers; NULL != h->key; h++) {
+	    t = agoo_text_append(t, h->key, -1);
+	    t = agoo_text_append(t, ": ", 2);
+	    t = agoo_text_append(t, h->value, -1);
+	    t = agoo_text_append(t, "\r\n", 2);
+	}
+    }
+    if (NULL == (t = agoo_text_append(t, "\r\n", 2))) {
+	return AGOO_ERR_MEM(err, "Stream");
+    }
+    // Quick hooks run on the con loop thread which would never drain the
+    // response if the writer waited.
+    agoo_res_stream_open(req->res, t, len, !req->hook->no_queue);
+
+    return AGOO_ERR_OK;
+}
+
+int
+agoo_stream_write(agooErr err, agooReq req, const char *buf, size_t len) {
+    return agoo_res_stream_write(err, req->res, buf, len);
+}
+
+int
+agoo_stream_close(agooErr err, agooReq req) {
+    return agoo_res_stream_close(err, req->res);
+}
+
+agooText
+agoo_respond_not_modified(agooReq req, const char *etag, time_t mtime, agooKeyVal headers) {
+    agooText	t;
+    agooKeyVal	h;
+    const char	*inm;
+    const char	*ims;
+    int		inmlen = 0;
+    int		imslen = 0;
+    char	date[AGOO_HTTP_DATE_LEN + 1];
+
+    inm = agoo_req_header_value(req, "If-None-Match", &inmlen);
+    ims = agoo_req_header_value(req, "If-Modified-Since", &imslen);
+    if (!agoo_http_not_modified(inm, inmlen, etag, ims, imslen, mtime)) {
+	return NULL;
+    }
+    if (NULL == (t = agoo_text_allocate(256))) {
+	printf("*-*-* Out of memory *-*-*\n");
+	exit(AGOO_ERR_MEMORY);
+	return NULL;
+    }
+    t = agoo_text_append(t, "HTTP/1.1 304 Not Modified\r\n", -1);
+    if (NULL != etag) {
+	t = agoo_text_append(t, "ETag: ", 6);
+	t = agoo_text_append(t, etag, -1);
+	t = agoo_text_append(t, "\r\n", 2);
+    }
+    if (0 < mtime) {
+	agoo_http_date(date, mtime);
+	t = agoo_text_append(t, "Last-Modified: ", 15);
+	t = agoo_text_append(t, date, AGOO_HTTP_DATE_LEN);
+	t = agoo_text_append(t, "\r\n", 2);
+    }
+    if (NULL != headers) {
+	for (h = headers; NULL != h->key; h++) {
+	    t = agoo_text_append(t, h->key, -1);
+	    t = agoo_text_append(t, ": ", 2);
+	    t = agoo_text_append(t, h->value, -1);
+	    t = agoo_text_append(t, "\r\n", 2);
+	}
+    }
+    return agoo_text_append(t, "\r\n", 2);
+}
@@ -4,11 +4,14 @@
 #define AGOO_H
 
 #include <stdarg.h>
+#include <time.h>
 
 #include "agoo/err.h"
 #include "agoo/method.h"
 #include "agoo/req.h"
+#include "agoo/shed.h"
 #include "agoo/text.h"
+#include "agoo/workers.h"
 #include "agoo/gqleval.h"
 
 #define AGOO_VERSION	"0.7.3"
@@ -30,16 +33,49 @@ extern int	agoo_add_func_hook(agooErr	err,
 				   const char	*pattern,
 				   void		(*func)(agooReq req),
 				   bool		quick);
+// Like agoo_add_func_hook but the hook is evaluated on the threads of the
+// worker pool. Create the pool with agoo_workers_create().
+extern int	agoo_add_workers_hook(agooErr		err,
+				      agooWorkers	workers,
+				      agooMethod	method,
+				      const char	*pattern,
+				      void		(*func)(agooReq req));
+// Sets the AGOO_PRIORITY_ of hooks already added. When overloaded with the
+// AGOO_SHED_PRIORITY policy low priority routes are turned away first.
+extern int	agoo_set_priority(agooErr err, agooMethod method, const char *pattern, int priority);
+
+// Turns on metrics and serves them in the Prometheus text format on a GET
+// of path. The route is high priority so it still answers when overloaded.
+extern int	agoo_add_metrics(agooErr err, const char *path);
 
 extern int	agoo_start(agooErr err, const char *version);
 extern void	agoo_shutdown(void (*stop)());
 
 extern agooText	agoo_respond(int status, const char *body, int blen, agooKeyVal headers);
+// Returns a 304 response with the etag, last modified, and headers if the
+// request validators match, otherwise NULL and the full response should be
+// sent. The etag must include the quotes and may be NULL. An mtime of 0 is
+// ignored.
+extern agooText	agoo_respond_not_modified(agooReq req, const char *etag, time_t mtime, agooKeyVal headers);
+
+// Streams a response instead of building it whole. A len of -1 sends the
+// body with the chunked transfer coding, otherwise it is the
+// Content-Length. Each write is sent as soon as the connection allows and
+// blocks while more than agoo_server.stream_max bytes are waiting. The
+// stream must be closed even if a write fails.
+extern int	agoo_stream_open(agooErr err, agooReq req, int status, long len, agooKeyVal headers);
+extern int	agoo_stream_write(agooErr err, agooReq req, const char *buf, size_t len);
+extern int	agoo_stream_close(agooErr err, agooReq req);
+
 extern int	agoo_setup_graphql(agooErr err, const char *path, ...);
 extern int	agoo_load_graphql(agooErr err, const char *path, const char *filename);
 
 extern gqlRef	agoo_query_object;
 extern gqlRef	agoo_mutation_object;
+// Subscription fields set a "subject" string in the result. Events published
+// with agoo_server_gpublish() on that subject are then sent to the
+// subscriber.
+extern gqlRef	agoo_subscription_object;
 extern double	agoo_poll_wait;
 
 #endif // AGOO_H
@@ -38,6 +38,7 @@ typedef struct _agooAtom {
 
 typedef struct _agooAtom	atomic_flag;
 typedef struct _agooAtom	atomic_int;
+typedef struct _agooAtom	atomic_ullong;
 
 static inline void
 agoo_atomic_flag_init(atomic_flag *flagp) {
@@ -71,30 +72,63 @@ atomic_load(agooAtom a) {
     return value;
 }
 
-static inline int
-atomic_fetch_add(agooAtom a, int delta) {
-    int	before;
+// Values are held in the pointer so an atomic_ullong keeps 64 bits where
+// pointers are that wide.
+static inline long
+atomic_fetch_add(agooAtom a, long delta) {
+    long	before;
     
     pthread_mutex_lock(&a->lock);
-    before = (int)(long)a->value;
-    a->value = (void*)(long)(before + delta);
+    before = (long)a->value;
+    a->value = (void*)(before + delta);
     pthread_mutex_unlock(&a->lock);
 
     return before;
 }
 
-static inline int
-atomic_fetch_sub(agooAtom a, int delta) {
-    int	before;
+static inline long
+atomic_fetch_sub(agooAtom a, long delta) {
+    long	before;
     
     pthread_mutex_lock(&a->lock);
-    before = (int)(long)a->value;
-    a->value = (void*)(long)(before - delta);
+    before = (long)a->value;
+    a->value = (void*)(before - delta);
     pthread_mutex_unlock(&a->lock);
 
     return before;
 }
 
+#define atomic_exchange(a, v) _atomic_exchange((a), (void*)(v))
+
+static inline void*
+_atomic_exchange(agooAtom a, void *value) {
+    void	*prev;
+
+    pthread_mutex_lock(&a->lock);
+    prev = (void*)a->value;
+    a->value = value;
+    pthread_mutex_unlock(&a->lock);
+
+    return prev;
+}
+
+#define atomic_compare_exchange_weak(a, expected, v) _atomic_compare_exchange((a), (void**)(expected), (void*)(v))
+
+static inline bool
+_atomic_compare_exchange(agooAtom a, void **expected, void *value) {
+    bool	ok;
+
+    pthread_mutex_lock(&a->lock);
+    if ((ok = (a->value == *expected))) {
+	a->value = value;
+    } else {
+	*expected = (void*)a->value;
+    }
+    pthread_mutex_unlock(&a->lock);
+
+    return ok;
+}
+
 static inline void
 atomic_flag_clear(agooAtom a) {
     pthread_mutex_lock(&a->lock);
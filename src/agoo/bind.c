@@ -271,23 +271,24 @@ agoo_bind_destroy(agooBind b) {
 }
 
 static int
-usual_listen(agooErr err, agooBind b) {
+usual_listen(agooErr err, agooBind b, int *fdp) {
     int		optval = 1;
     int	domain = PF_INET;
+    int		fd;
 
     if (AF_INET6 == b->family) {
 	domain = PF_INET6;
     }
-    if (0 >= (b->fd = socket(domain, SOCK_STREAM, IPPROTO_TCP))) {
+    if (0 >= (*fdp = fd = socket(domain, SOCK_STREAM, IPPROTO_TCP))) {
 	agoo_log_cat(&agoo_error_cat, "Server failed to open server socket on port %d. %s.", b->port, strerror(errno));
 
 	return agoo_err_set(err, errno, "Server failed to open server socket. %s.", strerror(errno));
     }
 #ifdef OSX_OS
-    setsockopt(b->fd, SOL_SOCKET, SO_NOSIGPIPE, &optval, sizeof(optval));
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &optval, sizeof(optval));
 #endif
-    setsockopt(b->fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval));
-    setsockopt(b->fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval));
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
     if (AF_INET6 == b->family) {
 	struct sockaddr_in6	addr;
 
@@ -296,7 +297,7 @@ usual_listen(agooErr err, agooBind b) {
 	addr.sin6_family = b->family;
 	addr.sin6_addr = b->addr6;
 	addr.sin6_port = htons(b->port);
-	if (0 > bind(b->fd, (struct sockaddr*)&addr, sizeof(addr))) {
+	if (0 > bind(fd, (struct sockaddr*)&addr, sizeof(addr))) {
 	    agoo_log_cat(&agoo_error_cat, "Server failed to bind server socket. %s.", strerror(errno));
 
 	    return agoo_err_set(err, errno, "Server failed to bind server socket. %s.", strerror(errno));
@@ -308,13 +309,13 @@ usual_listen(agooErr err, agooBind b) {
 	addr.sin_family = b->family;
 	addr.sin_addr = b->addr4;
 	addr.sin_port = htons(b->port);
-	if (0 > bind(b->fd, (struct sockaddr*)&addr, sizeof(addr))) {
+	if (0 > bind(fd, (struct sockaddr*)&addr, sizeof(addr))) {
 	    agoo_log_cat(&agoo_error_cat, "Server failed to bind server socket. %s.", strerror(errno));
 
 	    return agoo_err_set(err, errno, "Server failed to bind server socket. %s.", strerror(errno));
 	}
     }
-    listen(b->fd, 1000);
+    listen(fd, 1000);
 
     return AGOO_ERR_OK;
 }
@@ -347,7 +348,22 @@ agoo_bind_listen(agooErr err, agooBind b) {
     if (NULL != b->name) {
 	return named_listen(err, b);
     }
-    return usual_listen(err, b);
+    return usual_listen(err, b, &b->fd);
+}
+
+int
+agoo_bind_listen_more(agooErr err, agooBind b, int *fdp) {
+    if (NULL != b->name) {
+	return agoo_err_set(err, AGOO_ERR_ARG, "Named Unix sockets can not share a port. (%s)", b->id);
+    }
+    if (AGOO_ERR_OK != usual_listen(err, b, fdp)) {
+	if (0 < *fdp) {
+	    close(*fdp);
+	    *fdp = 0;
+	}
+	return err->code;
+    }
+    return AGOO_ERR_OK;
 }
 
 void
@@ -35,6 +35,9 @@ extern agooBind	agoo_bind_port(agooErr err, int port);
 extern void	agoo_bind_destroy(agooBind b);
 
 extern int	agoo_bind_listen(agooErr err, agooBind b);
+// Opens another listening socket on the same port as the bind. The kernel
+// spreads new connections across all the sockets with SO_REUSEPORT.
+extern int	agoo_bind_listen_more(agooErr err, agooBind b, int *fdp);
 extern void	agoo_bind_close(agooBind b);
 
 #endif // AGOO_BIND_H
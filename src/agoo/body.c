@@ -0,0 +1,359 @@
+// Copyright (c) 2018, Peter Ohler, All rights reserved.
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "body.h"
+#include "debug.h"
+
+// Line ends must be a CRLF and only extensions and white space may follow
+// a chunk size. Anything looser could be framed differently by a proxy in
+// front.
+typedef enum {
+    CHUNK_START		= 0,
+    CHUNK_SIZE,
+    CHUNK_EXT,
+    CHUNK_EXT_TEXT,
+    CHUNK_SIZE_LF,
+    CHUNK_DATA,
+    CHUNK_DATA_END,
+    CHUNK_DATA_LF,
+    CHUNK_TRAILER,
+    CHUNK_TRAILER_LINE,
+    CHUNK_TRAILER_LF,
+    CHUNK_END_LF,
+} ChunkState;
+
+static int
+spill_open(agooErr err) {
+    const char	*dir = getenv("TMPDIR");
+    char	path[1024];
+    int		fd;
+
+    if (NULL == dir || '\0' == *dir) {
+	dir = "/tmp";
+    }
+    if ((int)sizeof(path) <= snprintf(path, sizeof(path), "%s/agoo-body-XXXXXX", dir)) {
+	agoo_err_set(err, AGOO_ERR_OVERFLOW, "temporary directory path too long");
+	return -1;
+    }
+    if (0 > (fd = mkstemp(path))) {
+	agoo_err_no(err, "failed to create a temporary file for a request body");
+	return -1;
+    }
+    // Only the descriptor is needed so the file goes away when it is closed.
+    unlink(path);
+
+    return fd;
+}
+
+static int
+fd_write(agooErr err, int fd, const char *buf, size_t len) {
+    ssize_t	cnt;
+
+    while (0 < len) {
+	if (0 > (cnt = write(fd, buf, len))) {
+	    return agoo_err_no(err, "failed to write request body");
+	}
+	buf += cnt;
+	len -= cnt;
+    }
+    return AGOO_ERR_OK;
+}
+
+static int
+body_put(agooErr err, agooBody b, const char *buf, size_t len) {
+    if (b->max - b->len < len) {
+	return agoo_err_set(err, AGOO_ERR_OVERFLOW, "request body larger than %zu bytes", b->max);
+    }
+    if (0 > b->fd && b->spill < b->len + len) {
+	if (0 > (b->fd = spill_open(err))) {
+	    return err->code;
+	}
+	if (AGOO_ERR_OK != fd_write(err, b->fd, b->buf, b->len)) {
+	    return err->code;
+	}
+	AGOO_FREE(b->buf);
+	b->buf = NULL;
+	b->alen = 0;
+    }
+    if (0 <= b->fd) {
+	if (NULL == b->buf) {
+	    if (NULL == (b->buf = (char*)AGOO_MALLOC(AGOO_BODY_SPILL_WRITE))) {
+		return AGOO_ERR_MEM(err, "Request body");
+	    }
+	    b->alen = AGOO_BODY_SPILL_WRITE;
+	    b->pend = 0;
+	}
+	while (0 < len) {
+	    size_t	n = b->alen - b->pend;
+
+	    if (len < n) {
+		n = len;
+	    }
+	    memcpy(b->buf + b->pend, buf, n);
+	    b->pend += n;
+	    b->len += n;
+	    buf += n;
+	    len -= n;
+	    if (b->alen == b->pend) {
+		if (AGOO_ERR_OK != fd_write(err, b->fd, b->buf, b->pend)) {
+		    return err->code;
+		}
+		b->pend = 0;
+	    }
+	}
+	return AGOO_ERR_OK;
+    } else {
+	if (b->alen <= b->len + len) {
+	    size_t	size = b->alen * 2;
+	    char	*nb;
+
+	    if (size <= b->len + len) {
+		size = b->len + len + 1;
+	    }
+	    if (NULL == (nb = (char*)AGOO_REALLOC(b->buf, size))) {
+		return AGOO_ERR_MEM(err, "Request body");
+	    }
+	    b->buf = nb;
+	    b->alen = size;
+	}
+	memcpy(b->buf + b->len, buf, len);
+	b->buf[b->len + len] = '\0';
+    }
+    b->len += len;
+
+    return AGOO_ERR_OK;
+}
+
+agooBody
+agoo_body_create(agooErr err, bool chunked, size_t clen, size_t spill, size_t max) {
+    agooBody	b = (agooBody)AGOO_CALLOC(1, sizeof(struct _agooBody));
+
+    if (NULL == b) {
+	AGOO_ERR_MEM(err, "Request body");
+	return NULL;
+    }
+    b->fd = -1;
+    b->spill = spill;
+    // One is kept for the '\0' that follows the body.
+    b->max = (UINT_MAX - 1 < max) ? UINT_MAX - 1 : max;
+    b->chunked = chunked;
+    b->state = CHUNK_START;
+    if (!chunked) {
+	b->rem = clen;
+	if (spill < clen && 0 > (b->fd = spill_open(err))) {
+	    AGOO_FREE(b);
+	    return NULL;
+	}
+	b->done = (0 == clen);
+    }
+    return b;
+}
+
+void
+agoo_body_destroy(agooBody b) {
+    if (NULL != b) {
+	if (NULL != b->map) {
+	    munmap(b->map, b->len + 1);
+	}
+	if (0 <= b->fd) {
+	    close(b->fd);
+	}
+	AGOO_FREE(b->buf);
+	AGOO_FREE(b);
+    }
+}
+
+static int
+hex_val(char c) {
+    if ('0' <= c && c <= '9') {
+	return c - '0';
+    }
+    if ('a' <= c && c <= 'f') {
+	return c - 'a' + 10;
+    }
+    if ('A' <= c && c <= 'F') {
+	return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static long
+chunk_feed(agooErr err, agooBody b, const char *buf, size_t len) {
+    const char	*s = buf;
+    const char	*end = buf + len;
+    size_t	n;
+    int		d;
+
+    while (s < end && !b->done) {
+	switch (b->state) {
+	case CHUNK_START:
+	    if (0 > (d = hex_val(*s))) {
+		agoo_err_set(err, AGOO_ERR_PARSE, "invalid chunk size");
+		return -1;
+	    }
+	    b->rem = d;
+	    b->state = CHUNK_SIZE;
+	    s++;
+	    break;
+	case CHUNK_SIZE:
+	    if (0 <= (d = hex_val(*s))) {
+		if ((SIZE_MAX >> 4) < b->rem) {
+		    agoo_err_set(err, AGOO_ERR_OVERFLOW, "chunk size too large");
+		    return -1;
+		}
+		b->rem = (b->rem << 4) | d;
+		s++;
+	    } else {
+		b->state = CHUNK_EXT;
+	    }
+	    break;
+	case CHUNK_EXT:
+	    switch (*s) {
+	    case ' ':
+	    case '\t':
+		break;
+	    case ';':
+		b->state = CHUNK_EXT_TEXT;
+		break;
+	    case '\r':
+		b->state = CHUNK_SIZE_LF;
+		break;
+	    default:
+		agoo_err_set(err, AGOO_ERR_PARSE, "invalid character after the chunk size");
+		return -1;
+	    }
+	    s++;
+	    break;
+	case CHUNK_EXT_TEXT:
+	    // Extensions are not used but must not hold control characters.
+	    if ('\r' == *s) {
+		b->state = CHUNK_SIZE_LF;
+	    } else if (((uint8_t)*s < ' ' && '\t' != *s) || 0x7F == *s) {
+		agoo_err_set(err, AGOO_ERR_PARSE, "invalid chunk extension");
+		return -1;
+	    }
+	    s++;
+	    break;
+	case CHUNK_SIZE_LF:
+	    if ('\n' != *s) {
+		agoo_err_set(err, AGOO_ERR_PARSE, "chunk size line not ended with a CRLF");
+		return -1;
+	    }
+	    b->state = (0 == b->rem) ? CHUNK_TRAILER : CHUNK_DATA;
+	    s++;
+	    break;
+	case CHUNK_DATA:
+	    n = (size_t)(end - s);
+	    if (b->rem < n) {
+		n = b->rem;
+	    }
+	    if (AGOO_ERR_OK != body_put(err, b, s, n)) {
+		return -1;
+	    }
+	    s += n;
+	    if (0 == (b->rem -= n)) {
+		b->state = CHUNK_DATA_END;
+	    }
+	    break;
+	case CHUNK_DATA_END:
+	    if ('\r' != *s) {
+		agoo_err_set(err, AGOO_ERR_PARSE, "chunk data not followed by a CRLF");
+		return -1;
+	    }
+	    b->state = CHUNK_DATA_LF;
+	    s++;
+	    break;
+	case CHUNK_DATA_LF:
+	    if ('\n' != *s) {
+		agoo_err_set(err, AGOO_ERR_PARSE, "chunk data not followed by a CRLF");
+		return -1;
+	    }
+	    b->state = CHUNK_START;
+	    s++;
+	    break;
+	case CHUNK_TRAILER:
+	case CHUNK_TRAILER_LINE:
+	    // Trailer fields are not kept. A blank line ends the body.
+	    if ('\r' == *s) {
+		b->state = (CHUNK_TRAILER == b->state) ? CHUNK_END_LF : CHUNK_TRAILER_LF;
+	    } else if ('\n' == *s) {
+		agoo_err_set(err, AGOO_ERR_PARSE, "trailer line not ended with a CRLF");
+		return -1;
+	    } else {
+		b->state = CHUNK_TRAILER_LINE;
+	    }
+	    s++;
+	    break;
+	case CHUNK_TRAILER_LF:
+	case CHUNK_END_LF:
+	default:
+	    if ('\n' != *s) {
+		agoo_err_set(err, AGOO_ERR_PARSE, "trailer line not ended with a CRLF");
+		return -1;
+	    }
+	    if (CHUNK_TRAILER_LF == b->state) {
+		b->state = CHUNK_TRAILER;
+	    } else {
+		b->done = true;
+	    }
+	    s++;
+	    break;
+	}
+    }
+    return (long)(s - buf);
+}
+
+long
+agoo_body_feed(agooErr err, agooBody b, const char *buf, size_t len) {
+    if (b->done) {
+	return 0;
+    }
+    if (b->chunked) {
+	return chunk_feed(err, b, buf, len);
+    }
+    if (b->rem < len) {
+	len = b->rem;
+    }
+    if (AGOO_ERR_OK != body_put(err, b, buf, len)) {
+	return -1;
+    }
+    if (0 == (b->rem -= len)) {
+	b->done = true;
+    }
+    return (long)len;
+}
+
+int
+agoo_body_append(agooErr err, agooBody b, const char *buf, size_t len) {
+    return body_put(err, b, buf, len);
+}
+
+int
+agoo_body_finish(agooErr err, agooBody b) {
+    void	*map;
+
+    if (0 > b->fd) {
+	return AGOO_ERR_OK;
+    }
+    // The terminating '\0' is written to the file so it is in the map.
+    if (NULL != b->buf) {
+	b->buf[b->pend++] = '\0';
+    }
+    if (AGOO_ERR_OK != fd_write(err, b->fd, (NULL == b->buf) ? "" : b->buf, (NULL == b->buf) ? 1 : b->pend)) {
+	return err->code;
+    }
+    b->pend = 0;
+    if (MAP_FAILED == (map = mmap(NULL, b->len + 1, PROT_READ, MAP_PRIVATE, b->fd, 0))) {
+	return agoo_err_no(err, "failed to map request body");
+    }
+    b->map = (char*)map;
+
+    return AGOO_ERR_OK;
+}
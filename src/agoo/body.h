@@ -0,0 +1,63 @@
+// Copyright (c) 2018, Peter Ohler, All rights reserved.
+
+#ifndef AGOO_BODY_H
+#define AGOO_BODY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "err.h"
+
+// Bodies larger than this are written to a temporary file instead of being
+// held in memory.
+#define AGOO_BODY_SPILL	(4 * 1024 * 1024)
+
+// Bodies larger than this are refused. The request body length is an
+// unsigned int so a larger limit is reduced to fit.
+#define AGOO_BODY_MAX	(1024 * 1024 * 1024)
+
+// Once spilled, writes to the file are staged and made this many bytes at a
+// time.
+#define AGOO_BODY_SPILL_WRITE	(64 * 1024)
+
+// A request body read separately from the header, either because it uses
+// the chunked transfer coding or because it is too large to read into the
+// request message. The body is kept in buf until it grows past spill and is
+// then moved to an unlinked temporary file. After that buf stages the
+// writes.
+//
+// Spill writes are made on the connection thread. They go to the page cache
+// with no sync so each costs about as much as a copy of at most
+// AGOO_BODY_SPILL_WRITE bytes, other than the one write that moves what was
+// held before the spill. Only kernel writeback throttling can stall them.
+typedef struct _agooBody {
+    char	*buf;
+    size_t	len;   // decoded length so far
+    size_t	alen;  // allocated size of buf
+    size_t	pend;  // staged in buf once spilled
+    size_t	spill;
+    size_t	max;
+    size_t	rem;   // left in the current chunk or in the whole body
+    char	*map;  // the spill file mapped once finished
+    int		fd;    // -1 until spilled
+    int		state;
+    bool	chunked;
+    bool	done;
+} *agooBody;
+
+extern agooBody	agoo_body_create(agooErr err, bool chunked, size_t clen, size_t spill, size_t max);
+extern void	agoo_body_destroy(agooBody b);
+
+// Consumes up to len bytes and returns the number used or -1 on error. When
+// the end of the body is reached done is set and any remaining bytes belong
+// to the next request. Going over max is an AGOO_ERR_OVERFLOW.
+extern long	agoo_body_feed(agooErr err, agooBody b, const char *buf, size_t len);
+
+// Adds already decoded bytes, such as HTTP/2 DATA frames, to the body.
+extern int	agoo_body_append(agooErr err, agooBody b, const char *buf, size_t len);
+
+// Called once the body is complete. A spilled body has the staged writes
+// made and the file is mapped into map, followed by a '\0' as with buf.
+extern int	agoo_body_finish(agooErr err, agooBody b);
+
+#endif // AGOO_BODY_H
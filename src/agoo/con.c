@@ -1,9 +1,21 @@
 // Copyright (c) 2018, Peter Ohler, All rights reserved.
 
+#ifdef Linux
+// for accept4()
+#define _GNU_SOURCE
+#endif
+
 #include <ctype.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#ifdef Linux
+#include <sys/sendfile.h>
+#endif
 #include <unistd.h>
 
 #include "bind.h"
@@ -14,20 +26,36 @@
 #include "hook.h"
 #include "gqlsub.h"
 #include "http.h"
+#include "http2.h"
 #include "log.h"
+#include "metrics.h"
 #include "page.h"
 #include "pub.h"
 #include "ready.h"
 #include "res.h"
 #include "seg.h"
 #include "server.h"
+#include "shed.h"
 #include "sse.h"
 #include "subject.h"
 #include "upgraded.h"
 #include "websocket.h"
+#include "workers.h"
 
-#define CON_TIMEOUT		10.0
 #define INITIAL_POLL_SIZE	1024
+// Maximum connections accepted on one read event so other links get a turn.
+#define ACCEPT_MAX		64
+// Maximum texts gathered into one sendmsg() call.
+#define WRITE_IOV_MAX		64
+
+// Listening socket for a bind owned by a con loop when each loop accepts its
+// own connections.
+typedef struct _acceptor {
+    agooBind	bind;
+    agooConLoop	loop;
+    int		fd;
+    bool	owned; // true if opened for the loop and not the bind fd
+} *Acceptor;
 
 typedef enum {
     HEAD_AGAIN		= 'A',
@@ -56,19 +84,57 @@ static struct _agooBind	sse_bind = {
     .events = con_sse_events,
 };
 
+void
+agoo_con_init(void *obj) {
+    pthread_mutex_init(&((agooCon)obj)->res_lock, 0);
+}
+
+// Attaches a read buffer if the connection does not have one.
+static bool
+con_buf_get(agooCon c) {
+    if (NULL == c->buf) {
+	agooPool	pool = (NULL == c->loop) ? NULL : &c->loop->buf_pool;
+
+	if (NULL == (c->hdrs = (agooHeaders)agoo_pool_alloc(pool, sizeof(struct _agooHeaders) + MAX_HEADER_SIZE))) {
+	    agoo_log_cat(&agoo_error_cat, "memory allocation of read buffer failed on connection %llu.", (unsigned long long)c->id);
+	    c->dead = true;
+	    return false;
+	}
+	agoo_headers_reset(c->hdrs);
+	c->buf = (char*)(c->hdrs + 1);
+	*c->buf = '\0';
+    }
+    return true;
+}
+
+// Returns the read buffer once nothing in it is still needed. Reads into a
+// request message without a streamed body do not use the buffer.
+static void
+con_buf_release(agooCon c) {
+    if (NULL != c->buf && (0 == c->bcnt || (NULL != c->req && NULL == c->body))) {
+	agoo_pool_free(c->hdrs);
+	c->hdrs = NULL;
+	c->buf = NULL;
+    }
+}
+
 agooCon
-agoo_con_create(agooErr err, int sock, uint64_t id, agooBind b) {
+agoo_con_create(agooErr err, agooPool pool, int sock, uint64_t id, agooBind b) {
     agooCon	c;
 
-    if (NULL == (c = (agooCon)AGOO_CALLOC(1, sizeof(struct _agooCon)))) {
+    if (NULL == (c = (agooCon)agoo_pool_alloc(pool, sizeof(struct _agooCon)))) {
 	AGOO_ERR_MEM(err, "Connection");
     } else {
+	if (NULL == pool) {
+	    agoo_con_init(c);
+	}
+	memset(c, 0, offsetof(struct _agooCon, res_lock));
 	c->sock = sock;
 	c->id = id;
-	c->timeout = dtime() + CON_TIMEOUT;
+	c->accepted = dtime();
+	c->timeout = c->accepted + CON_TIMEOUT;
 	c->bind = b;
 	c->loop = NULL;
-	pthread_mutex_init(&c->res_lock, 0);
     }
     return c;
 }
@@ -82,6 +148,11 @@ agoo_con_destroy(agooCon c) {
     if (0 < c->sock) {
 #ifdef HAVE_OPENSSL_SSL_H
 	if (NULL != c->ssl) {
+	    // Only a clean close sends a close_notify. Without one the session
+	    // is dropped from the cache when freed so it can't be resumed.
+	    if (!c->ssl_failed && SSL_is_init_finished(c->ssl)) {
+		SSL_shutdown(c->ssl);
+	    }
 	    SSL_free(c->ssl);
 	    c->ssl = NULL;
 	}
@@ -92,6 +163,9 @@ agoo_con_destroy(agooCon c) {
     if (NULL != c->req) {
 	agoo_req_destroy(c->req);
     }
+    agoo_body_destroy(c->body);
+    agoo_pool_free(c->hdrs);
+    agoo_h2_destroy(c->h2);
     if (NULL != c->up) {
 	agoo_upgraded_release_con(c->up);
 	c->up = NULL;
@@ -107,10 +181,10 @@ agoo_con_destroy(agooCon c) {
 
     while (NULL != (res = c->res_head)) {
 	c->res_head = res->next;
-	AGOO_FREE(res);
+	agoo_res_destroy(res);
     }
-    pthread_mutex_destroy(&c->res_lock);
-    AGOO_FREE(c);
+    // The lock is kept for the next connection that reuses the memory.
+    agoo_pool_free(c);
 }
 
 void
@@ -123,6 +197,7 @@ agoo_con_res_append(agooCon c, agooRes res) {
     }
     c->res_tail = res;
     pthread_mutex_unlock(&c->res_lock);
+    agoo_ready_touch(c->link);
 }
 
 static void
@@ -173,7 +248,7 @@ agoo_con_header_value(const char *header, int hlen, const char *key, int *vlen)
     int		klen = (int)strlen(key);
 
     while (h < hend) {
-	if (0 == strncmp(key, h, klen) && ':' == h[klen]) {
+	if (0 == strncasecmp(key, h, klen) && ':' == h[klen]) {
 	    h += klen + 1;
 	    for (; ' ' == *h; h++) {
 	    }
@@ -216,32 +291,60 @@ bad_request(agooCon c, int status, int line) {
 }
 
 static bool
-should_close(const char *header, int hlen) {
+should_close(agooHeaders h, const char *base) {
     const char	*v;
     int		vlen = 0;
 
-    if (NULL != (v = agoo_con_header_value(header, hlen, "Connection", &vlen))) {
+    if (NULL != (v = agoo_headers_get(h, base, AGOO_HDR_CONNECTION, &vlen))) {
 	return (5 == vlen && 0 == strncasecmp("Close", v, 5));
     }
     return false;
 }
 
 static bool
-page_response(agooCon c, agooPage p, char *hend) {
+page_response(agooCon c, agooPage p) {
+    agooHeaders	h = c->hdrs;
     agooRes 	res;
-    char	*b;
+    agooText	t;
+    const char	*accept;
+    const char	*inm;
+    const char	*ims;
+    int		alen = 0;
+    int		inmlen = 0;
+    int		imslen = 0;
+    int		enc;
 
     if (NULL == (res = agoo_res_create(c))) {
+	agoo_page_release(p);
 	return true;
     }
     agoo_con_res_append(c, res);
 
-    b = strstr(c->buf, "\r\n");
-    res->close = should_close(b, (int)(hend - b));
+    res->close = should_close(h, c->buf);
     if (res->close) {
 	c->closing = true;
     }
-    agoo_res_message_push(res, p->resp);
+    accept = agoo_headers_get(h, c->buf, AGOO_HDR_ACCEPT_ENCODING, &alen);
+    enc = agoo_page_encoding(p, accept, alen);
+    inm = agoo_headers_get(h, c->buf, AGOO_HDR_IF_NONE_MATCH, &inmlen);
+    ims = agoo_headers_get(h, c->buf, AGOO_HDR_IF_MODIFIED_SINCE, &imslen);
+    if (NULL == (t = agoo_page_not_modified(p, enc, inm, inmlen, ims, imslen))) {
+	const char	*range;
+	const char	*if_range;
+	int		rlen = 0;
+	int		irlen = 0;
+
+	if (NULL != (range = agoo_headers_get(h, c->buf, AGOO_HDR_RANGE, &rlen))) {
+	    if_range = agoo_headers_get(h, c->buf, AGOO_HDR_IF_RANGE, &irlen);
+	    t = agoo_page_range(p, enc, range, rlen, if_range, irlen);
+	}
+	if (NULL == t) {
+	    t = agoo_page_resp(p, enc);
+	}
+    }
+    // The response holds the text until written so the page can go.
+    agoo_res_message_push(res, t);
+    agoo_page_release(p);
 
     return false;
 }
@@ -265,9 +368,25 @@ push_error(agooUpgraded up, const char *msg, int mlen) {
     }
 }
 
+static agooHook
+hook_find(agooMethod method, agooSeg path, agooParam params, int *pcnt) {
+    agooHook	hook;
+
+    pthread_rwlock_rdlock(&agoo_server.route_lock);
+    if (NULL == agoo_server.router) {
+	*pcnt = 0;
+	hook = agoo_hook_find(agoo_server.hooks, method, path);
+    } else {
+	hook = agoo_router_find(agoo_server.router, method, path, params, pcnt);
+    }
+    pthread_rwlock_unlock(&agoo_server.route_lock);
+
+    return hook;
+}
+
 static HeadReturn
 con_header_read(agooCon c, size_t *mlenp) {
-    char		*hend = strstr(c->buf, "\r\n\r\n");
+    agooHeaders		h = c->hdrs;
     agooMethod		method;
     struct _agooSeg	path;
     char		*query = NULL;
@@ -278,17 +397,32 @@ con_header_read(agooCon c, size_t *mlenp) {
     agooHook		hook = NULL;
     agooPage		p;
     struct _agooErr	err = AGOO_ERR_INIT;
-
-    if (NULL == hend) {
-	if (sizeof(c->buf) - 1 <= c->bcnt) {
+    struct _agooParam	params[AGOO_PARAM_MAX];
+    int			pcnt = 0;
+    int			i;
+    bool		chunked = false;
+    bool		stream;
+
+    switch (agoo_headers_parse(h, c->buf, (int)c->bcnt)) {
+    case AGOO_HEAD_DONE:
+	break;
+    case AGOO_HEAD_FULL:
+	return bad_request(c, 431, __LINE__);
+    case AGOO_HEAD_BAD:
+	return bad_request(c, 400, __LINE__);
+    case AGOO_HEAD_MORE:
+    default:
+	if (MAX_HEADER_SIZE - 1 <= c->bcnt) {
 	    return bad_request(c, 431, __LINE__);
 	}
 	return HEAD_AGAIN;
     }
     if (agoo_req_cat.on) {
-	*hend = '\0';
+	char	save = c->buf[h->end];
+
+	c->buf[h->end] = '\0';
 	agoo_log_cat(&agoo_req_cat, "%s %llu: %s", agoo_con_kind_str(c->bind->kind), (unsigned long long)c->id, c->buf);
-	*hend = '\r';
+	c->buf[h->end] = save;
     }
     for (b = c->buf; ' ' != *b; b++) {
 	if ('\0' == *b) {
@@ -306,6 +440,8 @@ con_header_read(agooCon c, size_t *mlenp) {
 	const char	*v;
 	int		vlen = 0;
 	char		*vend;
+	const char	*te;
+	int		telen = 0;
 
 	if (3 == b - c->buf && 0 == strncmp("PUT", c->buf, 3)) {
 	    method = AGOO_PUT;
@@ -314,12 +450,31 @@ con_header_read(agooCon c, size_t *mlenp) {
 	} else {
 	    return bad_request(c, 400, __LINE__);
 	}
-	if (NULL == (v = agoo_con_header_value(c->buf, (int)(hend - c->buf), "Content-Length", &vlen))) {
+	v = agoo_headers_get(h, c->buf, AGOO_HDR_CONTENT_LENGTH, &vlen);
+	if (NULL != (te = agoo_headers_get(h, c->buf, AGOO_HDR_TRANSFER_ENCODING, &telen))) {
+	    // Both together are a request smuggling risk so reject them.
+	    if (NULL != v) {
+		return bad_request(c, 400, __LINE__);
+	    }
+	    if (7 != telen || 0 != strncasecmp("chunked", te, 7)) {
+		return bad_request(c, 501, __LINE__);
+	    }
+	    chunked = true;
+	    break;
+	}
+	if (NULL == v) {
 	    return bad_request(c, 411, __LINE__);
 	}
+	// A list or a sign is not a valid length.
+	if (0 == vlen || !isdigit(*v)) {
+	    return bad_request(c, 400, __LINE__);
+	}
 	clen = (size_t)strtoul(v, &vend, 10);
 	if (vend != v + vlen) {
-	    return bad_request(c, 411, __LINE__);
+	    return bad_request(c, 400, __LINE__);
+	}
+	if (agoo_server.body_max < clen) {
+	    return bad_request(c, 413, __LINE__);
 	}
 	break;
     }
@@ -375,7 +530,13 @@ con_header_read(agooCon c, size_t *mlenp) {
     } else {
 	qend = b;
     }
-    mlen = hend - c->buf + 4 + clen;
+    // Chunked and large bodies are read separately so only the header goes
+    // in the request message.
+    if ((stream = chunked || agoo_server.body_spill < clen)) {
+	mlen = h->body;
+    } else {
+	mlen = h->body + clen;
+    }
     *mlenp = mlen;
 
     if (AGOO_GET == method) {
@@ -383,7 +544,7 @@ con_header_read(agooCon c, size_t *mlenp) {
 	const char	*root = NULL;
 
 	if (NULL != (p = agoo_group_get(&err, path.start, (int)(path.end - path.start)))) {
-	    if (page_response(c, p, hend)) {
+	    if (page_response(c, p)) {
 		return bad_request(c, 500, __LINE__);
 	    }
 	    return HEAD_HANDLED;
@@ -391,24 +552,26 @@ con_header_read(agooCon c, size_t *mlenp) {
 	if (agoo_domain_use()) {
 	    const char	*host;
 	    int		vlen = 0;
+	    char	save;
 
-	    if (NULL == (host = agoo_con_header_value(c->buf, (int)(hend - c->buf), "Host", &vlen))) {
+	    if (NULL == (host = agoo_headers_get(h, c->buf, AGOO_HDR_HOST, &vlen))) {
 		return bad_request(c, 411, __LINE__);
 	    }
+	    save = host[vlen];
 	    ((char*)host)[vlen] = '\0';
 	    root = agoo_domain_resolve(host, root_buf, sizeof(root_buf));
-	    ((char*)host)[vlen] = '\r';
+	    ((char*)host)[vlen] = save;
 	}
 	if (agoo_server.root_first &&
 	    NULL != (p = agoo_page_get(&err, path.start, (int)(path.end - path.start), root))) {
-	    if (page_response(c, p, hend)) {
+	    if (page_response(c, p)) {
 		return bad_request(c, 500, __LINE__);
 	    }
 	    return HEAD_HANDLED;
 	}
-	if (NULL == (hook = agoo_hook_find(agoo_server.hooks, method, &path))) {
+	if (NULL == (hook = hook_find(method, &path, params, &pcnt))) {
 	    if (NULL != (p = agoo_page_get(&err, path.start, (int)(path.end - path.start), root))) {
-		if (page_response(c, p, hend)) {
+		if (page_response(c, p)) {
 		    return bad_request(c, 500, __LINE__);
 		}
 		return HEAD_HANDLED;
@@ -418,13 +581,19 @@ con_header_read(agooCon c, size_t *mlenp) {
 	    }
 	    hook = agoo_server.hook404;
 	}
-    } else if (NULL == (hook = agoo_hook_find(agoo_server.hooks, method, &path))) {
+    } else if (NULL == (hook = hook_find(method, &path, params, &pcnt))) {
  	return bad_request(c, 404, __LINE__);
     }
     // Create request and populate.
-    if (NULL == (c->req = agoo_req_create(mlen))) {
+    if (NULL == (c->req = agoo_req_create_from(c->loop->req_pools, mlen))) {
 	return bad_request(c, 413, __LINE__);
     }
+    if (stream && NULL == (c->body = agoo_body_create(&err, chunked, clen, agoo_server.body_spill, agoo_server.body_max))) {
+	agoo_log_cat(&agoo_error_cat, "request body on connection %llu. %s", (unsigned long long)c->id, err.msg);
+	agoo_req_destroy(c->req);
+	c->req = NULL;
+	return bad_request(c, 500, __LINE__);
+    }
     if ((long)c->bcnt <= mlen) {
 	memcpy(c->req->msg, c->buf, c->bcnt);
 	if ((long)c->bcnt < mlen) {
@@ -442,17 +611,111 @@ con_header_read(agooCon c, size_t *mlenp) {
     c->req->query.start = c->req->msg + (query - c->buf);
     c->req->query.len = (int)(qend - query);
     c->req->query.start[c->req->query.len] = '\0';
-    c->req->body.start = c->req->msg + (hend - c->buf + 4);
-    c->req->body.len = (unsigned int)clen;
-    b = strstr(b, "\r\n");
-    c->req->header.start = c->req->msg + (b + 2 - c->buf);
-    if (b < hend) {
-	c->req->header.len = (unsigned int)(hend - b - 2);
+    if (stream) {
+	c->req->body.start = NULL;
+	c->req->body.len = 0;
     } else {
-	c->req->header.len = 0;
-    }
+	c->req->body.start = c->req->msg + h->body;
+	c->req->body.len = (unsigned int)clen;
+	c->req->body_size = clen;
+    }
+    c->req->header.start = c->req->msg + h->start;
+    c->req->header.len = (unsigned int)(h->end - h->start);
+    // The message is a copy of buf so the offsets are the same.
+    memcpy(c->req->headers.fields, h->fields, sizeof(*h->fields) * h->cnt);
+    memcpy(c->req->headers.known, h->known, sizeof(h->known));
+    c->req->headers.cnt = h->cnt;
+    c->req->headers.start = h->start;
+    c->req->headers.end = h->end;
+    c->req->headers.body = h->body;
+    c->req->headers.scan = h->scan;
     c->req->res = NULL;
     c->req->hook = hook;
+    for (i = 0; i < pcnt; i++) {
+	c->req->params[i] = params[i];
+	c->req->params[i].value = c->req->msg + (params[i].value - c->buf);
+    }
+    c->req->param_cnt = pcnt;
+    if (stream) {
+	// Leave only body bytes in buf.
+	memmove(c->buf, c->buf + h->body, c->bcnt - h->body);
+	c->bcnt -= h->body;
+	c->buf[c->bcnt] = '\0';
+    }
+
+    return HEAD_OK;
+}
+
+// Hands a complete streamed body to the request and destroys the body. On
+// failure the body is left as it was.
+static int
+body_to_req(agooErr err, agooReq r, agooBody b) {
+    if (AGOO_ERR_OK != agoo_body_finish(err, b)) {
+	return err->code;
+    }
+    r->body_size = b->len;
+    if (0 <= b->fd) {
+	// The spill file is mapped so hooks can still use body.start.
+	r->body_fd = b->fd;
+	r->body.start = b->map;
+	r->body.len = (unsigned int)b->len;
+	b->fd = -1;
+	b->map = NULL;
+    } else if (NULL != b->buf) {
+	r->body_buf = b->buf;
+	r->body.start = b->buf;
+	r->body.len = (unsigned int)b->len;
+	b->buf = NULL;
+    } else {
+	r->body.start = r->msg + r->mlen;
+    }
+    agoo_body_destroy(b);
+
+    return AGOO_ERR_OK;
+}
+
+static HeadReturn
+body_fail(agooCon c, agooErr err) {
+    agoo_log_cat(&agoo_warn_cat, "Bad request body on connection %llu. %s", (unsigned long long)c->id, err->msg);
+    agoo_body_destroy(c->body);
+    c->body = NULL;
+    agoo_req_destroy(c->req);
+    c->req = NULL;
+    c->bcnt = 0;
+    *c->buf = '\0';
+    switch (err->code) {
+    case AGOO_ERR_PARSE:	return bad_request(c, 400, __LINE__);
+    case AGOO_ERR_OVERFLOW:	return bad_request(c, 413, __LINE__);
+    default:			return bad_request(c, 500, __LINE__);
+    }
+}
+
+// Moves what has been read into the streamed body. Once the body is
+// complete it is handed to the request and HEAD_OK is returned.
+static HeadReturn
+con_body_read(agooCon c) {
+    struct _agooErr	err = AGOO_ERR_INIT;
+    agooBody		b = c->body;
+    agooReq		r = c->req;
+    long		cnt;
+
+    if (0 > (cnt = agoo_body_feed(&err, b, c->buf, c->bcnt))) {
+	return body_fail(c, &err);
+    }
+    if (cnt < (long)c->bcnt) {
+	memmove(c->buf, c->buf + cnt, c->bcnt - cnt);
+	c->bcnt -= cnt;
+    } else {
+	c->bcnt = 0;
+    }
+    c->buf[c->bcnt] = '\0';
+    if (!b->done) {
+	return HEAD_AGAIN;
+    }
+    if (AGOO_ERR_OK != body_to_req(&err, r, b)) {
+	return body_fail(c, &err);
+    }
+    c->body = NULL;
 
     return HEAD_OK;
 }
@@ -465,9 +728,9 @@ check_upgrade(agooCon c) {
     if (NULL == c->req) {
 	return;
     }
-    if (NULL != (v = agoo_con_header_value(c->req->header.start, c->req->header.len, "Connection", &vlen))) {
+    if (NULL != (v = agoo_req_header(c->req, AGOO_HDR_CONNECTION, &vlen))) {
 	if (NULL != strstr(v, "Upgrade")) {
-	    if (NULL != (v = agoo_con_header_value(c->req->header.start, c->req->header.len, "Upgrade", &vlen))) {
+	    if (NULL != (v = agoo_req_header(c->req, AGOO_HDR_UPGRADE, &vlen))) {
 		if (0 == strncasecmp("WebSocket", v, vlen)) {
 		    c->res_tail->close = false;
 		    c->res_tail->con_kind = AGOO_CON_WS;
@@ -476,7 +739,7 @@ check_upgrade(agooCon c) {
 	    }
 	}
     }
-    if (NULL != (v = agoo_con_header_value(c->req->header.start, c->req->header.len, "Accept", &vlen))) {
+    if (NULL != (v = agoo_req_header(c->req, AGOO_HDR_ACCEPT, &vlen))) {
 	if (0 == strncasecmp("text/event-stream", v, vlen)) {
 	    c->res_tail->close = false;
 	    c->res_tail->con_kind = AGOO_CON_SSE;
@@ -485,6 +748,128 @@ check_upgrade(agooCon c) {
     }
 }
 
+// Requests are turned away with a 503 instead of stalling the loop when the
+// eval threads fall behind.
+static bool
+req_admit(agooReq req) {
+    agooWorkers	w = req->hook->workers;
+
+    if (NULL != w && !agoo_workers_admit(w)) {
+	return false;
+    }
+    if (agoo_shed_push(req)) {
+	return true;
+    }
+    if (NULL != w) {
+	agoo_workers_done(w);
+    }
+    return false;
+}
+
+static void
+req_dispatch(agooReq req) {
+    req->res->mid = req->hook->mid;
+    if (req->hook->no_queue && FUNC_HOOK == req->hook->type) {
+	agoo_metrics_call(req);
+	agoo_req_destroy(req);
+    } else if (!req_admit(req)) {
+	agoo_shed_reply(req);
+	agoo_req_destroy(req);
+    }
+}
+
+void
+agoo_con_h2_dispatch(agooCon c, const char *head, size_t hlen, agooBody body) {
+    struct _agooErr	err = AGOO_ERR_INIT;
+    agooReq		req;
+    agooRes		res;
+    size_t		mlen;
+    HeadReturn		hr;
+
+    if (MAX_HEADER_SIZE <= hlen) {
+	agoo_body_destroy(body);
+	bad_request(c, 431, __LINE__);
+	return;
+    }
+    if (!con_buf_get(c)) {
+	agoo_body_destroy(body);
+	return;
+    }
+    // The header is parsed from buf just as if it had been read.
+    memcpy(c->buf, head, hlen);
+    c->buf[hlen] = '\0';
+    c->bcnt = hlen;
+    agoo_headers_reset(c->hdrs);
+    hr = con_header_read(c, &mlen);
+    agoo_headers_reset(c->hdrs);
+    c->bcnt = 0;
+    *c->buf = '\0';
+    if (HEAD_OK != hr) {
+	agoo_body_destroy(body);
+	return;
+    }
+    req = c->req;
+    c->req = NULL;
+    if (NULL != c->body || (NULL != body && 0 <= body->fd)) {
+	// A large body was expected or the body read was spilled so the body
+	// already read replaces the one in the message.
+	agoo_body_destroy(c->body);
+	c->body = NULL;
+	if (AGOO_ERR_OK != body_to_req(&err, req, body)) {
+	    agoo_log_cat(&agoo_error_cat, "Request body on connection %llu. %s", (unsigned long long)c->id, err.msg);
+	    agoo_body_destroy(body);
+	    agoo_req_destroy(req);
+	    bad_request(c, 500, __LINE__);
+	    return;
+	}
+    } else if (NULL != body) {
+	if (NULL != body->buf) {
+	    memcpy(req->msg + req->headers.body, body->buf, body->len);
+	}
+	agoo_body_destroy(body);
+    }
+    if (NULL == (res = agoo_res_create(c))) {
+	agoo_log_cat(&agoo_error_cat, "memory allocation of response failed on connection %llu.", (unsigned long long)c->id);
+	agoo_req_destroy(req);
+	return;
+    }
+    agoo_con_res_append(c, res);
+    req->res = res;
+    req_dispatch(req);
+}
+
+// Records how long the request took to arrive and be parsed. A pipelined
+// request that follows starts now.
+static void
+parse_done(agooCon c, int route) {
+    if (agoo_metrics_on) {
+	double	now = dtime();
+
+	agoo_metrics_record(route, AGOO_METRIC_PARSE, now - c->rstart);
+	c->rstart = now;
+    }
+}
+
+// HTTP/2 is used with prior knowledge on plain connections and only if
+// negotiated with ALPN on TLS connections.
+static bool
+h2_allowed(agooCon c) {
+    if (AGOO_CON_HTTP == c->bind->kind) {
+	return true;
+    }
+#ifdef HAVE_OPENSSL_SSL_H
+    if (AGOO_CON_HTTPS == c->bind->kind && NULL != c->ssl) {
+	const unsigned char	*proto = NULL;
+	unsigned int		plen = 0;
+
+	SSL_get0_alpn_selected(c->ssl, &proto, &plen);
+
+	return 2 == plen && 0 == memcmp("h2", proto, 2);
+    }
+#endif
+    return false;
+}
+
 #ifdef HAVE_OPENSSL_SSL_H
 static void
 con_ssl_error(agooCon c, const char *what, unsigned long e, const char *filename, int line) {
@@ -494,24 +879,52 @@ con_ssl_error(agooCon c, const char *what, unsigned long e, const char *filename
 	e = ERR_get_error();
     }
     c->dead = true;
+    c->ssl_failed = true;
     ERR_error_string_n(e, buf, sizeof(buf));
     agoo_log_cat(&agoo_error_cat, "%s %s at %s:%d", what, buf, filename, line);
 }
 #endif
 
+ssize_t
+agoo_con_recv(agooCon c, void *buf, size_t size) {
+    if (!c->rring) {
+	return recv(c->sock, buf, size, 0);
+    }
+    if (NULL == c->rdata) {
+	return 0;
+    }
+    if (0 == c->rlen) {
+	errno = EAGAIN;
+	return -1;
+    }
+    if (c->rlen < size) {
+	size = c->rlen;
+    }
+    memcpy(buf, c->rdata, size);
+    c->rdata += size;
+    c->rlen -= size;
+
+    return (ssize_t)size;
+}
+
 bool
 agoo_con_http_read(agooCon c) {
     ssize_t	cnt = 0;
+    double	now;
+    bool	fresh = (NULL == c->req && NULL == c->body && 0 == c->bcnt);
 
     if (c->dead || 0 == c->sock || c->closing) {
 	return true;
     }
     if (AGOO_CON_HTTPS == c->bind->kind) {
 #ifdef HAVE_OPENSSL_SSL_H
-	if (NULL != c->req) {
+	if (NULL != c->req && NULL == c->body) {
 	    cnt = SSL_read(c->ssl, c->req->msg + c->bcnt, (int)(c->req->mlen - c->bcnt));
 	} else {
-	    cnt = SSL_read(c->ssl, c->buf + c->bcnt, (int)(sizeof(c->buf) - c->bcnt - 1));
+	    if (!con_buf_get(c)) {
+		return true;
+	    }
+	    cnt = SSL_read(c->ssl, c->buf + c->bcnt, (int)(MAX_HEADER_SIZE - c->bcnt - 1));
 	}
 	if (0 > cnt) {
 	    //unsigned long	e = ERR_get_error();
@@ -530,13 +943,17 @@ agoo_con_http_read(agooCon c) {
 	c->dead = true;
 #endif
     } else {
-	if (NULL != c->req) {
-	    cnt = recv(c->sock, c->req->msg + c->bcnt, c->req->mlen - c->bcnt, 0);
+	if (NULL != c->req && NULL == c->body) {
+	    cnt = agoo_con_recv(c, c->req->msg + c->bcnt, c->req->mlen - c->bcnt);
 	} else {
-	    cnt = recv(c->sock, c->buf + c->bcnt, sizeof(c->buf) - c->bcnt - 1, 0);
+	    if (!con_buf_get(c)) {
+		return true;
+	    }
+	    cnt = agoo_con_recv(c, c->buf + c->bcnt, MAX_HEADER_SIZE - c->bcnt - 1);
 	}
     }
-    c->timeout = dtime() + CON_TIMEOUT;
+    now = dtime();
+    c->timeout = now + CON_TIMEOUT;
     if (0 >= cnt) {
 	// If nothing read then no need to complain. Just close.
 	if (0 < c->bcnt) {
@@ -549,12 +966,38 @@ agoo_con_http_read(agooCon c) {
 	c->dead = true;
 	return true;
     }
+    if (fresh) {
+	c->rstart = now;
+    }
+    if (NULL == c->req || NULL != c->body) {
+	c->buf[c->bcnt + cnt] = '\0';
+    }
     c->bcnt += cnt;
+    // The prior knowledge preface can only be the first bytes.
+    if (!c->h1) {
+	size_t	n = (c->bcnt < AGOO_H2_PREFACE_LEN) ? c->bcnt : AGOO_H2_PREFACE_LEN;
+
+	if (h2_allowed(c) && 0 == memcmp(AGOO_H2_PREFACE, c->buf, n)) {
+	    if (c->bcnt < AGOO_H2_PREFACE_LEN) {
+		return false;
+	    }
+	    n = c->bcnt;
+	    c->bcnt = 0;
+
+	    return agoo_h2_start(c, c->buf, n);
+	}
+	c->h1 = true;
+    }
     while (true) {
 	if (NULL == c->req) {
 	    size_t	mlen;
+	    HeadReturn	hr = con_header_read(c, &mlen);
 
-	    switch (con_header_read(c, &mlen)) {
+	    if (HEAD_AGAIN != hr) {
+		// The next request starts at the front of buf.
+		agoo_headers_reset(c->hdrs);
+	    }
+	    switch (hr) {
 	    case HEAD_AGAIN:
 		// Try again the next time. Didn't read enough.
 		return false;
@@ -562,9 +1005,11 @@ agoo_con_http_read(agooCon c) {
 		// req was created
 		break;
 	    case HEAD_HANDLED:
+		parse_done(c, 0);
 		if (mlen < c->bcnt) {
 		    memmove(c->buf, c->buf + mlen, c->bcnt - mlen);
 		    c->bcnt -= mlen;
+		    c->buf[c->bcnt] = '\0';
 		    // req is NULL so try to ready the header on the next request.
 		    continue;
 		} else {
@@ -583,10 +1028,18 @@ agoo_con_http_read(agooCon c) {
 	    }
 	}
 	if (NULL != c->req) {
-	    if (c->req->mlen <= c->bcnt) {
+	    long	mlen = (long)c->req->mlen;
+
+	    if (NULL != c->body) {
+		if (HEAD_OK != con_body_read(c)) {
+		    return false;
+		}
+		// The body has already been taken out of buf.
+		mlen = 0;
+	    }
+	    if (mlen <= (long)c->bcnt) {
 		agooReq	req;
 		agooRes	res;
-		long	mlen;
 
 		if (agoo_debug_cat.on && NULL != c->req && NULL != c->req->body.start) {
 		    agoo_log_cat(&agoo_debug_cat, "%s request on %llu: %s", agoo_con_kind_str(c->bind->kind), (unsigned long long)c->id, c->req->body.start);
@@ -597,28 +1050,27 @@ agoo_con_http_read(agooCon c) {
 		    return bad_request(c, 500, __LINE__);
 		} else {
 		    agoo_con_res_append(c, res);
-		    res->close = should_close(c->req->header.start, c->req->header.len);
+		    res->close = should_close(&c->req->headers, c->req->msg);
 		    if (res->close) {
 			c->closing = true;
 		    }
 		}
 		c->req->res = res;
-		mlen = c->req->mlen;
 		check_upgrade(c);
 		req = c->req;
 		c->req = NULL;
-		if (req->hook->no_queue && FUNC_HOOK == req->hook->type) {
-		    req->hook->func(req);
-		    agoo_req_destroy(req);
-		} else {
-		    agoo_queue_push(req->hook->queue, (void*)req);
-		}
+		parse_done(c, req->hook->mid);
+		req_dispatch(req);
 		if (mlen < (long)c->bcnt) {
 		    memmove(c->buf, c->buf + mlen, c->bcnt - mlen);
 		    c->bcnt -= mlen;
+		    c->buf[c->bcnt] = '\0';
 		} else {
+		    // The message may have been read directly into the request.
 		    c->bcnt = 0;
-		    *c->buf = '\0';
+		    if (NULL != c->buf) {
+			*c->buf = '\0';
+		    }
 		    break;
 		}
 		continue;
@@ -629,39 +1081,172 @@ agoo_con_http_read(agooCon c) {
     return false;
 }
 
-// return false to remove/close connection
-bool
-agoo_con_http_write(agooCon c) {
-    agooRes	res = agoo_con_res_pop(c);
-    agooText	message = agoo_res_message_peek(res);
-    ssize_t	cnt = 0;
+static void
+log_response(agooCon c, agooText message) {
+    if (agoo_resp_cat.on) {
+	char	buf[4096];
+	char	*hend = strstr(message->text, "\r\n\r\n");
 
-    if (NULL == message) {
-	return true;
+	if (NULL == hend) {
+	    hend = message->text + message->len;
+	}
+	if ((long)sizeof(buf) <= hend - message->text) {
+	    hend = message->text + sizeof(buf) - 1;
+	}
+	memcpy(buf, message->text, hend - message->text);
+	buf[hend - message->text] = '\0';
+	agoo_log_cat(&agoo_resp_cat, "%s %llu: %s", agoo_con_kind_str(c->bind->kind), (unsigned long long)c->id, buf);
     }
-    c->timeout = dtime() + CON_TIMEOUT;
-    if (0 == c->wcnt) {
-	if (agoo_resp_cat.on) {
-	    char	buf[4096];
-	    char	*hend = strstr(message->text, "\r\n\r\n");
+    if (agoo_debug_cat.on) {
+	agoo_log_cat(&agoo_debug_cat, "%s response on %llu: %s", agoo_con_kind_str(c->bind->kind), (unsigned long long)c->id, message->text);
+    }
+}
 
-	    if (NULL == hend) {
-		hend = message->text + message->len;
+// Collects the texts ready to be written starting with the head
+// response. Following responses are included as long as each one before was
+// final and did not close the connection. A response that changes the
+// connection kind ends the batch so the bind can be switched before anything
+// else is written. A text with a file body also ends the batch since the
+// body is not in memory. The ress array gets the response for each text.
+static int
+http_gather(agooCon c, agooRes res, agooText *texts, agooRes *ress, int max) {
+    int	cnt = 0;
+
+    while (NULL != res && cnt < max) {
+	agooText	t;
+	bool		more;
+
+	pthread_mutex_lock(&res->lock);
+	for (t = res->message; NULL != t && cnt < max; t = t->next) {
+	    texts[cnt] = t;
+	    ress[cnt] = res;
+	    cnt++;
+	    if (0 <= t->fd) {
+		break;
 	    }
-	    if ((long)sizeof(buf) <= hend - message->text) {
-		hend = message->text + sizeof(buf) - 1;
+	}
+	more = (NULL == t && res->final && !res->close && AGOO_CON_HTTP == res->con_kind);
+	pthread_mutex_unlock(&res->lock);
+	if (!more) {
+	    break;
+	}
+	pthread_mutex_lock(&c->res_lock);
+	res = res->next;
+	pthread_mutex_unlock(&c->res_lock);
+	if (NULL != res && AGOO_CON_HTTP != res->con_kind) {
+	    break;
+	}
+    }
+    return cnt;
+}
+
+static long
+text_size(agooText t) {
+    return (0 <= t->fd) ? t->len + t->flen : t->len;
+}
+
+// Writes the file body of a text starting at off. Returns the number of
+// bytes written, 0 if the socket was not ready, or -1 on an error.
+static ssize_t
+file_send(agooCon c, agooText t, off_t off) {
+    off_t	pos = (off_t)t->foff + off;
+    ssize_t	cnt;
+
+#ifdef Linux
+    if (AGOO_CON_HTTPS != c->bind->kind) {
+	if (0 > (cnt = sendfile(c->sock, t->fd, &pos, t->flen - off))) {
+	    if (EAGAIN == errno) {
+		return 0;
 	    }
-	    memcpy(buf, message->text, hend - message->text);
-	    buf[hend - message->text] = '\0';
-	    agoo_log_cat(&agoo_resp_cat, "%s %llu: %s", agoo_con_kind_str(c->bind->kind), (unsigned long long)c->id, buf);
+	    agoo_log_cat(&agoo_error_cat, "Socket error @ %llu.", (unsigned long long)c->id);
+	    return -1;
+	}
+	if (0 == cnt) {
+	    agoo_log_cat(&agoo_error_cat, "File for page changed while sending @ %llu.", (unsigned long long)c->id);
+	    return -1;
 	}
-	if (agoo_debug_cat.on) {
-	    agoo_log_cat(&agoo_debug_cat, "%s response on %llu: %s", agoo_con_kind_str(c->bind->kind), (unsigned long long)c->id, message->text);
+	return cnt;
+    }
+#endif
+#if defined(HAVE_OPENSSL_SSL_H) && defined(SSL_OP_ENABLE_KTLS)
+    // With kernel TLS the file goes to the socket without a copy.
+    if (AGOO_CON_HTTPS == c->bind->kind && BIO_get_ktls_send(SSL_get_wbio(c->ssl))) {
+	if (0 > (cnt = SSL_sendfile(c->ssl, t->fd, pos, t->flen - off, 0))) {
+	    if (SSL_ERROR_WANT_WRITE == SSL_get_error(c->ssl, (int)cnt)) {
+		return 0;
+	    }
+	    con_ssl_error(c, "sendfile", 0, __FILE__, __LINE__);
+	    return -1;
 	}
+	return cnt;
     }
+#endif
+    {
+	char	buf[16384];
+	size_t	size = sizeof(buf);
+
+	if ((off_t)t->flen - off < (off_t)size) {
+	    size = (size_t)(t->flen - off);
+	}
+	if (0 >= (cnt = pread(t->fd, buf, size, pos))) {
+	    agoo_log_cat(&agoo_error_cat, "File for page changed while sending @ %llu.", (unsigned long long)c->id);
+	    return -1;
+	}
+	if (AGOO_CON_HTTPS == c->bind->kind) {
+#ifdef HAVE_OPENSSL_SSL_H
+	    if (0 >= (cnt = SSL_write(c->ssl, buf, (int)cnt))) {
+		unsigned long	e = ERR_get_error();
+
+		if (0 == e) {
+		    return 0;
+		}
+		con_ssl_error(c, "write", (unsigned long)e, __FILE__, __LINE__);
+		return -1;
+	    }
+#else
+	    return -1;
+#endif
+	} else if (0 > (cnt = send(c->sock, buf, cnt, MSG_DONTWAIT))) {
+	    if (EAGAIN == errno) {
+		return 0;
+	    }
+	    agoo_log_cat(&agoo_error_cat, "Socket error @ %llu.", (unsigned long long)c->id);
+	    return -1;
+	}
+    }
+    return cnt;
+}
+
+// return false to remove/close connection
+bool
+agoo_con_http_write(agooCon c) {
+    agooText	texts[WRITE_IOV_MAX];
+    agooRes	ress[WRITE_IOV_MAX];
+    agooRes	res = agoo_con_res_peek(c);
+    agooText	last;
+    ssize_t	cnt = 0;
+    int		tcnt;
+    int		i;
+
+    if (NULL == res) {
+	return true;
+    }
+    // TLS writes one text at a time.
+    if (0 == (tcnt = http_gather(c, res, texts, ress, AGOO_CON_HTTPS == c->bind->kind ? 1 : WRITE_IOV_MAX))) {
+	return true;
+    }
+    last = texts[tcnt - 1];
+    c->timeout = dtime() + CON_TIMEOUT;
     if (AGOO_CON_HTTPS == c->bind->kind) {
 #ifdef HAVE_OPENSSL_SSL_H
-	if (0 >= (cnt = SSL_write(c->ssl, message->text + c->wcnt, (int)(message->len - c->wcnt)))) {
+	agooText	message = *texts;
+
+	if (message->len <= c->wcnt) {
+	    if (0 > (cnt = file_send(c, message, c->wcnt - message->len))) {
+		c->dead = true;
+		return false;
+	    }
+	} else if (0 >= (cnt = SSL_write(c->ssl, message->text + c->wcnt, (int)(message->len - c->wcnt)))) {
 	    unsigned long	e = ERR_get_error();
 
 	    if (0 == e) {
@@ -677,31 +1262,86 @@ agoo_con_http_write(agooCon c) {
 	c->dead = true;
 #endif
     } else {
-	if (0 > (cnt = send(c->sock, message->text + c->wcnt, message->len - c->wcnt, MSG_DONTWAIT))) {
-	    if (EAGAIN == errno) {
-		return true;
+	struct iovec	iov[WRITE_IOV_MAX];
+	struct msghdr	msg;
+	long		fstart = 0; // position of the file body if there is one
+	size_t		ilen = 0;
+	int		icnt = 0;
+	int		flags = MSG_DONTWAIT;
+
+	for (i = 0; i < tcnt; i++) {
+	    agooText	t = texts[i];
+	    long	off = (0 == i) ? c->wcnt : 0;
+
+	    if (off < t->len) {
+		iov[icnt].iov_base = t->text + off;
+		iov[icnt].iov_len = t->len - off;
+		ilen += iov[icnt].iov_len;
+		icnt++;
 	    }
-	    agoo_log_cat(&agoo_error_cat, "Socket error @ %llu.", (unsigned long long)c->id);
-	    c->dead = true;
+	    fstart += (t == last) ? t->len : text_size(t);
+	}
+	if (0 < icnt) {
+#ifdef MSG_MORE
+	    if (0 <= last->fd) {
+		// The body follows right away so don't send the header alone.
+		flags |= MSG_MORE;
+	    }
+#endif
+	    memset(&msg, 0, sizeof(msg));
+	    msg.msg_iov = iov;
+	    msg.msg_iovlen = icnt;
+	    if (0 > (cnt = sendmsg(c->sock, &msg, flags))) {
+		if (EAGAIN == errno) {
+		    return true;
+		}
+		agoo_log_cat(&agoo_error_cat, "Socket error @ %llu.", (unsigned long long)c->id);
+		c->dead = true;
 
-	    return false;
+		return false;
+	    }
+	}
+	if (0 <= last->fd && (size_t)cnt == ilen) {
+	    ssize_t	fcnt;
+
+	    if (0 > (fcnt = file_send(c, last, c->wcnt + cnt - fstart))) {
+		c->dead = true;
+		return false;
+	    }
+	    cnt += fcnt;
 	}
     }
-    c->wcnt += cnt;
-    if (c->wcnt == message->len) { // finished
-	agooText	next = agoo_res_message_next(res);
+    // Release each text that was completely written and each response that
+    // has nothing more to send. The count is relative to the start of the
+    // first text. A text is logged once, when the last of it is written, no
+    // matter how many writes it took.
+    cnt += c->wcnt;
+    for (i = 0; i < tcnt; i++) {
+	agooText	next;
+	long		size = text_size(texts[i]);
 
+	if (cnt < size) {
+	    c->wcnt = cnt;
+	    break;
+	}
+	cnt -= size;
 	c->wcnt = 0;
+	if (agoo_resp_cat.on || agoo_debug_cat.on) {
+	    log_response(c, texts[i]);
+	}
+	res = ress[i];
+	next = agoo_res_message_next(res);
 	if (NULL == next && res->final) {
 	    bool	done = res->close;
 
+	    agoo_res_written(res);
+	    agoo_con_res_pop(c);
 	    agoo_res_destroy(res);
-
-	    return !done;
+	    if (done) {
+		return false;
+	    }
 	}
     }
-    agoo_con_res_prepend(c, res);
-
     return true;
 }
 
@@ -713,9 +1353,12 @@ con_ws_read(agooCon c) {
     long	mlen;
 
     if (NULL != c->req) {
-	cnt = recv(c->sock, c->req->msg + c->bcnt, c->req->mlen - c->bcnt, 0);
+	cnt = agoo_con_recv(c, c->req->msg + c->bcnt, c->req->mlen - c->bcnt);
     } else {
-	cnt = recv(c->sock, c->buf + c->bcnt, sizeof(c->buf) - c->bcnt - 1, 0);
+	if (!con_buf_get(c)) {
+	    return true;
+	}
+	cnt = agoo_con_recv(c, c->buf + c->bcnt, MAX_HEADER_SIZE - c->bcnt - 1);
     }
     c->timeout = dtime() + CON_TIMEOUT;
     if (0 >= cnt) {
@@ -801,7 +1444,9 @@ con_ws_read(agooCon c) {
 		c->bcnt -= mlen;
 	    } else {
 		c->bcnt = 0;
-		*c->buf = '\0';
+		if (NULL != c->buf) {
+		    *c->buf = '\0';
+		}
 		c->req = NULL;
 		break;
 	    }
@@ -1113,8 +1758,24 @@ remove_dead_res(agooCon c) {
     bool	empty;
 
     pthread_mutex_lock(&c->res_lock);
+    if (c->dead && NULL != c->h2) {
+	// HTTP/2 responses are not written in order so any could be streaming.
+	for (res = c->res_head; NULL != res; res = res->next) {
+	    if (res->stream && !res->final) {
+		agoo_res_stream_gone(res);
+	    }
+	}
+    }
     while (NULL != (res = c->res_head)) {
-	if (NULL == agoo_res_message_peek(c->res_head) && !c->res_head->close && !c->res_head->ping) {
+	if (res->stream && !res->final) {
+	    // The writer still has the response so it can not be destroyed
+	    // until the stream is closed.
+	    if (c->dead) {
+		agoo_res_stream_gone(res);
+	    }
+	    break;
+	}
+	if (NULL == agoo_res_message_peek(res) && !res->close && !res->ping && !res->final) {
 	    break;
 	}
 	c->res_head = res->next;
@@ -1178,6 +1839,7 @@ con_ready_read(agooReady ready, void *ctx) {
 
     if (NULL != c->bind->read) {
 	if (!c->bind->read(c)) {
+	    con_buf_release(c);
 	    return true;
 	}
     } else {
@@ -1188,13 +1850,37 @@ con_ready_read(agooReady ready, void *ctx) {
     return false;
 }
 
+// The read functions take the data through agoo_con_recv() until it is used
+// up. Anything left when a read takes nothing, such as after a close, is
+// dropped.
+static bool
+con_ready_recv(agooReady ready, void *ctx, const char *data, size_t len) {
+    agooCon	c = (agooCon)ctx;
+    bool	ok;
+    size_t	prev;
+
+    c->rring = true;
+    c->rdata = (0 == len) ? NULL : data;
+    c->rlen = len;
+    do {
+	prev = c->rlen;
+	ok = con_ready_read(ready, ctx);
+    } while (ok && 0 < c->rlen && c->rlen < prev);
+    c->rring = false;
+    c->rdata = NULL;
+    c->rlen = 0;
+
+    return ok;
+}
+
 static bool
 con_ready_write(void *ctx) {
     agooCon	c = (agooCon)ctx;
     agooRes	res = agoo_con_res_peek(c);
 
-    if (NULL != res) {
-	agooConKind	kind = res->con_kind;
+    // HTTP/2 also writes frames that are not part of a response.
+    if (NULL != res || NULL != c->h2) {
+	agooConKind	kind = (NULL == res) ? AGOO_CON_ANY : res->con_kind;
 
 	if (NULL != c->bind->write) {
 	    if (c->bind->write(c)) {
@@ -1227,18 +1913,39 @@ con_ready_destroy(void *ctx) {
 
 static void
 con_ready_error(void *ctx) {
-    ((agooCon)ctx)->dead = true;
+    agooCon	c = (agooCon)ctx;
+
+    c->dead = true;
+#ifdef HAVE_OPENSSL_SSL_H
+    c->ssl_failed = true;
+#endif
 }
 
 static struct _agooHandler	con_handler = {
     .io = con_ready_io,
     .check = con_ready_check,
     .read = con_ready_read,
+    .recv = con_ready_recv,
     .write = con_ready_write,
     .error = con_ready_error,
     .destroy = con_ready_destroy,
 };
 
+// TLS reads from the socket itself so the loop can not receive for it.
+static struct _agooHandler	con_tls_handler = {
+    .io = con_ready_io,
+    .check = con_ready_check,
+    .read = con_ready_read,
+    .write = con_ready_write,
+    .error = con_ready_error,
+    .destroy = con_ready_destroy,
+};
+
+static agooHandler
+con_handler_get(agooCon c) {
+    return (AGOO_CON_HTTPS == c->bind->kind) ? &con_tls_handler : &con_handler;
+}
+
 static agooReadyIO
 queue_ready_io(void *ctx) {
     return AGOO_READY_IN;
@@ -1262,22 +1969,32 @@ con_ssl_setup(agooCon c) {
 #endif
 }
 
+// Adds a connection accepted by the listen thread to the loop.
+static void
+loop_take(agooReady ready, agooConLoop loop, agooCon c) {
+    struct _agooErr	err = AGOO_ERR_INIT;
+
+    c->loop = loop;
+    if (NULL == (c->link = agoo_ready_add(&err, ready, c->sock, con_handler_get(c), c))) {
+	agoo_log_cat(&agoo_error_cat, "Failed to add connection to manager. %s", err.msg);
+	agoo_err_clear(&err);
+    }
+    if (agoo_metrics_on) {
+	agoo_metrics_accept(dtime() - c->accepted);
+    }
+    if (AGOO_CON_HTTPS == c->bind->kind) {
+	con_ssl_setup(c);
+    }
+}
+
 static bool
 con_queue_ready_read(agooReady ready, void *ctx) {
     agooConLoop		loop = (agooConLoop)ctx;
-    struct _agooErr	err = AGOO_ERR_INIT;
     agooCon		c;
 
     agoo_queue_release(&agoo_server.con_queue);
     while (NULL != (c = (agooCon)agoo_queue_pop(&agoo_server.con_queue, 0.0))) {
-	c->loop = loop;
-	if (AGOO_ERR_OK != agoo_ready_add(&err, ready, c->sock, &con_handler, c)) {
-	    agoo_log_cat(&agoo_error_cat, "Failed to add connection to manager. %s", err.msg);
-	    agoo_err_clear(&err);
-	}
-	if (AGOO_CON_HTTPS == c->bind->kind) {
-	    con_ssl_setup(c);
-	}
+	loop_take(ready, loop, c);
     }
     return true;
 }
@@ -1312,6 +2029,123 @@ static struct _agooHandler	pub_queue_handler = {
     .destroy = NULL,
 };
 
+// Sets up a connection for a socket accepted by a loop acceptor.
+static void
+acceptor_take(agooReady ready, Acceptor a, int sock) {
+    struct _agooErr	err = AGOO_ERR_INIT;
+    agooCon		c;
+
+    if (NULL == (c = agoo_con_create(&err, &a->loop->con_pool, sock, agoo_server_con_id(), a->bind))) {
+	agoo_log_cat(&agoo_error_cat, "Server with pid %d accept connection failed. %s.", getpid(), err.msg);
+	close(sock);
+	return;
+    }
+    agoo_server_sock_opts(sock);
+    agoo_log_cat(&agoo_con_cat, "Server with pid %d accepted connection %llu on %s [%d]",
+		 getpid(), (unsigned long long)c->id, a->bind->id, sock);
+    atomic_fetch_add(&agoo_server.con_cnt, 1);
+    c->loop = a->loop;
+    if (NULL == (c->link = agoo_ready_add(&err, ready, sock, con_handler_get(c), c))) {
+	agoo_log_cat(&agoo_error_cat, "Failed to add connection to manager. %s", err.msg);
+	agoo_con_destroy(c);
+	return;
+    }
+    if (agoo_metrics_on) {
+	agoo_metrics_accept(dtime() - c->accepted);
+    }
+    if (AGOO_CON_HTTPS == c->bind->kind) {
+	con_ssl_setup(c);
+    }
+}
+
+static bool
+acceptor_ready_read(agooReady ready, void *ctx) {
+    Acceptor	a = (Acceptor)ctx;
+    int		sock;
+    int		i;
+
+    for (i = ACCEPT_MAX; 0 < i; i--) {
+#ifdef SOCK_NONBLOCK
+	sock = accept4(a->fd, NULL, NULL, SOCK_NONBLOCK);
+#else
+	if (0 <= (sock = accept(a->fd, NULL, NULL))) {
+	    fcntl(sock, F_SETFL, O_NONBLOCK);
+	}
+#endif
+	if (0 > sock) {
+	    if (EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno) {
+		agoo_log_cat(&agoo_error_cat, "Server with pid %d accept connection failed. %s.", getpid(), strerror(errno));
+	    }
+	    break;
+	}
+	acceptor_take(ready, a, sock);
+    }
+    return true;
+}
+
+// With io_uring the loop accepts the connections itself.
+static bool
+acceptor_ready_accept(agooReady ready, void *ctx, int sock) {
+    acceptor_take(ready, (Acceptor)ctx, sock);
+
+    return true;
+}
+
+static void
+acceptor_ready_destroy(void *ctx) {
+    Acceptor	a = (Acceptor)ctx;
+
+    if (a->owned) {
+	close(a->fd);
+    }
+    AGOO_FREE(a);
+}
+
+static struct _agooHandler	acceptor_handler = {
+    .io = queue_ready_io,
+    .check = NULL,
+    .read = acceptor_ready_read,
+    .accept = acceptor_ready_accept,
+    .write = NULL,
+    .error = NULL,
+    .destroy = acceptor_ready_destroy,
+};
+
+// Each TCP bind gets a listening socket in the loop. The first loop uses the
+// socket already opened for the bind and the others open their own on the
+// same port with SO_REUSEPORT.
+static int
+acceptors_add(agooErr err, agooReady ready, agooConLoop loop) {
+    agooBind	b;
+    Acceptor	a;
+
+    for (b = agoo_server.binds; NULL != b; b = b->next) {
+	if (NULL != b->name) {
+	    continue;
+	}
+	if (NULL == (a = (Acceptor)AGOO_CALLOC(1, sizeof(struct _acceptor)))) {
+	    return AGOO_ERR_MEM(err, "Acceptor");
+	}
+	a->bind = b;
+	a->loop = loop;
+	if (0 == loop->id) {
+	    a->fd = b->fd;
+	    a->owned = false;
+	} else if (AGOO_ERR_OK != agoo_bind_listen_more(err, b, &a->fd)) {
+	    AGOO_FREE(a);
+	    return err->code;
+	} else {
+	    a->owned = true;
+	}
+	fcntl(a->fd, F_SETFL, O_NONBLOCK);
+	if (NULL == agoo_ready_add(err, ready, a->fd, &acceptor_handler, a)) {
+	    acceptor_ready_destroy(a);
+	    return err->code;
+	}
+    }
+    return AGOO_ERR_OK;
+}
+
 void*
 agoo_con_loop(void *x) {
     agooConLoop		loop = (agooConLoop)x;
@@ -1321,31 +2155,37 @@ agoo_con_loop(void *x) {
     agooCon		c;
     int			con_queue_fd = agoo_queue_listen(&agoo_server.con_queue);
     int			pub_queue_fd = agoo_queue_listen(&loop->pub_queue);
+    int			i;
 
+    agoo_pool_own(&loop->res_pool);
+    agoo_pool_own(&loop->con_pool);
+    for (i = 0; i < AGOO_REQ_CLASS_CNT; i++) {
+	agoo_pool_own(loop->req_pools + i);
+    }
+    agoo_pool_own(&loop->buf_pool);
     if (NULL == ready) {
 	agoo_log_cat(&agoo_error_cat, "Failed to create connection manager. %s", err.msg);
 	exit(EXIT_FAILURE);
 	return NULL;
     }
-    if (AGOO_ERR_OK != agoo_ready_add(&err, ready, con_queue_fd, &con_queue_handler, loop) ||
-	AGOO_ERR_OK != agoo_ready_add(&err, ready, pub_queue_fd, &pub_queue_handler, loop)) {
+    if (NULL == agoo_ready_add(&err, ready, con_queue_fd, &con_queue_handler, loop) ||
+	NULL == agoo_ready_add(&err, ready, pub_queue_fd, &pub_queue_handler, loop)) {
 	agoo_log_cat(&agoo_error_cat, "Failed to add queue connection to manager. %s", err.msg);
 	exit(EXIT_FAILURE);
 
 	return NULL;
     }
+    if (agoo_server.reuse_port && AGOO_ERR_OK != acceptors_add(&err, ready, loop)) {
+	agoo_log_cat(&agoo_error_cat, "Failed to add listener to manager. %s", err.msg);
+	exit(EXIT_FAILURE);
+
+	return NULL;
+    }
     atomic_fetch_add(&agoo_server.running, 1);
 
     while (agoo_server.active) {
 	while (NULL != (c = (agooCon)agoo_queue_pop(&agoo_server.con_queue, 0.0))) {
-	    c->loop = loop;
-	    if (AGOO_ERR_OK != agoo_ready_add(&err, ready, c->sock, &con_handler, c)) {
-		agoo_log_cat(&agoo_error_cat, "Failed to add connection to manager. %s", err.msg);
-		agoo_err_clear(&err);
-	    }
-	    if (AGOO_CON_HTTPS == c->bind->kind) {
-		con_ssl_setup(c);
-	    }
+	    loop_take(ready, loop, c);
 	}
 	while (NULL != (pub = (agooPub)agoo_queue_pop(&loop->pub_queue, 0.0))) {
 	    process_pub_con(pub, loop);
@@ -1369,6 +2209,7 @@ agoo_conloop_create(agooErr err, int id) {
 	AGOO_ERR_MEM(err, "connection thread");
     } else {
 	int	stat;
+	int	i;
 
 	loop->next = NULL;
 	if (AGOO_ERR_OK != agoo_queue_multi_init(err, &loop->pub_queue, 256, true, false)) {
@@ -1376,13 +2217,12 @@ agoo_conloop_create(agooErr err, int id) {
 	    return NULL;
 	}
 	loop->id = id;
-	loop->res_head = NULL;
-	loop->res_tail = NULL;
-	if (0 != pthread_mutex_init(&loop->lock, 0)) {
-	    AGOO_FREE(loop);
-	    agoo_err_no(err, "Failed to initialize loop mutex.");
-	    return NULL;
+	agoo_pool_init(&loop->res_pool, sizeof(struct _agooRes), 1024, agoo_res_init);
+	agoo_pool_init(&loop->con_pool, sizeof(struct _agooCon), 256, agoo_con_init);
+	for (i = 0; i < AGOO_REQ_CLASS_CNT; i++) {
+	    agoo_pool_init(loop->req_pools + i, AGOO_REQ_CLASS_MIN << i, 256 >> i, NULL);
 	}
+	agoo_pool_init(&loop->buf_pool, sizeof(struct _agooHeaders) + MAX_HEADER_SIZE, 64, NULL);
 	if (0 != (stat = pthread_create(&loop->thread, NULL, agoo_con_loop, loop))) {
 	    agoo_err_set(err, stat, "Failed to create connection loop. %s", strerror(stat));
 	    return NULL;
@@ -1393,12 +2233,14 @@ agoo_conloop_create(agooErr err, int id) {
 
 void
 agoo_conloop_destroy(agooConLoop loop) {
-    agooRes	res;
+    int	i;
 
     agoo_queue_cleanup(&loop->pub_queue);
-    while (NULL != (res = loop->res_head)) {
-	loop->res_head = res->next;
-	AGOO_FREE(res);
+    agoo_pool_cleanup(&loop->res_pool);
+    agoo_pool_cleanup(&loop->con_pool);
+    for (i = 0; i < AGOO_REQ_CLASS_CNT; i++) {
+	agoo_pool_cleanup(loop->req_pools + i);
     }
+    agoo_pool_cleanup(&loop->buf_pool);
     AGOO_FREE(loop);
 }
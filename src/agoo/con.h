@@ -11,18 +11,24 @@
 #include <openssl/ssl.h>
 #endif
 
+#include "body.h"
 #include "err.h"
+#include "header.h"
+#include "pool.h"
 #include "req.h"
 #include "response.h"
 #include "server.h"
 #include "kinds.h"
 
 #define MAX_HEADER_SIZE	8192
+#define CON_TIMEOUT	10.0
 
 struct _agooUpgraded;
 struct _agooReq;
 struct _agooRes;
 struct _agooBind;
+struct _agooH2;
+struct _agooLink;
 struct _agooQueue;
 struct _gqlSub;
 
@@ -32,11 +38,11 @@ typedef struct _agooConLoop {
     pthread_t		thread;
     int			id;
 
-    // Cache of responses to be reused.
-    struct _agooRes	*res_head;
-    struct _agooRes	*res_tail;
-    pthread_mutex_t	lock;
-
+    // Objects allocated on the loop thread are reused from these.
+    struct _agooPool	res_pool;
+    struct _agooPool	con_pool;
+    struct _agooPool	req_pools[AGOO_REQ_CLASS_CNT];
+    struct _agooPool	buf_pool;
 } *agooConLoop;
 
 typedef struct _agooCon {
@@ -45,30 +51,51 @@ typedef struct _agooCon {
     struct _agooBind		*bind;
     struct pollfd		*pp;
     uint64_t			id;
-    char			buf[MAX_HEADER_SIZE];
+    // The read buffer and header index share one allocation from the loop
+    // buf_pool that is only held while a header or streamed body is being
+    // read so idle connections stay small.
+    char			*buf; // MAX_HEADER_SIZE bytes
     size_t			bcnt;
+    struct _agooHeaders		*hdrs; // parsed so far from buf
+    struct _agooBody		*body; // set while reading a streamed body
 
     ssize_t			mcnt;  // how much has been read so far
     ssize_t			wcnt;  // how much has been written
 
     double			timeout;
+    double			accepted; // when the socket was accepted
+    double			rstart;   // when the first byte of a request was read
     bool			closing;
     bool			dead;
+    bool			h1; // the first bytes were not an HTTP/2 preface
     volatile bool		hijacked;
     struct _agooReq		*req;
     struct _agooRes		*res_head;
     struct _agooRes		*res_tail;
-    pthread_mutex_t		res_lock;
 
     struct _agooUpgraded	*up; // only set for push connections
     struct _gqlSub		*gsub; // for graphql subscription
 #ifdef HAVE_OPENSSL_SSL_H
     SSL				*ssl;
+    bool			ssl_failed; // closed by an error, no close_notify
 #endif
     agooConLoop			loop;
+    struct _agooLink		*link; // set once added to the loop
+    struct _agooH2		*h2;   // set once switched to HTTP/2
+    // Data received by the loop while it is handed to the read functions.
+    const char			*rdata; // NULL at the end of the stream
+    size_t			rlen;
+    bool			rring;
+
+    // Must be last. Everything before is cleared when a connection is
+    // reused but the lock is only initialized once.
+    pthread_mutex_t		res_lock;
 } *agooCon;
 
-extern agooCon		agoo_con_create(agooErr err, int sock, uint64_t id, struct _agooBind *b);
+// Pool init function for the lock which is kept when a connection is reused.
+extern void		agoo_con_init(void *obj);
+// The pool is NULL or the pool of the thread making the connection.
+extern agooCon		agoo_con_create(agooErr err, agooPool pool, int sock, uint64_t id, struct _agooBind *b);
 extern void		agoo_con_destroy(agooCon c);
 extern const char*	agoo_con_header_value(const char *header, int hlen, const char *key, int *vlen);
 
@@ -77,8 +104,15 @@ extern void		agoo_conloop_destroy(agooConLoop loop);
 
 extern void		agoo_con_res_append(agooCon c, struct _agooRes *res);
 
+// Reads from the socket or from the data received by the loop if being
+// handed over. Returns as recv() does.
+extern ssize_t		agoo_con_recv(agooCon c, void *buf, size_t size);
 extern bool		agoo_con_http_read(agooCon c);
 extern bool		agoo_con_http_write(agooCon c);
 extern short		agoo_con_http_events(agooCon c);
 
+// Handles a request from an HTTP/2 stream given as an HTTP/1.1 header. The
+// body is always consumed. A response is appended unless memory runs out.
+extern void		agoo_con_h2_dispatch(agooCon c, const char *head, size_t hlen, struct _agooBody *body);
+
 #endif // AGOO_CON_H
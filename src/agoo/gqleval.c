@@ -502,6 +502,10 @@ eval_post(agooErr err, agooReq req) {
 	agoo_err_set(err, AGOO_ERR_TYPE, "required Content-Type not in the HTTP header");
 	return NULL;
     }
+    if (NULL == req->body.start) {
+	agoo_err_set(err, AGOO_ERR_TOO_MANY, "request body too large");
+	return NULL;
+    }
     if (0 == strncmp(graphql_content_type, s, sizeof(graphql_content_type) - 1)) {
 	if (NULL == (doc = sdl_parse_doc(err, req->body.start, req->body.len, vars, GQL_QUERY))) {
 	    return NULL;
@@ -0,0 +1,175 @@
+// Copyright (c) 2018, Peter Ohler, All rights reserved.
+
+#include <string.h>
+#include <strings.h>
+
+#include "header.h"
+
+typedef struct _known {
+    const char	*name;
+    int		len;
+} *Known;
+
+// Same order as agooHeaderId.
+static struct _known	known_headers[] = {
+    { "Accept", 6 },
+    { "Accept-Encoding", 15 },
+    { "Connection", 10 },
+    { "Content-Length", 14 },
+    { "Content-Type", 12 },
+    { "Host", 4 },
+    { "If-Modified-Since", 17 },
+    { "If-None-Match", 13 },
+    { "If-Range", 8 },
+    { "Range", 5 },
+    { "Sec-WebSocket-Key", 17 },
+    { "Sec-WebSocket-Protocol", 22 },
+    { "Transfer-Encoding", 17 },
+    { "Upgrade", 7 },
+};
+
+void
+agoo_headers_reset(agooHeaders h) {
+    memset(h->known, 0, sizeof(h->known));
+    h->cnt = 0;
+    h->scan = 0;
+    h->start = 0;
+    h->end = 0;
+    h->body = 0;
+}
+
+// The length and the first character pick the only candidate so there is
+// at most one compare.
+agooHeaderId
+agoo_header_id(const char *name, int nlen) {
+    agooHeaderId	id;
+
+    switch (nlen) {
+    case 4:	id = AGOO_HDR_HOST;			break;
+    case 5:	id = AGOO_HDR_RANGE;			break;
+    case 6:	id = AGOO_HDR_ACCEPT;			break;
+    case 7:	id = AGOO_HDR_UPGRADE;			break;
+    case 8:	id = AGOO_HDR_IF_RANGE;			break;
+    case 10:	id = AGOO_HDR_CONNECTION;		break;
+    case 12:	id = AGOO_HDR_CONTENT_TYPE;		break;
+    case 13:	id = AGOO_HDR_IF_NONE_MATCH;		break;
+    case 14:	id = AGOO_HDR_CONTENT_LENGTH;		break;
+    case 15:	id = AGOO_HDR_ACCEPT_ENCODING;		break;
+    case 17:
+	switch (*name | 0x20) {
+	case 'i':	id = AGOO_HDR_IF_MODIFIED_SINCE;	break;
+	case 's':	id = AGOO_HDR_SEC_WEBSOCKET_KEY;	break;
+	case 't':	id = AGOO_HDR_TRANSFER_ENCODING;	break;
+	default:	return AGOO_HDR_OTHER;
+	}
+	break;
+    case 22:	id = AGOO_HDR_SEC_WEBSOCKET_PROTOCOL;	break;
+    default:	return AGOO_HDR_OTHER;
+    }
+    if (0 != strncasecmp(name, known_headers[id].name, nlen)) {
+	return AGOO_HDR_OTHER;
+    }
+    return id;
+}
+
+agooHeadStatus
+agoo_headers_parse(agooHeaders h, const char *buf, int len) {
+    const char	*nl;
+
+    // memchr is vectorized in most C libraries so it is used to find line
+    // and name ends rather than stepping a character at a time.
+    while (h->scan < len && NULL != (nl = (const char*)memchr(buf + h->scan, '\n', len - h->scan))) {
+	int		end = (int)(nl - buf);
+	int		next = end + 1;
+	const char	*colon;
+
+	if (h->scan < end && '\r' == buf[end - 1]) {
+	    end--;
+	}
+	if (0 == h->start) {
+	    // The request line is parsed by the caller.
+	    h->start = next;
+	    h->end = next;
+	} else if (h->scan == end) {
+	    h->scan = next;
+	    h->body = next;
+
+	    return AGOO_HEAD_DONE;
+	} else if (NULL == (colon = (const char*)memchr(buf + h->scan, ':', end - h->scan))) {
+	    return AGOO_HEAD_BAD;
+	} else {
+	    agooField	f;
+	    int		v = (int)(colon - buf) + 1;
+	    int		ve = end;
+	    int		i;
+
+	    // White space in or after the name, including a folded line, is
+	    // not allowed.
+	    if (colon == buf + h->scan) {
+		return AGOO_HEAD_BAD;
+	    }
+	    for (i = h->scan; buf + i < colon; i++) {
+		if (' ' == buf[i] || '\t' == buf[i]) {
+		    return AGOO_HEAD_BAD;
+		}
+	    }
+	    if (AGOO_HEADER_MAX <= h->cnt) {
+		return AGOO_HEAD_FULL;
+	    }
+	    for (; v < ve && (' ' == buf[v] || '\t' == buf[v]); v++) {
+	    }
+	    for (; v < ve && (' ' == buf[ve - 1] || '\t' == buf[ve - 1]); ve--) {
+	    }
+	    f = h->fields + h->cnt;
+	    f->name = (uint16_t)h->scan;
+	    f->nlen = (uint16_t)(colon - buf - h->scan);
+	    f->value = (uint16_t)v;
+	    f->vlen = (uint16_t)(ve - v);
+	    f->id = (uint8_t)agoo_header_id(buf + h->scan, f->nlen);
+	    h->cnt++;
+	    if (AGOO_HDR_OTHER != f->id) {
+		if (0 == h->known[f->id]) {
+		    h->known[f->id] = (uint8_t)h->cnt;
+		} else if (AGOO_HDR_CONTENT_LENGTH == f->id || AGOO_HDR_TRANSFER_ENCODING == f->id) {
+		    // Only the first is looked at so a repeat could frame
+		    // the body differently than a proxy in front did.
+		    return AGOO_HEAD_BAD;
+		}
+	    }
+	    h->end = end;
+	}
+	h->scan = next;
+    }
+    return AGOO_HEAD_MORE;
+}
+
+const char*
+agoo_headers_get(agooHeaders h, const char *base, agooHeaderId id, int *vlen) {
+    agooField	f;
+
+    if (AGOO_HDR_OTHER <= id || 0 == h->known[id]) {
+	return NULL;
+    }
+    f = h->fields + h->known[id] - 1;
+    *vlen = f->vlen;
+
+    return base + f->value;
+}
+
+const char*
+agoo_headers_value(agooHeaders h, const char *base, const char *key, int klen, int *vlen) {
+    agooHeaderId	id = agoo_header_id(key, klen);
+    agooField		f;
+    int			i;
+
+    if (AGOO_HDR_OTHER != id) {
+	return agoo_headers_get(h, base, id, vlen);
+    }
+    for (i = h->cnt, f = h->fields; 0 < i; i--, f++) {
+	if (klen == f->nlen && 0 == strncasecmp(key, base + f->name, klen)) {
+	    *vlen = f->vlen;
+	    return base + f->value;
+	}
+    }
+    return NULL;
+}
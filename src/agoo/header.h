@@ -0,0 +1,70 @@
+// Copyright (c) 2018, Peter Ohler, All rights reserved.
+
+#ifndef AGOO_HEADER_H
+#define AGOO_HEADER_H
+
+#include <stdint.h>
+
+// More fields than this in one request is rejected with a 431.
+#define AGOO_HEADER_MAX	64
+
+// Headers the server or common handlers look at. They are identified as
+// the request is parsed so finding one later is a table lookup.
+typedef enum {
+    AGOO_HDR_ACCEPT		= 0,
+    AGOO_HDR_ACCEPT_ENCODING,
+    AGOO_HDR_CONNECTION,
+    AGOO_HDR_CONTENT_LENGTH,
+    AGOO_HDR_CONTENT_TYPE,
+    AGOO_HDR_HOST,
+    AGOO_HDR_IF_MODIFIED_SINCE,
+    AGOO_HDR_IF_NONE_MATCH,
+    AGOO_HDR_IF_RANGE,
+    AGOO_HDR_RANGE,
+    AGOO_HDR_SEC_WEBSOCKET_KEY,
+    AGOO_HDR_SEC_WEBSOCKET_PROTOCOL,
+    AGOO_HDR_TRANSFER_ENCODING,
+    AGOO_HDR_UPGRADE,
+    AGOO_HDR_OTHER, // also the count of known headers
+} agooHeaderId;
+
+// Offsets are from the start of the message the header is in.
+typedef struct _agooField {
+    uint16_t	name;
+    uint16_t	nlen;
+    uint16_t	value;
+    uint16_t	vlen;
+    uint8_t	id;
+} *agooField;
+
+typedef struct _agooHeaders {
+    struct _agooField	fields[AGOO_HEADER_MAX];
+    uint8_t		known[AGOO_HDR_OTHER]; // index + 1 of the first field with the id
+    int			cnt;
+    int			scan;  // where to continue parsing
+    int			start; // first field line, 0 until the request line is read
+    int			end;   // end of the last field line
+    int			body;  // after the blank line, 0 until it is found
+} *agooHeaders;
+
+typedef enum {
+    AGOO_HEAD_MORE	= 0,
+    AGOO_HEAD_DONE	= 1,
+    AGOO_HEAD_FULL	= -1,
+    AGOO_HEAD_BAD	= -2, // malformed line, repeated Content-Length or Transfer-Encoding
+} agooHeadStatus;
+
+extern void		agoo_headers_reset(agooHeaders h);
+
+// Parses the complete lines in buf from where the last call stopped. The
+// buf is the whole message received so far and not just the new part.
+extern agooHeadStatus	agoo_headers_parse(agooHeaders h, const char *buf, int len);
+
+extern agooHeaderId	agoo_header_id(const char *name, int nlen);
+
+// Values are relative to base which must be the buffer that was parsed or a
+// copy of it. Leading and trailing white space is not included.
+extern const char*	agoo_headers_get(agooHeaders h, const char *base, agooHeaderId id, int *vlen);
+extern const char*	agoo_headers_value(agooHeaders h, const char *base, const char *key, int klen, int *vlen);
+
+#endif // AGOO_HEADER_H
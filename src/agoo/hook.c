@@ -7,6 +7,7 @@
 #include "debug.h"
 #include "hook.h"
 #include "req.h"
+#include "shed.h"
 
 agooHook
 agoo_hook_create(agooMethod method, const char *pattern, void *handler, agooHookType type, agooQueue q) {
@@ -34,6 +35,9 @@ agoo_hook_create(agooMethod method, const char *pattern, void *handler, agooHook
 	hook->handler = handler;
 	hook->type = type;
 	hook->queue = q;
+	hook->workers = NULL;
+	hook->priority = AGOO_PRIORITY_NORMAL;
+	hook->mid = 0;
 	hook->no_queue = false;
     }
     return hook;
@@ -65,6 +69,9 @@ agoo_hook_func_create(agooMethod method, const char *pattern, void (*func)(agooR
 	hook->func = func;
 	hook->type = FUNC_HOOK;
 	hook->queue = q;
+	hook->workers = NULL;
+	hook->priority = AGOO_PRIORITY_NORMAL;
+	hook->mid = 0;
 	hook->no_queue = false;
     }
     return hook;
@@ -81,6 +88,7 @@ agoo_hook_match(agooHook hook, agooMethod method, const agooSeg path) {
     const char	*pat = hook->pattern;
     char	*p = path->start;
     char	*end = path->end;
+    size_t	plen;
 
     if (1 < end - p && '/' == *(end - 1)) {
 	end--;
@@ -97,6 +105,11 @@ agoo_hook_match(agooHook hook, agooMethod method, const agooSeg path) {
 	    }
 	    for (; p < end && '/' != *p; p++) {
 	    }
+	} else if ('{' == *pat && 0 < (plen = strcspn(pat + 1, "/{}")) && '}' == pat[plen + 1]) {
+	    // A named parameter matches like a '*'.
+	    pat += plen + 1;
+	    for (; p < end && '/' != *p; p++) {
+	    }
 	} else {
 	    break;
 	}
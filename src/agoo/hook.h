@@ -11,6 +11,7 @@
 
 struct _agooCon;
 struct _agooReq;
+struct _agooWorkers;
 
 typedef enum {
     NO_HOOK		= '\0',
@@ -32,6 +33,9 @@ typedef struct _agooHook {
 	void		(*func)(struct _agooReq *req);
     };
     agooQueue		queue;
+    struct _agooWorkers	*workers; // set if queue belongs to a worker pool
+    int			priority; // AGOO_PRIORITY_NORMAL unless set
+    int			mid; // route number for metrics
     bool		no_queue;
 } *agooHook;
 
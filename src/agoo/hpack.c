@@ -0,0 +1,460 @@
+// Copyright (c) 2018, Peter Ohler, All rights reserved.
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "debug.h"
+#include "hpack.h"
+
+#define ENTRY_OVERHEAD	32
+#define HUFF_MAX_BITS	30
+#define HUFF_EOS	256
+#define SCRATCH_SIZE	4096
+
+typedef struct _static {
+    const char	*name;
+    const char	*value;
+} *Static;
+
+// RFC 7541 Appendix A. Index 0 is not used.
+static struct _static	static_table[] = {
+    { NULL, NULL },
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+#define STATIC_CNT	61
+
+// Code lengths from RFC 7541 Appendix B. The code is canonical so the codes
+// themselves are built from the lengths.
+static const uint8_t	huff_lens[HUFF_EOS + 1] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+     6, 10, 10, 12, 13,  6,  8, 11, 10, 10,  8, 11,  8,  6,  6,  6,
+     5,  5,  5,  6,  6,  6,  6,  6,  6,  6,  7,  8, 15,  6, 12, 10,
+    13,  6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,
+     7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  8, 13, 19, 13, 14,  6,
+    15,  5,  6,  5,  6,  5,  6,  6,  6,  5,  7,  7,  6,  6,  6,  5,
+     6,  7,  6,  5,  5,  6,  7,  7,  7,  7,  7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30
+};
+
+static uint32_t		huff_first[HUFF_MAX_BITS + 1]; // first code of each length
+static int		huff_cnt[HUFF_MAX_BITS + 1];
+static int		huff_index[HUFF_MAX_BITS + 1]; // into huff_syms
+static uint16_t		huff_syms[HUFF_EOS + 1];       // by length then value
+static pthread_once_t	huff_once = PTHREAD_ONCE_INIT;
+
+static void
+huff_init(void) {
+    int		pos[HUFF_MAX_BITS + 1];
+    uint32_t	code = 0;
+    int		i;
+    int		len;
+
+    for (i = 0; i <= HUFF_EOS; i++) {
+	huff_cnt[huff_lens[i]]++;
+    }
+    for (i = 0, len = 1; len <= HUFF_MAX_BITS; len++) {
+	huff_index[len] = i;
+	pos[len] = i;
+	i += huff_cnt[len];
+	code = (code + huff_cnt[len - 1]) << 1;
+	huff_first[len] = code;
+    }
+    for (i = 0; i <= HUFF_EOS; i++) {
+	huff_syms[pos[huff_lens[i]]++] = (uint16_t)i;
+    }
+}
+
+// Returns the decoded length or -1 if the encoding is not valid.
+static long
+huff_decode(const uint8_t *s, size_t len, char *out) {
+    const uint8_t	*end = s + len;
+    char		*o = out;
+    uint32_t		code = 0;
+    int			bits = 0;
+    int			b;
+
+    for (; s < end; s++) {
+	for (b = 7; 0 <= b; b--) {
+	    uint32_t	off;
+
+	    code = (code << 1) | ((*s >> b) & 0x01);
+	    if (HUFF_MAX_BITS < ++bits) {
+		return -1;
+	    }
+	    off = code - huff_first[bits];
+	    if (huff_first[bits] <= code && off < (uint32_t)huff_cnt[bits]) {
+		int	sym = huff_syms[huff_index[bits] + off];
+
+		if (HUFF_EOS == sym) {
+		    return -1;
+		}
+		*o++ = (char)sym;
+		code = 0;
+		bits = 0;
+	    }
+	}
+    }
+    // Padding must be a prefix of EOS which is all ones.
+    if (7 < bits || code != (1U << bits) - 1) {
+	return -1;
+    }
+    return (long)(o - out);
+}
+
+void
+agoo_hpack_init(agooHpack h, size_t limit) {
+    pthread_once(&huff_once, huff_init);
+    h->fields = NULL;
+    h->cnt = 0;
+    h->cap = 0;
+    h->size = 0;
+    h->max = limit;
+    h->limit = limit;
+}
+
+static void
+table_evict(agooHpack h, size_t max) {
+    while (max < h->size && 0 < h->cnt) {
+	agooHpackField	f = h->fields + --h->cnt;
+
+	h->size -= f->nlen + f->vlen + ENTRY_OVERHEAD;
+	AGOO_FREE(f->name);
+    }
+}
+
+void
+agoo_hpack_cleanup(agooHpack h) {
+    table_evict(h, 0);
+    AGOO_FREE(h->fields);
+    h->fields = NULL;
+    h->cap = 0;
+}
+
+static int
+table_add(agooErr err, agooHpack h, const char *name, size_t nlen, const char *value, size_t vlen) {
+    size_t	size = nlen + vlen + ENTRY_OVERHEAD;
+    char	*block;
+
+    if (h->max < size) {
+	// Too big for the table so it just empties the table.
+	table_evict(h, 0);
+	return AGOO_ERR_OK;
+    }
+    // Copy before evicting since the name may be from an entry that is
+    // about to be evicted.
+    if (NULL == (block = (char*)AGOO_MALLOC(nlen + vlen + 1))) {
+	return AGOO_ERR_MEM(err, "HPACK table entry");
+    }
+    memcpy(block, name, nlen);
+    memcpy(block + nlen, value, vlen);
+    block[nlen + vlen] = '\0';
+    table_evict(h, h->max - size);
+    if (h->cap <= h->cnt) {
+	int		cap = (0 == h->cap) ? 16 : h->cap * 2;
+	agooHpackField	fields;
+
+	if (NULL == (fields = (agooHpackField)AGOO_REALLOC(h->fields, sizeof(struct _agooHpackField) * cap))) {
+	    AGOO_FREE(block);
+	    return AGOO_ERR_MEM(err, "HPACK table");
+	}
+	h->fields = fields;
+	h->cap = cap;
+    }
+    memmove(h->fields + 1, h->fields, sizeof(struct _agooHpackField) * h->cnt);
+    h->fields->name = block;
+    h->fields->nlen = nlen;
+    h->fields->value = block + nlen;
+    h->fields->vlen = vlen;
+    h->cnt++;
+    h->size += size;
+
+    return AGOO_ERR_OK;
+}
+
+static int
+table_get(agooErr err, agooHpack h, uint64_t index, const char **name, size_t *nlen, const char **value, size_t *vlen) {
+    if (0 == index) {
+	return agoo_err_set(err, AGOO_ERR_PARSE, "HPACK index of zero");
+    }
+    if (index <= STATIC_CNT) {
+	Static	s = static_table + index;
+
+	*name = s->name;
+	*nlen = strlen(s->name);
+	*value = s->value;
+	*vlen = strlen(s->value);
+    } else if (index - STATIC_CNT <= (uint64_t)h->cnt) {
+	agooHpackField	f = h->fields + (index - STATIC_CNT - 1);
+
+	*name = f->name;
+	*nlen = f->nlen;
+	*value = f->value;
+	*vlen = f->vlen;
+    } else {
+	return agoo_err_set(err, AGOO_ERR_PARSE, "HPACK index %llu out of range", (unsigned long long)index);
+    }
+    return AGOO_ERR_OK;
+}
+
+static int
+int_decode(agooErr err, const uint8_t **bp, const uint8_t *end, int prefix, uint64_t *vp) {
+    const uint8_t	*b = *bp;
+    uint64_t		mask = (1 << prefix) - 1;
+    uint64_t		v = *b++ & mask;
+    int			shift = 0;
+
+    if (mask == v) {
+	do {
+	    if (end <= b || 28 < shift) {
+		return agoo_err_set(err, AGOO_ERR_PARSE, "HPACK integer not valid");
+	    }
+	    v += (uint64_t)(*b & 0x7F) << shift;
+	    shift += 7;
+	} while (0x80 & *b++);
+    }
+    *bp = b;
+    *vp = v;
+
+    return AGOO_ERR_OK;
+}
+
+// Huffman coded strings are decoded into the scratch buffer which is sized
+// so that every string in the block fits.
+static int
+str_decode(agooErr err, const uint8_t **bp, const uint8_t *end, char **scratch, const char **sp, size_t *lenp) {
+    bool	huff = (0x80 & **bp);
+    uint64_t	len;
+
+    if (AGOO_ERR_OK != int_decode(err, bp, end, 7, &len)) {
+	return err->code;
+    }
+    if ((uint64_t)(end - *bp) < len) {
+	return agoo_err_set(err, AGOO_ERR_PARSE, "HPACK string longer than the block");
+    }
+    if (huff) {
+	long	cnt = huff_decode(*bp, (size_t)len, *scratch);
+
+	if (0 > cnt) {
+	    return agoo_err_set(err, AGOO_ERR_PARSE, "HPACK Huffman coding not valid");
+	}
+	*sp = *scratch;
+	*lenp = (size_t)cnt;
+	*scratch += cnt;
+    } else {
+	*sp = (const char*)*bp;
+	*lenp = (size_t)len;
+    }
+    *bp += len;
+
+    return AGOO_ERR_OK;
+}
+
+int
+agoo_hpack_decode(agooErr err, agooHpack h, const uint8_t *buf, size_t len, agooHpackCb cb, void *ctx) {
+    const uint8_t	*b = buf;
+    const uint8_t	*end = buf + len;
+    char		stack_scratch[SCRATCH_SIZE];
+    char		*heap_scratch = NULL;
+    char		*scratch = stack_scratch;
+    const char		*name;
+    const char		*value;
+    size_t		nlen;
+    size_t		vlen;
+    uint64_t		index;
+    bool		field = false;
+
+    // Huffman coding is never less than 5 bits a character.
+    if (sizeof(stack_scratch) < len * 8 / 5 + 1) {
+	if (NULL == (heap_scratch = (char*)AGOO_MALLOC(len * 8 / 5 + 1))) {
+	    return AGOO_ERR_MEM(err, "HPACK scratch");
+	}
+	scratch = heap_scratch;
+    }
+    while (b < end && AGOO_ERR_OK == err->code) {
+	char	*sp = scratch;
+
+	if (0x80 & *b) { // indexed field
+	    field = true;
+	    if (AGOO_ERR_OK == int_decode(err, &b, end, 7, &index) &&
+		AGOO_ERR_OK == table_get(err, h, index, &name, &nlen, &value, &vlen)) {
+		cb(ctx, name, nlen, value, vlen);
+	    }
+	} else if (0x20 == (0xE0 & *b)) { // dynamic table size update
+	    // Only allowed at the start of a block (RFC 7541 4.2).
+	    if (field) {
+		agoo_err_set(err, AGOO_ERR_PARSE, "HPACK table size update after a field");
+	    } else if (AGOO_ERR_OK == int_decode(err, &b, end, 5, &index)) {
+		if (h->limit < index) {
+		    agoo_err_set(err, AGOO_ERR_PARSE, "HPACK table size update over the limit");
+		} else {
+		    h->max = (size_t)index;
+		    table_evict(h, h->max);
+		}
+	    }
+	} else {
+	    // Literals with incremental indexing have a 6 bit name index,
+	    // those without indexing or never indexed a 4 bit index.
+	    bool	add = (0x40 & *b);
+
+	    field = true;
+	    if (AGOO_ERR_OK != int_decode(err, &b, end, add ? 6 : 4, &index)) {
+		break;
+	    }
+	    if (0 == index) {
+		if (end <= b || AGOO_ERR_OK != str_decode(err, &b, end, &sp, &name, &nlen)) {
+		    agoo_err_set(err, AGOO_ERR_PARSE, "HPACK field name missing");
+		    break;
+		}
+	    } else if (AGOO_ERR_OK != table_get(err, h, index, &name, &nlen, &value, &vlen)) {
+		break;
+	    }
+	    if (end <= b || AGOO_ERR_OK != str_decode(err, &b, end, &sp, &value, &vlen)) {
+		agoo_err_set(err, AGOO_ERR_PARSE, "HPACK field value missing");
+		break;
+	    }
+	    cb(ctx, name, nlen, value, vlen);
+	    if (add) {
+		table_add(err, h, name, nlen, value, vlen);
+	    }
+	}
+    }
+    AGOO_FREE(heap_scratch);
+
+    return err->code;
+}
+
+static agooText
+int_encode(agooText t, uint8_t bits, int prefix, uint64_t v) {
+    uint64_t	max = (1 << prefix) - 1;
+
+    if (v < max) {
+	return agoo_text_append_char(t, (char)(bits | v));
+    }
+    t = agoo_text_append_char(t, (char)(bits | max));
+    for (v -= max; 0x80 <= v; v >>= 7) {
+	t = agoo_text_append_char(t, (char)(0x80 | (v & 0x7F)));
+    }
+    return agoo_text_append_char(t, (char)v);
+}
+
+static agooText
+str_encode(agooText t, const char *s, size_t len, bool lower) {
+    t = int_encode(t, 0x00, 7, len);
+    if (NULL != t && 0 < len) {
+	if (NULL != (t = agoo_text_append(t, s, (int)len)) && lower) {
+	    char	*c = t->text + t->len - len;
+
+	    for (; c < t->text + t->len; c++) {
+		*c = tolower(*c);
+	    }
+	}
+    }
+    return t;
+}
+
+agooText
+agoo_hpack_encode_status(agooText t, int status) {
+    char	num[8];
+    int		i;
+
+    // The common codes are in the static table.
+    for (i = 8; i <= 14; i++) {
+	if (status == atoi(static_table[i].value)) {
+	    return int_encode(t, 0x80, 7, i);
+	}
+    }
+    snprintf(num, sizeof(num), "%03d", status % 1000);
+    t = int_encode(t, 0x00, 4, 8);
+
+    return str_encode(t, num, 3, false);
+}
+
+agooText
+agoo_hpack_encode(agooText t, const char *name, size_t nlen, const char *value, size_t vlen) {
+    int	i;
+
+    for (i = 15; i <= STATIC_CNT; i++) {
+	if (0 == strncasecmp(static_table[i].name, name, nlen) && '\0' == static_table[i].name[nlen]) {
+	    t = int_encode(t, 0x00, 4, i);
+	    return str_encode(t, value, vlen, false);
+	}
+    }
+    t = agoo_text_append_char(t, 0x00);
+    t = str_encode(t, name, nlen, true);
+
+    return str_encode(t, value, vlen, false);
+}
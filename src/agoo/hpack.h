@@ -0,0 +1,48 @@
+// Copyright (c) 2018, Peter Ohler, All rights reserved.
+
+#ifndef AGOO_HPACK_H
+#define AGOO_HPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "err.h"
+#include "text.h"
+
+// The default and the limit advertised for the decoder dynamic table.
+#define AGOO_HPACK_TABLE_SIZE	4096
+
+typedef struct _agooHpackField {
+    char	*name;  // value follows the name in the same allocation
+    size_t	nlen;
+    char	*value;
+    size_t	vlen;
+} *agooHpackField;
+
+// Decoder state for one connection. The dynamic table is kept newest first.
+typedef struct _agooHpack {
+    agooHpackField	fields;
+    int			cnt;
+    int			cap;
+    size_t		size;  // sum of the entry sizes as defined by RFC 7541
+    size_t		max;   // set by the encoder with table size updates
+    size_t		limit; // the most the encoder is allowed to set
+} *agooHpack;
+
+// Called for each field in a header block. The name and value are only
+// valid for the duration of the call.
+typedef void	(*agooHpackCb)(void *ctx, const char *name, size_t nlen, const char *value, size_t vlen);
+
+extern void	agoo_hpack_init(agooHpack h, size_t limit);
+extern void	agoo_hpack_cleanup(agooHpack h);
+
+// Decodes a complete header block. An error means the decoder state can no
+// longer be trusted and the connection must be closed.
+extern int	agoo_hpack_decode(agooErr err, agooHpack h, const uint8_t *buf, size_t len, agooHpackCb cb, void *ctx);
+
+// Fields are encoded as literals without indexing and without Huffman
+// coding so no encoder state is needed.
+extern agooText	agoo_hpack_encode_status(agooText t, int status);
+extern agooText	agoo_hpack_encode(agooText t, const char *name, size_t nlen, const char *value, size_t vlen);
+
+#endif // AGOO_HPACK_H
@@ -7,6 +7,7 @@
 
 #include "debug.h"
 #include "http.h"
+#include "sectime.h"
 
 #define BUCKET_SIZE	1024
 #define BUCKET_MASK	1023
@@ -619,3 +620,107 @@ agoo_http_code_message(int code) {
     }
     return msg;
 }
+
+static const char	*day_names[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+static const char	*mon_names[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+int
+agoo_http_date(char *buf, time_t t) {
+    struct _agooTime	at;
+    int64_t		days = (int64_t)t / 86400LL;
+
+    if (t < 0 && 0 != t % 86400) {
+	days--;
+    }
+    agoo_sectime((int64_t)t, &at);
+    // 1970-01-01 was a Thursday.
+    return sprintf(buf, "%s, %02d %s %04d %02d:%02d:%02d GMT",
+		   day_names[((days + 4) % 7 + 7) % 7], at.day, mon_names[at.mon - 1], at.year, at.hour, at.min, at.sec);
+}
+
+static int
+read_num(const char *s, int n) {
+    int	v = 0;
+
+    for (; 0 < n; n--, s++) {
+	if (*s < '0' || '9' < *s) {
+	    return -1;
+	}
+	v = v * 10 + *s - '0';
+    }
+    return v;
+}
+
+time_t
+agoo_http_date_parse(const char *s, int len) {
+    int		day;
+    int		mon;
+    int		year;
+    int		hour;
+    int		min;
+    int		sec;
+    int64_t	days;
+    int		y;
+
+    if (len < AGOO_HTTP_DATE_LEN || ',' != s[3] || 0 != strncmp(s + 25, " GMT", 4)) {
+	return -1;
+    }
+    for (mon = 0; mon < 12; mon++) {
+	if (0 == strncmp(mon_names[mon], s + 8, 3)) {
+	    break;
+	}
+    }
+    day = read_num(s + 5, 2);
+    year = read_num(s + 12, 4);
+    hour = read_num(s + 17, 2);
+    min = read_num(s + 20, 2);
+    sec = read_num(s + 23, 2);
+    if (12 <= mon || day < 1 || year < 1970 || hour < 0 || min < 0 || sec < 0) {
+	return -1;
+    }
+    // Days from the civil date, with March as the first month of the year
+    // so the leap day is last.
+    y = (mon < 2) ? year - 1 : year;
+    mon = (mon < 2) ? mon + 10 : mon - 2;
+    days = (int64_t)y * 365 + y / 4 - y / 100 + y / 400 + (153 * mon + 2) / 5 + day - 1 - 719468;
+
+    return (time_t)(days * 86400LL + hour * 3600 + min * 60 + sec);
+}
+
+bool
+agoo_http_not_modified(const char *inm, int inmlen, const char *etag, const char *ims, int imslen, time_t mtime) {
+    if (NULL != inm) {
+	const char	*end = inm + inmlen;
+	int		elen;
+
+	if (NULL == etag) {
+	    return false;
+	}
+	elen = (int)strlen(etag);
+	// Weak comparison so W/ prefixes are ignored.
+	while (inm < end) {
+	    const char	*tag;
+
+	    for (; inm < end && (' ' == *inm || '\t' == *inm || ',' == *inm); inm++) {
+	    }
+	    if (inm < end && '*' == *inm) {
+		return true;
+	    }
+	    if ('W' == *inm && inm + 1 < end && '/' == inm[1]) {
+		inm += 2;
+	    }
+	    for (tag = inm; inm < end && ',' != *inm && ' ' != *inm; inm++) {
+	    }
+	    if (elen == (int)(inm - tag) && 0 == strncmp(tag, etag, elen)) {
+		return true;
+	    }
+	}
+	return false;
+    }
+    if (NULL != ims && 0 < mtime) {
+	time_t	since = agoo_http_date_parse(ims, imslen);
+
+	return 0 <= since && mtime <= since;
+    }
+    return false;
+}
@@ -4,6 +4,7 @@
 #define AGOO_HTTP_H
 
 #include <stdbool.h>
+#include <time.h>
 
 #include "err.h"
 
@@ -14,4 +15,16 @@ extern int		agoo_http_header_ok(agooErr err, const char *key, int klen, const ch
 
 extern const char*	agoo_http_code_message(int code);
 
+// Writes an IMF-fixdate such as "Sun, 06 Nov 1994 08:49:37 GMT" and
+// returns the length which is always AGOO_HTTP_DATE_LEN.
+#define AGOO_HTTP_DATE_LEN	29
+extern int		agoo_http_date(char *buf, time_t t);
+// Returns -1 if the value is not an IMF-fixdate.
+extern time_t		agoo_http_date_parse(const char *s, int len);
+// True if the validators in the If-None-Match or, if that is NULL, the
+// If-Modified-Since values say the client copy is current. The etag
+// includes the quotes.
+extern bool		agoo_http_not_modified(const char *inm, int inmlen, const char *etag,
+					       const char *ims, int imslen, time_t mtime);
+
 #endif // AGOO_HTTP_H
@@ -0,0 +1,1420 @@
+// Copyright (c) 2018, Peter Ohler, All rights reserved.
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "bind.h"
+#include "con.h"
+#include "debug.h"
+#include "dtime.h"
+#include "http2.h"
+#include "log.h"
+#include "res.h"
+#include "server.h"
+
+#define FRAME_HEAD	9
+#define OUT_MAX		(64 * 1024) // frames built ahead of the socket
+#define REPLY_MAX	1024        // control replies queued before the peer is cut off
+#define BLOCK_MAX	(64 * 1024) // largest request header block
+#define WINDOW_MAX	0x7FFFFFFF
+#define WINDOW_START	65535
+
+typedef enum {
+    FRAME_DATA		= 0x0,
+    FRAME_HEADERS	= 0x1,
+    FRAME_PRIORITY	= 0x2,
+    FRAME_RST_STREAM	= 0x3,
+    FRAME_SETTINGS	= 0x4,
+    FRAME_PUSH_PROMISE	= 0x5,
+    FRAME_PING		= 0x6,
+    FRAME_GOAWAY	= 0x7,
+    FRAME_WINDOW_UPDATE	= 0x8,
+    FRAME_CONTINUATION	= 0x9,
+} FrameType;
+
+#define FLAG_END_STREAM		0x01
+#define FLAG_ACK		0x01
+#define FLAG_END_HEADERS	0x04
+#define FLAG_PADDED		0x08
+#define FLAG_PRIORITY		0x20
+
+typedef enum {
+    H2_NO_ERROR			= 0x0,
+    H2_PROTOCOL_ERROR		= 0x1,
+    H2_INTERNAL_ERROR		= 0x2,
+    H2_FLOW_CONTROL_ERROR	= 0x3,
+    H2_STREAM_CLOSED		= 0x5,
+    H2_FRAME_SIZE_ERROR		= 0x6,
+    H2_REFUSED_STREAM		= 0x7,
+    H2_COMPRESSION_ERROR	= 0x9,
+    H2_ENHANCE_YOUR_CALM	= 0xb,
+} H2Error;
+
+typedef enum {
+    SETTINGS_ENABLE_PUSH		= 0x2,
+    SETTINGS_MAX_CONCURRENT_STREAMS	= 0x3,
+    SETTINGS_INITIAL_WINDOW_SIZE	= 0x4,
+    SETTINGS_MAX_FRAME_SIZE		= 0x5,
+    SETTINGS_MAX_HEADER_LIST_SIZE	= 0x6,
+} Setting;
+
+typedef enum {
+    RES_WAIT	= 0, // nothing can be sent now
+    RES_MORE,	     // a frame was added
+    RES_DONE,	     // the stream is finished
+} ResState;
+
+// Collects the fields of a request header block.
+typedef struct _build {
+    agooText	lines;
+    agooText	cookie;
+    agooText	path;
+    agooText	authority;
+    char	method[16];
+    size_t	mlen;
+    size_t	size;    // header list size as defined by RFC 7540
+    bool	regular; // a regular field has been seen
+    bool	big;     // over MAX_HEADER_SIZE
+    bool	bad;
+    bool	ignore;  // trailers are not passed on
+} *Build;
+
+// Connection-specific fields are not allowed in HTTP/2.
+static const char	*hop_fields[] = {
+    "connection",
+    "keep-alive",
+    "proxy-connection",
+    "transfer-encoding",
+    "upgrade",
+    NULL
+};
+
+static bool	h2_read(agooCon c);
+static bool	h2_write(agooCon c);
+static short	h2_events(agooCon c);
+
+static struct _agooBind	h2_bind = {
+    .kind = AGOO_CON_H2,
+    .read = h2_read,
+    .write = h2_write,
+    .events = h2_events,
+};
+
+static uint32_t
+get32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static void
+put32(char *p, uint32_t v) {
+    p[0] = (char)(v >> 24);
+    p[1] = (char)(v >> 16);
+    p[2] = (char)(v >> 8);
+    p[3] = (char)v;
+}
+
+// agoo_text_append() takes a zero length to mean a C string.
+static agooText
+append(agooText t, const char *s, size_t len) {
+    if (0 < len) {
+	t = agoo_text_append(t, s, (int)len);
+    }
+    return t;
+}
+
+static bool
+hop_field(const char *name, size_t nlen) {
+    const char	**f;
+
+    for (f = hop_fields; NULL != *f; f++) {
+	if (strlen(*f) == nlen && 0 == strncasecmp(*f, name, nlen)) {
+	    return true;
+	}
+    }
+    return false;
+}
+
+static long
+out_pending(agooH2 h2) {
+    return (NULL == h2->out) ? 0 : h2->out->len - h2->osent;
+}
+
+static void
+frame_add(agooH2 h2, FrameType type, uint8_t flags, uint32_t id, const char *payload, uint32_t len) {
+    char	head[FRAME_HEAD];
+
+    head[0] = (char)(len >> 16);
+    head[1] = (char)(len >> 8);
+    head[2] = (char)len;
+    head[3] = (char)type;
+    head[4] = (char)flags;
+    put32(head + 5, id);
+    h2->out = append(h2->out, head, FRAME_HEAD);
+    if (NULL != payload) {
+	h2->out = append(h2->out, payload, len);
+    }
+}
+
+static void
+rst_stream(agooH2 h2, uint32_t id, H2Error code) {
+    char	p[4];
+
+    put32(p, code);
+    frame_add(h2, FRAME_RST_STREAM, 0, id, p, 4);
+    h2->replies++;
+}
+
+// Answers a stream before its request is complete. The reset tells the
+// client to stop sending the rest.
+static void
+early_status(agooH2 h2, uint32_t id, int status) {
+    agooText	t = agoo_hpack_encode_status(agoo_text_allocate(16), status);
+
+    if (NULL != t) {
+	frame_add(h2, FRAME_HEADERS, FLAG_END_HEADERS | FLAG_END_STREAM, id, t->text, (uint32_t)t->len);
+	agoo_text_release(t);
+    }
+    rst_stream(h2, id, H2_NO_ERROR);
+}
+
+static void
+window_update(agooH2 h2, uint32_t id, uint32_t inc) {
+    char	p[4];
+
+    put32(p, inc);
+    frame_add(h2, FRAME_WINDOW_UPDATE, 0, id, p, 4);
+}
+
+// Sends a GOAWAY and stops reading. The connection is closed once the
+// frames already built are written. Always returns false.
+static bool
+goaway(agooCon c, H2Error code, const char *msg) {
+    agooH2	h2 = c->h2;
+    char	p[8];
+
+    if (!h2->goaway) {
+	put32(p, h2->last_id);
+	put32(p + 4, code);
+	frame_add(h2, FRAME_GOAWAY, 0, 0, p, 8);
+	h2->goaway = true;
+	agoo_log_cat(&agoo_warn_cat, "HTTP/2 error on connection %llu. %s", (unsigned long long)c->id, msg);
+    }
+    return false;
+}
+
+static agooH2Stream
+stream_find(agooH2 h2, uint32_t id) {
+    agooH2Stream	s;
+
+    for (s = h2->streams; NULL != s; s = s->next) {
+	if (id == s->id) {
+	    break;
+	}
+    }
+    return s;
+}
+
+static void
+stream_free(agooH2Stream s) {
+    if (NULL != s->block) {
+	agoo_text_release(s->block);
+    }
+    if (NULL != s->head) {
+	agoo_text_release(s->head);
+    }
+    agoo_body_destroy(s->body);
+    AGOO_FREE(s);
+}
+
+// DATA still held by the stream is credited to the connection window.
+static void
+stream_remove(agooH2 h2, agooH2Stream s) {
+    agooH2Stream	*sp;
+
+    if (0 < s->held) {
+	window_update(h2, 0, s->held);
+    }
+    for (sp = &h2->streams; NULL != *sp; sp = &(*sp)->next) {
+	if (s == *sp) {
+	    *sp = s->next;
+	    break;
+	}
+    }
+    stream_free(s);
+}
+
+static agooRes
+res_find(agooCon c, uint32_t id) {
+    agooRes	res;
+
+    pthread_mutex_lock(&c->res_lock);
+    for (res = c->res_head; NULL != res; res = res->next) {
+	if (id == res->h2_id) {
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&c->res_lock);
+
+    return res;
+}
+
+// Responses are not in request order so one can finish before those ahead
+// of it in the list.
+static void
+res_remove(agooCon c, agooRes res) {
+    agooRes	prev = NULL;
+    agooRes	r;
+
+    pthread_mutex_lock(&c->res_lock);
+    for (r = c->res_head; NULL != r && r != res; r = r->next) {
+	prev = r;
+    }
+    if (NULL != r) {
+	if (NULL == prev) {
+	    c->res_head = res->next;
+	} else {
+	    prev->next = res->next;
+	}
+	if (c->res_tail == res) {
+	    c->res_tail = prev;
+	}
+    }
+    pthread_mutex_unlock(&c->res_lock);
+    if (!res->h2_reset) {
+	agoo_res_written(res);
+    }
+    agoo_res_destroy(res);
+}
+
+// Nothing more is sent for a reset stream. A streaming writer is told so it
+// stops.
+static void
+res_reset(agooRes res) {
+    res->h2_reset = true;
+    agoo_res_stream_gone(res);
+}
+
+static int
+open_cnt(agooCon c) {
+    agooH2		h2 = c->h2;
+    agooH2Stream	s;
+    agooRes		res;
+    int			cnt = 0;
+
+    for (s = h2->streams; NULL != s; s = s->next) {
+	cnt++;
+    }
+    pthread_mutex_lock(&c->res_lock);
+    for (res = c->res_head; NULL != res; res = res->next) {
+	if (0 != res->h2_id) {
+	    cnt++;
+	}
+    }
+    pthread_mutex_unlock(&c->res_lock);
+
+    return cnt;
+}
+
+////////// Request side
+
+// Field names must also be lowercase and have no colon.
+static bool
+valid_token(const char *s, size_t len, bool name) {
+    const char	*end = s + len;
+
+    if (0 == len) {
+	return false;
+    }
+    for (; s < end; s++) {
+	if ((uint8_t)*s <= ' ' || 0x7F <= (uint8_t)*s || (name && (':' == *s || ('A' <= *s && *s <= 'Z')))) {
+	    return false;
+	}
+    }
+    return true;
+}
+
+static void
+build_field(void *ctx, const char *name, size_t nlen, const char *value, size_t vlen) {
+    Build	b = (Build)ctx;
+
+    // Indexed fields can repeat a large table entry many times so the
+    // decoded size is limited, not just the block. Nothing more is kept
+    // once over but the caller keeps decoding so the table stays in step.
+    b->size += nlen + vlen + 32;
+    if (MAX_HEADER_SIZE < b->size) {
+	b->big = true;
+    }
+    if (b->bad || b->big || b->ignore) {
+	return;
+    }
+    if (NULL != memchr(value, '\0', vlen) || NULL != memchr(value, '\r', vlen) || NULL != memchr(value, '\n', vlen)) {
+	b->bad = true;
+	return;
+    }
+    if (0 < nlen && ':' == *name) {
+	// Pseudo-header fields must come first.
+	if (b->regular) {
+	    b->bad = true;
+	} else if (7 == nlen && 0 == strncmp(":method", name, nlen)) {
+	    if (0 < b->mlen || sizeof(b->method) <= vlen || !valid_token(value, vlen, false)) {
+		b->bad = true;
+	    } else {
+		memcpy(b->method, value, vlen);
+		b->mlen = vlen;
+	    }
+	} else if (5 == nlen && 0 == strncmp(":path", name, nlen)) {
+	    if (NULL != b->path || !valid_token(value, vlen, false)) {
+		b->bad = true;
+	    } else {
+		b->path = agoo_text_create(value, (int)vlen);
+	    }
+	} else if (10 == nlen && 0 == strncmp(":authority", name, nlen)) {
+	    if (NULL != b->authority) {
+		b->bad = true;
+	    } else {
+		b->authority = agoo_text_create(value, (int)vlen);
+	    }
+	} else if (7 != nlen || 0 != strncmp(":scheme", name, nlen)) {
+	    b->bad = true;
+	}
+	return;
+    }
+    b->regular = true;
+    if (!valid_token(name, nlen, true) || hop_field(name, nlen)) {
+	b->bad = true;
+	return;
+    }
+    switch (nlen) {
+    case 2:
+	if (0 == strncmp("te", name, 2)) {
+	    if (8 != vlen || 0 != strncmp("trailers", value, 8)) {
+		b->bad = true;
+	    }
+	    return;
+	}
+	break;
+    case 4:
+	if (0 == strncmp("host", name, 4) && NULL != b->authority) {
+	    return;
+	}
+	break;
+    case 6:
+	// Cookies may be split across fields so they are joined again.
+	if (0 == strncmp("cookie", name, 6)) {
+	    if (NULL == b->cookie) {
+		b->cookie = agoo_text_create(value, (int)vlen);
+	    } else {
+		b->cookie = append(b->cookie, "; ", 2);
+		b->cookie = append(b->cookie, value, vlen);
+	    }
+	    return;
+	}
+	break;
+    case 14:
+	// The length is set from the DATA frames.
+	if (0 == strncmp("content-length", name, 14)) {
+	    return;
+	}
+	break;
+    default:
+	break;
+    }
+    b->lines = append(b->lines, name, nlen);
+    b->lines = append(b->lines, ": ", 2);
+    b->lines = append(b->lines, value, vlen);
+    b->lines = append(b->lines, "\r\n", 2);
+}
+
+static void
+build_cleanup(Build b) {
+    if (NULL != b->lines) {
+	agoo_text_release(b->lines);
+    }
+    if (NULL != b->cookie) {
+	agoo_text_release(b->cookie);
+    }
+    if (NULL != b->path) {
+	agoo_text_release(b->path);
+    }
+    if (NULL != b->authority) {
+	agoo_text_release(b->authority);
+    }
+}
+
+// Builds an HTTP/1.1 request header without the blank line so the
+// content-length can be added once the body is complete.
+static agooText
+build_head(Build b) {
+    agooText	t = agoo_text_allocate((int)(b->lines->len + b->path->len + 128));
+
+    t = append(t, b->method, b->mlen);
+    t = append(t, " ", 1);
+    t = append(t, b->path->text, b->path->len);
+    t = append(t, " HTTP/1.1\r\n", 11);
+    if (NULL != b->authority) {
+	t = append(t, "host: ", 6);
+	t = append(t, b->authority->text, b->authority->len);
+	t = append(t, "\r\n", 2);
+    }
+    t = append(t, b->lines->text, b->lines->len);
+    if (NULL != b->cookie) {
+	t = append(t, "cookie: ", 8);
+	t = append(t, b->cookie->text, b->cookie->len);
+	t = append(t, "\r\n", 2);
+    }
+    return t;
+}
+
+static void
+dispatch(agooCon c, agooH2Stream s) {
+    agooH2	h2 = c->h2;
+    agooText	head = s->head;
+    agooBody	body = s->body;
+    uint32_t	id = s->id;
+    uint32_t	held = s->held;
+    size_t	blen = (NULL == body) ? 0 : body->len;
+    agooRes	res;
+    char	cl[64];
+
+    // The connection window is credited once the body is handed over.
+    s->head = NULL;
+    s->body = NULL;
+    s->held = 0;
+    stream_remove(h2, s);
+    // POST and PUT must have a length even if there is no body.
+    if (0 < blen || 0 == strncmp("POST ", head->text, 5) || 0 == strncmp("PUT ", head->text, 4)) {
+	head = append(head, cl, snprintf(cl, sizeof(cl), "content-length: %zu\r\n", blen));
+    }
+    if (NULL == (head = append(head, "\r\n", 2))) {
+	agoo_body_destroy(body);
+	if (0 < held) {
+	    window_update(h2, 0, held);
+	}
+	rst_stream(h2, id, H2_INTERNAL_ERROR);
+	return;
+    }
+    agoo_con_h2_dispatch(c, head->text, head->len, body);
+    agoo_text_release(head);
+    if (0 < held) {
+	window_update(h2, 0, held);
+    }
+
+    // A response is always appended unless memory ran out.
+    pthread_mutex_lock(&c->res_lock);
+    if (NULL != (res = c->res_tail) && 0 == res->h2_id) {
+	res->h2_id = id;
+	res->h2_window = h2->init_window;
+    } else {
+	res = NULL;
+    }
+    pthread_mutex_unlock(&c->res_lock);
+    if (NULL == res) {
+	rst_stream(h2, id, H2_INTERNAL_ERROR);
+    }
+}
+
+static bool
+headers_done(agooCon c, agooH2Stream s) {
+    agooH2		h2 = c->h2;
+    struct _build	b;
+    struct _agooErr	err = AGOO_ERR_INIT;
+
+    memset(&b, 0, sizeof(b));
+    b.ignore = (NULL != s->head || s->refused);
+    if (NULL == (b.lines = agoo_text_allocate(1024))) {
+	return goaway(c, H2_INTERNAL_ERROR, "memory allocation of header failed");
+    }
+    // The block must always be decoded to keep the table in step.
+    if (AGOO_ERR_OK != agoo_hpack_decode(&err, &h2->decoder, (uint8_t*)s->block->text, s->block->len, build_field, &b)) {
+	build_cleanup(&b);
+	return goaway(c, H2_COMPRESSION_ERROR, err.msg);
+    }
+    agoo_text_release(s->block);
+    s->block = NULL;
+    if (s->refused) {
+	build_cleanup(&b);
+	rst_stream(h2, s->id, H2_REFUSED_STREAM);
+	stream_remove(h2, s);
+	return true;
+    }
+    if (NULL == s->head) {
+	if (b.bad || b.big || 0 == b.mlen || NULL == b.path || NULL == b.lines) {
+	    build_cleanup(&b);
+	    rst_stream(h2, s->id, H2_PROTOCOL_ERROR);
+	    stream_remove(h2, s);
+	    return true;
+	}
+	if (NULL == (s->head = build_head(&b))) {
+	    build_cleanup(&b);
+	    return goaway(c, H2_INTERNAL_ERROR, "memory allocation of header failed");
+	}
+    }
+    build_cleanup(&b);
+    if (s->end) {
+	dispatch(c, s);
+    }
+    return true;
+}
+
+static bool
+data_read(agooCon c, uint8_t flags, uint32_t id, const uint8_t *p, uint32_t len) {
+    agooH2		h2 = c->h2;
+    agooH2Stream	s;
+    struct _agooErr	err = AGOO_ERR_INIT;
+    const uint8_t	*data = p;
+    uint32_t		dlen = len;
+
+    if (0 == id) {
+	return goaway(c, H2_PROTOCOL_ERROR, "DATA on stream 0");
+    }
+    if (FLAG_PADDED & flags) {
+	if (0 == len || len <= *p) {
+	    return goaway(c, H2_PROTOCOL_ERROR, "DATA padding too long");
+	}
+	data++;
+	dlen = len - 1 - *p;
+    }
+    if (NULL == (s = stream_find(h2, id)) || NULL == s->head) {
+	if (h2->last_id < id || NULL != s) {
+	    return goaway(c, H2_PROTOCOL_ERROR, "DATA on an idle stream");
+	}
+	// Nothing is kept so the connection window is credited now.
+	if (0 < len) {
+	    window_update(h2, 0, len);
+	}
+	rst_stream(h2, id, H2_STREAM_CLOSED);
+	return true;
+    }
+    // The whole frame counts against the windows. They are credited only
+    // once the data is spilled or the request is dispatched so a stream
+    // never holds more than AGOO_H2_HOLD of a body in memory.
+    s->held += len;
+    if (0 < dlen) {
+	size_t	spill = agoo_server.body_spill;
+
+	if (AGOO_H2_HOLD < spill) {
+	    spill = AGOO_H2_HOLD;
+	}
+	if (NULL == s->body && NULL == (s->body = agoo_body_create(&err, false, 0, spill, agoo_server.body_max))) {
+	    agoo_log_cat(&agoo_error_cat, "request body on connection %llu. %s", (unsigned long long)c->id, err.msg);
+	    rst_stream(h2, id, H2_INTERNAL_ERROR);
+	    stream_remove(h2, s);
+	    return true;
+	}
+	if (AGOO_ERR_OK != agoo_body_append(&err, s->body, (const char*)data, dlen)) {
+	    if (AGOO_ERR_OVERFLOW == err.code) {
+		early_status(h2, id, 413);
+	    } else {
+		agoo_log_cat(&agoo_error_cat, "request body on connection %llu. %s", (unsigned long long)c->id, err.msg);
+		rst_stream(h2, id, H2_INTERNAL_ERROR);
+	    }
+	    stream_remove(h2, s);
+	    return true;
+	}
+    }
+    if (FLAG_END_STREAM & flags) {
+	s->end = true;
+	dispatch(c, s);
+    } else if (NULL != s->body && 0 <= s->body->fd && 0 < s->held) {
+	window_update(h2, 0, s->held);
+	window_update(h2, id, s->held);
+	s->held = 0;
+    }
+    return true;
+}
+
+static bool
+headers_read(agooCon c, uint8_t flags, uint32_t id, const uint8_t *p, uint32_t len) {
+    agooH2		h2 = c->h2;
+    agooH2Stream	s;
+
+    if (0 == (id & 1)) {
+	return goaway(c, H2_PROTOCOL_ERROR, "HEADERS on an invalid stream");
+    }
+    if (FLAG_PADDED & flags) {
+	if (0 == len || len - 1 < *p) {
+	    return goaway(c, H2_PROTOCOL_ERROR, "HEADERS padding too long");
+	}
+	len -= 1 + *p;
+	p++;
+    }
+    if (FLAG_PRIORITY & flags) {
+	if (len < 5) {
+	    return goaway(c, H2_FRAME_SIZE_ERROR, "HEADERS priority too short");
+	}
+	p += 5;
+	len -= 5;
+    }
+    if (NULL != (s = stream_find(h2, id))) {
+	// Only trailers can follow and they must end the stream.
+	if (NULL == s->head || !(FLAG_END_STREAM & flags)) {
+	    return goaway(c, H2_PROTOCOL_ERROR, "unexpected HEADERS");
+	}
+    } else {
+	if (id <= h2->last_id) {
+	    return goaway(c, H2_STREAM_CLOSED, "HEADERS on a closed stream");
+	}
+	if (NULL == (s = (agooH2Stream)AGOO_CALLOC(1, sizeof(struct _agooH2Stream)))) {
+	    return goaway(c, H2_INTERNAL_ERROR, "memory allocation of stream failed");
+	}
+	h2->last_id = id;
+	s->id = id;
+	s->refused = c->closing || AGOO_H2_MAX_STREAMS <= open_cnt(c);
+	s->next = h2->streams;
+	h2->streams = s;
+    }
+    s->end = (0 != (FLAG_END_STREAM & flags));
+    if (NULL == (s->block = append(agoo_text_allocate((int)len + 1), (const char*)p, len))) {
+	return goaway(c, H2_INTERNAL_ERROR, "memory allocation of header block failed");
+    }
+    if (FLAG_END_HEADERS & flags) {
+	return headers_done(c, s);
+    }
+    h2->cont_id = id;
+
+    return true;
+}
+
+static bool
+continuation_read(agooCon c, uint8_t flags, uint32_t id, const uint8_t *p, uint32_t len) {
+    agooH2		h2 = c->h2;
+    agooH2Stream	s;
+
+    if (0 == h2->cont_id || id != h2->cont_id || NULL == (s = stream_find(h2, id))) {
+	return goaway(c, H2_PROTOCOL_ERROR, "unexpected CONTINUATION");
+    }
+    if (BLOCK_MAX < s->block->len + len) {
+	return goaway(c, H2_PROTOCOL_ERROR, "header block too large");
+    }
+    if (NULL == (s->block = append(s->block, (const char*)p, len))) {
+	return goaway(c, H2_INTERNAL_ERROR, "memory allocation of header block failed");
+    }
+    if (FLAG_END_HEADERS & flags) {
+	h2->cont_id = 0;
+	return headers_done(c, s);
+    }
+    return true;
+}
+
+static bool
+settings_read(agooCon c, uint8_t flags, uint32_t id, const uint8_t *p, uint32_t len) {
+    agooH2		h2 = c->h2;
+    const uint8_t	*end = p + len;
+
+    if (0 != id) {
+	return goaway(c, H2_PROTOCOL_ERROR, "SETTINGS on a stream");
+    }
+    if (FLAG_ACK & flags) {
+	if (0 != len) {
+	    return goaway(c, H2_FRAME_SIZE_ERROR, "SETTINGS ack with a payload");
+	}
+	return true;
+    }
+    if (0 != len % 6) {
+	return goaway(c, H2_FRAME_SIZE_ERROR, "SETTINGS length not a multiple of 6");
+    }
+    for (; p < end; p += 6) {
+	uint32_t	value = get32(p + 2);
+
+	switch ((p[0] << 8) | p[1]) {
+	case SETTINGS_ENABLE_PUSH:
+	    if (1 < value) {
+		return goaway(c, H2_PROTOCOL_ERROR, "invalid ENABLE_PUSH");
+	    }
+	    break;
+	case SETTINGS_INITIAL_WINDOW_SIZE: {
+	    int64_t	delta;
+	    agooRes	res;
+
+	    if (WINDOW_MAX < value) {
+		return goaway(c, H2_FLOW_CONTROL_ERROR, "INITIAL_WINDOW_SIZE too large");
+	    }
+	    // Open streams are adjusted by the change.
+	    delta = (int64_t)value - h2->init_window;
+	    h2->init_window = value;
+	    pthread_mutex_lock(&c->res_lock);
+	    for (res = c->res_head; NULL != res; res = res->next) {
+		if (0 != res->h2_id) {
+		    res->h2_window += delta;
+		}
+	    }
+	    pthread_mutex_unlock(&c->res_lock);
+	    break;
+	}
+	case SETTINGS_MAX_FRAME_SIZE:
+	    if (value < AGOO_H2_FRAME_MAX || 0xFFFFFF < value) {
+		return goaway(c, H2_PROTOCOL_ERROR, "invalid MAX_FRAME_SIZE");
+	    }
+	    h2->max_frame = value;
+	    break;
+	default:
+	    // Unknown settings and ones that don't change what is sent.
+	    break;
+	}
+    }
+    frame_add(h2, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+    h2->replies++;
+
+    return true;
+}
+
+static bool
+window_read(agooCon c, uint32_t id, const uint8_t *p, uint32_t len) {
+    agooH2	h2 = c->h2;
+    uint32_t	inc;
+    agooRes	res;
+
+    if (4 != len) {
+	return goaway(c, H2_FRAME_SIZE_ERROR, "WINDOW_UPDATE length not 4");
+    }
+    inc = get32(p) & WINDOW_MAX;
+    if (0 == id) {
+	if (0 == inc) {
+	    return goaway(c, H2_PROTOCOL_ERROR, "WINDOW_UPDATE of 0");
+	}
+	if (WINDOW_MAX < (h2->window += inc)) {
+	    return goaway(c, H2_FLOW_CONTROL_ERROR, "connection window too large");
+	}
+	return true;
+    }
+    if (NULL != (res = res_find(c, id)) && !res->h2_reset) {
+	if (0 == inc) {
+	    rst_stream(h2, id, H2_PROTOCOL_ERROR);
+	    res_reset(res);
+	} else if (WINDOW_MAX < (res->h2_window += inc)) {
+	    rst_stream(h2, id, H2_FLOW_CONTROL_ERROR);
+	    res_reset(res);
+	}
+    }
+    return true;
+}
+
+static bool
+frame_read(agooCon c, uint8_t type, uint8_t flags, uint32_t id, const uint8_t *p, uint32_t len) {
+    agooH2		h2 = c->h2;
+    agooH2Stream	s;
+    agooRes		res;
+
+    if (0 != h2->cont_id && FRAME_CONTINUATION != type) {
+	return goaway(c, H2_PROTOCOL_ERROR, "CONTINUATION expected");
+    }
+    switch (type) {
+    case FRAME_DATA:
+	return data_read(c, flags, id, p, len);
+    case FRAME_HEADERS:
+	return headers_read(c, flags, id, p, len);
+    case FRAME_CONTINUATION:
+	return continuation_read(c, flags, id, p, len);
+    case FRAME_SETTINGS:
+	return settings_read(c, flags, id, p, len);
+    case FRAME_WINDOW_UPDATE:
+	return window_read(c, id, p, len);
+    case FRAME_PING:
+	if (0 != id) {
+	    return goaway(c, H2_PROTOCOL_ERROR, "PING on a stream");
+	}
+	if (8 != len) {
+	    return goaway(c, H2_FRAME_SIZE_ERROR, "PING length not 8");
+	}
+	if (!(FLAG_ACK & flags)) {
+	    frame_add(h2, FRAME_PING, FLAG_ACK, 0, (const char*)p, 8);
+	    h2->replies++;
+	}
+	break;
+    case FRAME_RST_STREAM:
+	if (0 == id) {
+	    return goaway(c, H2_PROTOCOL_ERROR, "RST_STREAM on stream 0");
+	}
+	if (4 != len) {
+	    return goaway(c, H2_FRAME_SIZE_ERROR, "RST_STREAM length not 4");
+	}
+	if (NULL != (s = stream_find(h2, id))) {
+	    stream_remove(h2, s);
+	} else if (NULL != (res = res_find(c, id))) {
+	    res_reset(res);
+	}
+	break;
+    case FRAME_GOAWAY:
+	if (0 != id) {
+	    return goaway(c, H2_PROTOCOL_ERROR, "GOAWAY on a stream");
+	}
+	// Streams already open are finished before closing.
+	c->closing = true;
+	break;
+    case FRAME_PUSH_PROMISE:
+	return goaway(c, H2_PROTOCOL_ERROR, "PUSH_PROMISE from a client");
+    case FRAME_PRIORITY:
+    default:
+	// Priorities are not used and unknown frames are ignored.
+	break;
+    }
+    return true;
+}
+
+// Processes the complete frames that have been read. Returns false if the
+// connection should be closed right away.
+static bool
+h2_process(agooCon c) {
+    agooH2	h2 = c->h2;
+    size_t	pos = 0;
+
+    if (!h2->preface) {
+	if (h2->icnt < AGOO_H2_PREFACE_LEN) {
+	    return 0 == memcmp(AGOO_H2_PREFACE, h2->in, h2->icnt);
+	}
+	if (0 != memcmp(AGOO_H2_PREFACE, h2->in, AGOO_H2_PREFACE_LEN)) {
+	    return false;
+	}
+	h2->preface = true;
+	pos = AGOO_H2_PREFACE_LEN;
+    }
+    while (!h2->goaway && FRAME_HEAD <= h2->icnt - pos) {
+	const uint8_t	*f = (const uint8_t*)h2->in + pos;
+	uint32_t	len = ((uint32_t)f[0] << 16) | ((uint32_t)f[1] << 8) | (uint32_t)f[2];
+
+	if (AGOO_H2_FRAME_MAX < len) {
+	    goaway(c, H2_FRAME_SIZE_ERROR, "frame too large");
+	    break;
+	}
+	if (h2->icnt - pos < FRAME_HEAD + len) {
+	    break;
+	}
+	frame_read(c, f[3], f[4], get32(f + 5) & WINDOW_MAX, f + FRAME_HEAD, len);
+	pos += FRAME_HEAD + len;
+	// A peer that keeps asking for replies without reading them is cut off.
+	if (REPLY_MAX < h2->replies) {
+	    goaway(c, H2_ENHANCE_YOUR_CALM, "too many control frames");
+	}
+    }
+    if (h2->goaway) {
+	h2->icnt = 0;
+    } else if (0 < pos) {
+	memmove(h2->in, h2->in + pos, h2->icnt - pos);
+	h2->icnt -= pos;
+    }
+    return NULL != h2->out;
+}
+
+////////// Response side
+
+static long
+text_size(agooText t) {
+    return (0 <= t->fd) ? t->len + t->flen : t->len;
+}
+
+// Sets the part of a body text that is data. Streamed chunks are unwrapped
+// since HTTP/2 frames the data itself.
+static void
+body_range(agooRes res, agooText t, long *startp, long *endp) {
+    long	start = res->h2_off;
+    long	end = text_size(t);
+
+    if (res->chunked) {
+	if (0 == start) {
+	    const char	*nl = memchr(t->text, '\n', t->len);
+
+	    start = (NULL == nl) ? t->len : nl - t->text + 1;
+	}
+	end = (start + 2 <= t->len) ? t->len - 2 : start;
+    }
+    *startp = start;
+    *endp = end;
+}
+
+static bool
+data_copy(agooH2 h2, agooText t, long off, long n) {
+    if (off < t->len) {
+	long	cnt = t->len - off;
+
+	if (n < cnt) {
+	    cnt = n;
+	}
+	h2->out = append(h2->out, t->text + off, cnt);
+	off += cnt;
+	n -= cnt;
+    }
+    if (0 < n) {
+	char	buf[AGOO_H2_FRAME_MAX];
+
+	if (n != pread(t->fd, buf, n, t->foff + off - t->len)) {
+	    return false;
+	}
+	h2->out = append(h2->out, buf, n);
+    }
+    return NULL != h2->out;
+}
+
+// Adds a header block as a HEADERS frame and as many CONTINUATION frames as
+// needed.
+static void
+block_add(agooH2 h2, uint32_t id, agooText block, uint8_t flags) {
+    const char	*b = block->text;
+    long	left = block->len;
+    FrameType	type = FRAME_HEADERS;
+    uint8_t	end_stream = flags & FLAG_END_STREAM;
+
+    do {
+	long	n = (left < (long)h2->max_frame) ? left : (long)h2->max_frame;
+
+	left -= n;
+	frame_add(h2, type, (0 == left) ? FLAG_END_HEADERS | end_stream : end_stream, id, b, (uint32_t)n);
+	b += n;
+	type = FRAME_CONTINUATION;
+	end_stream = 0;
+    } while (0 < left);
+}
+
+static ResState
+head_frame(agooCon c, agooRes res, agooText t, bool last) {
+    agooH2	h2 = c->h2;
+    const char	*start = t->text + res->h2_off;
+    const char	*end = t->text + t->len;
+    const char	*line;
+    const char	*eol;
+    agooText	block;
+    long	hend = t->len;
+    int		status;
+
+    if (end - start < 12 || 0 != strncmp("HTTP/1.", start, 7) || NULL == (line = memchr(start, '\n', end - start))) {
+	agoo_log_cat(&agoo_error_cat, "Response on connection %llu is not HTTP.", (unsigned long long)c->id);
+	rst_stream(h2, res->h2_id, H2_INTERNAL_ERROR);
+	res_reset(res);
+	return RES_MORE;
+    }
+    status = atoi(start + 9);
+    if (NULL == (block = agoo_text_allocate(256))) {
+	return RES_WAIT;
+    }
+    block = agoo_hpack_encode_status(block, status);
+    for (line++; line < end; line = eol + 1) {
+	const char	*vend;
+	const char	*colon;
+	const char	*v;
+
+	if (NULL == (eol = memchr(line, '\n', end - line))) {
+	    break;
+	}
+	vend = eol;
+	if (line < vend && '\r' == vend[-1]) {
+	    vend--;
+	}
+	if (vend == line) {
+	    hend = eol + 1 - t->text;
+	    break;
+	}
+	if (NULL == (colon = memchr(line, ':', vend - line)) || hop_field(line, colon - line)) {
+	    continue;
+	}
+	for (v = colon + 1; v < vend && (' ' == *v || '\t' == *v); v++) {
+	}
+	block = agoo_hpack_encode(block, line, colon - line, v, vend - v);
+    }
+    if (NULL == block) {
+	return RES_WAIT;
+    }
+    // Informational responses are followed by another header.
+    if (status < 200) {
+	block_add(h2, res->h2_id, block, 0);
+	agoo_text_release(block);
+	if (hend < t->len) {
+	    res->h2_off = hend;
+	} else {
+	    agoo_res_message_next(res);
+	    res->h2_off = 0;
+	}
+	return RES_MORE;
+    }
+    res->h2_body = true;
+    if (hend < text_size(t)) {
+	block_add(h2, res->h2_id, block, 0);
+	agoo_text_release(block);
+	res->h2_off = hend;
+	return RES_MORE;
+    }
+    block_add(h2, res->h2_id, block, last ? FLAG_END_STREAM : 0);
+    agoo_text_release(block);
+    agoo_res_message_next(res);
+    res->h2_off = 0;
+
+    return last ? RES_DONE : RES_MORE;
+}
+
+static ResState
+body_frame(agooCon c, agooRes res, agooText t, bool last) {
+    agooH2	h2 = c->h2;
+    long	start;
+    long	end;
+    long	n;
+    uint8_t	flags = 0;
+
+    body_range(res, t, &start, &end);
+    if (0 < (n = end - start)) {
+	if ((long)h2->max_frame < n) {
+	    n = h2->max_frame;
+	}
+	if (AGOO_H2_FRAME_MAX < n) {
+	    n = AGOO_H2_FRAME_MAX;
+	}
+	if (h2->window < n) {
+	    n = (long)h2->window;
+	}
+	if (res->h2_window < n) {
+	    n = (long)res->h2_window;
+	}
+	if (n <= 0) {
+	    res->h2_off = start;
+	    return RES_WAIT;
+	}
+    }
+    if (last && start + n == end) {
+	// A short streamed body can only be reported by resetting the stream.
+	if (res->close) {
+	    rst_stream(h2, res->h2_id, H2_INTERNAL_ERROR);
+	    res_reset(res);
+	    return RES_MORE;
+	}
+	flags = FLAG_END_STREAM;
+    }
+    if (0 < n || 0 != flags) {
+	long	mark = h2->out->len;
+
+	frame_add(h2, FRAME_DATA, flags, res->h2_id, NULL, (uint32_t)n);
+	if (!data_copy(h2, t, start, n)) {
+	    if (NULL == h2->out) {
+		return RES_WAIT;
+	    }
+	    // Drop the partial frame.
+	    h2->out->len = mark;
+	    agoo_log_cat(&agoo_error_cat, "File for page changed while sending @ %llu.", (unsigned long long)c->id);
+	    rst_stream(h2, res->h2_id, H2_INTERNAL_ERROR);
+	    res_reset(res);
+	    return RES_MORE;
+	}
+	h2->window -= n;
+	res->h2_window -= n;
+    }
+    if (start + n < end) {
+	res->h2_off = start + n;
+	return RES_MORE;
+    }
+    agoo_res_message_next(res);
+    res->h2_off = 0;
+
+    return (0 != flags) ? RES_DONE : RES_MORE;
+}
+
+// Adds at most one frame for a response so streams share the connection.
+static ResState
+res_frame(agooCon c, agooRes res) {
+    agooText	t;
+    bool	final;
+    bool	last;
+
+    pthread_mutex_lock(&res->lock);
+    t = res->message;
+    final = res->final;
+    last = final && NULL != t && NULL == t->next;
+    pthread_mutex_unlock(&res->lock);
+
+    if (0 == res->h2_id || res->h2_reset) {
+	// Nothing is sent but the texts still have to be released.
+	while (NULL != agoo_res_message_next(res)) {
+	}
+	return final ? RES_DONE : RES_WAIT;
+    }
+    if (NULL == t) {
+	if (!final) {
+	    return RES_WAIT;
+	}
+	if (res->h2_body) {
+	    frame_add(c->h2, FRAME_DATA, FLAG_END_STREAM, res->h2_id, NULL, 0);
+	} else {
+	    rst_stream(c->h2, res->h2_id, H2_INTERNAL_ERROR);
+	}
+	return RES_DONE;
+    }
+    if (res->h2_body) {
+	return body_frame(c, res, t, last);
+    }
+    return head_frame(c, res, t, last);
+}
+
+static void
+h2_fill(agooCon c) {
+    agooH2	h2 = c->h2;
+    bool	more = true;
+
+    while (more && out_pending(h2) < OUT_MAX) {
+	agooRes	res;
+	agooRes	next;
+
+	more = false;
+	pthread_mutex_lock(&c->res_lock);
+	res = c->res_head;
+	pthread_mutex_unlock(&c->res_lock);
+	for (; NULL != res; res = next) {
+	    pthread_mutex_lock(&c->res_lock);
+	    next = res->next;
+	    pthread_mutex_unlock(&c->res_lock);
+	    switch (res_frame(c, res)) {
+	    case RES_DONE:
+		res_remove(c, res);
+		more = true;
+		break;
+	    case RES_MORE:
+		more = true;
+		break;
+	    default:
+		break;
+	    }
+	    if (NULL == h2->out) {
+		return;
+	    }
+	}
+    }
+}
+
+// Something can be written for the response now.
+static bool
+res_ready(agooH2 h2, agooRes res) {
+    bool	ready;
+
+    pthread_mutex_lock(&res->lock);
+    if (NULL == res->message) {
+	ready = res->final;
+    } else if (0 == res->h2_id || res->h2_reset || !res->h2_body) {
+	ready = true;
+    } else {
+	long	start;
+	long	end;
+
+	body_range(res, res->message, &start, &end);
+	ready = (end <= start || (0 < h2->window && 0 < res->h2_window));
+    }
+    pthread_mutex_unlock(&res->lock);
+
+    return ready;
+}
+
+////////// Socket
+
+// Returns the number of bytes read, 0 if nothing was ready, or -1 if the
+// connection closed or failed.
+static ssize_t
+h2_recv(agooCon c, char *buf, size_t size) {
+    ssize_t	cnt;
+
+#ifdef HAVE_OPENSSL_SSL_H
+    if (NULL != c->ssl) {
+	int	n = SSL_read(c->ssl, buf, (int)size);
+
+	if (0 < n) {
+	    return n;
+	}
+	switch (SSL_get_error(c->ssl, n)) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+	    return 0;
+	default:
+	    return -1;
+	}
+    }
+#endif
+    if (0 < (cnt = agoo_con_recv(c, buf, size))) {
+	return cnt;
+    }
+    if (0 > cnt && (EAGAIN == errno || EINTR == errno)) {
+	return 0;
+    }
+    return -1;
+}
+
+static ssize_t
+h2_send(agooCon c, const char *buf, size_t len) {
+    ssize_t	cnt;
+
+#ifdef HAVE_OPENSSL_SSL_H
+    if (NULL != c->ssl) {
+	int	n = SSL_write(c->ssl, buf, (int)len);
+
+	if (0 < n) {
+	    return n;
+	}
+	switch (SSL_get_error(c->ssl, n)) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+	    return 0;
+	default:
+	    return -1;
+	}
+    }
+#endif
+    if (0 > (cnt = send(c->sock, buf, len, MSG_DONTWAIT))) {
+	return (EAGAIN == errno || EINTR == errno) ? 0 : -1;
+    }
+    return cnt;
+}
+
+// Returns false on a write error.
+static bool
+h2_flush(agooCon c) {
+    agooH2	h2 = c->h2;
+    ssize_t	cnt;
+
+    while (0 < out_pending(h2)) {
+	if (0 > (cnt = h2_send(c, h2->out->text + h2->osent, out_pending(h2)))) {
+	    return false;
+	}
+	if (0 == cnt) {
+	    return true;
+	}
+	h2->osent += cnt;
+    }
+    if (NULL != h2->out) {
+	h2->out->len = 0;
+	h2->osent = 0;
+    }
+    h2->replies = 0;
+
+    return true;
+}
+
+// return true to close
+static bool
+h2_read(agooCon c) {
+    agooH2	h2 = c->h2;
+    ssize_t	cnt;
+
+    if (c->dead || 0 == c->sock) {
+	return true;
+    }
+    if (h2->goaway) {
+	return false;
+    }
+    // Reading stops until the client takes what has been queued. Data the
+    // ring has already received still has to be used.
+    if (OUT_MAX <= out_pending(h2) && !c->rring) {
+	return false;
+    }
+    // A partial frame always leaves room since the buffer holds the preface
+    // and a full frame.
+    if (0 == (cnt = h2_recv(c, h2->in + h2->icnt, sizeof(h2->in) - h2->icnt))) {
+	return false;
+    }
+    if (0 > cnt) {
+	return true;
+    }
+    c->timeout = dtime() + CON_TIMEOUT;
+    h2->icnt += cnt;
+
+    return !h2_process(c);
+}
+
+// return false to close
+static bool
+h2_write(agooCon c) {
+    agooH2	h2 = c->h2;
+
+    c->timeout = dtime() + CON_TIMEOUT;
+    if (!h2->goaway) {
+	h2_fill(c);
+    }
+    if (NULL == h2->out) {
+	agoo_log_cat(&agoo_error_cat, "memory allocation of HTTP/2 frames failed on connection %llu.", (unsigned long long)c->id);
+	return false;
+    }
+    if (!h2_flush(c)) {
+	return false;
+    }
+    if (0 < out_pending(h2)) {
+	return true;
+    }
+    if (h2->goaway) {
+	return false;
+    }
+    return !c->closing || NULL != c->res_head;
+}
+
+static short
+h2_events(agooCon c) {
+    agooH2	h2 = c->h2;
+    short	events = (h2->goaway || OUT_MAX <= out_pending(h2)) ? 0 : POLLIN;
+    agooRes	res;
+
+    if (0 < out_pending(h2) || h2->goaway || (c->closing && NULL == c->res_head)) {
+	return events | POLLOUT;
+    }
+    pthread_mutex_lock(&c->res_lock);
+    for (res = c->res_head; NULL != res; res = res->next) {
+	if (res_ready(h2, res)) {
+	    events |= POLLOUT;
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&c->res_lock);
+
+    return events;
+}
+
+bool
+agoo_h2_start(agooCon c, const char *buf, size_t len) {
+    agooH2	h2;
+    char	settings[18];
+
+    if (NULL == (h2 = (agooH2)AGOO_CALLOC(1, sizeof(struct _agooH2)))) {
+	agoo_log_cat(&agoo_error_cat, "memory allocation of HTTP/2 state failed on connection %llu.", (unsigned long long)c->id);
+	return true;
+    }
+    agoo_hpack_init(&h2->decoder, AGOO_HPACK_TABLE_SIZE);
+    h2->window = WINDOW_START;
+    h2->init_window = WINDOW_START;
+    h2->max_frame = AGOO_H2_FRAME_MAX;
+    h2->out = agoo_text_allocate(4096);
+    c->h2 = h2;
+    c->bind = &h2_bind;
+    agoo_log_cat(&agoo_con_cat, "HTTP/2 on connection %llu.", (unsigned long long)c->id);
+
+    // The server preface goes out with the first write.
+    settings[0] = 0;
+    settings[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    put32(settings + 2, AGOO_H2_MAX_STREAMS);
+    settings[6] = 0;
+    settings[7] = SETTINGS_INITIAL_WINDOW_SIZE;
+    put32(settings + 8, AGOO_H2_WINDOW);
+    settings[12] = 0;
+    settings[13] = SETTINGS_MAX_HEADER_LIST_SIZE;
+    put32(settings + 14, MAX_HEADER_SIZE);
+    frame_add(h2, FRAME_SETTINGS, 0, 0, settings, sizeof(settings));
+    window_update(h2, 0, AGOO_H2_CONN_WINDOW - WINDOW_START);
+
+    if (0 < len) {
+	memcpy(h2->in, buf, len);
+	h2->icnt = len;
+	if (!h2_process(c)) {
+	    return true;
+	}
+    }
+    return NULL == h2->out;
+}
+
+void
+agoo_h2_destroy(agooH2 h2) {
+    agooH2Stream	s;
+
+    if (NULL != h2) {
+	while (NULL != (s = h2->streams)) {
+	    h2->streams = s->next;
+	    stream_free(s);
+	}
+	agoo_hpack_cleanup(&h2->decoder);
+	if (NULL != h2->out) {
+	    agoo_text_release(h2->out);
+	}
+	AGOO_FREE(h2);
+    }
+}
@@ -0,0 +1,60 @@
+// Copyright (c) 2018, Peter Ohler, All rights reserved.
+
+#ifndef AGOO_HTTP2_H
+#define AGOO_HTTP2_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "body.h"
+#include "hpack.h"
+#include "text.h"
+
+#define AGOO_H2_PREFACE		"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define AGOO_H2_PREFACE_LEN	24
+#define AGOO_H2_FRAME_MAX	16384 // largest frame read or written
+#define AGOO_H2_MAX_STREAMS	100
+#define AGOO_H2_WINDOW		(1024 * 1024) // stream receive window given to the client
+#define AGOO_H2_HOLD		(256 * 1024)  // most of a request body kept in memory
+// Large enough that every stream can hold its share without starving others.
+#define AGOO_H2_CONN_WINDOW	(AGOO_H2_MAX_STREAMS * AGOO_H2_HOLD)
+
+struct _agooCon;
+
+// A stream that is still receiving its request. Once the request is
+// complete it is dispatched and the response carries the stream.
+typedef struct _agooH2Stream {
+    struct _agooH2Stream	*next;
+    uint32_t			id;
+    agooText			block; // header block being received
+    agooText			head;  // request converted to an HTTP/1.1 header
+    agooBody			body;
+    uint32_t			held;  // DATA not yet credited to the windows
+    bool			end;   // END_STREAM seen
+    bool			refused;
+} *agooH2Stream;
+
+typedef struct _agooH2 {
+    struct _agooHpack	decoder;
+    agooH2Stream	streams;
+    agooText		out;       // frames not yet written
+    long		osent;
+    int64_t		window;    // connection send window
+    int64_t		init_window; // initial send window for new streams
+    uint32_t		max_frame; // largest frame the client accepts
+    uint32_t		last_id;   // highest stream opened by the client
+    uint32_t		cont_id;   // stream expecting CONTINUATION frames
+    uint32_t		replies;   // control replies queued since the last flush
+    bool		preface;   // client preface received
+    bool		goaway;    // GOAWAY sent, close once written
+    size_t		icnt;
+    char		in[AGOO_H2_PREFACE_LEN + 9 + AGOO_H2_FRAME_MAX];
+} *agooH2;
+
+// Switches a connection to HTTP/2. Any bytes already read, starting with the
+// client preface, are processed. Returns true if the connection should be
+// closed.
+extern bool	agoo_h2_start(struct _agooCon *c, const char *buf, size_t len);
+extern void	agoo_h2_destroy(agooH2 h2);
+
+#endif // AGOO_HTTP2_H
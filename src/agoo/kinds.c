@@ -10,6 +10,7 @@ agoo_con_kind_str(agooConKind kind) {
     case AGOO_CON_HTTPS:	return "HTTPS";
     case AGOO_CON_WS:		return "WS";
     case AGOO_CON_SSE:		return "SSE";
+    case AGOO_CON_H2:		return "H2";
     default:			break;
     }
     return "UNKNOWN";
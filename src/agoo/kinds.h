@@ -9,6 +9,7 @@ typedef enum {
     AGOO_CON_HTTPS	= 'T',
     AGOO_CON_WS		= 'W',
     AGOO_CON_SSE	= 'S',
+    AGOO_CON_H2		= '2',
 } agooConKind;
 
 extern const char*	agoo_con_kind_str(agooConKind kind);
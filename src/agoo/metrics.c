@@ -0,0 +1,436 @@
+// Copyright (c) 2018, Peter Ohler, All rights reserved.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "con.h"
+#include "debug.h"
+#include "dtime.h"
+#include "log.h"
+#include "page.h"
+#include "req.h"
+#include "res.h"
+#include "server.h"
+#include "shed.h"
+#include "upgraded.h"
+#include "workers.h"
+#include "metrics.h"
+
+// Each thread that records gets a block of histograms, one set per route
+// with route 0 for requests that did not match a hook. Only the owning
+// thread writes to a block. Blocks of threads that have exited are left on
+// the list for the next new thread so counts never go backwards.
+typedef struct _block {
+    struct _block	*next;
+    bool		active;
+    int			route_cnt;
+    struct _agooHist	accept;
+    struct _agooHist	hists[]; // route_cnt * AGOO_METRIC_CNT
+} *Block;
+
+bool	agoo_metrics_on = false;
+
+static agooHook		*routes = NULL; // hook for each route, NULL for 0
+static int		route_cnt = 1;
+static Block		blocks = NULL;
+static pthread_mutex_t	blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t	block_key;
+static pthread_once_t	block_once = PTHREAD_ONCE_INIT;
+static __thread Block	thread_block = NULL;
+
+static const char	fail_msg[] = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n";
+static const char	*metric_names[AGOO_METRIC_CNT] = { "parse", "queue", "eval", "write" };
+
+static void
+block_release(void *ptr) {
+    pthread_mutex_lock(&blocks_lock);
+    ((Block)ptr)->active = false;
+    pthread_mutex_unlock(&blocks_lock);
+}
+
+static void
+block_key_create(void) {
+    pthread_key_create(&block_key, block_release);
+}
+
+static Block
+block_get(void) {
+    Block	b;
+
+    if (NULL != thread_block) {
+	return thread_block;
+    }
+    pthread_once(&block_once, block_key_create);
+    pthread_mutex_lock(&blocks_lock);
+    for (b = blocks; NULL != b; b = b->next) {
+	if (!b->active && route_cnt == b->route_cnt) {
+	    break;
+	}
+    }
+    if (NULL == b) {
+	if (NULL == (b = (Block)AGOO_CALLOC(1, sizeof(struct _block) + sizeof(struct _agooHist) * route_cnt * AGOO_METRIC_CNT))) {
+	    pthread_mutex_unlock(&blocks_lock);
+	    return NULL;
+	}
+	b->route_cnt = route_cnt;
+	b->next = blocks;
+	blocks = b;
+    }
+    b->active = true;
+    pthread_mutex_unlock(&blocks_lock);
+    pthread_setspecific(block_key, b);
+    thread_block = b;
+
+    return b;
+}
+
+// Only the owning thread writes so a relaxed store is enough for readers to
+// see whole values.
+static void
+hist_add(agooHist h, double secs) {
+    uint64_t	usecs = (0.0 < secs) ? (uint64_t)(secs * 1000000.0) : 0;
+    int		i = (0 == usecs) ? 0 : 64 - __builtin_clzll(usecs);
+
+    if (AGOO_HIST_BUCKETS <= i) {
+	i = AGOO_HIST_BUCKETS - 1;
+    }
+    __atomic_store_n(&h->counts[i], h->counts[i] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, h->sum + usecs, __ATOMIC_RELAXED);
+}
+
+static void
+hist_sum(agooHist sum, agooHist h) {
+    int	i;
+
+    for (i = 0; i < AGOO_HIST_BUCKETS; i++) {
+	sum->counts[i] += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+    }
+    sum->sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+}
+
+int
+agoo_metrics_start(agooErr err, agooHook hooks) {
+    agooHook	h;
+    int		cnt = 1;
+
+    for (h = hooks; NULL != h; h = h->next) {
+	h->mid = cnt++;
+    }
+    AGOO_FREE(routes);
+    if (NULL == (routes = (agooHook*)AGOO_CALLOC(cnt, sizeof(agooHook)))) {
+	route_cnt = 1;
+	return AGOO_ERR_MEM(err, "Metrics Routes");
+    }
+    for (h = hooks; NULL != h; h = h->next) {
+	routes[h->mid] = h;
+    }
+    pthread_mutex_lock(&blocks_lock);
+    route_cnt = cnt;
+    pthread_mutex_unlock(&blocks_lock);
+
+    return AGOO_ERR_OK;
+}
+
+void
+agoo_metrics_cleanup() {
+    pthread_mutex_lock(&blocks_lock);
+    route_cnt = 1;
+    pthread_mutex_unlock(&blocks_lock);
+    AGOO_FREE(routes);
+    routes = NULL;
+}
+
+void
+agoo_metrics_record(int route, agooMetric m, double secs) {
+    Block	b = block_get();
+
+    if (NULL != b && 0 <= route && route < b->route_cnt) {
+	hist_add(&b->hists[route * AGOO_METRIC_CNT + m], secs);
+    }
+}
+
+void
+agoo_metrics_accept(double secs) {
+    Block	b = block_get();
+
+    if (NULL != b) {
+	hist_add(&b->accept, secs);
+    }
+}
+
+void
+agoo_metrics_call(agooReq req) {
+    if (agoo_metrics_on) {
+	double	start = dtime();
+
+	req->hook->func(req);
+	agoo_metrics_record(req->hook->mid, AGOO_METRIC_EVAL, dtime() - start);
+    } else {
+	req->hook->func(req);
+    }
+}
+
+static agooText
+append_value(agooText t, const char *name, const char *labels, double value) {
+    char	buf[256];
+    int		cnt;
+
+    if (NULL == labels || '\0' == *labels) {
+	cnt = snprintf(buf, sizeof(buf), "%s %.15g\n", name, value);
+    } else {
+	cnt = snprintf(buf, sizeof(buf), "%s{%s} %.15g\n", name, labels, value);
+    }
+    return agoo_text_append(t, buf, cnt);
+}
+
+static agooText
+append_hist(agooText t, const char *name, const char *labels, agooHist h) {
+    char	buf[512];
+    uint64_t	total = 0;
+    int		cnt;
+    int		i;
+
+    for (i = 0; i < AGOO_HIST_BUCKETS - 1; i++) {
+	total += h->counts[i];
+	cnt = snprintf(buf, sizeof(buf), "%s_bucket{%s%sle=\"%g\"} %llu\n",
+		       name, labels, ('\0' == *labels) ? "" : ",", (double)(1L << i) / 1000000.0, (unsigned long long)total);
+	t = agoo_text_append(t, buf, cnt);
+    }
+    total += h->counts[i];
+    cnt = snprintf(buf, sizeof(buf), "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, ('\0' == *labels) ? "" : ",", (unsigned long long)total);
+    t = agoo_text_append(t, buf, cnt);
+    snprintf(buf, sizeof(buf), "%s_sum", name);
+    t = append_value(t, buf, labels, (double)h->sum / 1000000.0);
+    snprintf(buf, sizeof(buf), "%s_count", name);
+
+    return append_value(t, buf, labels, (double)total);
+}
+
+// Label values are escaped as the text format requires.
+static char*
+label_escape(char *b, const char *end, const char *s) {
+    for (; '\0' != *s && b < end - 1; s++) {
+	switch (*s) {
+	case '"':
+	case '\\':
+	    *b++ = '\\';
+	    *b++ = *s;
+	    break;
+	case '\n':
+	    *b++ = '\\';
+	    *b++ = 'n';
+	    break;
+	default:
+	    *b++ = *s;
+	    break;
+	}
+    }
+    return b;
+}
+
+static void
+name_label(char *buf, size_t size, const char *key, const char *name) {
+    char	*b = buf + snprintf(buf, size, "%s=\"", key);
+
+    b = label_escape(b, buf + size - 2, (NULL == name) ? "" : name);
+    *b++ = '"';
+    *b = '\0';
+}
+
+static int
+route_label(char *buf, size_t size, agooHook h) {
+    const char	*method;
+    char	*b;
+
+    if (NULL == h) {
+	return snprintf(buf, size, "route=\"\"");
+    }
+    switch (h->method) {
+    case AGOO_CONNECT:	method = "CONNECT";	break;
+    case AGOO_DELETE:	method = "DELETE";	break;
+    case AGOO_GET:	method = "GET";		break;
+    case AGOO_HEAD:	method = "HEAD";	break;
+    case AGOO_OPTIONS:	method = "OPTIONS";	break;
+    case AGOO_POST:	method = "POST";	break;
+    case AGOO_PUT:	method = "PUT";		break;
+    case AGOO_PATCH:	method = "PATCH";	break;
+    default:		method = "ALL";		break;
+    }
+    b = buf + snprintf(buf, size, "route=\"%s ", method);
+    b = label_escape(b, buf + size - 2, (NULL == h->pattern) ? "" : h->pattern);
+    *b++ = '"';
+    *b = '\0';
+
+    return (int)(b - buf);
+}
+
+static agooText
+append_type(agooText t, const char *name, const char *type, const char *help) {
+    char	buf[256];
+    int		cnt = snprintf(buf, sizeof(buf), "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+
+    return agoo_text_append(t, buf, cnt);
+}
+
+static agooText
+append_gauges(agooText t) {
+    struct _agooPageStats	ps;
+    struct _agooTextStats	ts;
+    struct _agooShedStats	ss;
+    struct _agooTlsStats	tls;
+    agooConLoop			loop;
+    agooUpgraded		up;
+    agooWorkers			w;
+    char			labels[256];
+    long			cnt = 0;
+
+    t = append_type(t, "agoo_connections", "gauge", "Open connections.");
+    t = append_value(t, "agoo_connections", NULL, (double)(long)atomic_load(&agoo_server.con_cnt));
+    t = append_type(t, "agoo_con_loops", "gauge", "Connection loop threads.");
+    t = append_value(t, "agoo_con_loops", NULL, (double)agoo_server.loop_cnt);
+
+    pthread_mutex_lock(&agoo_server.up_lock);
+    for (up = agoo_server.up_list; NULL != up; up = up->next) {
+	cnt++;
+    }
+    pthread_mutex_unlock(&agoo_server.up_lock);
+    t = append_type(t, "agoo_upgraded_connections", "gauge", "WebSocket and SSE connections.");
+    t = append_value(t, "agoo_upgraded_connections", NULL, (double)cnt);
+
+    t = append_type(t, "agoo_queue_depth", "gauge", "Items waiting in a queue.");
+    t = append_value(t, "agoo_queue_depth", "queue=\"eval\"", (double)agoo_queue_count(&agoo_server.eval_queue));
+    t = append_value(t, "agoo_queue_depth", "queue=\"con\"", (double)agoo_queue_count(&agoo_server.con_queue));
+    cnt = 0;
+    for (loop = agoo_server.con_loops; NULL != loop; loop = loop->next) {
+	cnt += agoo_queue_count(&loop->pub_queue);
+    }
+    t = append_value(t, "agoo_queue_depth", "queue=\"pub\"", (double)cnt);
+    for (w = agoo_server.workers; NULL != w; w = w->next) {
+	name_label(labels, sizeof(labels), "queue", w->name);
+	t = append_value(t, "agoo_queue_depth", labels, (double)agoo_queue_count(&w->queue));
+    }
+    if (NULL != agoo_server.workers) {
+	t = append_type(t, "agoo_workers_inflight", "gauge", "Requests queued or running in a worker pool.");
+	for (w = agoo_server.workers; NULL != w; w = w->next) {
+	    name_label(labels, sizeof(labels), "pool", w->name);
+	    t = append_value(t, "agoo_workers_inflight", labels, (double)(long)atomic_load(&w->inflight));
+	}
+	t = append_type(t, "agoo_workers_rejected_total", "counter", "Requests over the worker pool limit.");
+	for (w = agoo_server.workers; NULL != w; w = w->next) {
+	    name_label(labels, sizeof(labels), "pool", w->name);
+	    t = append_value(t, "agoo_workers_rejected_total", labels, (double)(long)atomic_load(&w->rejected));
+	}
+    }
+    agoo_shed_stats(&ss);
+    t = append_type(t, "agoo_shed_total", "counter", "Requests turned away when overloaded.");
+    t = append_value(t, "agoo_shed_total", "reason=\"full\"", (double)ss.full);
+    t = append_value(t, "agoo_shed_total", "reason=\"priority\"", (double)ss.priority);
+    t = append_value(t, "agoo_shed_total", "reason=\"expired\"", (double)ss.expired);
+
+    agoo_pages_stats(&ps);
+    t = append_type(t, "agoo_page_cache_bytes", "gauge", "Memory used by cached pages.");
+    t = append_value(t, "agoo_page_cache_bytes", NULL, (double)ps.mem);
+    t = append_type(t, "agoo_page_cache_pages", "gauge", "Cached pages.");
+    t = append_value(t, "agoo_page_cache_pages", NULL, (double)ps.count);
+    t = append_type(t, "agoo_page_cache_total", "counter", "Page cache lookups.");
+    t = append_value(t, "agoo_page_cache_total", "result=\"hit\"", (double)ps.hits);
+    t = append_value(t, "agoo_page_cache_total", "result=\"miss\"", (double)ps.misses);
+    t = append_value(t, "agoo_page_cache_total", "result=\"eviction\"", (double)ps.evictions);
+
+    agoo_text_stats(&ts);
+    t = append_type(t, "agoo_text_alloc_total", "counter", "Text allocations by where they came from.");
+    t = append_value(t, "agoo_text_alloc_total", "result=\"cache\"", (double)ts.hits);
+    t = append_value(t, "agoo_text_alloc_total", "result=\"heap\"", (double)ts.misses);
+
+    if (agoo_server.tls) {
+	agoo_server_tls_stats(&tls);
+	t = append_type(t, "agoo_tls_handshakes_total", "counter", "Completed TLS handshakes.");
+	t = append_value(t, "agoo_tls_handshakes_total", "kind=\"full\"", (double)tls.full);
+	t = append_value(t, "agoo_tls_handshakes_total", "kind=\"resumed\"", (double)tls.resumed);
+	t = append_type(t, "agoo_tls_ktls_total", "counter", "TLS connections using kernel TLS.");
+	t = append_value(t, "agoo_tls_ktls_total", NULL, (double)tls.ktls);
+    }
+    return t;
+}
+
+agooText
+agoo_metrics_dump(agooText t) {
+    struct _agooHist	accept;
+    agooHist		sums;
+    Block		b;
+    char		labels[512];
+    int			cnt;
+    int			r;
+    int			m;
+
+    t = append_gauges(t);
+
+    pthread_mutex_lock(&blocks_lock);
+    cnt = route_cnt;
+    if (NULL == (sums = (agooHist)AGOO_CALLOC(cnt * AGOO_METRIC_CNT, sizeof(struct _agooHist)))) {
+	pthread_mutex_unlock(&blocks_lock);
+	return t;
+    }
+    memset(&accept, 0, sizeof(accept));
+    for (b = blocks; NULL != b; b = b->next) {
+	hist_sum(&accept, &b->accept);
+	if (cnt == b->route_cnt) {
+	    for (r = cnt * AGOO_METRIC_CNT - 1; 0 <= r; r--) {
+		hist_sum(sums + r, b->hists + r);
+	    }
+	}
+    }
+    pthread_mutex_unlock(&blocks_lock);
+
+    t = append_type(t, "agoo_accept_seconds", "histogram", "Time from accept until the connection loop takes the connection.");
+    t = append_hist(t, "agoo_accept_seconds", "", &accept);
+    t = append_type(t, "agoo_request_seconds", "histogram", "Time spent in each stage of a request by route.");
+    for (r = 0; r < cnt; r++) {
+	int	len = route_label(labels, sizeof(labels) - 32, (NULL == routes) ? NULL : routes[r]);
+
+	for (m = 0; m < AGOO_METRIC_CNT; m++) {
+	    agooHist	h = sums + r * AGOO_METRIC_CNT + m;
+	    int		i;
+
+	    for (i = 0; i < AGOO_HIST_BUCKETS; i++) {
+		if (0 < h->counts[i]) {
+		    break;
+		}
+	    }
+	    // Stages a route never went through are left out.
+	    if (AGOO_HIST_BUCKETS <= i) {
+		continue;
+	    }
+	    snprintf(labels + len, sizeof(labels) - len, ",stage=\"%s\"", metric_names[m]);
+	    t = append_hist(t, "agoo_request_seconds", labels, h);
+	}
+    }
+    AGOO_FREE(sums);
+
+    return t;
+}
+
+void
+agoo_metrics_hook(agooReq req) {
+    char	buf[256];
+    int		cnt;
+    agooText	text = agoo_metrics_dump(agoo_text_allocate(16384));
+    agooText	head;
+
+    if (NULL == text) {
+	agoo_log_cat(&agoo_error_cat, "Failed to allocate memory for metrics.");
+	agoo_res_message_push(req->res, agoo_text_create(fail_msg, sizeof(fail_msg) - 1));
+	return;
+    }
+    cnt = snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %ld\r\n\r\n", text->len);
+    // The text is left as it was if the prepend fails.
+    if (NULL == (head = agoo_text_prepend(text, buf, cnt))) {
+	agoo_log_cat(&agoo_error_cat, "Failed to allocate memory for metrics.");
+	agoo_text_release(text);
+	agoo_res_message_push(req->res, agoo_text_create(fail_msg, sizeof(fail_msg) - 1));
+	return;
+    }
+    agoo_res_message_push(req->res, head);
+}
@@ -0,0 +1,51 @@
+// Copyright (c) 2018, Peter Ohler, All rights reserved.
+
+#ifndef AGOO_METRICS_H
+#define AGOO_METRICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "hook.h"
+#include "text.h"
+
+// Latencies are counted in buckets that double from 1 microsecond. The last
+// bucket holds everything over about 33 seconds.
+#define AGOO_HIST_BUCKETS	27
+
+typedef enum {
+    AGOO_METRIC_PARSE	= 0, // first byte read until dispatched
+    AGOO_METRIC_QUEUE,	     // waiting for an eval thread
+    AGOO_METRIC_EVAL,	     // in the hook function
+    AGOO_METRIC_WRITE,	     // response ready until the last byte is sent
+    AGOO_METRIC_CNT
+} agooMetric;
+
+typedef struct _agooHist {
+    uint64_t	counts[AGOO_HIST_BUCKETS];
+    uint64_t	sum; // microseconds
+} *agooHist;
+
+struct _agooReq;
+
+// Nothing is timed unless on. Counters are kept per thread so recording
+// needs no locks.
+extern bool	agoo_metrics_on;
+
+// Numbers the hooks. Called once the hooks are final when the server starts.
+extern int	agoo_metrics_start(agooErr err, agooHook hooks);
+extern void	agoo_metrics_cleanup();
+
+extern void	agoo_metrics_record(int route, agooMetric m, double secs);
+extern void	agoo_metrics_accept(double secs);
+
+// Calls the hook function of the request and records how long it took.
+extern void	agoo_metrics_call(struct _agooReq *req);
+
+// Appends everything in the Prometheus text format.
+extern agooText	agoo_metrics_dump(agooText t);
+
+// A hook function that responds with agoo_metrics_dump().
+extern void	agoo_metrics_hook(struct _agooReq *req);
+
+#endif // AGOO_METRICS_H
@@ -1,34 +1,69 @@
 // Copyright 2016, 2018 by Peter Ohler, All Rights Reserved
 
+#include <fcntl.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#ifdef Linux
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+
 #include "debug.h"
 #include "dtime.h"
+#include "http.h"
+#include "log.h"
 #include "page.h"
 
 #define PAGE_RECHECK_TIME	5.0
+// milliseconds
+#define WATCH_WAIT		500
+// Pages larger than this are sent from the file instead of memory.
+#define PAGE_FILE_MIN		(1024 * 1024)
+// Text pages this large or larger are gzipped on load.
+#define PAGE_COMPRESS_MIN	1024
+// Requests with more ranges than this get the full page.
+#define RANGE_MAX		16
+// Room for the ETag, Last-Modified, Content-Encoding, and Vary headers.
+#define EXTRA_HEAD_MAX		(AGOO_ETAG_MAX + AGOO_HTTP_DATE_LEN + 96)
 
 #define MAX_KEY_UNIQ		9
 #define MAX_KEY_LEN		1024
+// Initial size of the page tables. They double when the number of pages
+// exceeds the number of buckets.
 #define PAGE_BUCKET_SIZE	1024
-#define PAGE_BUCKET_MASK	1023
 
 #define MAX_MIME_KEY_LEN	15
 #define MIME_BUCKET_SIZE	64
 #define MIME_BUCKET_MASK	63
 
+struct _table;
+
 typedef struct _slot {
     struct _slot	*next;
+    struct _slot	*newer; // LRU links, immutable pages are not on the list
+    struct _slot	*older;
+    struct _table	*table;
     char		key[MAX_KEY_LEN + 1];
     agooPage		value;
     uint64_t		hash;
+    long		size; // bytes counted against the memory limit
     int			klen;
 } *Slot;
 
+typedef struct _table {
+    Slot		*buckets;
+    uint64_t		mask;
+    int			cnt;
+} *Table;
+
 typedef struct _headRule {
     struct _headRule	*next;
     char		*path;
@@ -46,13 +81,61 @@ typedef struct _mimeSlot {
     int			klen;
 } *MimeSlot;
 
+// A cache key for a page loaded from a file in a watched directory.
+typedef struct _watchKey {
+    struct _watchKey	*next;
+    struct _table	*table;
+    const char		*name; // file name in the directory, follows the key
+    int			klen;
+    char		key[1];
+} *WatchKey;
+
+// Each watched directory has the keys of the pages loaded from it so an
+// event only looks at those pages.
+typedef struct _watch {
+    struct _watch	*next;
+    char		*path;
+    WatchKey		keys;
+    int			wd;
+} *Watch;
+
+// A cached page to be reloaded after a file change.
+typedef struct _stale {
+    struct _stale	*next;
+    struct _table	*table;
+    agooPage		page;
+    int			klen;
+    char		key[1];
+} *Stale;
+
 typedef struct _cache {
-    Slot		buckets[PAGE_BUCKET_SIZE];
-    Slot		ruckets[PAGE_BUCKET_SIZE];
+    struct _table	pages; // keyed by request path or group file path
+    struct _table	roots; // keyed by full path for domain roots
     MimeSlot		muckets[MIME_BUCKET_SIZE];
     char		*root;
     agooGroup		groups;
     HeadRule		head_rules;
+    long		file_min;
+    long		compress_min;
+
+    // Least recently used pages are evicted when mem goes over max_mem.
+    Slot		newest;
+    Slot		oldest;
+    size_t		max_mem; // 0 for no limit
+    size_t		mem;
+    uint64_t		hits;
+    uint64_t		misses;
+    uint64_t		evictions;
+    pthread_mutex_t	lock;
+
+    // When watching, changes to files are picked up by the watch thread and
+    // cached pages are never checked on the request path.
+    volatile bool	watching;
+    bool		watch_started;
+    int			watch_fd;
+    Watch		watches;
+    pthread_mutex_t	watch_lock;
+    pthread_t		watch_thread;
 } *Cache;
 
 typedef struct _mime {
@@ -110,14 +193,36 @@ static struct _mime	mime_map[] = {
 
 static const char	page_fmt[] = "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %ld\r\n\r\n";
 static const char	page_min_fmt[] = "HTTP/1.1 200 OK\r\nContent-Length: %ld\r\n";
+static const char	unchanged_status[] = "HTTP/1.1 304 Not Modified\r\n";
+static const char	partial_status[] = "HTTP/1.1 206 Partial Content\r\n";
+static const char	unsatisfiable_fmt[] = "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Length: 0\r\nContent-Range: bytes */%ld\r\n\r\n";
+
+// Indexed by agooEncoding.
+static const char	*enc_names[AGOO_ENC_CNT] = { "br", "zstd", "gzip" };
+static const char	*enc_suffixes[AGOO_ENC_CNT] = { ".br", ".zst", ".gz" };
 
 static struct _cache	cache = {
-    .buckets = {0},
-    .ruckets = {0},
+    .pages = { .buckets = NULL, .mask = 0, .cnt = 0 },
+    .roots = { .buckets = NULL, .mask = 0, .cnt = 0 },
     .muckets = {0},
     .root = NULL,
     .groups = NULL,
     .head_rules = NULL,
+    .file_min = PAGE_FILE_MIN,
+    .compress_min = PAGE_COMPRESS_MIN,
+    .newest = NULL,
+    .oldest = NULL,
+    .max_mem = 0,
+    .mem = 0,
+    .hits = 0,
+    .misses = 0,
+    .evictions = 0,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .watching = false,
+    .watch_started = false,
+    .watch_fd = -1,
+    .watches = NULL,
+    .watch_lock = PTHREAD_MUTEX_INITIALIZER,
 };
 
 static uint64_t
@@ -148,13 +253,8 @@ calc_hash(const char *key, int *lenp) {
 
 // Buckets are a twist on the hash to mix it up a bit. Odd shifts and XORs.
 static Slot*
-get_bucketp(uint64_t h) {
-    return cache.buckets + (PAGE_BUCKET_MASK & (h ^ (h << 5) ^ (h >> 7)));
-}
-
-static Slot*
-get_rucketp(uint64_t h) {
-    return cache.ruckets + (PAGE_BUCKET_MASK & (h ^ (h << 5) ^ (h >> 7)));
+get_bucketp(Table t, uint64_t h) {
+    return t->buckets + (t->mask & (h ^ (h << 5) ^ (h >> 7)));
 }
 
 static MimeSlot*
@@ -181,40 +281,22 @@ mime_get(const char *key) {
     return v;
 }
 
-agooPage
-cache_get(const char *key, int klen) {
+static Slot
+table_get(Table t, const char *key, int klen) {
     int		len = klen;
     int64_t	h = calc_hash(key, &len);
-    Slot	*bucket = get_bucketp(h);
     Slot	s;
-    agooPage	v = NULL;
 
-    for (s = *bucket; NULL != s; s = s->next) {
-	if (h == (int64_t)s->hash && len == (int)s->klen &&
-	    ((0 <= len && len <= MAX_KEY_UNIQ) || 0 == strncmp(s->key, key, klen))) {
-	    v = s->value;
-	    break;
-	}
+    if (NULL == t->buckets) {
+	return NULL;
     }
-    return v;
-}
-
-agooPage
-cache_root_get(const char *key, int klen) {
-    int		len = klen;
-    int64_t	h = calc_hash(key, &len);
-    Slot	*bucket = get_rucketp(h);
-    Slot	s;
-    agooPage	v = NULL;
-
-    for (s = *bucket; NULL != s; s = s->next) {
+    for (s = *get_bucketp(t, h); NULL != s; s = s->next) {
 	if (h == (int64_t)s->hash && len == (int)s->klen &&
 	    ((0 <= len && len <= MAX_KEY_UNIQ) || 0 == strncmp(s->key, key, klen))) {
-	    v = s->value;
-	    break;
+	    return s;
 	}
     }
-    return v;
+    return NULL;
 }
 
 int
@@ -259,59 +341,201 @@ mime_set(agooErr err, const char *key, const char *value) {
     return AGOO_ERR_OK;
 }
 
-static agooPage
-bucket_set(Slot *bucket, int64_t h, const char *key, int klen, agooPage value) {
-    Slot	s;
-    agooPage	old = NULL;
-
-    if (MAX_KEY_LEN < klen) {
-	return value;
-    }
-    for (s = *bucket; NULL != s; s = s->next) {
-	if (h == (int64_t)s->hash && klen == s->klen &&
-	    ((0 <= klen && klen <= MAX_KEY_UNIQ) || 0 == strncmp(s->key, key, klen))) {
+static long
+slot_size(Slot s) {
+    long	size = (long)sizeof(struct _slot) + (long)sizeof(struct _agooPage);
 
-	    old = s->value;
-	    // replace
-	    s->value = value;
+    int		i;
 
-	    return old;
+    if (NULL != s->value->resp) {
+	size += s->value->resp->alen;
+    }
+    for (i = 0; i < AGOO_ENC_CNT; i++) {
+	if (NULL != s->value->encoded[i]) {
+	    size += s->value->encoded[i]->alen;
 	}
     }
-    if (NULL == (s = (Slot)AGOO_MALLOC(sizeof(struct _slot)))) {
-	return value;
+    for (i = 0; i <= AGOO_ENC_CNT; i++) {
+	if (NULL != s->value->unchanged[i]) {
+	    size += s->value->unchanged[i]->alen;
+	}
     }
-    s->hash = h;
-    s->klen = klen;
-    if (NULL == key) {
-	*s->key = '\0';
+    return size;
+}
+
+static void
+lru_unlink(Slot s) {
+    if (NULL == s->newer) {
+	cache.newest = s->older;
     } else {
-	strncpy(s->key, key, klen);
-	s->key[klen] = '\0';
+	s->newer->older = s->older;
     }
-    s->value = value;
-    s->next = *bucket;
-    *bucket = s;
+    if (NULL == s->older) {
+	cache.oldest = s->newer;
+    } else {
+	s->older->newer = s->newer;
+    }
+    s->newer = NULL;
+    s->older = NULL;
+}
+
+static void
+lru_push(Slot s) {
+    s->newer = NULL;
+    s->older = cache.newest;
+    if (NULL == cache.newest) {
+	cache.oldest = s;
+    } else {
+	cache.newest->newer = s;
+    }
+    cache.newest = s;
+}
 
-    return old;
+static void
+lru_touch(Slot s) {
+    if (!s->value->immutable && cache.newest != s) {
+	lru_unlink(s);
+	lru_push(s);
+    }
 }
 
-static agooPage
-cache_set(const char *key, int klen, agooPage value) {
-    int		len = klen;
-    int64_t	h = calc_hash(key, &len);
-    Slot	*bucket = get_bucketp(h);
+// Updates the memory use after the page content changes.
+static void
+slot_resize(Slot s) {
+    long	size = slot_size(s);
 
-    return bucket_set(bucket, h, key, len, value);
+    cache.mem += size - s->size;
+    s->size = size;
 }
 
-static agooPage
-cache_root_set(const char *key, int klen, agooPage value) {
+static void	agoo_page_destroy(agooPage p);
+
+static void
+page_ref(agooPage p) {
+    atomic_fetch_add(&p->ref_cnt, 1);
+}
+
+// Pages dropped from the cache stay around until the last lookup is done
+// with them.
+void
+agoo_page_release(agooPage p) {
+    if (1 >= atomic_fetch_sub(&p->ref_cnt, 1)) {
+	agoo_page_destroy(p);
+    }
+}
+
+static void
+slot_remove(Slot s) {
+    Slot	*bucket = get_bucketp(s->table, s->hash);
+
+    for (; NULL != *bucket; bucket = &(*bucket)->next) {
+	if (s == *bucket) {
+	    *bucket = s->next;
+	    break;
+	}
+    }
+    if (!s->value->immutable) {
+	lru_unlink(s);
+    }
+    s->table->cnt--;
+    cache.mem -= s->size;
+    agoo_page_release(s->value);
+    AGOO_FREE(s);
+}
+
+static void
+table_grow(Table t) {
+    uint64_t	size = (t->mask + 1) * 2;
+    Slot	*buckets = (Slot*)AGOO_CALLOC(size, sizeof(Slot));
+    Slot	*old = t->buckets;
+    Slot	s;
+    Slot	next;
+    uint64_t	i;
+
+    // If the allocation fails the chains just get longer.
+    if (NULL == buckets) {
+	return;
+    }
+    t->buckets = buckets;
+    t->mask = size - 1;
+    for (i = 0; i < size / 2; i++) {
+	for (s = old[i]; NULL != s; s = next) {
+	    Slot	*bucket = get_bucketp(t, s->hash);
+
+	    next = s->next;
+	    s->next = *bucket;
+	    *bucket = s;
+	}
+    }
+    AGOO_FREE(old);
+}
+
+// Drops the least recently used pages until the cache fits. The newest page
+// is never dropped.
+static void
+cache_evict() {
+    if (0 == cache.max_mem) {
+	return;
+    }
+    while (cache.max_mem < cache.mem && NULL != cache.oldest && cache.oldest != cache.newest) {
+	slot_remove(cache.oldest);
+	cache.evictions++;
+    }
+}
+
+// Adds or replaces a page. Must be called with the cache locked. The cache
+// takes its own reference to the page. If the key is too long the page is
+// not cached and false is returned.
+static bool
+table_set(Table t, const char *key, int klen, agooPage value) {
     int		len = klen;
     int64_t	h = calc_hash(key, &len);
-    Slot	*bucket = get_rucketp(h);
+    Slot	*bucket;
+    Slot	s;
+
+    if (MAX_KEY_LEN < klen) {
+	return false;
+    }
+    if (NULL == t->buckets) {
+	if (NULL == (t->buckets = (Slot*)AGOO_CALLOC(PAGE_BUCKET_SIZE, sizeof(Slot)))) {
+	    return false;
+	}
+	t->mask = PAGE_BUCKET_SIZE - 1;
+    }
+    page_ref(value);
+    if (NULL != (s = table_get(t, key, klen))) {
+	if (!s->value->immutable) {
+	    lru_unlink(s);
+	}
+	agoo_page_release(s->value);
+	s->value = value;
+    } else {
+	if (NULL == (s = (Slot)AGOO_MALLOC(sizeof(struct _slot)))) {
+	    agoo_page_release(value);
+	    return false;
+	}
+	s->table = t;
+	s->value = value;
+	s->hash = h;
+	s->klen = len;
+	s->size = 0;
+	strncpy(s->key, key, klen);
+	s->key[klen] = '\0';
+	bucket = get_bucketp(t, h);
+	s->next = *bucket;
+	*bucket = s;
+	t->cnt++;
+	if ((uint64_t)t->cnt > t->mask + 1) {
+	    table_grow(t);
+	}
+    }
+    if (!value->immutable) {
+	lru_push(s);
+    }
+    slot_resize(s);
+    cache_evict();
 
-    return bucket_set(bucket, h, key, len, value);
+    return true;
 }
 
 int
@@ -319,6 +543,11 @@ agoo_pages_init(agooErr err) {
     Mime	m;
 
     memset(&cache, 0, sizeof(struct _cache));
+    cache.file_min = PAGE_FILE_MIN;
+    cache.compress_min = PAGE_COMPRESS_MIN;
+    cache.watch_fd = -1;
+    pthread_mutex_init(&cache.lock, NULL);
+    pthread_mutex_init(&cache.watch_lock, NULL);
     if (NULL == (cache.root = AGOO_STRDUP("."))) {
 	return agoo_err_set(err, AGOO_ERR_ARG, "out of memory allocating root path");
     }
@@ -341,43 +570,115 @@ agoo_pages_set_root(agooErr err, const char *root) {
     return AGOO_ERR_OK;
 }
 
+void
+agoo_pages_set_file_min(long size) {
+    cache.file_min = size;
+}
+
+void
+agoo_pages_set_compress_min(long size) {
+    cache.compress_min = size;
+}
+
+void
+agoo_pages_set_max_mem(size_t size) {
+    pthread_mutex_lock(&cache.lock);
+    cache.max_mem = size;
+    cache_evict();
+    pthread_mutex_unlock(&cache.lock);
+}
+
+void
+agoo_pages_stats(agooPageStats stats) {
+    pthread_mutex_lock(&cache.lock);
+    stats->hits = cache.hits;
+    stats->misses = cache.misses;
+    stats->evictions = cache.evictions;
+    stats->mem = cache.mem;
+    stats->max_mem = cache.max_mem;
+    stats->count = cache.pages.cnt + cache.roots.cnt;
+    pthread_mutex_unlock(&cache.lock);
+}
+
 static void
 agoo_page_destroy(agooPage p) {
+    int	i;
+
     if (NULL != p->resp) {
 	agoo_text_release(p->resp);
 	p->resp = NULL;
     }
+    for (i = 0; i < AGOO_ENC_CNT; i++) {
+	if (NULL != p->encoded[i]) {
+	    agoo_text_release(p->encoded[i]);
+	    p->encoded[i] = NULL;
+	}
+    }
+    for (i = 0; i <= AGOO_ENC_CNT; i++) {
+	if (NULL != p->unchanged[i]) {
+	    agoo_text_release(p->unchanged[i]);
+	    p->unchanged[i] = NULL;
+	}
+    }
     AGOO_FREE(p->path);
     AGOO_FREE(p);
 }
 
-void
-agoo_pages_cleanup() {
-    Slot	*sp = cache.buckets;
+static void
+table_cleanup(Table t) {
     Slot	s;
     Slot	n;
+    uint64_t	i;
+
+    if (NULL == t->buckets) {
+	return;
+    }
+    for (i = 0; i <= t->mask; i++) {
+	for (s = t->buckets[i]; NULL != s; s = n) {
+	    n = s->next;
+	    agoo_page_release(s->value);
+	    AGOO_FREE(s);
+	}
+    }
+    AGOO_FREE(t->buckets);
+    t->buckets = NULL;
+    t->mask = 0;
+    t->cnt = 0;
+}
+
+void
+agoo_pages_cleanup() {
     MimeSlot	*mp = cache.muckets;
     MimeSlot	sm;
     MimeSlot	m;
     HeadRule	hr;
+    Watch	w;
     int		i;
 
-    for (i = PAGE_BUCKET_SIZE; 0 < i; i--, sp++) {
-	for (s = *sp; NULL != s; s = n) {
-	    n = s->next;
-	    agoo_page_destroy(s->value);
-	    AGOO_FREE(s);
-	}
-	*sp = NULL;
+    if (cache.watching) {
+	cache.watching = false;
+	pthread_join(cache.watch_thread, NULL);
     }
-    for (sp = cache.ruckets, i = PAGE_BUCKET_SIZE; 0 < i; i--, sp++) {
-	for (s = *sp; NULL != s; s = n) {
-	    n = s->next;
-	    agoo_page_destroy(s->value);
-	    AGOO_FREE(s);
-	}
-	*sp = NULL;
+    if (0 <= cache.watch_fd) {
+	close(cache.watch_fd);
+	cache.watch_fd = -1;
     }
+    while (NULL != (w = cache.watches)) {
+	WatchKey	k;
+
+	cache.watches = w->next;
+	while (NULL != (k = w->keys)) {
+	    w->keys = k->next;
+	    AGOO_FREE(k);
+	}
+	AGOO_FREE(w->path);
+	AGOO_FREE(w);
+    }
+    table_cleanup(&cache.pages);
+    table_cleanup(&cache.roots);
+    cache.newest = NULL;
+    cache.oldest = NULL;
+    cache.mem = 0;
     for (i = MIME_BUCKET_SIZE; 0 < i; i--, mp++) {
 	for (sm = *mp; NULL != sm; sm = m) {
 	    m = sm->next;
@@ -484,6 +785,10 @@ agoo_page_create(const char *path) {
 
     if (NULL != p) {
 	p->resp = NULL;
+	memset(p->encoded, 0, sizeof(p->encoded));
+	memset(p->unchanged, 0, sizeof(p->unchanged));
+	memset(p->etags, 0, sizeof(p->etags));
+	memset(p->modified, 0, sizeof(p->modified));
 	if (NULL == path) {
 	    p->path = NULL;
 	} else {
@@ -495,119 +800,775 @@ agoo_page_create(const char *path) {
 	p->mtime = 0;
 	p->last_check = 0.0;
 	p->immutable = false;
+	atomic_init(&p->ref_cnt, 1);
     }
     return p;
 }
 
-agooPage
-agoo_page_immutable(agooErr err, const char *path, const char *content, int clen) {
-    agooPage	p = (agooPage)AGOO_MALLOC(sizeof(struct _agooPage));
-    const char	*mime = path_mime(path);
-    char	*rel_path = NULL;
-    long	msize;
-    int		cnt;
-    int		plen = 0;
-    long	hlen = 0;
-    HeadRule	hr;
+int
+agoo_page_encoding(agooPage p, const char *accept, int alen) {
+    const char	*end;
+    int		best = AGOO_ENC_NONE;
+    int		i;
 
-    if (NULL == p) {
-	AGOO_ERR_MEM(err, "Page");
-	return NULL;
+    if (NULL == accept) {
+	return AGOO_ENC_NONE;
     }
-    if (NULL == path) {
-	p->path = NULL;
-    } else {
-	if (NULL == (p->path = AGOO_STRDUP(path))) {
-	    AGOO_FREE(p);
-	    return NULL;
-	}
-	plen = (int)strlen(path);
-	if (NULL != cache.root) {
-	    int	rlen = (int)strlen(cache.root);
+    // The coding with the most preferred available variant is used. Weights
+    // other than q=0 are not compared.
+    for (end = accept + alen; accept < end; accept++) {
+	const char	*name;
+	int		nlen;
+	bool		refused = false;
 
-	    if (0 == strncmp(cache.root, p->path, rlen) && '/' == p->path[rlen]) {
-		rel_path = p->path + rlen + 1;
-	    } else {
-		rel_path = NULL;
+	for (; accept < end && (' ' == *accept || '\t' == *accept || ',' == *accept); accept++) {
+	}
+	for (name = accept; accept < end && ',' != *accept && ';' != *accept && ' ' != *accept; accept++) {
+	}
+	nlen = (int)(accept - name);
+	for (; accept < end && ',' != *accept; accept++) {
+	    if ('q' == *accept && accept + 2 < end && '=' == accept[1]) {
+		refused = (0.0 == strtod(accept + 2, NULL));
+	    }
+	}
+	if (refused) {
+	    continue;
+	}
+	for (i = 0; i < best; i++) {
+	    if (NULL != p->encoded[i] &&
+		(int)strlen(enc_names[i]) == nlen && 0 == strncasecmp(enc_names[i], name, nlen)) {
+		best = i;
+		break;
 	    }
 	}
     }
-    p->mtime = 0;
-    p->last_check = 0.0;
-    p->immutable = true;
+    return best;
+}
 
-    if (NULL == mime) {
-	mime = "text/html";
-    }
-    if (0 == clen) {
-	clen = (int)strlen(content);
+agooText
+agoo_page_resp(agooPage p, int enc) {
+    if (AGOO_ENC_NONE == enc) {
+	return p->resp;
     }
-    for (hr = cache.head_rules; NULL != hr; hr = hr->next) {
-	if (head_rule_match(hr, rel_path, mime)) {
-	    hlen += hr->len;
-	}
+    return p->encoded[enc];
+}
+
+agooText
+agoo_page_not_modified(agooPage p, int enc, const char *inm, int inmlen, const char *ims, int imslen) {
+    if ((NULL == inm && NULL == ims) || NULL == p->unchanged[enc]) {
+	return NULL;
     }
-    // Format size plus space for the length, the mime type, and some
-    // padding. Then add the content length.
-    msize = sizeof(page_fmt) + 60 + clen;
-    if (NULL == (p->resp = agoo_text_allocate((int)msize))) {
-	AGOO_ERR_MEM(err, "Page content");
-	AGOO_FREE(p);
+    if (!agoo_http_not_modified(inm, inmlen, p->etags[enc], ims, imslen, p->modified[enc])) {
 	return NULL;
     }
-    if (0 < hlen) {
-	bool	has_ct;
+    return p->unchanged[enc];
+}
 
-	cnt = sprintf(p->resp->text, page_min_fmt, (long)clen); // HTTP/1.1 200 OK\r\nContent-Length: %ld\r\n
-	for (hr = cache.head_rules; NULL != hr; hr = hr->next) {
-	    if (head_rule_match(hr, rel_path, mime)) {
-		cnt += sprintf(p->resp->text + cnt, "%s: %s\r\n", hr->key, hr->value);
-		if (0 == strcasecmp("Content-Type", hr->key)) {
-		    has_ct = true;
-		}
+typedef struct _span {
+    long	start;
+    long	end; // inclusive
+} *Span;
+
+// Parses a Range value into spans that fit within size bytes. Returns the
+// number of spans or -1 if the value is not a bytes range set that can be
+// handled.
+static int
+range_parse(const char *range, int rlen, long size, Span spans) {
+    const char	*end = range + rlen;
+    int		cnt = 0;
+    bool	any = false;
+
+    if (rlen < 6 || 0 != strncasecmp("bytes=", range, 6)) {
+	return -1;
+    }
+    for (range += 6; range < end; range++) {
+	long	start = -1;
+	long	last = -1;
+
+	for (; range < end && (' ' == *range || '\t' == *range || ',' == *range); range++) {
+	}
+	if (end <= range) {
+	    break;
+	}
+	if ('0' <= *range && *range <= '9') {
+	    for (start = 0; range < end && '0' <= *range && *range <= '9'; range++) {
+		start = start * 10 + *range - '0';
 	    }
 	}
-	if (!has_ct) {
-	    cnt += sprintf(p->resp->text + cnt, "Content-Type: %s\r\n\r\n", mime);
-	} else {
-	    strcpy(p->resp->text + cnt, "\r\n");
-	    cnt += 2;
+	if (end <= range || '-' != *range) {
+	    return -1;
 	}
-    } else {
-	cnt = sprintf(p->resp->text, page_fmt, mime, (long)clen);
+	range++;
+	if (range < end && '0' <= *range && *range <= '9') {
+	    for (last = 0; range < end && '0' <= *range && *range <= '9'; range++) {
+		last = last * 10 + *range - '0';
+	    }
+	}
+	for (; range < end && (' ' == *range || '\t' == *range); range++) {
+	}
+	if (range < end && ',' != *range) {
+	    return -1;
+	}
+	any = true;
+	if (0 > start) { // suffix range of the last bytes
+	    if (0 >= last) {
+		continue;
+	    }
+	    start = (last < size) ? size - last : 0;
+	    last = size - 1;
+	} else if (0 <= last && last < start) {
+	    return -1;
+	} else if (0 > last || size <= last) {
+	    last = size - 1;
+	}
+	if (size <= start) {
+	    continue;
+	}
+	if (RANGE_MAX <= cnt) {
+	    return -1;
+	}
+	spans[cnt].start = start;
+	spans[cnt].end = last;
+	cnt++;
     }
-    msize = cnt + clen;
-    memcpy(p->resp->text + cnt, content, clen);
-    p->resp->text[msize] = '\0';
-    p->resp->len = msize;
-    agoo_text_ref(p->resp);
-
-    cache_set(path, plen, p);
-
-    return p;
+    return any ? cnt : -1;
 }
 
+// True if the If-Range value matches the representation. A strong
+// comparison is used for entity tags and dates must be exact.
 static bool
-close_return_false(FILE *f) {
-    fclose(f);
-    return false;
+if_range_match(agooPage p, int enc, const char *if_range, int irlen) {
+    if ('\0' == *p->etags[enc]) {
+	return false;
+    }
+    if ('"' == *if_range) {
+	return (int)strlen(p->etags[enc]) == irlen && 0 == strncmp(p->etags[enc], if_range, irlen);
+    }
+    return p->modified[enc] == agoo_http_date_parse(if_range, irlen);
 }
 
-static bool
-update_contents(agooPage p) {
-    const char	*mime = path_mime(p->path);
+// Creates a text with room for the header and len bytes of body that are
+// copied from body or, if body is NULL, sent from the file.
+static agooText
+part_text(const char *head, int hlen, const char *body, agooText src, long start, long len) {
+    agooText	t;
+
+    if (NULL == body) {
+	if (NULL == (t = agoo_text_allocate(hlen))) {
+	    return NULL;
+	}
+	if (0 > (t->fd = dup(src->fd))) {
+	    agoo_text_release(t);
+	    return NULL;
+	}
+	fcntl(t->fd, F_SETFD, FD_CLOEXEC);
+	t->foff = src->foff + start;
+	t->flen = len;
+	memcpy(t->text, head, hlen);
+	t->len = hlen;
+    } else {
+	if (NULL == (t = agoo_text_allocate((int)(hlen + len)))) {
+	    return NULL;
+	}
+	memcpy(t->text, head, hlen);
+	memcpy(t->text + hlen, body + start, len);
+	t->len = hlen + len;
+    }
+    t->text[t->len] = '\0';
+
+    return t;
+}
+
+// Writes the boundary and header of one part of a multipart/byteranges body.
+static int
+part_head(char *buf, int size, const char *boundary, const char *ct, int ctlen, Span span, long total) {
+    if (NULL == ct) {
+	return snprintf(buf, size, "\r\n--%s\r\nContent-Range: bytes %ld-%ld/%ld\r\n\r\n",
+			boundary, span->start, span->end, total);
+    }
+    return snprintf(buf, size, "\r\n--%s\r\nContent-Type: %.*s\r\nContent-Range: bytes %ld-%ld/%ld\r\n\r\n",
+		    boundary, ctlen, ct, span->start, span->end, total);
+}
+
+// Appends the header lines from head up to and including the blank line at
+// head_end, skipping Content-Length and optionally Content-Type. Returns the
+// new length or -1 if buf is too small.
+static int
+head_copy(char *buf, int size, int blen, const char *head, const char *head_end, bool skip_ct) {
+    const char	*line;
+    const char	*h;
+    int		len;
+
+    for (h = head; h <= head_end; h = line + 2) {
+	line = strstr(h, "\r\n");
+	if (0 == strncasecmp("Content-Length:", h, 15) || (skip_ct && 0 == strncasecmp("Content-Type:", h, 13))) {
+	    continue;
+	}
+	len = (int)(line + 2 - h);
+	if (size <= blen + len + 2) {
+	    return -1;
+	}
+	memcpy(buf + blen, h, len);
+	blen += len;
+    }
+    memcpy(buf + blen, "\r\n", 2);
+
+    return blen + 2;
+}
+
+static void
+chain_release(agooText t) {
+    agooText	next;
+
+    for (; NULL != t; t = next) {
+	next = t->next;
+	agoo_text_release(t);
+    }
+}
+
+agooText
+agoo_page_range(agooPage p, int enc, const char *range, int rlen, const char *if_range, int irlen) {
+    agooText		resp = agoo_page_resp(p, enc);
+    struct _span	spans[RANGE_MAX];
+    const char		*body = NULL;
+    const char		*head;
+    const char		*head_end;
+    const char		*ct = NULL;
+    int			ctlen = 0;
+    long		size;
+    int			cnt;
+    char		buf[1024];
+    int			blen;
+    agooText		t;
+
+    if (NULL == resp || (NULL != if_range && !if_range_match(p, enc, if_range, irlen))) {
+	return NULL;
+    }
+    if (NULL == (head_end = strstr(resp->text, "\r\n\r\n"))) {
+	return NULL;
+    }
+    if (0 <= resp->fd) {
+	size = resp->flen;
+    } else {
+	body = head_end + 4;
+	size = resp->len - (long)(body - resp->text);
+    }
+    if (0 > (cnt = range_parse(range, rlen, size, spans))) {
+	return NULL;
+    }
+    if (0 == cnt) {
+	if (NULL != (t = agoo_text_allocate(sizeof(unsatisfiable_fmt) + 24))) {
+	    t->len = snprintf(t->text, t->alen + 1, unsatisfiable_fmt, size);
+	}
+	return t;
+    }
+    // The status and content length lines are replaced and the rest of the
+    // header is kept. Multipart responses move the content type to each
+    // part.
+    head = strstr(resp->text, "\r\n") + 2;
+    if (1 == cnt) {
+	long	len = spans->end - spans->start + 1;
+
+	blen = snprintf(buf, sizeof(buf), "%sContent-Length: %ld\r\nContent-Range: bytes %ld-%ld/%ld\r\n",
+			partial_status, len, spans->start, spans->end, size);
+	if (0 > (blen = head_copy(buf, sizeof(buf), blen, head, head_end, false))) {
+	    return NULL;
+	}
+	return part_text(buf, blen, body, resp, spans->start, len);
+    } else {
+	static atomic_int	boundary_cnt = 0;
+	char			boundary[32];
+	char			phead[256];
+	const char		*h;
+	const char		*line;
+	agooText		first = NULL;
+	agooText		last = NULL;
+	long			total = 0;
+	int			bdlen;
+	int			plen;
+	int			i;
+
+	bdlen = sprintf(boundary, "agoo%08x%06x",
+			(unsigned int)time(NULL), (unsigned int)atomic_fetch_add(&boundary_cnt, 1) & 0xFFFFFF);
+	for (h = head; h < head_end; h = line + 2) {
+	    line = strstr(h, "\r\n");
+	    if (0 == strncasecmp("Content-Type:", h, 13)) {
+		for (ct = h + 13; ' ' == *ct; ct++) {
+		}
+		ctlen = (int)(line - ct);
+		break;
+	    }
+	}
+	for (i = 0; i < cnt; i++) {
+	    if ((int)sizeof(phead) <= (plen = part_head(phead, sizeof(phead), boundary, ct, ctlen, spans + i, size))) {
+		return NULL;
+	    }
+	    total += plen + spans[i].end - spans[i].start + 1;
+	}
+	total += bdlen + 8;
+	blen = snprintf(buf, sizeof(buf), "%sContent-Length: %ld\r\nContent-Type: multipart/byteranges; boundary=%s\r\n",
+			partial_status, total, boundary);
+	if (0 > (blen = head_copy(buf, sizeof(buf), blen, head, head_end, true))) {
+	    return NULL;
+	}
+	if (NULL != body) {
+	    // Memory bodies go in one text.
+	    if (NULL == (t = agoo_text_allocate((int)(blen + total)))) {
+		return NULL;
+	    }
+	    memcpy(t->text, buf, blen);
+	    t->len = blen;
+	    for (i = 0; i < cnt; i++) {
+		long	len = spans[i].end - spans[i].start + 1;
+
+		plen = part_head(t->text + t->len, (int)(t->alen - t->len), boundary, ct, ctlen, spans + i, size);
+		t->len += plen;
+		memcpy(t->text + t->len, body + spans[i].start, len);
+		t->len += len;
+	    }
+	    t->len += snprintf(t->text + t->len, t->alen - t->len + 1, "\r\n--%s--\r\n", boundary);
+
+	    return t;
+	}
+	// File bodies need a text for each part so each can be sent from the
+	// file.
+	for (i = 0; i < cnt; i++) {
+	    plen = part_head(phead, sizeof(phead), boundary, ct, ctlen, spans + i, size);
+	    if (0 == i) {
+		if ((int)sizeof(buf) <= blen + plen) {
+		    return NULL;
+		}
+		memcpy(buf + blen, phead, plen);
+		t = part_text(buf, blen + plen, NULL, resp, spans[i].start, spans[i].end - spans[i].start + 1);
+	    } else {
+		t = part_text(phead, plen, NULL, resp, spans[i].start, spans[i].end - spans[i].start + 1);
+	    }
+	    if (NULL == t) {
+		chain_release(first);
+		return NULL;
+	    }
+	    if (NULL == first) {
+		first = t;
+	    } else {
+		last->next = t;
+	    }
+	    last = t;
+	}
+	plen = snprintf(phead, sizeof(phead), "\r\n--%s--\r\n", boundary);
+	if (NULL == (last->next = agoo_text_create(phead, plen))) {
+	    chain_release(first);
+	    return NULL;
+	}
+	return first;
+    }
+}
+
+agooPage
+agoo_page_immutable(agooErr err, const char *path, const char *content, int clen) {
+    agooPage	p = (agooPage)AGOO_MALLOC(sizeof(struct _agooPage));
+    const char	*mime = path_mime(path);
+    char	*rel_path = NULL;
+    long	msize;
+    int		cnt;
+    int		plen = 0;
+    long	hlen = 0;
+    HeadRule	hr;
+    bool	cached;
+
+    if (NULL == p) {
+	AGOO_ERR_MEM(err, "Page");
+	return NULL;
+    }
+    memset(p->encoded, 0, sizeof(p->encoded));
+    memset(p->unchanged, 0, sizeof(p->unchanged));
+    memset(p->etags, 0, sizeof(p->etags));
+    memset(p->modified, 0, sizeof(p->modified));
+    if (NULL == path) {
+	p->path = NULL;
+    } else {
+	if (NULL == (p->path = AGOO_STRDUP(path))) {
+	    AGOO_FREE(p);
+	    return NULL;
+	}
+	plen = (int)strlen(path);
+	if (NULL != cache.root) {
+	    int	rlen = (int)strlen(cache.root);
+
+	    if (0 == strncmp(cache.root, p->path, rlen) && '/' == p->path[rlen]) {
+		rel_path = p->path + rlen + 1;
+	    } else {
+		rel_path = NULL;
+	    }
+	}
+    }
+    p->mtime = 0;
+    p->last_check = 0.0;
+    p->immutable = true;
+    atomic_init(&p->ref_cnt, 1);
+
+    if (NULL == mime) {
+	mime = "text/html";
+    }
+    if (0 == clen) {
+	clen = (int)strlen(content);
+    }
+    for (hr = cache.head_rules; NULL != hr; hr = hr->next) {
+	if (head_rule_match(hr, rel_path, mime)) {
+	    hlen += hr->len;
+	}
+    }
+    // Format size plus space for the length, the mime type, and some
+    // padding. Then add the content length.
+    msize = sizeof(page_fmt) + 60 + clen;
+    if (NULL == (p->resp = agoo_text_allocate((int)msize))) {
+	AGOO_ERR_MEM(err, "Page content");
+	AGOO_FREE(p);
+	return NULL;
+    }
+    if (0 < hlen) {
+	bool	has_ct;
+
+	cnt = sprintf(p->resp->text, page_min_fmt, (long)clen); // HTTP/1.1 200 OK\r\nContent-Length: %ld\r\n
+	for (hr = cache.head_rules; NULL != hr; hr = hr->next) {
+	    if (head_rule_match(hr, rel_path, mime)) {
+		cnt += sprintf(p->resp->text + cnt, "%s: %s\r\n", hr->key, hr->value);
+		if (0 == strcasecmp("Content-Type", hr->key)) {
+		    has_ct = true;
+		}
+	    }
+	}
+	if (!has_ct) {
+	    cnt += sprintf(p->resp->text + cnt, "Content-Type: %s\r\n\r\n", mime);
+	} else {
+	    strcpy(p->resp->text + cnt, "\r\n");
+	    cnt += 2;
+	}
+    } else {
+	cnt = sprintf(p->resp->text, page_fmt, mime, (long)clen);
+    }
+    msize = cnt + clen;
+    memcpy(p->resp->text + cnt, content, clen);
+    p->resp->text[msize] = '\0';
+    p->resp->len = msize;
+    agoo_text_ref(p->resp);
+
+    pthread_mutex_lock(&cache.lock);
+    cached = table_set(&cache.pages, path, plen, p);
+    pthread_mutex_unlock(&cache.lock);
+
+    // Only the cache holds the page from here on.
+    agoo_page_release(p);
+    if (!cached) {
+	agoo_err_set(err, AGOO_ERR_ARG, "page path %s is too long", path);
+	return NULL;
+    }
+    return p;
+}
+
+// Watches the directory of a file or a directory if the path ends with a
+// '/'. If t is not NULL the key of the page loaded from the file is added to
+// the keys of the directory.
+static void
+watch_add(const char *path, struct _table *t, const char *key, int klen) {
+#ifdef Linux
+    const char	*end = strrchr(path, '/');
+    const char	*name = (NULL == end) ? path : end + 1;
+    char	dir[1024];
+    int		len;
+    int		wd;
+    Watch	w;
+    WatchKey	k;
+
+    if (NULL == end) {
+	strcpy(dir, ".");
+	len = 1;
+    } else if ((int)sizeof(dir) <= (len = (int)(end - path))) {
+	return;
+    } else {
+	if (0 == len) {
+	    len = 1; // the root directory
+	}
+	strncpy(dir, path, len);
+	dir[len] = '\0';
+    }
+    if (0 > (wd = inotify_add_watch(cache.watch_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE))) {
+	return;
+    }
+    pthread_mutex_lock(&cache.watch_lock);
+    for (w = cache.watches; NULL != w; w = w->next) {
+	if (wd == w->wd) {
+	    break;
+	}
+    }
+    if (NULL == w && NULL != (w = (Watch)AGOO_MALLOC(sizeof(struct _watch)))) {
+	if (NULL == (w->path = AGOO_STRDUP(dir))) {
+	    AGOO_FREE(w);
+	    w = NULL;
+	} else {
+	    w->wd = wd;
+	    w->keys = NULL;
+	    w->next = cache.watches;
+	    cache.watches = w;
+	}
+    }
+    if (NULL != w && NULL != t && '\0' != *name) {
+	for (k = w->keys; NULL != k; k = k->next) {
+	    if (t == k->table && klen == k->klen && 0 == strncmp(key, k->key, klen)) {
+		break;
+	    }
+	}
+	if (NULL == k && NULL != (k = (WatchKey)AGOO_MALLOC(sizeof(struct _watchKey) + klen + strlen(name) + 1))) {
+	    k->table = t;
+	    k->klen = klen;
+	    memcpy(k->key, key, klen);
+	    k->key[klen] = '\0';
+	    k->name = k->key + klen + 1;
+	    strcpy(k->key + klen + 1, name);
+	    k->next = w->keys;
+	    w->keys = k;
+	}
+    }
+    pthread_mutex_unlock(&cache.watch_lock);
+#endif
+}
+
+static bool
+close_return_false(FILE *f) {
+    fclose(f);
+    return false;
+}
+
+// Sets the strong entity tag of a file representation from the file
+// modification time and size.
+static void
+etag_set(char *etag, struct stat *fs, const char *enc) {
+    if (NULL == enc) {
+	snprintf(etag, AGOO_ETAG_MAX, "\"%lx-%lx\"", (unsigned long)fs->st_mtime, (unsigned long)fs->st_size);
+    } else {
+	snprintf(etag, AGOO_ETAG_MAX, "\"%lx-%lx-%s\"", (unsigned long)fs->st_mtime, (unsigned long)fs->st_size, enc);
+    }
+}
+
+// Writes the header lines that depend on the representation.
+static int
+rep_head(char *text, const char *etag, time_t mtime, const char *enc, bool vary) {
+    int	cnt = sprintf(text, "ETag: %s\r\nLast-Modified: ", etag);
+
+    cnt += agoo_http_date(text + cnt, mtime);
+    strcpy(text + cnt, "\r\n");
+    cnt += 2;
+    if (NULL != enc) {
+	cnt += sprintf(text + cnt, "Content-Encoding: %s\r\n", enc);
+    }
+    if (vary) {
+	cnt += sprintf(text + cnt, "Vary: Accept-Encoding\r\n");
+    }
+    return cnt;
+}
+
+// Writes the response header for a body of size bytes and returns the
+// header length. The encoding is NULL for the unencoded body.
+static int
+page_head(char *text, const char *mime, const char *rel_path, long size,
+	  const char *enc, bool vary, const char *etag, time_t mtime) {
+    HeadRule	hr;
+    bool	has_ct = false;
+    int		cnt;
+
+    cnt = sprintf(text, page_min_fmt, size); // HTTP/1.1 200 OK\r\nContent-Length: %ld\r\n
+    for (hr = cache.head_rules; NULL != hr; hr = hr->next) {
+	if (head_rule_match(hr, rel_path, mime)) {
+	    cnt += sprintf(text + cnt, "%s: %s\r\n", hr->key, hr->value);
+	    if (0 == strcasecmp("Content-Type", hr->key)) {
+		has_ct = true;
+	    }
+	}
+    }
+    cnt += rep_head(text + cnt, etag, mtime, enc, vary);
+    strcpy(text + cnt, "Accept-Ranges: bytes\r\n");
+    cnt += 22;
+    if (!has_ct) {
+	cnt += sprintf(text + cnt, "Content-Type: %s\r\n\r\n", mime);
+    } else {
+	strcpy(text + cnt, "\r\n");
+	cnt += 2;
+    }
+    return cnt;
+}
+
+// Creates the 304 response for a representation. Header rules other than
+// the content type are included as they would be in the full response.
+static agooText
+unchanged_text(const char *mime, const char *rel_path, long hlen, bool vary, const char *etag, time_t mtime) {
+    agooText	t;
+    HeadRule	hr;
+    int		cnt;
+
+    if (NULL == (t = agoo_text_allocate((int)(sizeof(unchanged_status) + hlen + EXTRA_HEAD_MAX)))) {
+	return NULL;
+    }
+    strcpy(t->text, unchanged_status);
+    cnt = sizeof(unchanged_status) - 1;
+    for (hr = cache.head_rules; NULL != hr; hr = hr->next) {
+	if (head_rule_match(hr, rel_path, mime) && 0 != strcasecmp("Content-Type", hr->key)) {
+	    cnt += sprintf(t->text + cnt, "%s: %s\r\n", hr->key, hr->value);
+	}
+    }
+    cnt += rep_head(t->text + cnt, etag, mtime, NULL, vary);
+    strcpy(t->text + cnt, "\r\n");
+    t->len = cnt + 2;
+
+    return t;
+}
+
+// Creates a response from the file. Large files are not read. Only the
+// header is kept and the body is sent from the file.
+static agooText
+file_text(FILE *f, const char *mime, const char *rel_path, long hlen,
+	  const char *enc, bool vary, const char *etag, time_t mtime) {
+    agooText	t;
+    long	size;
+    long	fsize = 0;
+    long	msize;
+    int		cnt;
+
+    if (0 != fseek(f, 0, SEEK_END) || 0 > (size = ftell(f))) {
+	return NULL;
+    }
+    rewind(f);
+    if (0 < cache.file_min && cache.file_min < size) {
+	fsize = size;
+	size = 0;
+    }
+    // Format size plus space for the length, the mime type, and some
+    // padding. Then add the header rules and encoding headers.
+    msize = sizeof(page_fmt) + 60 + size + hlen + EXTRA_HEAD_MAX;
+    if (NULL == (t = agoo_text_allocate((int)msize))) {
+	return NULL;
+    }
+    cnt = page_head(t->text, mime, rel_path, size + fsize, enc, vary, etag, mtime);
+    msize = cnt + size;
+    if (0 < size) {
+	if (size != (long)fread(t->text + cnt, 1, size, f)) {
+	    agoo_text_release(t);
+	    return NULL;
+	}
+    }
+    if (0 < fsize) {
+	// The fd stays open until the last response that uses the text is
+	// done with it, even if the page is reloaded before then.
+	if (0 > (t->fd = dup(fileno(f)))) {
+	    agoo_text_release(t);
+	    return NULL;
+	}
+	fcntl(t->fd, F_SETFD, FD_CLOEXEC);
+	t->flen = fsize;
+    }
+    t->text[msize] = '\0';
+    t->len = msize;
+
+    return t;
+}
+
+#ifdef HAVE_ZLIB_H
+static bool
+compressible(const char *mime) {
+    return (0 == strncmp("text/", mime, 5) ||
+	    NULL != strstr(mime, "javascript") ||
+	    NULL != strstr(mime, "json") ||
+	    NULL != strstr(mime, "xml"));
+}
+
+// Gzips the body of an unencoded response. Returns NULL if compressing
+// does not save at least a tenth of the size.
+static agooText
+gzip_text(agooText plain, const char *mime, const char *rel_path, long hlen, const char *etag, time_t mtime) {
+    const char	*body = strstr(plain->text, "\r\n\r\n") + 4;
+    long	size = plain->len - (long)(body - plain->text);
+    z_stream	zs;
+    agooText	t;
+    char	*buf;
+    long	zlen;
+    int		cnt;
+
+    memset(&zs, 0, sizeof(zs));
+    // 16 added to the window bits selects the gzip wrapper.
+    if (Z_OK != deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY)) {
+	return NULL;
+    }
+    zlen = (long)deflateBound(&zs, (uLong)size);
+    if (NULL == (buf = (char*)AGOO_MALLOC(zlen))) {
+	deflateEnd(&zs);
+	return NULL;
+    }
+    zs.next_in = (Bytef*)body;
+    zs.avail_in = (uInt)size;
+    zs.next_out = (Bytef*)buf;
+    zs.avail_out = (uInt)zlen;
+    if (Z_STREAM_END != deflate(&zs, Z_FINISH)) {
+	deflateEnd(&zs);
+	AGOO_FREE(buf);
+	return NULL;
+    }
+    zlen = (long)zs.total_out;
+    deflateEnd(&zs);
+    if (size - size / 10 < zlen ||
+	NULL == (t = agoo_text_allocate((int)(sizeof(page_fmt) + 60 + zlen + hlen + EXTRA_HEAD_MAX)))) {
+	AGOO_FREE(buf);
+	return NULL;
+    }
+    cnt = page_head(t->text, mime, rel_path, zlen, enc_names[AGOO_ENC_GZIP], true, etag, mtime);
+    memcpy(t->text + cnt, buf, zlen);
+    AGOO_FREE(buf);
+    t->len = cnt + zlen;
+    t->text[t->len] = '\0';
+
+    return t;
+}
+#endif
+
+// Opens a precompressed file next to the page file. Variants older than the
+// page file are ignored so a stale variant is never sent.
+static FILE*
+variant_open(const char *path, const char *suffix, struct stat *ps, struct stat *vs) {
+    char	vpath[1024];
+    FILE	*f;
+
+    if ((int)sizeof(vpath) <= snprintf(vpath, sizeof(vpath), "%s%s", path, suffix) ||
+	NULL == (f = fopen(vpath, "rb"))) {
+	return NULL;
+    }
+    if (0 != fstat(fileno(f), vs) || !S_ISREG(vs->st_mode) || vs->st_mtime < ps->st_mtime) {
+	fclose(f);
+	return NULL;
+    }
+    return f;
+}
+
+// Loads the page from its file. If file is not NULL it is set to the path of
+// the file read which is the index.html for a directory.
+static bool
+update_contents(agooPage p, char *file) {
+    const char	*mime = path_mime(p->path);
     char	path[1024];
     char	*rel_path = NULL;
     int		plen = (int)strlen(p->path);
-    long	size;
     struct stat	fattr;
-    long	msize;
     long	hlen = 0;
-    int		cnt;
     struct stat	fs;
+    struct stat	vs;
     agooText	t;
+    agooText	encoded[AGOO_ENC_CNT];
+    char	etags[AGOO_ENC_CNT + 1][AGOO_ETAG_MAX];
+    time_t	mtimes[AGOO_ENC_CNT + 1];
     FILE	*f = fopen(p->path, "rb");
+    FILE	*vf;
     HeadRule	hr;
+    bool	vary = false;
+#ifdef HAVE_ZLIB_H
+    bool	zip = false;
+#endif
+    int		i;
 
     strncpy(path, p->path, sizeof(path));
     path[sizeof(path) - 1] = '\0';
@@ -640,6 +1601,9 @@ update_contents(agooPage p) {
 	    if (NULL == (f = fopen(path, "rb"))) {
 		return false;
 	    }
+	    if (0 != fstat(fileno(f), &fs)) {
+		return close_return_false(f);
+	    }
 	    mime = "text/html";
 	} else {
 	    return false;
@@ -648,14 +1612,6 @@ update_contents(agooPage p) {
     if (NULL == mime) {
 	mime = "text/html";
     }
-    if (0 != fseek(f, 0, SEEK_END)) {
-	return close_return_false(f);
-    }
-    if (0 > (size = ftell(f))) {
-	return close_return_false(f);
-    }
-    rewind(f);
-
     if (NULL != cache.root) {
 	int	rlen = (int)strlen(cache.root);
 
@@ -668,43 +1624,47 @@ update_contents(agooPage p) {
 	    hlen += hr->len;
 	}
     }
-    // Format size plus space for the length, the mime type, and some
-    // padding. Then add the header rule and content length.
-    msize = sizeof(page_fmt) + 60 + size + hlen;
-    if (NULL == (t = agoo_text_allocate((int)msize))) {
-	return close_return_false(f);
-    }
-    if (0 < hlen) {
-	bool	has_ct = false;
-
-	cnt = sprintf(t->text, page_min_fmt, size); // HTTP/1.1 200 OK\r\nContent-Length: %ld\r\n
-	for (hr = cache.head_rules; NULL != hr; hr = hr->next) {
-	    if (head_rule_match(hr, rel_path, mime)) {
-		cnt += sprintf(t->text + cnt, "%s: %s\r\n", hr->key, hr->value);
-		if (0 == strcasecmp("Content-Type", hr->key)) {
-		    has_ct = true;
-		}
+    for (i = 0; i < AGOO_ENC_CNT; i++) {
+	encoded[i] = NULL;
+	if (NULL != (vf = variant_open(path, enc_suffixes[i], &fs, &vs))) {
+	    etag_set(etags[i], &vs, enc_names[i]);
+	    mtimes[i] = vs.st_mtime;
+	    encoded[i] = file_text(vf, mime, rel_path, hlen, enc_names[i], true, etags[i], mtimes[i]);
+	    fclose(vf);
+	    if (NULL != encoded[i]) {
+		vary = true;
 	    }
 	}
-	if (!has_ct) {
-	    cnt += sprintf(t->text + cnt, "Content-Type: %s\r\n\r\n", mime);
-	} else {
-	    strcpy(t->text + cnt, "\r\n");
-	    cnt += 2;
-	}
-    } else {
-	cnt = sprintf(t->text, page_fmt, mime, size);
     }
-    msize = cnt + size;
-    if (0 < size) {
-	if (size != (long)fread(t->text + cnt, 1, size, f)) {
-	    agoo_text_release(t);
-	    return close_return_false(f);
+#ifdef HAVE_ZLIB_H
+    // Without a .gz file, text pages are compressed once read.
+    if (NULL == encoded[AGOO_ENC_GZIP] && 0 < cache.compress_min && cache.compress_min <= fs.st_size &&
+	(cache.file_min <= 0 || fs.st_size <= cache.file_min) && compressible(mime)) {
+	zip = true;
+	vary = true;
+    }
+#endif
+    etag_set(etags[AGOO_ENC_NONE], &fs, NULL);
+    mtimes[AGOO_ENC_NONE] = fs.st_mtime;
+    if (NULL == (t = file_text(f, mime, rel_path, hlen, NULL, vary, etags[AGOO_ENC_NONE], mtimes[AGOO_ENC_NONE]))) {
+	for (i = 0; i < AGOO_ENC_CNT; i++) {
+	    if (NULL != encoded[i]) {
+		agoo_text_release(encoded[i]);
+	    }
 	}
+	return close_return_false(f);
     }
     fclose(f);
-    t->text[msize] = '\0';
-    t->len = msize;
+#ifdef HAVE_ZLIB_H
+    if (zip && 0 > t->fd) {
+	etag_set(etags[AGOO_ENC_GZIP], &fs, enc_names[AGOO_ENC_GZIP]);
+	mtimes[AGOO_ENC_GZIP] = fs.st_mtime;
+	encoded[AGOO_ENC_GZIP] = gzip_text(t, mime, rel_path, hlen, etags[AGOO_ENC_GZIP], mtimes[AGOO_ENC_GZIP]);
+    }
+#endif
+    if (NULL != file) {
+	strcpy(file, path);
+    }
     if (0 == stat(p->path, &fattr)) {
 	p->mtime = fattr.st_mtime;
     } else {
@@ -716,56 +1676,320 @@ update_contents(agooPage p) {
     }
     p->resp = t;
     agoo_text_ref(p->resp);
+    for (i = 0; i < AGOO_ENC_CNT; i++) {
+	if (NULL != p->encoded[i]) {
+	    agoo_text_release(p->encoded[i]);
+	}
+	if (NULL != (p->encoded[i] = encoded[i])) {
+	    agoo_text_ref(encoded[i]);
+	}
+    }
+    for (i = 0; i <= AGOO_ENC_CNT; i++) {
+	if (NULL != p->unchanged[i]) {
+	    agoo_text_release(p->unchanged[i]);
+	    p->unchanged[i] = NULL;
+	}
+	*p->etags[i] = '\0';
+	if ((AGOO_ENC_NONE == i || NULL != encoded[i]) &&
+	    NULL != (p->unchanged[i] = unchanged_text(mime, rel_path, hlen, vary, etags[i], mtimes[i]))) {
+	    agoo_text_ref(p->unchanged[i]);
+	    strcpy(p->etags[i], etags[i]);
+	    p->modified[i] = mtimes[i];
+	}
+    }
     p->last_check = dtime();
 
     return true;
 }
 
+// Called with the cache locked. Replaces the old page for the key with page
+// or drops it if page is NULL. Nothing is done if the key no longer holds the
+// old page since whatever replaced it is newer.
 static void
-agoo_page_remove(agooPage p) {
-    int		len = (int)strlen(p->path);
-    int64_t	h = calc_hash(p->path, &len);
-    Slot	*bucket = get_bucketp(h);
+page_swap(Table t, const char *key, int klen, agooPage old, agooPage page) {
     Slot	s;
-    Slot	prev = NULL;
 
-    for (s = *bucket; NULL != s; s = s->next) {
-	if (h == (int64_t)s->hash && len == (int)s->klen &&
-	    ((0 <= len && len <= MAX_KEY_UNIQ) || 0 == strncmp(s->key, p->path, len))) {
+    if (NULL != (s = table_get(t, key, klen)) && old == s->value) {
+	if (NULL == page) {
+	    slot_remove(s);
+	} else {
+	    table_set(t, key, klen, page);
+	}
+    }
+}
 
-	    if (NULL == prev) {
-		*bucket = s->next;
-	    } else {
-		prev->next = s->next;
+// Builds a new page from the file of the old one without holding the lock
+// and swaps it in. The reference to old is given up. Returns the new page
+// with a reference or NULL if the file is gone.
+static agooPage
+page_reload(agooErr err, Table t, const char *key, int klen, agooPage old) {
+    agooPage	page;
+
+    if (NULL != (page = agoo_page_create(old->path)) && !update_contents(page, NULL)) {
+	agoo_page_release(page);
+	page = NULL;
+    }
+    pthread_mutex_lock(&cache.lock);
+    page_swap(t, key, klen, old, page);
+    pthread_mutex_unlock(&cache.lock);
+    agoo_page_release(old);
+    if (NULL == page) {
+	agoo_err_set(err, AGOO_ERR_NOT_FOUND, "not found.");
+    }
+    return page;
+}
+
+// Returns the page for the key if cached with a reference for the caller.
+// Without a watcher the file is checked now and then and the page reloaded
+// if it changed. Only the first lookup after the check time does the stat
+// and reload. Others get the current page meanwhile.
+static agooPage
+cache_lookup(agooErr err, Table t, const char *key, int klen) {
+    agooPage	page = NULL;
+    bool	check = false;
+    Slot	s;
+
+    pthread_mutex_lock(&cache.lock);
+    if (NULL != (s = table_get(t, key, klen))) {
+	page = s->value;
+	cache.hits++;
+	lru_touch(s);
+	if (!page->immutable && !cache.watching) {
+	    double	now = dtime();
+
+	    if (page->last_check + PAGE_RECHECK_TIME < now) {
+		page->last_check = now;
+		check = true;
 	    }
-	    agoo_page_destroy(s->value);
-	    AGOO_FREE(s);
+	}
+	page_ref(page);
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    if (check) {
+	struct stat	fattr;
+
+	if (0 != stat(page->path, &fattr) || page->mtime != fattr.st_mtime) {
+	    page = page_reload(err, t, key, klen, page);
+	}
+    }
+    return page;
+}
+
+#ifdef Linux
+// True if the page was loaded from the file at path. Directory pages are
+// loaded from the index.html in the directory.
+static bool
+page_matches(agooPage p, const char *path, int dlen) {
+    int	len = (int)strlen(path);
+    int	plen;
+    int	i;
 
+    if (NULL == p->path || p->immutable) {
+	return false;
+    }
+    // A change to a precompressed variant refreshes the page as well.
+    for (i = 0; i < AGOO_ENC_CNT; i++) {
+	int	slen = (int)strlen(enc_suffixes[i]);
+
+	if (slen < len && 0 == strcmp(path + len - slen, enc_suffixes[i])) {
+	    len -= slen;
 	    break;
 	}
-	prev = s;
     }
+    plen = (int)strlen(p->path);
+    if (plen == len && 0 == strncmp(p->path, path, len)) {
+	return true;
+    }
+    if (0 < plen && '/' == p->path[plen - 1]) {
+	plen--;
+    }
+    return (plen == dlen && dlen + 11 == len &&
+	    0 == strncmp(p->path, path, dlen) && 0 == strncmp(path + dlen, "/index.html", 11));
 }
 
-static agooPage
-page_check(agooErr err, agooPage page) {
-    if (!page->immutable) {
-	double	now = dtime();
-
-	if (page->last_check + PAGE_RECHECK_TIME < now) {
-	    struct stat	fattr;
-
-	    if (0 == stat(page->path, &fattr) && page->mtime != fattr.st_mtime) {
-		update_contents(page);
-		if (NULL == page->resp) {
-		    agoo_page_remove(page);
-		    agoo_err_set(err, AGOO_ERR_NOT_FOUND, "not found.");
-		    return NULL;
+// Reloads or drops each cached page for the file. The keys come from the
+// watched directory. Matches are found with the cache locked and the files
+// are read without the lock.
+static void
+watch_refresh(const char *path, int dlen, Stale stale) {
+    Stale	st;
+    Slot	s;
+
+    pthread_mutex_lock(&cache.lock);
+    for (st = stale; NULL != st; st = st->next) {
+	if (NULL != (s = table_get(st->table, st->key, st->klen)) && page_matches(s->value, path, dlen)) {
+	    st->page = s->value;
+	    page_ref(st->page);
+	}
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    while (NULL != (st = stale)) {
+	struct _agooErr	err = AGOO_ERR_INIT;
+	agooPage	page;
+
+	stale = st->next;
+	if (NULL != st->page && NULL != (page = page_reload(&err, st->table, st->key, st->klen, st->page))) {
+	    agoo_page_release(page);
+	}
+	AGOO_FREE(st);
+    }
+}
+
+// Collects the keys of pages loaded from the named file in the watched
+// directory. Called with the watch lock held.
+static Stale
+watch_keys(Watch w, const char *name) {
+    Stale	stale = NULL;
+    Stale	st;
+    WatchKey	k;
+    int		len = (int)strlen(name);
+    int		i;
+
+    // A change to a precompressed variant refreshes the page as well.
+    for (i = 0; i < AGOO_ENC_CNT; i++) {
+	int	slen = (int)strlen(enc_suffixes[i]);
+
+	if (slen < len && 0 == strcmp(name + len - slen, enc_suffixes[i])) {
+	    len -= slen;
+	    break;
+	}
+    }
+    for (k = w->keys; NULL != k; k = k->next) {
+	if (len == (int)strlen(k->name) && 0 == strncmp(name, k->name, len) &&
+	    NULL != (st = (Stale)AGOO_MALLOC(sizeof(struct _stale) + k->klen))) {
+	    st->table = k->table;
+	    st->page = NULL;
+	    st->klen = k->klen;
+	    memcpy(st->key, k->key, k->klen + 1);
+	    st->next = stale;
+	    stale = st;
+	}
+    }
+    return stale;
+}
+
+static void*
+watch_loop(void *ctx) {
+    char		buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct pollfd	pa;
+    char		path[2048];
+
+    pa.fd = cache.watch_fd;
+    pa.events = POLLIN;
+    while (cache.watching) {
+	ssize_t	cnt;
+	char	*b;
+
+	pa.revents = 0;
+	if (0 < poll(&pa, 1, WATCH_WAIT) && 0 < (cnt = read(cache.watch_fd, buf, sizeof(buf)))) {
+	    for (b = buf; b < buf + cnt; b += sizeof(struct inotify_event) + ((struct inotify_event*)b)->len) {
+		struct inotify_event	*event = (struct inotify_event*)b;
+		Stale			stale = NULL;
+		Watch			w;
+		int			dlen = 0;
+
+		if (0 == event->len) {
+		    continue;
 		}
+		pthread_mutex_lock(&cache.watch_lock);
+		for (w = cache.watches; NULL != w; w = w->next) {
+		    if (event->wd == w->wd) {
+			dlen = snprintf(path, sizeof(path), "%s/%s", w->path, event->name);
+			if ((int)sizeof(path) <= dlen) {
+			    dlen = 0;
+			} else {
+			    dlen = (int)strlen(w->path);
+			    stale = watch_keys(w, event->name);
+			}
+			break;
+		    }
+		}
+		pthread_mutex_unlock(&cache.watch_lock);
+		if (NULL != stale) {
+		    watch_refresh(path, dlen, stale);
+		}
+	    }
+	}
+    }
+    return NULL;
+}
+
+// Starts the watch thread on the first load. If inotify is not available
+// pages are checked on the request path instead.
+static void
+watch_start() {
+    agooGroup	g;
+    agooDir	d;
+    char	dir[1100];
+
+    pthread_mutex_lock(&cache.watch_lock);
+    if (cache.watch_started) {
+	pthread_mutex_unlock(&cache.watch_lock);
+	return;
+    }
+    cache.watch_started = true;
+    pthread_mutex_unlock(&cache.watch_lock);
+
+    if (0 > (cache.watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC))) {
+	agoo_log_cat(&agoo_warn_cat, "inotify not available, pages will be checked with stat(). %s", strerror(errno));
+	return;
+    }
+    if (NULL != cache.root && strlen(cache.root) < sizeof(dir) - 2) {
+	sprintf(dir, "%s/", cache.root);
+	watch_add(dir, NULL, NULL, 0);
+    }
+    for (g = cache.groups; NULL != g; g = g->next) {
+	for (d = g->dirs; NULL != d; d = d->next) {
+	    if (d->plen < (int)sizeof(dir) - 2) {
+		sprintf(dir, "%s/", d->path);
+		watch_add(dir, NULL, NULL, 0);
 	    }
-	    page->last_check = now;
 	}
     }
+    cache.watching = true;
+    if (0 != pthread_create(&cache.watch_thread, NULL, watch_loop, NULL)) {
+	cache.watching = false;
+	close(cache.watch_fd);
+	cache.watch_fd = -1;
+	agoo_log_cat(&agoo_warn_cat, "Failed to start the page watch thread, pages will be checked with stat().");
+    }
+}
+#endif
+
+// Reads the file at path and caches the page. The file is read without
+// holding the lock. Like a lookup, the page returned is referenced.
+static agooPage
+cache_load(agooErr err, Table t, const char *key, int klen, const char *path) {
+    agooPage	page;
+    char	file[1024];
+
+#ifdef Linux
+    if (!cache.watch_started) {
+	watch_start();
+    }
+#endif
+    pthread_mutex_lock(&cache.lock);
+    cache.misses++;
+    pthread_mutex_unlock(&cache.lock);
+
+    if (NULL == (page = agoo_page_create(path))) {
+	AGOO_ERR_MEM(err, "Page");
+	return NULL;
+    }
+    if (!update_contents(page, file) || NULL == page->resp) {
+	agoo_page_release(page);
+	agoo_err_set(err, AGOO_ERR_NOT_FOUND, "not found.");
+	return NULL;
+    }
+    pthread_mutex_lock(&cache.lock);
+    table_set(t, key, klen, page);
+    pthread_mutex_unlock(&cache.lock);
+    if (0 <= cache.watch_fd) {
+	watch_add(file, t, key, klen);
+    }
+
     return page;
 }
 
@@ -779,10 +2003,8 @@ agoo_page_get(agooErr err, const char *path, int plen, const char *root) {
     if (NULL != root) {
 	char	full_path[2048];
 	char	*s = stpcpy(full_path, root);
+	int	flen;
 
-	if (NULL != strstr(path, "../")) {
-	    return NULL;
-	}
 	if ((int)sizeof(full_path) <= plen + (s - full_path)) {
 	    AGOO_ERR_MEM(err, "Page path");
 	    return NULL;
@@ -792,31 +2014,16 @@ agoo_page_get(agooErr err, const char *path, int plen, const char *root) {
 	}
 	strncpy(s, path, plen);
 	s[plen] = '\0';
+	flen = (int)(s - full_path) + plen;
 
-	if (NULL == (page = cache_root_get(full_path, plen))) {
+	if (NULL == (page = cache_lookup(err, &cache.roots, full_path, flen)) && AGOO_ERR_OK == err->code) {
 	    if (NULL != cache.root) {
-		agooPage	old;
-
-		if (NULL == (page = agoo_page_create(full_path))) {
-		    AGOO_ERR_MEM(err, "Page");
-		    return NULL;
-		}
-		if (!update_contents(page) || NULL == page->resp) {
-		    agoo_page_destroy(page);
-		    agoo_err_set(err, AGOO_ERR_NOT_FOUND, "not found.");
-		    return NULL;
-		}
-		if (NULL != (old = cache_root_set(full_path, plen, page))) {
-		    agoo_page_destroy(old);
-		}
+		page = cache_load(err, &cache.roots, full_path, flen, full_path);
 	    }
-	} else {
-	    page = page_check(err, page);
 	}
     } else {
-	if (NULL == (page = cache_get(path, plen))) {
+	if (NULL == (page = cache_lookup(err, &cache.pages, path, plen)) && AGOO_ERR_OK == err->code) {
 	    if (NULL != cache.root) {
-		agooPage	old;
 		char	full_path[2048];
 		char	*s = stpcpy(full_path, cache.root);
 
@@ -829,21 +2036,8 @@ agoo_page_get(agooErr err, const char *path, int plen, const char *root) {
 		}
 		strncpy(s, path, plen);
 		s[plen] = '\0';
-		if (NULL == (page = agoo_page_create(full_path))) {
-		    AGOO_ERR_MEM(err, "Page");
-		    return NULL;
-		}
-		if (!update_contents(page) || NULL == page->resp) {
-		    agoo_page_destroy(page);
-		    agoo_err_set(err, AGOO_ERR_NOT_FOUND, "not found.");
-		    return NULL;
-		}
-		if (NULL != (old = cache_set(path, plen, page))) {
-		    agoo_page_destroy(old);
-		}
+		page = cache_load(err, &cache.pages, path, plen, full_path);
 	    }
-	} else {
-	    page = page_check(err, page);
 	}
     }
     return page;
@@ -876,47 +2070,29 @@ agoo_group_get(agooErr err, const char *path, int plen) {
 	strncpy(s, path + g->plen, plen - g->plen);
 	s += plen - g->plen;
 	*s = '\0';
-	if (NULL != (page = cache_get(full_path, (int)(s - full_path)))) {
-	    break;
-	}
-    }
-    if (NULL == page) {
-	for (d = g->dirs; NULL != d; d = d->next) {
-	    if ((int)sizeof(full_path) <= d->plen + plen) {
-		continue;
-	    }
-	    s = stpcpy(full_path, d->path);
-	    strncpy(s, path + g->plen, plen - g->plen);
-	    s += plen - g->plen;
-	    *s = '\0';
-	    if (0 == access(full_path, R_OK)) {
-		break;
-	    }
+	if (NULL != (page = cache_lookup(err, &cache.pages, full_path, (int)(s - full_path)))) {
+	    return page;
 	}
-	if (NULL == d) {
+	if (AGOO_ERR_OK != err->code) {
 	    return NULL;
 	}
-	plen = (int)(s - full_path);
-	path = full_path;
-	if (NULL == (page = cache_get(path, plen))) {
-	    agooPage	old;
-
-	    if (NULL == (page = agoo_page_create(path))) {
-		AGOO_ERR_MEM(err, "Page");
-		return NULL;
-	    }
-	    if (!update_contents(page) || NULL == page->resp) {
-		agoo_page_destroy(page);
-		agoo_err_set(err, AGOO_ERR_NOT_FOUND, "not found.");
-		return NULL;
-	    }
-	    if (NULL != (old = cache_set(path, plen, page))) {
-		agoo_page_destroy(old);
-	    }
+    }
+    for (d = g->dirs; NULL != d; d = d->next) {
+	if ((int)sizeof(full_path) <= d->plen + plen) {
+	    continue;
 	}
-	return page;
+	s = stpcpy(full_path, d->path);
+	strncpy(s, path + g->plen, plen - g->plen);
+	s += plen - g->plen;
+	*s = '\0';
+	if (0 == access(full_path, R_OK)) {
+	    break;
+	}
+    }
+    if (NULL == d) {
+	return NULL;
     }
-    return page_check(err, page);
+    return cache_load(err, &cache.pages, full_path, (int)(s - full_path), full_path);
 }
 
 agooGroup
@@ -4,19 +4,49 @@
 #define AGOO_PAGE_H
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <time.h>
 
+#include "atomic.h"
 #include "err.h"
 #include "text.h"
 
+// Room for a quoted strong entity tag.
+#define AGOO_ETAG_MAX	48
+
+// Content encodings of precompressed page variants in order of preference.
+typedef enum {
+    AGOO_ENC_BR		= 0,
+    AGOO_ENC_ZSTD	= 1,
+    AGOO_ENC_GZIP	= 2,
+    AGOO_ENC_CNT	= 3,
+} agooEncoding;
+
+// Index of the unencoded response in arrays covering all representations.
+#define AGOO_ENC_NONE	AGOO_ENC_CNT
+
 typedef struct _agooPage {
     agooText		resp;
+    agooText		encoded[AGOO_ENC_CNT]; // NULL if there is no variant
+    agooText		unchanged[AGOO_ENC_CNT + 1]; // 304 responses
+    char		etags[AGOO_ENC_CNT + 1][AGOO_ETAG_MAX];
+    time_t		modified[AGOO_ENC_CNT + 1];
     char		*path;
     time_t		mtime;
     double		last_check;
+    atomic_int		ref_cnt; // one for the cache and one for each lookup
     bool		immutable;
 } *agooPage;
 
+typedef struct _agooPageStats {
+    uint64_t		hits;
+    uint64_t		misses;
+    uint64_t		evictions;
+    size_t		mem;     // bytes used by cached pages
+    size_t		max_mem; // 0 if there is no limit
+    int			count;
+} *agooPageStats;
+
 typedef struct _agooDir {
     struct _agooDir	*next;
     char		*path;
@@ -33,14 +63,44 @@ typedef struct _agooGroup {
 extern int		agoo_pages_init(agooErr err);
 extern int		agoo_pages_set_root(agooErr err, const char *root);
 extern void		agoo_pages_cleanup();
+// Pages larger than size bytes are not loaded into memory. Only the header is
+// cached and the body is sent from the file. Zero turns that off.
+extern void		agoo_pages_set_file_min(long size);
+// Limits the memory used by cached pages. The least recently used pages are
+// dropped when over the limit. Zero, the default, is no limit.
+extern void		agoo_pages_set_max_mem(size_t size);
+extern void		agoo_pages_stats(agooPageStats stats);
+// Text pages of at least size bytes are gzipped when loaded if there is no
+// .gz file next to the page. Zero turns that off.
+extern void		agoo_pages_set_compress_min(long size);
 
 extern agooGroup	agoo_group_create(const char *path);
 extern agooDir		agoo_group_add(agooErr err, agooGroup g, const char *dir);
-extern agooPage		agoo_group_get(agooErr err, const char *path, int plen);
+extern agooPage		agoo_group_get(agooErr err, const char *path, int plen); // referenced like agoo_page_get()
 
 extern agooPage		agoo_page_create(const char *path);
 extern agooPage		agoo_page_immutable(agooErr err, const char *path, const char *content, int clen);
+// The page returned is referenced and must be released once the response
+// texts taken from it have been pushed. Each pushed text holds its own
+// reference until written so a page replaced meanwhile is freed only when
+// the last of them is done.
 extern agooPage		agoo_page_get(agooErr err, const char *path, int plen, const char *root);
+extern void		agoo_page_release(agooPage p);
+// Returns the encoding of the representation to send given an
+// Accept-Encoding header value which may be NULL, or AGOO_ENC_NONE.
+extern int		agoo_page_encoding(agooPage p, const char *accept, int alen);
+extern agooText		agoo_page_resp(agooPage p, int enc);
+// Returns the 304 response for the representation if the If-None-Match or
+// If-Modified-Since value matches it, otherwise NULL.
+extern agooText		agoo_page_not_modified(agooPage p, int enc,
+					       const char *inm, int inmlen,
+					       const char *ims, int imslen);
+// Returns a 206 response for the Range header value, a 416 if no range can
+// be satisfied, or NULL if the full response should be sent. An If-Range
+// value that does not match the representation also gives NULL.
+extern agooText		agoo_page_range(agooPage p, int enc,
+					const char *range, int rlen,
+					const char *if_range, int irlen);
 extern int		mime_set(agooErr err, const char *key, const char *value);
 extern int		agoo_header_rule(agooErr err, const char *path, const char *mime, const char *key, const char *value);
 
@@ -0,0 +1,155 @@
+// Copyright (c) 2018, Peter Ohler, All rights reserved.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "pool.h"
+
+void
+agoo_pool_init(agooPool p, size_t size, int max, void (*init)(void *obj)) {
+    p->local = NULL;
+    atomic_init(&p->remote, NULL);
+    p->size = size;
+    p->cnt = 0;
+    p->max = max;
+    p->owned = false;
+    p->init = init;
+}
+
+static void
+items_free(agooPoolItem item) {
+    agooPoolItem	next;
+
+    for (; NULL != item; item = next) {
+	next = item->next;
+	AGOO_FREE(item);
+    }
+}
+
+void
+agoo_pool_cleanup(agooPool p) {
+    items_free(p->local);
+    p->local = NULL;
+    p->cnt = 0;
+    items_free((agooPoolItem)atomic_exchange(&p->remote, NULL));
+}
+
+void
+agoo_pool_own(agooPool p) {
+    p->owner = pthread_self();
+    p->owned = true;
+}
+
+void
+agoo_pool_disown(agooPool p) {
+    p->owned = false;
+    agoo_pool_cleanup(p);
+}
+
+static bool
+is_owner(agooPool p) {
+    return p->owned && pthread_equal(p->owner, pthread_self());
+}
+
+// Moves the remote items to the empty local list keeping no more than max.
+static void
+drain(agooPool p) {
+    agooPoolItem	item = (agooPoolItem)atomic_exchange(&p->remote, NULL);
+    agooPoolItem	next;
+
+    for (; NULL != item && p->cnt < p->max; item = next) {
+	next = item->next;
+	item->next = p->local;
+	p->local = item;
+	p->cnt++;
+    }
+    items_free(item);
+}
+
+void*
+agoo_pool_alloc(agooPool p, size_t size) {
+    agooPoolItem	item = NULL;
+
+    if (NULL == p) {
+	if (NULL == (item = (agooPoolItem)AGOO_MALLOC(sizeof(union _agooPoolItem) + size))) {
+	    return NULL;
+	}
+	item->pool = NULL;
+
+	return item + 1;
+    }
+    if (is_owner(p)) {
+	if (NULL == p->local) {
+	    drain(p);
+	}
+	if (NULL != (item = p->local)) {
+	    p->local = item->next;
+	    p->cnt--;
+	    item->pool = p;
+
+	    return item + 1;
+	}
+    }
+    if (NULL == (item = (agooPoolItem)AGOO_MALLOC(sizeof(union _agooPoolItem) + p->size))) {
+	return NULL;
+    }
+    // Only objects made on the owner thread are returned to the pool.
+    item->pool = is_owner(p) ? p : NULL;
+    if (NULL != p->init) {
+	p->init(item + 1);
+    }
+    return item + 1;
+}
+
+void
+agoo_pool_free(void *obj) {
+    agooPoolItem	item;
+    agooPool		p;
+
+    if (NULL == obj) {
+	return;
+    }
+    item = (agooPoolItem)obj - 1;
+    if (NULL == (p = item->pool)) {
+	AGOO_FREE(item);
+    } else if (is_owner(p)) {
+	if (p->max <= p->cnt) {
+	    AGOO_FREE(item);
+	} else {
+	    item->next = p->local;
+	    p->local = item;
+	    p->cnt++;
+	}
+    } else {
+	agooPoolItem	head = (agooPoolItem)atomic_load(&p->remote);
+
+	do {
+	    item->next = head;
+	} while (!atomic_compare_exchange_weak(&p->remote, &head, item));
+    }
+}
+
+void*
+agoo_pool_realloc(void *obj, size_t size) {
+    agooPoolItem	item;
+    void		*nobj;
+
+    if (NULL == obj) {
+	return agoo_pool_alloc(NULL, size);
+    }
+    item = (agooPoolItem)obj - 1;
+    if (NULL == item->pool) {
+	if (NULL == (item = (agooPoolItem)AGOO_REALLOC(item, sizeof(union _agooPoolItem) + size))) {
+	    return NULL;
+	}
+	return item + 1;
+    }
+    if (NULL == (nobj = agoo_pool_alloc(NULL, size))) {
+	return NULL;
+    }
+    memcpy(nobj, obj, (item->pool->size < size) ? item->pool->size : size);
+    agoo_pool_free(obj);
+
+    return nobj;
+}
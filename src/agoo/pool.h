@@ -0,0 +1,53 @@
+// Copyright (c) 2018, Peter Ohler, All rights reserved.
+
+#ifndef AGOO_POOL_H
+#define AGOO_POOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "atomic.h"
+
+// Each object is preceded by an item that holds the pool it came from while
+// in use and the next free item while cached.
+typedef union _agooPoolItem {
+    union _agooPoolItem	*next;
+    struct _agooPool	*pool; // NULL if from the heap
+    max_align_t		align;
+} *agooPoolItem;
+
+// A cache of same size objects for one thread. Only the owning thread
+// allocates from the pool. Any thread can free back to it. Frees from other
+// threads go on the remote stack which the owner takes all at once so no
+// locks are needed and there is no ABA problem.
+typedef struct _agooPool {
+    agooPoolItem		local;
+    _Atomic(agooPoolItem)	remote;
+    size_t			size;
+    int				cnt; // items in local
+    int				max;
+    pthread_t			owner;
+    volatile bool		owned;
+    void			(*init)(void *obj); // only on the first allocation
+} *agooPool;
+
+extern void	agoo_pool_init(agooPool p, size_t size, int max, void (*init)(void *obj));
+extern void	agoo_pool_cleanup(agooPool p);
+
+// Must be called from the thread that will allocate from the pool.
+extern void	agoo_pool_own(agooPool p);
+
+// Releases the cached items and stops the pool from caching until it is
+// owned again. Frees from other threads still go to the remote stack.
+extern void	agoo_pool_disown(agooPool p);
+
+// Allocations from a thread other than the owner or with a NULL pool come
+// from the heap. The size is only used when the pool is NULL.
+extern void*	agoo_pool_alloc(agooPool p, size_t size);
+extern void	agoo_pool_free(void *obj);
+
+// Resizes an object, moving it to the heap if it came from a pool.
+extern void*	agoo_pool_realloc(void *obj, size_t size);
+
+#endif // AGOO_POOL_H
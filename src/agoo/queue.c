@@ -1,30 +1,68 @@
 // Copyright 2015, 2016, 2018 by Peter Ohler, All Rights Reserved
 
 #include <fcntl.h>
-#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 #include <pthread.h>
 
+#ifdef Linux
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif
+
 #include "debug.h"
 #include "dtime.h"
 #include "queue.h"
 
-// lower gives faster response but burns more CPU. This is a reasonable compromise.
+// Number of attempts before blocking. A handoff is often only a few hundred
+// nanoseconds away so a short spin avoids the sleep and wake.
+#define SPIN_CNT	64
+// Used to wait when futexes are not available and as the longest wait for
+// a blocked pusher before checking again.
 #define RETRY_SECS	0.0001
-#define WAIT_MSECS	100
+#define PUSH_WAIT_SECS	0.1
 
 #define NOT_WAITING	0
 #define WAITING		1
 #define NOTIFIED	2
 
-// head and tail both increment and wrap.
-// tail points to next open space.
-// When head == tail the queue is full. This happens when tail catches up with head.
-//
+// The ring is the bounded MPMC queue described by Dmitry Vyukov. Each cell
+// has a sequence. A cell at position pos is free for a pusher when seq ==
+// pos and filled for a popper when seq == pos + 1. After a pop the sequence
+// is set to pos + size, ready for the next lap.
+
+static void
+futex_wait(uint32_t *addr, uint32_t expect, double timeout) {
+#ifdef Linux
+    struct timespec	ts;
+
+    ts.tv_sec = (time_t)timeout;
+    ts.tv_nsec = (long)((timeout - (double)ts.tv_sec) * 1000000000.0);
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expect, &ts, NULL, 0);
+#else
+    if (__atomic_load_n(addr, __ATOMIC_ACQUIRE) == expect) {
+	dsleep(RETRY_SECS);
+    }
+#endif
+}
+
+// The fence pairs with the increment of waiters before the waiter checks
+// the ring again so either the waiter sees the change or the waker sees the
+// waiter. Without waiters the shared seq is left alone.
+static void
+futex_wake(uint32_t *addr, uint32_t *waiters) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (0 < __atomic_load_n(waiters, __ATOMIC_RELAXED)) {
+	__atomic_fetch_add(addr, 1, __ATOMIC_SEQ_CST);
+#ifdef Linux
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
+    }
+}
 
 int
 agoo_queue_init(agooErr err, agooQueue q, size_t qsize) {
@@ -33,19 +71,22 @@ agoo_queue_init(agooErr err, agooQueue q, size_t qsize) {
 
 int
 agoo_queue_multi_init(agooErr err, agooQueue q, size_t qsize, bool multi_push, bool multi_pop) {
-    if (qsize < 4) {
-	qsize = 4;
+    size_t	size = 4;
+    size_t	i;
+
+    // The ring size must be a power of 2 so positions can be masked.
+    while (size < qsize) {
+	size <<= 1;
     }
-    if (NULL == (q->q = (agooQItem*)AGOO_CALLOC(qsize, sizeof(agooQItem)))) {
+    memset(q, 0, sizeof(struct _agooQueue));
+    if (NULL == (q->q = (agooQCell)AGOO_CALLOC(size, sizeof(struct _agooQCell)))) {
 	return AGOO_ERR_MEM(err, "Queue");
     }
-    q->end = q->q + qsize;
-
-    atomic_init(&q->head, q->q);
-    atomic_init(&q->tail, q->q + 1);
-    agoo_atomic_flag_init(&q->push_lock);
-    agoo_atomic_flag_init(&q->pop_lock);
-    atomic_init(&q->wait_state, 0);
+    for (i = 0; i < size; i++) {
+	q->q[i].seq = i;
+    }
+    q->mask = size - 1;
+    atomic_init(&q->wait_state, NOT_WAITING);
     q->multi_push = multi_push;
     q->multi_pop = multi_pop;
     // Create when/if needed.
@@ -59,120 +100,190 @@ void
 agoo_queue_cleanup(agooQueue q) {
     AGOO_FREE(q->q);
     q->q = NULL;
-    q->end = NULL;
-    if (0 < q->wsock) {
+    if (0 < q->wsock && q->wsock != q->rsock) {
 	close(q->wsock);
     }
     if (0 < q->rsock) {
 	close(q->rsock);
     }
+    q->rsock = 0;
+    q->wsock = 0;
 }
 
-void
-agoo_queue_push(agooQueue q, agooQItem item) {
-    agooQItem	*tail;
+static bool
+try_push(agooQueue q, agooQItem item) {
+    size_t	pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    agooQCell	cell;
+    size_t	seq;
+    intptr_t	dif;
 
-    if (q->multi_push) {
-	while (atomic_flag_test_and_set(&q->push_lock)) {
-	    dsleep(RETRY_SECS);
+    while (true) {
+	cell = &q->q[pos & q->mask];
+	seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+	dif = (intptr_t)seq - (intptr_t)pos;
+	if (0 == dif) {
+	    if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		break;
+	    }
+	    // pos was updated by the failed exchange
+	} else if (dif < 0) {
+	    return false; // full
+	} else {
+	    pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
 	}
     }
-    // Wait for head to move on.
-    while (atomic_load(&q->head) == atomic_load(&q->tail)) {
-	dsleep(RETRY_SECS);
+    cell->item = item;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+static agooQItem
+try_pop(agooQueue q) {
+    size_t	pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    agooQCell	cell;
+    agooQItem	item;
+    size_t	seq;
+    intptr_t	dif;
+
+    while (true) {
+	cell = &q->q[pos & q->mask];
+	seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+	dif = (intptr_t)seq - (intptr_t)(pos + 1);
+	if (0 == dif) {
+	    if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		break;
+	    }
+	} else if (dif < 0) {
+	    return NULL; // empty
+	} else {
+	    pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	}
     }
-    *(agooQItem*)atomic_load(&q->tail) = item;
-    tail = (agooQItem*)atomic_load(&q->tail) + 1;
+    item = cell->item;
+    cell->item = NULL;
+    __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+
+    return item;
+}
 
-    if (q->end <= tail) {
-	tail = q->q;
+// Wakes poppers after an item has been added. Only the push that moves a
+// listened queue from waiting to notified writes to the fd.
+static void
+pushed(agooQueue q) {
+    futex_wake(&q->pop_seq, &q->pop_waiters);
+    if (0 != q->wsock &&
+	WAITING == (long)atomic_load(&q->wait_state) &&
+	WAITING == (long)atomic_exchange(&q->wait_state, NOTIFIED)) {
+	agoo_queue_wakeup(q);
     }
-    atomic_store(&q->tail, tail);
-    if (q->multi_push) {
-	atomic_flag_clear(&q->push_lock);
+}
+
+void
+agoo_queue_push(agooQueue q, agooQItem item) {
+    int	i;
+
+    for (i = SPIN_CNT; !try_push(q, item); i--) {
+	if (i <= 0) {
+	    uint32_t	seq;
+	    bool	done;
+
+	    // Full so wait for a pop.
+	    __atomic_fetch_add(&q->push_waiters, 1, __ATOMIC_SEQ_CST);
+	    seq = __atomic_load_n(&q->push_seq, __ATOMIC_ACQUIRE);
+	    if (!(done = try_push(q, item))) {
+		futex_wait(&q->push_seq, seq, PUSH_WAIT_SECS);
+	    }
+	    __atomic_fetch_sub(&q->push_waiters, 1, __ATOMIC_SEQ_CST);
+	    if (done) {
+		break;
+	    }
+	    i = SPIN_CNT;
+	}
     }
-    if (0 != q->wsock && WAITING == (long)atomic_load(&q->wait_state)) {
-	if (write(q->wsock, ".", 1)) {}
-	atomic_store(&q->wait_state, NOTIFIED);
+    pushed(q);
+}
+
+bool
+agoo_queue_try_push(agooQueue q, agooQItem item) {
+    if (!try_push(q, item)) {
+	return false;
     }
+    pushed(q);
+
+    return true;
 }
 
 void
 agoo_queue_wakeup(agooQueue q) {
     if (0 != q->wsock) {
+#ifdef Linux
+	uint64_t	one = 1;
+
+	if (write(q->wsock, &one, sizeof(one))) {}
+#else
 	if (write(q->wsock, ".", 1)) {}
+#endif
     }
 }
 
 agooQItem
 agoo_queue_pop(agooQueue q, double timeout) {
     agooQItem	item;
-    agooQItem	*next;
-    int cnt;
+    double	giveup;
+    double	now;
+    int		i;
 
-    if (q->multi_pop) {
-	while (atomic_flag_test_and_set(&q->pop_lock)) {
-	    dsleep(RETRY_SECS);
+    for (i = SPIN_CNT; 0 < i; i--) {
+	if (NULL != (item = try_pop(q))) {
+	    futex_wake(&q->push_seq, &q->push_waiters);
+	    return item;
 	}
-    }
-    item = *(agooQItem*)atomic_load(&q->head);
-
-    if (NULL != item) {
-	*(agooQItem*)atomic_load(&q->head) = NULL;
-	if (q->multi_pop) {
-	    atomic_flag_clear(&q->pop_lock);
+	if (timeout <= 0.0) {
+	    return NULL;
 	}
-	return item;
     }
-    next = (agooQItem*)atomic_load(&q->head) + 1;
+    giveup = dtime() + timeout;
+    while (true) {
+	uint32_t	seq;
 
-    if (q->end <= next) {
-	next = q->q;
-    }
-    // If the next is the tail then wait for something to be appended.
-    for (cnt = (int)(timeout / (double)WAIT_MSECS * 1000.0); atomic_load(&q->tail) == next; cnt--) {
-	struct pollfd	pa;
-
-	if (cnt <= 0) {
-	    if (q->multi_pop) {
-		atomic_flag_clear(&q->pop_lock);
-	    }
-	    return NULL;
+	// Register as a waiter before the last check. A push after that
+	// either bumps the seq, which makes the futex wait return right away,
+	// or is seen by the check.
+	__atomic_fetch_add(&q->pop_waiters, 1, __ATOMIC_SEQ_CST);
+	seq = __atomic_load_n(&q->pop_seq, __ATOMIC_ACQUIRE);
+	if (NULL == (item = try_pop(q)) && (now = dtime()) < giveup) {
+	    futex_wait(&q->pop_seq, seq, giveup - now);
 	}
-	pa.fd = agoo_queue_listen(q);
-	pa.events = POLLIN;
-	pa.revents = 0;
-	if (0 < poll(&pa, 1, WAIT_MSECS)) {
-	    agoo_queue_release(q);
+	__atomic_fetch_sub(&q->pop_waiters, 1, __ATOMIC_SEQ_CST);
+	if (NULL != item) {
+	    futex_wake(&q->push_seq, &q->push_waiters);
+	    return item;
+	}
+	if (giveup <= dtime()) {
+	    break;
 	}
     }
-    atomic_store(&q->head, next);
-    item = *next;
-    *next = NULL;
-    if (q->multi_pop) {
-	atomic_flag_clear(&q->pop_lock);
-    }
-    return item;
+    return NULL;
 }
 
 // Called by the popper usually.
 bool
 agoo_queue_empty(agooQueue q) {
-    agooQItem	*head = atomic_load(&q->head);
-    agooQItem	*next = head + 1;
-
-    if (q->end <= next) {
-	next = q->q;
-    }
-    if (NULL == *head && atomic_load(&q->tail) == next) {
-	return true;
-    }
-    return false;
+    return 0 == agoo_queue_count(q);
 }
 
 int
 agoo_queue_listen(agooQueue q) {
     if (0 == q->rsock) {
+#ifdef Linux
+	int	fd = eventfd(0, EFD_NONBLOCK);
+
+	if (0 <= fd) {
+	    q->rsock = fd;
+	    q->wsock = fd;
+	}
+#else
 	int	fd[2];
 
 	if (0 == pipe(fd)) {
@@ -181,25 +292,39 @@ agoo_queue_listen(agooQueue q) {
 	    q->rsock = fd[0];
 	    q->wsock = fd[1];
 	}
+#endif
     }
     atomic_store(&q->wait_state, WAITING);
 
     return q->rsock;
 }
 
+// Clears the fd and waits for the next push. The caller must pop everything
+// after this or an item pushed before it could be left without a wake.
 void
 agoo_queue_release(agooQueue q) {
+#ifdef Linux
+    uint64_t	cnt;
+
+    // An eventfd read resets the count.
+    if (read(q->rsock, &cnt, sizeof(cnt))) {}
+#else
     char	buf[8];
 
     // clear pipe
     while (0 < read(q->rsock, buf, sizeof(buf))) {
     }
-    atomic_store(&q->wait_state, NOT_WAITING);
+#endif
+    atomic_store(&q->wait_state, WAITING);
 }
 
 int
 agoo_queue_count(agooQueue q) {
-    int	size = (int)(q->end - q->q);
+    size_t	tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    size_t	head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
 
-    return ((agooQItem*)atomic_load(&q->tail) - (agooQItem*)atomic_load(&q->head) + size) % size;
+    if (tail <= head) {
+	return 0;
+    }
+    return (int)(tail - head);
 }
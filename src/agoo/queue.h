@@ -4,25 +4,42 @@
 #define AGOO_QUEUE_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #include "atomic.h"
 #include "err.h"
 
+#define AGOO_CACHE_LINE	64
+
 typedef void	*agooQItem;
 
+typedef struct _agooQCell {
+    size_t	seq;
+    agooQItem	item;
+} *agooQCell;
+
+// A bounded multi-producer, multi-consumer ring where each cell carries a
+// sequence number that tells pushers and poppers if the cell is free or
+// filled for the current lap. Neither side takes a lock. Poppers and pushers
+// that have to wait block on a futex (Linux) rather than sleeping.
 typedef struct _agooQueue {
-    agooQItem		*q;
-    agooQItem		*end;
-    _Atomic(agooQItem*)	head;
-    _Atomic(agooQItem*)	tail;
-    bool		multi_push;
+    agooQCell		q;
+    size_t		mask;
+    bool		multi_push; // kept for the API, the ring is always MPMC
     bool		multi_pop;
-    atomic_flag		push_lock; // set to true when push in progress
-    atomic_flag		pop_lock; // set to true when push in progress
-    atomic_int		wait_state;
     int			rsock;
     int			wsock;
+    atomic_int		wait_state;
+    char		pad0[AGOO_CACHE_LINE];
+    size_t		tail; // next push position
+    uint32_t		push_seq; // bumped on each pop, pushers wait on it
+    uint32_t		push_waiters;
+    char		pad1[AGOO_CACHE_LINE];
+    size_t		head; // next pop position
+    uint32_t		pop_seq; // bumped on each push, poppers wait on it
+    uint32_t		pop_waiters;
+    char		pad2[AGOO_CACHE_LINE];
 } *agooQueue;
 
 extern int		agoo_queue_init(agooErr err, agooQueue q, size_t qsize);
@@ -31,6 +48,8 @@ extern int		agoo_queue_multi_init(agooErr err, agooQueue q, size_t qsize, bool m
 
 extern void		agoo_queue_cleanup(agooQueue q);
 extern void		agoo_queue_push(agooQueue q, agooQItem item);
+// Returns false instead of waiting if the queue is full.
+extern bool		agoo_queue_try_push(agooQueue q, agooQItem item);
 extern agooQItem	agoo_queue_pop(agooQueue q, double timeout);
 extern bool		agoo_queue_empty(agooQueue q);
 extern int		agoo_queue_listen(agooQueue q);
@@ -1,18 +1,33 @@
 // Copyright (c) 2018, Peter Ohler, All rights reserved.
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+#ifdef Linux
+#include <sys/eventfd.h>
+#endif
+
 #if HAVE_SYS_EPOLL_H
 #include <sys/epoll.h>
+#if HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
 #else
 #include <ctype.h>
 #include <netdb.h>
 #include <poll.h>
 #endif
 
+#include "atomic.h"
 #include "debug.h"
 #include "dtime.h"
 #include "log.h"
@@ -24,29 +39,102 @@
 
 #if HAVE_SYS_EPOLL_H
 #define EPOLL_SIZE		100
+#if HAVE_LINUX_IO_URING_H
+#define RING_SIZE		1024
+// user_data for completions that are not for a link.
+#define RING_NONE		0
+#define RING_TIMEOUT		1
+#ifdef IORING_RECV_MULTISHOT
+// Set in the user_data of a recv or accept to tell it from a poll on the
+// same link.
+#define RING_RECV		1
+// Provided buffers shared by all the multishot recvs on a ring.
+#define RECV_BUF_CNT		64
+#define RECV_BUF_SIZE		16384
+#define RECV_GROUP		0
+#endif
+#endif
 #else
 #define INITIAL_POLL_SIZE	1024
 #endif
 
-typedef struct _link {
-    struct _link	*next;
-    struct _link	*prev;
+bool	agoo_ready_uring = true;
+
+typedef struct _agooLink {
+    struct _agooLink	*next;
+    struct _agooLink	*prev;
     int			fd;
     void		*ctx;
     agooHandler		handler;
+    agooReady		ready;
 #if HAVE_SYS_EPOLL_H
+    struct _agooLink	*dnext; // next on the dirty list
+    bool		dirty;
     uint32_t		events; // last events set
+#if HAVE_LINUX_IO_URING_H
+    bool		armed;    // poll submitted and not yet completed
+    bool		canceling;
+    bool		removed;  // free when the poll and recv complete
+    bool		recving;  // multishot recv or accept submitted and not yet done
+    bool		rcanceling;
+#endif
 #else
     struct pollfd	*pp;
 #endif
 } *Link;
 
+#if HAVE_LINUX_IO_URING_H
+typedef struct _ring {
+    int				fd;
+    unsigned			*sq_head;
+    unsigned			*sq_tail;
+    unsigned			*sq_mask;
+    unsigned			*sq_entries;
+    unsigned			*sq_array;
+    unsigned			*cq_head;
+    unsigned			*cq_tail;
+    unsigned			*cq_mask;
+    struct io_uring_sqe		*sqes;
+    struct io_uring_cqe		*cqes;
+    void			*sq_ptr;
+    size_t			sq_size;
+    void			*cq_ptr;
+    size_t			cq_size;
+    size_t			sqes_size;
+    unsigned			pending;
+    bool			timeout_armed;
+    struct __kernel_timespec	timeout;
+    // Removed links waiting for the poll to be canceled.
+    Link			zombies;
+#ifdef IORING_RECV_MULTISHOT
+    struct io_uring_buf_ring	*br;
+    char			*bufs;
+    bool			recv;   // false if multishot recv is not supported
+    bool			accept; // false if multishot accept is not supported
+#endif
+} *Ring;
+#endif
+
 struct _agooReady {
     Link	links;
     int		lcnt;
     double	next_check;
+    // Other threads wake the loop by writing to wake_wfd after a touch. The
+    // woken flag is set while the loop is busy or a wake is already pending
+    // so there is at most one write per loop iteration.
+    int		wake_rfd;
+    int		wake_wfd;
+    atomic_flag	woken;
 #if HAVE_SYS_EPOLL_H
-    int		epoll_fd;
+    int			epoll_fd;
+    // Links that need their events re-evaluated. Only those links are
+    // visited before the epoll_wait() so the cost of each call scales with
+    // activity and not with the number of connections.
+    Link		dirty;
+    pthread_mutex_t	dirty_lock;
+#if HAVE_LINUX_IO_URING_H
+    Ring		ring; // NULL if epoll is used
+#endif
 #else
     struct pollfd	*pa;
     struct pollfd	*pend;
@@ -54,9 +142,9 @@ struct _agooReady {
 };
 
 static Link
-link_create(agooErr err, int fd, void *ctx, agooHandler handler) {
+link_create(agooErr err, agooReady ready, int fd, void *ctx, agooHandler handler) {
     // TBD use block allocator
-    Link	link = (Link)AGOO_MALLOC(sizeof(struct _link));
+    Link	link = (Link)AGOO_MALLOC(sizeof(struct _agooLink));
 
     if (NULL == link) {
 	AGOO_ERR_MEM(err, "Connection Link");
@@ -67,10 +155,402 @@ link_create(agooErr err, int fd, void *ctx, agooHandler handler) {
 	link->fd = fd;
 	link->ctx = ctx;
 	link->handler = handler;
+	link->ready = ready;
+#if HAVE_SYS_EPOLL_H
+	link->dnext = NULL;
+	link->dirty = false;
+	link->events = 0;
+#if HAVE_LINUX_IO_URING_H
+	link->armed = false;
+	link->canceling = false;
+	link->removed = false;
+	link->recving = false;
+	link->rcanceling = false;
+#endif
+#endif
     }
     return link;
 }
 
+#if HAVE_LINUX_IO_URING_H
+// An io_uring is used in place of epoll when the kernel supports it. Polls
+// are single shot and re-armed after each completion which gives the same
+// level triggered behavior as epoll but all the re-arms, interest changes,
+// and the wait are submitted with a single io_uring_enter() call. Links with
+// a recv handler get a multishot recv into provided buffers instead of a
+// poll for input so reads need no system call at all. Listening links with
+// an accept handler get a multishot accept in the same way.
+
+static void
+ring_destroy(Ring ring) {
+    Link	link;
+
+    while (NULL != (link = ring->zombies)) {
+	ring->zombies = link->next;
+	AGOO_FREE(link);
+    }
+    if (NULL != ring->sqes) {
+	munmap(ring->sqes, ring->sqes_size);
+    }
+    if (NULL != ring->cq_ptr && ring->cq_ptr != ring->sq_ptr) {
+	munmap(ring->cq_ptr, ring->cq_size);
+    }
+    if (NULL != ring->sq_ptr) {
+	munmap(ring->sq_ptr, ring->sq_size);
+    }
+    if (0 <= ring->fd) {
+	close(ring->fd);
+    }
+#ifdef IORING_RECV_MULTISHOT
+    if (NULL != ring->br) {
+	munmap(ring->br, RECV_BUF_CNT * sizeof(struct io_uring_buf));
+    }
+    AGOO_FREE(ring->bufs);
+#endif
+    AGOO_FREE(ring);
+}
+
+#ifdef IORING_RECV_MULTISHOT
+// Gives a provided buffer back to the kernel once its data has been handled.
+static void
+ring_recycle(Ring ring, unsigned bid) {
+    unsigned short		tail = ring->br->tail;
+    struct io_uring_buf		*b = &ring->br->bufs[tail & (RECV_BUF_CNT - 1)];
+
+    b->addr = (uint64_t)(uintptr_t)(ring->bufs + bid * RECV_BUF_SIZE);
+    b->len = RECV_BUF_SIZE;
+    b->bid = (uint16_t)bid;
+    __atomic_store_n(&ring->br->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+// Registers the provided buffers. Polls are used for input if that fails.
+static void
+ring_recv_setup(Ring ring) {
+    struct io_uring_buf_reg	reg;
+    size_t			size = RECV_BUF_CNT * sizeof(struct io_uring_buf);
+    unsigned			i;
+
+    ring->br = (struct io_uring_buf_ring*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (MAP_FAILED == ring->br) {
+	ring->br = NULL;
+	return;
+    }
+    if (NULL == (ring->bufs = (char*)AGOO_MALLOC(RECV_BUF_CNT * RECV_BUF_SIZE))) {
+	munmap(ring->br, size);
+	ring->br = NULL;
+	return;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->br;
+    reg.ring_entries = RECV_BUF_CNT;
+    reg.bgid = RECV_GROUP;
+    if (0 > syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+	agoo_log_cat(&agoo_debug_cat, "io_uring provided buffers not available, polling for input. %s", strerror(errno));
+	munmap(ring->br, size);
+	ring->br = NULL;
+	AGOO_FREE(ring->bufs);
+	ring->bufs = NULL;
+	return;
+    }
+    ring->br->tail = 0;
+    for (i = 0; i < RECV_BUF_CNT; i++) {
+	ring_recycle(ring, i);
+    }
+    ring->recv = true;
+}
+#endif
+
+static bool
+ring_supported(int fd, bool *recv, bool *accept) {
+    size_t			size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe	*probe = (struct io_uring_probe*)AGOO_CALLOC(1, size);
+    bool			ok = false;
+
+    if (NULL == probe) {
+	return false;
+    }
+    if (0 <= syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256)) {
+	ok = (IORING_OP_TIMEOUT < probe->ops_len &&
+	      IORING_OP_POLL_REMOVE < probe->ops_len &&
+	      0 != (probe->ops[IORING_OP_POLL_ADD].flags & IO_URING_OP_SUPPORTED) &&
+	      0 != (probe->ops[IORING_OP_POLL_REMOVE].flags & IO_URING_OP_SUPPORTED) &&
+	      0 != (probe->ops[IORING_OP_TIMEOUT].flags & IO_URING_OP_SUPPORTED));
+	*recv = (IORING_OP_RECV < probe->ops_len &&
+		 0 != (probe->ops[IORING_OP_RECV].flags & IO_URING_OP_SUPPORTED) &&
+		 0 != (probe->ops[IORING_OP_ASYNC_CANCEL].flags & IO_URING_OP_SUPPORTED));
+	*accept = (*recv && 0 != (probe->ops[IORING_OP_ACCEPT].flags & IO_URING_OP_SUPPORTED));
+    }
+    AGOO_FREE(probe);
+
+    return ok;
+}
+
+// Returns NULL if io_uring is not available in which case epoll is used.
+static Ring
+ring_create() {
+    struct io_uring_params	params;
+    Ring			ring;
+    bool			recv = false;
+    bool			accept = false;
+
+    if (!agoo_ready_uring) {
+	return NULL;
+    }
+    if (NULL == (ring = (Ring)AGOO_CALLOC(1, sizeof(struct _ring)))) {
+	return NULL;
+    }
+    memset(&params, 0, sizeof(params));
+    if (0 > (ring->fd = (int)syscall(__NR_io_uring_setup, RING_SIZE, &params))) {
+	agoo_log_cat(&agoo_debug_cat, "io_uring not available, using epoll. %s", strerror(errno));
+	ring_destroy(ring);
+	return NULL;
+    }
+    if (0 == (params.features & IORING_FEAT_NODROP) || !ring_supported(ring->fd, &recv, &accept)) {
+	agoo_log_cat(&agoo_debug_cat, "io_uring missing features, using epoll.");
+	ring_destroy(ring);
+	return NULL;
+    }
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (0 != (params.features & IORING_FEAT_SINGLE_MMAP) && ring->sq_size < ring->cq_size) {
+	ring->sq_size = ring->cq_size;
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring->fd, IORING_OFF_SQ_RING);
+    if (MAP_FAILED == ring->sq_ptr) {
+	ring->sq_ptr = NULL;
+	ring_destroy(ring);
+	return NULL;
+    }
+    if (0 != (params.features & IORING_FEAT_SINGLE_MMAP)) {
+	ring->cq_ptr = ring->sq_ptr;
+    } else {
+	ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			    ring->fd, IORING_OFF_CQ_RING);
+	if (MAP_FAILED == ring->cq_ptr) {
+	    ring->cq_ptr = NULL;
+	    ring_destroy(ring);
+	    return NULL;
+	}
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+					    ring->fd, IORING_OFF_SQES);
+    if (MAP_FAILED == ring->sqes) {
+	ring->sqes = NULL;
+	ring_destroy(ring);
+	return NULL;
+    }
+    ring->sq_head = (unsigned*)((char*)ring->sq_ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned*)((char*)ring->sq_ptr + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)((char*)ring->sq_ptr + params.sq_off.ring_mask);
+    ring->sq_entries = (unsigned*)((char*)ring->sq_ptr + params.sq_off.ring_entries);
+    ring->sq_array = (unsigned*)((char*)ring->sq_ptr + params.sq_off.array);
+    ring->cq_head = (unsigned*)((char*)ring->cq_ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned*)((char*)ring->cq_ptr + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)((char*)ring->cq_ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ptr + params.cq_off.cqes);
+    ring->timeout.tv_sec = 0;
+    ring->timeout.tv_nsec = MAX_WAIT * 1000000;
+#ifdef IORING_RECV_MULTISHOT
+    if (recv) {
+	ring_recv_setup(ring);
+    }
+    ring->accept = accept;
+#endif
+    return ring;
+}
+
+static int
+ring_enter(Ring ring, unsigned wait) {
+    int	cnt;
+
+    cnt = (int)syscall(__NR_io_uring_enter, ring->fd, ring->pending, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (0 <= cnt) {
+	ring->pending -= cnt;
+    }
+    return cnt;
+}
+
+static struct io_uring_sqe*
+ring_sqe(Ring ring) {
+    unsigned		tail = *ring->sq_tail;
+    struct io_uring_sqe	*sqe;
+
+    // Full so submit what is there to make room.
+    while (*ring->sq_entries <= tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)) {
+	if (0 > ring_enter(ring, 0) && EINTR != errno && EAGAIN != errno && EBUSY != errno) {
+	    agoo_log_cat(&agoo_error_cat, "io_uring submit failed. %s", strerror(errno));
+	}
+    }
+    sqe = &ring->sqes[tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+
+    return sqe;
+}
+
+static void
+ring_arm(Ring ring, Link link, uint32_t events) {
+    struct io_uring_sqe	*sqe = ring_sqe(ring);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = link->fd;
+    sqe->poll32_events = events;
+    sqe->user_data = (uint64_t)(uintptr_t)link;
+    link->armed = true;
+    link->events = events;
+}
+
+static void
+ring_cancel(Ring ring, Link link) {
+    if (link->armed && !link->canceling) {
+	struct io_uring_sqe	*sqe = ring_sqe(ring);
+
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = (uint64_t)(uintptr_t)link;
+	sqe->user_data = RING_NONE;
+	link->canceling = true;
+    }
+}
+
+#ifdef IORING_RECV_MULTISHOT
+// True if input for the link comes from a multishot recv or accept.
+static bool
+ring_multishot(Ring ring, Link link) {
+    return ((ring->recv && NULL != link->handler->recv) ||
+	    (ring->accept && NULL != link->handler->accept));
+}
+
+static void
+ring_recv_arm(Ring ring, Link link) {
+    struct io_uring_sqe	*sqe = ring_sqe(ring);
+
+    sqe->fd = link->fd;
+    if (NULL != link->handler->accept) {
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK;
+    } else {
+	sqe->opcode = IORING_OP_RECV;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = RECV_GROUP;
+    }
+    sqe->user_data = (uint64_t)(uintptr_t)link | RING_RECV;
+    link->recving = true;
+}
+
+static void
+ring_recv_cancel(Ring ring, Link link) {
+    if (link->recving && !link->rcanceling) {
+	struct io_uring_sqe	*sqe = ring_sqe(ring);
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (uint64_t)(uintptr_t)link | RING_RECV;
+	sqe->user_data = RING_NONE;
+	link->rcanceling = true;
+    }
+}
+#endif
+
+static void
+ring_update(Ring ring, Link link, uint32_t events) {
+#ifdef IORING_RECV_MULTISHOT
+    if (ring_multishot(ring, link)) {
+	// Input comes from the recv or accept so the poll is only for the rest.
+	if (0 != (events & POLLIN)) {
+	    if (!link->recving) {
+		ring_recv_arm(ring, link);
+	    }
+	} else {
+	    ring_recv_cancel(ring, link);
+	}
+	events &= ~POLLIN;
+	if (0 == events && link->recving) {
+	    ring_cancel(ring, link);
+	    return;
+	}
+    }
+#endif
+    if (!link->armed) {
+	ring_arm(ring, link, events);
+    } else if (events != link->events) {
+	// Once the cancel completes the link is re-armed with the new events.
+	ring_cancel(ring, link);
+    }
+}
+#endif
+
+static agooReadyIO
+wake_io(void *ctx) {
+    return AGOO_READY_IN;
+}
+
+static bool
+wake_read(agooReady ready, void *ctx) {
+#ifdef Linux
+    uint64_t	cnt;
+
+    // An eventfd read resets the count.
+    if (read(ready->wake_rfd, &cnt, sizeof(cnt))) {}
+#else
+    char	buf[8];
+
+    while (0 < read(ready->wake_rfd, buf, sizeof(buf))) {
+    }
+#endif
+    return true;
+}
+
+static void
+wake_destroy(void *ctx) {
+    agooReady	ready = (agooReady)ctx;
+
+    if (ready->wake_wfd != ready->wake_rfd) {
+	close(ready->wake_wfd);
+    }
+    close(ready->wake_rfd);
+}
+
+static struct _agooHandler	wake_handler = {
+    .io = wake_io,
+    .check = NULL,
+    .read = wake_read,
+    .write = NULL,
+    .error = NULL,
+    .destroy = wake_destroy,
+};
+
+static int
+wake_open(agooErr err, agooReady ready) {
+#ifdef Linux
+    if (0 > (ready->wake_rfd = eventfd(0, EFD_NONBLOCK))) {
+	return agoo_err_no(err, "eventfd create failed");
+    }
+    ready->wake_wfd = ready->wake_rfd;
+#else
+    int	fd[2];
+
+    if (0 != pipe(fd)) {
+	return agoo_err_no(err, "wake pipe create failed");
+    }
+    fcntl(fd[0], F_SETFL, O_NONBLOCK);
+    fcntl(fd[1], F_SETFL, O_NONBLOCK);
+    ready->wake_rfd = fd[0];
+    ready->wake_wfd = fd[1];
+#endif
+    if (NULL == agoo_ready_add(err, ready, ready->wake_rfd, &wake_handler, ready)) {
+	wake_destroy(ready);
+	return err->code;
+    }
+    return AGOO_ERR_OK;
+}
+
 agooReady
 agoo_ready_create(agooErr err) {
     agooReady	ready = (agooReady)AGOO_MALLOC(sizeof(struct _agooReady));
@@ -82,7 +562,16 @@ agoo_ready_create(agooErr err) {
 	ready->links = NULL;
 	ready->lcnt = 0;
 	ready->next_check = dtime() + CHECK_FREQ;
+	agoo_atomic_flag_init(&ready->woken);
 #if HAVE_SYS_EPOLL_H
+	ready->dirty = NULL;
+	pthread_mutex_init(&ready->dirty_lock, 0);
+	ready->epoll_fd = -1;
+#if HAVE_LINUX_IO_URING_H
+	if (NULL != (ready->ring = ring_create())) {
+	    agoo_log_cat(&agoo_debug_cat, "Connection manager using io_uring.");
+	} else
+#endif
 	if (0 > (ready->epoll_fd = epoll_create(1))) {
 	    agoo_err_no(err, "epoll create failed");
 	    return NULL;
@@ -96,6 +585,10 @@ agoo_ready_create(agooErr err) {
 	    memset(ready->pa, 0, size);
 	}
 #endif
+	if (AGOO_ERR_OK != wake_open(err, ready)) {
+	    agoo_ready_destroy(ready);
+	    return NULL;
+	}
     }
     return ready;
 }
@@ -112,14 +605,35 @@ agoo_ready_destroy(agooReady ready) {
 	AGOO_FREE(link);
     }
 #if HAVE_SYS_EPOLL_H
-    close(ready->epoll_fd);
+#if HAVE_LINUX_IO_URING_H
+    if (NULL != ready->ring) {
+	ring_destroy(ready->ring);
+    }
+#endif
+    if (0 <= ready->epoll_fd) {
+	close(ready->epoll_fd);
+    }
+    pthread_mutex_destroy(&ready->dirty_lock);
 #else
     AGOO_FREE(ready->pa);
 #endif
     AGOO_FREE(ready);
 }
 
-int
+static void
+ready_unlink(agooReady ready, Link link) {
+    if (NULL == link->prev) {
+	ready->links = link->next;
+    } else {
+	link->prev->next = link->next;
+    }
+    if (NULL != link->next) {
+	link->next->prev = link->prev;
+    }
+    ready->lcnt--;
+}
+
+agooLink
 agoo_ready_add(agooErr		err,
 	       agooReady	ready,
 	       int		fd,
@@ -127,8 +641,8 @@ agoo_ready_add(agooErr		err,
 	       void		*ctx) {
     Link	link;
 
-    if (NULL == (link = link_create(err, fd, ctx, handler))) {
-	return err->code;
+    if (NULL == (link = link_create(err, ready, fd, ctx, handler))) {
+	return NULL;
     }
     link->next = ready->links;
     if (NULL != ready->links) {
@@ -138,6 +652,13 @@ agoo_ready_add(agooErr		err,
     ready->lcnt++;
 
 #if HAVE_SYS_EPOLL_H
+#if HAVE_LINUX_IO_URING_H
+    if (NULL != ready->ring) {
+	// Armed on the next go.
+	agoo_ready_touch(link);
+	return link;
+    }
+#endif
     link->events = EPOLLIN;
     {
 	struct epoll_event	event = {
@@ -148,9 +669,13 @@ agoo_ready_add(agooErr		err,
 	};
 	if (0 > epoll_ctl(ready->epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
 	    agoo_err_no(err, "epoll add failed");
-	    return err->code;
+	    ready_unlink(ready, link);
+	    AGOO_FREE(link);
+	    return NULL;
 	}
     }
+    // The handler may want more than EPOLLIN so evaluate on the next go.
+    agoo_ready_touch(link);
 #else
     if (ready->pend - ready->pa <= ready->lcnt) {
 	size_t	cnt = (ready->pend - ready->pa) * 2;
@@ -162,26 +687,89 @@ agoo_ready_add(agooErr		err,
 	    agoo_log_close();
 	    exit(EXIT_FAILURE);
 
-	    return err->code;
+	    return NULL;
 	}
 	ready->pend = ready->pa + cnt;
 	memset(ready->pa, 0, size);
     }
 #endif
-    return AGOO_ERR_OK;
+    return link;
 }
 
 static void
-ready_remove(agooReady ready, Link link) {
-    if (NULL == link->prev) {
-	ready->links = link->next;
-    } else {
-	link->prev->next = link->next;
+ready_wake(agooReady ready) {
+    if (!atomic_flag_test_and_set(&ready->woken)) {
+#ifdef Linux
+	uint64_t	one = 1;
+
+	if (write(ready->wake_wfd, &one, sizeof(one))) {}
+#else
+	if (write(ready->wake_wfd, ".", 1)) {}
+#endif
     }
-    if (NULL != link->next) {
-	link->next->prev = link->prev;
+}
+
+// The poll() version re-evaluates every link on each call so only the wake
+// is needed in that case.
+void
+agoo_ready_touch(agooLink link) {
+    if (NULL != link) {
+	agooReady	ready = link->ready;
+
+#if HAVE_SYS_EPOLL_H
+	pthread_mutex_lock(&ready->dirty_lock);
+	if (!link->dirty) {
+	    link->dirty = true;
+	    link->dnext = ready->dirty;
+	    ready->dirty = link;
+	}
+	pthread_mutex_unlock(&ready->dirty_lock);
+#endif
+	ready_wake(ready);
     }
+}
+
+static void
+ready_remove(agooReady ready, Link link) {
+    ready_unlink(ready, link);
 #if HAVE_SYS_EPOLL_H
+    pthread_mutex_lock(&ready->dirty_lock);
+    if (link->dirty) {
+	Link	*lp;
+
+	for (lp = &ready->dirty; NULL != *lp; lp = &(*lp)->dnext) {
+	    if (link == *lp) {
+		*lp = link->dnext;
+		break;
+	    }
+	}
+    }
+    pthread_mutex_unlock(&ready->dirty_lock);
+#if HAVE_LINUX_IO_URING_H
+    if (NULL != ready->ring) {
+	if (NULL != link->handler->destroy) {
+	    link->handler->destroy(link->ctx);
+	}
+	if (link->armed || link->recving) {
+	    // The kernel still has the link as user_data so keep it until the
+	    // poll and recv complete.
+	    ring_cancel(ready->ring, link);
+#ifdef IORING_RECV_MULTISHOT
+	    ring_recv_cancel(ready->ring, link);
+#endif
+	    link->removed = true;
+	    link->prev = NULL;
+	    link->next = ready->ring->zombies;
+	    if (NULL != ready->ring->zombies) {
+		ready->ring->zombies->prev = link;
+	    }
+	    ready->ring->zombies = link;
+	} else {
+	    AGOO_FREE(link);
+	}
+	return;
+    }
+#endif
     {
 	struct epoll_event	event = {
 	    .events = 0,
@@ -198,87 +786,307 @@ ready_remove(agooReady ready, Link link) {
 	link->handler->destroy(link->ctx);
     }
     AGOO_FREE(link);
-    ready->lcnt--;
 }
 
-static void
+// Returns true if the link was removed.
+static bool
 ready_check_remove(agooReady ready, Link link) {
     if (NULL == link->handler->check || link->handler->check(link->ctx, 0.0)) {
 	ready_remove(ready, link);
+	return true;
     }
+    return false;
 }
 
-int
-agoo_ready_go(agooErr err, agooReady ready) {
-    double	now;
-    Link	link;
-    Link	next;
-
 #if HAVE_SYS_EPOLL_H
-    struct epoll_event	events[EPOLL_SIZE];
-    struct epoll_event	*ep;
-    int			cnt;
+static void
+link_update(agooErr err, agooReady ready, Link link) {
+    struct epoll_event	event = {
+	.events = 0,
+	.data = {
+	    .ptr = link,
+	},
+    };
+    // The EPOLLIN and EPOLLOUT values are the same as POLLIN and POLLOUT
+    // so the same events work for io_uring polls.
+    switch (link->handler->io(link->ctx)) {
+    case AGOO_READY_IN:
+	event.events = EPOLLIN;
+	break;
+    case AGOO_READY_OUT:
+	event.events = EPOLLOUT;
+	break;
+    case AGOO_READY_BOTH:
+	event.events = EPOLLIN | EPOLLOUT;
+	break;
+    case AGOO_READY_NONE:
+    default:
+	// ignore, either dead or closing
+	break;
+    }
+#if HAVE_LINUX_IO_URING_H
+    if (NULL != ready->ring) {
+	ring_update(ready->ring, link, event.events);
+	return;
+    }
+#endif
+    if (event.events != link->events) {
+	if (0 > epoll_ctl(ready->epoll_fd, EPOLL_CTL_MOD, link->fd, &event)) {
+	    agoo_err_no(err, "epoll modifiy failed");
+	}
+	link->events = event.events;
+    }
+}
 
-    for (link = ready->links; NULL != link; link = link->next) {
-	struct epoll_event	event = {
-	    .events = 0,
-	    .data = {
-		.ptr = link,
-	    },
-	};
-	switch (link->handler->io(link->ctx)) {
-	case AGOO_READY_IN:
-	    event.events = EPOLLIN;
-	    break;
-	case AGOO_READY_OUT:
-	    event.events = EPOLLOUT;
-	    break;
-	case AGOO_READY_BOTH:
-	    event.events = EPOLLIN | EPOLLOUT;
-	    break;
-	case AGOO_READY_NONE:
-	default:
-	    // ignore, either dead or closing
-	    break;
+// Handles the events reported for a link by either epoll or io_uring.
+static void
+link_dispatch(agooErr err, agooReady ready, Link link, uint32_t events) {
+    if (0 != (events & EPOLLIN) && NULL != link->handler->read) {
+	if (!link->handler->read(ready, link->ctx)) {
+	    if (!ready_check_remove(ready, link)) {
+		link_update(err, ready, link);
+	    }
+	    return;
 	}
-	if (event.events != link->events) {
-	    if (0 > epoll_ctl(ready->epoll_fd, EPOLL_CTL_MOD, link->fd, &event)) {
-		agoo_err_no(err, "epoll modifiy failed");
+    }
+    if (0 != (events & EPOLLOUT && NULL != link->handler->write)) {
+	if (!link->handler->write(link->ctx)) {
+	    if (!ready_check_remove(ready, link)) {
+		link_update(err, ready, link);
 	    }
-	    link->events = event.events;
+	    return;
 	}
     }
-    if (0 > (cnt = epoll_wait(ready->epoll_fd, events, sizeof(events) / sizeof(*events), MAX_WAIT))) {
+    if (0 != (events & (EPOLLERR | EPOLLRDHUP | EPOLLHUP | EPOLLPRI))) {
+	if (NULL != link->handler->error) {
+	    link->handler->error(link->ctx);
+	}
+	if (!ready_check_remove(ready, link)) {
+	    link_update(err, ready, link);
+	}
+	return;
+    }
+    // Reading and writing change what the link is interested in.
+    link_update(err, ready, link);
+}
+
+static int
+epoll_wait_dispatch(agooErr err, agooReady ready, bool block) {
+    struct epoll_event	events[EPOLL_SIZE];
+    struct epoll_event	*ep;
+    int			cnt;
+
+    if (0 > (cnt = epoll_wait(ready->epoll_fd, events, sizeof(events) / sizeof(*events), block ? MAX_WAIT : 0))) {
 	agoo_err_no(err, "Polling error.");
 	agoo_log_cat(&agoo_error_cat, "%s", err->msg);
 	return err->code;
     }
+    // Touches while the loop is busy are picked up without a wake.
+    atomic_flag_test_and_set(&ready->woken);
     for (ep = events; 0 < cnt; ep++, cnt--) {
-	link = (Link)ep->data.ptr;
-	if (0 != (ep->events & EPOLLIN) && NULL != link->handler->read) {
-	    if (!link->handler->read(ready, link->ctx)) {
-		ready_check_remove(ready, link);
-		continue;
-	    }
+	link_dispatch(err, ready, (Link)ep->data.ptr, ep->events);
+    }
+    return AGOO_ERR_OK;
+}
+
+#if HAVE_LINUX_IO_URING_H
+static void
+ring_zombie_free(Ring ring, Link link) {
+    if (NULL == link->prev) {
+	ring->zombies = link->next;
+    } else {
+	link->prev->next = link->next;
+    }
+    if (NULL != link->next) {
+	link->next->prev = link->prev;
+    }
+    AGOO_FREE(link);
+}
+
+#ifdef IORING_RECV_MULTISHOT
+static void
+ring_recv_done(agooErr err, agooReady ready, Link link, int res, uint32_t flags) {
+    Ring	ring = ready->ring;
+    bool	ok = true;
+    if (0 == (flags & IORING_CQE_F_MORE)) {
+	link->recving = false;
+	link->rcanceling = false;
+    }
+    if (link->removed) {
+	if (0 != (flags & IORING_CQE_F_BUFFER)) {
+	    ring_recycle(ring, flags >> IORING_CQE_BUFFER_SHIFT);
+	} else if (NULL != link->handler->accept && 0 <= res) {
+	    close(res);
 	}
-	if (0 != (ep->events & EPOLLOUT && NULL != link->handler->write)) {
-	    if (!link->handler->write(link->ctx)) {
-		ready_check_remove(ready, link);
-		continue;
-	    }
+	if (!link->armed && !link->recving) {
+	    ring_zombie_free(ring, link);
+	}
+	return;
+    }
+    if (NULL != link->handler->accept) {
+	if (0 <= res) {
+	    ok = link->handler->accept(ready, link->ctx, res);
+	} else if (-EINVAL == res) {
+	    agoo_log_cat(&agoo_debug_cat, "io_uring multishot accept not supported, polling for connections.");
+	    ring->accept = false;
+	} else if (-ECANCELED != res) {
+	    // The accept is re-armed below as the read() would be retried.
+	    agoo_log_cat(&agoo_error_cat, "Server with pid %d accept connection failed. %s.", getpid(), strerror(-res));
+	}
+    } else if (0 <= res) {
+	if (0 != (flags & IORING_CQE_F_BUFFER)) {
+	    unsigned	bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+	    ok = link->handler->recv(ready, link->ctx, ring->bufs + bid * RECV_BUF_SIZE, (size_t)res);
+	    ring_recycle(ring, bid);
+	} else {
+	    ok = link->handler->recv(ready, link->ctx, NULL, 0);
+	}
+    } else if (-EINVAL == res) {
+	// The kernel has the op but not multishot so poll for input instead.
+	agoo_log_cat(&agoo_debug_cat, "io_uring multishot recv not supported, polling for input.");
+	ring->recv = false;
+    } else if (-ENOBUFS != res && -ECANCELED != res) {
+	// Out of buffers or canceled are re-armed below, anything else is an
+	// error on the socket.
+	if (NULL != link->handler->error) {
+	    link->handler->error(link->ctx);
+	}
+	ok = false;
+    }
+    // The data handled may have queued output so the events are updated
+    // even if the recv is still going.
+    if (ok || !ready_check_remove(ready, link)) {
+	link_update(err, ready, link);
+    }
+}
+#endif
+
+static int
+ring_wait(agooErr err, agooReady ready, bool block) {
+    Ring	ring = ready->ring;
+    Link	link;
+    unsigned	head;
+
+    if (!ring->timeout_armed) {
+	struct io_uring_sqe	*sqe = ring_sqe(ring);
+
+	// Completes on the first other completion or after MAX_WAIT.
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (uint64_t)(uintptr_t)&ring->timeout;
+	sqe->len = 1;
+	sqe->off = 1;
+	sqe->user_data = RING_TIMEOUT;
+	ring->timeout_armed = true;
+    }
+    if (0 > ring_enter(ring, block ? 1 : 0)) {
+	// EBUSY indicates the completion queue has overflowed so drain it.
+	if (EINTR == errno || EAGAIN == errno) {
+	    return AGOO_ERR_OK;
+	}
+	if (EBUSY != errno) {
+	    agoo_err_no(err, "Polling error.");
+	    agoo_log_cat(&agoo_error_cat, "%s", err->msg);
+	    return err->code;
+	}
+    }
+    atomic_flag_test_and_set(&ready->woken);
+    head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+	struct io_uring_cqe	*cqe = &ring->cqes[head & *ring->cq_mask];
+	uint64_t		udata = cqe->user_data;
+	int			res = cqe->res;
+#ifdef IORING_RECV_MULTISHOT
+	uint32_t		flags = cqe->flags;
+#endif
+
+	head++;
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	switch (udata) {
+	case RING_NONE:
+	    continue;
+	case RING_TIMEOUT:
+	    ring->timeout_armed = false;
+	    continue;
+	default:
+	    break;
+	}
+#ifdef IORING_RECV_MULTISHOT
+	if (0 != (udata & RING_RECV)) {
+	    ring_recv_done(err, ready, (Link)(uintptr_t)(udata & ~(uint64_t)RING_RECV), res, flags);
+	    continue;
 	}
-	if (0 != (ep->events & (EPOLLERR | EPOLLRDHUP | EPOLLHUP | EPOLLPRI))) {
-	    if (NULL != link->handler->error) {
-		link->handler->error(link->ctx);
+#endif
+	link = (Link)(uintptr_t)udata;
+	link->armed = false;
+	link->canceling = false;
+	if (link->removed) {
+	    if (!link->recving) {
+		ring_zombie_free(ring, link);
 	    }
-	    ready_check_remove(ready, link);
 	    continue;
 	}
+	if (res < 0) {
+	    // Canceled for a change in events or failed. Either way re-arm.
+	    link_update(err, ready, link);
+	    continue;
+	}
+	link_dispatch(err, ready, link, (uint32_t)res);
+    }
+    return AGOO_ERR_OK;
+}
+#endif
+#endif
+
+int
+agoo_ready_go(agooErr err, agooReady ready) {
+    double	now;
+    Link	link;
+    Link	next;
+#if HAVE_SYS_EPOLL_H
+    bool	block;
+#endif
+
+#if HAVE_SYS_EPOLL_H
+    pthread_mutex_lock(&ready->dirty_lock);
+    next = ready->dirty;
+    ready->dirty = NULL;
+    pthread_mutex_unlock(&ready->dirty_lock);
+    while (NULL != (link = next)) {
+	// A touch from another thread will reuse dnext once dirty is cleared
+	// so step under the lock.
+	pthread_mutex_lock(&ready->dirty_lock);
+	next = link->dnext;
+	link->dirty = false;
+	pthread_mutex_unlock(&ready->dirty_lock);
+	link_update(err, ready, link);
+    }
+    // A touch after the clear wakes the loop. One before it is already on
+    // the dirty list so don't block.
+    atomic_flag_clear(&ready->woken);
+    pthread_mutex_lock(&ready->dirty_lock);
+    block = (NULL == ready->dirty);
+    pthread_mutex_unlock(&ready->dirty_lock);
+#if HAVE_LINUX_IO_URING_H
+    if (NULL != ready->ring) {
+	if (AGOO_ERR_OK != ring_wait(err, ready, block)) {
+	    return err->code;
+	}
+    } else if (AGOO_ERR_OK != epoll_wait_dispatch(err, ready, block)) {
+	return err->code;
+    }
+#else
+    if (AGOO_ERR_OK != epoll_wait_dispatch(err, ready, block)) {
+	return err->code;
     }
+#endif
 #else
     struct pollfd	*pp;
     int			i;
 
+    // Any touch after this wakes the poll() below.
+    atomic_flag_clear(&ready->woken);
     // Setup the poll events.
     for (link = ready->links, pp = ready->pa; NULL != link; link = link->next, pp++) {
 	pp->fd = link->fd;
@@ -302,7 +1110,9 @@ agoo_ready_go(agooErr err, agooReady ready) {
 	    break;
 	}
     }
-    if (0 > (i = poll(ready->pa, (nfds_t)(pp - ready->pa), MAX_WAIT))) {
+    i = poll(ready->pa, (nfds_t)(pp - ready->pa), MAX_WAIT);
+    atomic_flag_test_and_set(&ready->woken);
+    if (0 > i) {
 	if (EAGAIN == errno) {
 	    return AGOO_ERR_OK;
 	}
@@ -346,7 +1156,13 @@ agoo_ready_go(agooErr err, agooReady ready) {
 	    next = link->next;
 	    if (NULL != link->handler->check && link->handler->check(link->ctx, now)) {
 		ready_remove(ready, link);
+		continue;
 	    }
+#if HAVE_SYS_EPOLL_H
+	    // The check may have changed the state such as closing on a
+	    // timeout.
+	    link_update(err, ready, link);
+#endif
 	}
 	ready->next_check = dtime() + CHECK_FREQ;
     }
@@ -17,24 +17,39 @@ typedef enum {
 } agooReadyIO;
 
 typedef struct _agooReady	*agooReady;
+typedef struct _agooLink	*agooLink;
 
 typedef struct _agooHandler {
     agooReadyIO	(*io)(void *ctx);
     // return false to remove connection
     bool	(*check)(void *ctx, double now);
     bool	(*read)(agooReady ready, void *ctx);
+    // Optional. If set and io_uring with multishot recv is available, data
+    // is received by the loop and handed over in place of read() calls. A
+    // zero len is the end of the stream. Return false as with read().
+    bool	(*recv)(agooReady ready, void *ctx, const char *data, size_t len);
+    // Optional. For listening sockets. If set and io_uring with multishot
+    // accept is available, connections are accepted by the loop and each
+    // non-blocking socket is handed over in place of read() calls.
+    bool	(*accept)(agooReady ready, void *ctx, int sock);
     bool	(*write)(void *ctx);
     void	(*error)(void *ctx);
     void	(*destroy)(void *ctx);
 } *agooHandler;
 
+// If true and the kernel supports it io_uring is used instead of epoll.
+extern bool		agoo_ready_uring;
+
 extern agooReady	agoo_ready_create(agooErr err);
 extern void		agoo_ready_destroy(agooReady ready);
-extern int		agoo_ready_add(agooErr		err,
+extern agooLink		agoo_ready_add(agooErr	err,
 				       agooReady	ready,
 				       int		fd,
 				       agooHandler	handler,
 				       void		*ctx);
+// Thread safe. Marks the link so the handler io() is called again on the
+// next agoo_ready_go().
+extern void		agoo_ready_touch(agooLink link);
 extern int		agoo_ready_go(agooErr err, agooReady ready);
 extern void		agoo_ready_iterate(agooReady ready, void (*cb)(void *ctx, void *arg), void *arg);
 
@@ -4,6 +4,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "con.h"
 #include "debug.h"
@@ -12,14 +14,34 @@
 
 agooReq
 agoo_req_create(size_t mlen) {
+    return agoo_req_create_from(NULL, mlen);
+}
+
+agooReq
+agoo_req_create_from(agooPool pools, size_t mlen) {
     size_t	size = mlen + sizeof(struct _agooReq) - 7;
-    agooReq	req = (agooReq)AGOO_MALLOC(size);
-    
+    agooPool	pool = NULL;
+    agooReq	req;
+
+    if (NULL != pools) {
+	size_t	csize = AGOO_REQ_CLASS_MIN;
+	int	i;
+
+	for (i = 0; i < AGOO_REQ_CLASS_CNT; i++, csize *= 2) {
+	    if (size <= csize) {
+		pool = pools + i;
+		break;
+	    }
+	}
+    }
+    req = (agooReq)agoo_pool_alloc(pool, size);
+
     if (NULL != req) {
 	memset(req, 0, size);
 	req->env = agoo_server.env_nil_value;
 	req->mlen = mlen;
 	req->hook = NULL;
+	req->body_fd = -1;
     }
     return req;
 }
@@ -29,7 +51,14 @@ agoo_req_destroy(agooReq req) {
     if (NULL != req->hook && PUSH_HOOK == req->hook->type) {
 	AGOO_FREE(req->hook);
     }
-    AGOO_FREE(req);
+    if (0 <= req->body_fd) {
+	if (NULL != req->body.start) {
+	    munmap((void*)req->body.start, req->body_size + 1);
+	}
+	close(req->body_fd);
+    }
+    AGOO_FREE(req->body_buf);
+    agoo_pool_free(req);
 }
 
 const char*
@@ -37,7 +66,7 @@ agoo_req_host(agooReq r, int *lenp) {
     const char	*host;
     const char	*colon;
 
-    if (NULL == (host = agoo_con_header_value(r->header.start, r->header.len, "Host", lenp))) {
+    if (NULL == (host = agoo_req_header(r, AGOO_HDR_HOST, lenp))) {
 	return NULL;
     }
     for (colon = host + *lenp - 1; host < colon; colon--) {
@@ -57,7 +86,7 @@ agoo_req_port(agooReq r) {
     const char	*host;
     const char	*colon;
     
-    if (NULL == (host = agoo_con_header_value(r->header.start, r->header.len, "Host", &len))) {
+    if (NULL == (host = agoo_req_header(r, AGOO_HDR_HOST, &len))) {
 	return 0;
     }
     for (colon = host + len - 1; host < colon; colon--) {
@@ -71,6 +100,39 @@ agoo_req_port(agooReq r) {
     return (int)strtol(colon + 1, NULL, 10);
 }
 
+long
+agoo_req_body_read(agooReq r, char *buf, size_t size, size_t off) {
+    size_t	len = (0 <= r->body_fd) ? r->body_size : r->body.len;
+
+    if (len <= off) {
+	return 0;
+    }
+    if (len - off < size) {
+	size = len - off;
+    }
+    if (0 <= r->body_fd) {
+	return (long)pread(r->body_fd, buf, size, (off_t)off);
+    }
+    memcpy(buf, r->body.start + off, size);
+
+    return (long)size;
+}
+
+const char*
+agoo_req_param(agooReq r, const char *key, int *vlenp) {
+    agooParam	p = r->params;
+    int		klen = (int)strlen(key);
+    int		i;
+
+    for (i = r->param_cnt; 0 < i; i--, p++) {
+	if (klen == p->klen && 0 == strncmp(key, p->key, klen)) {
+	    *vlenp = p->vlen;
+	    return p->value;
+	}
+    }
+    return NULL;
+}
+
 const char*
 agoo_req_query_value(agooReq r, const char *key, int klen, int *vlenp) {
     const char	*value;
@@ -139,32 +201,11 @@ agoo_req_query_decode(char *s, int len) {
 
 const char*
 agoo_req_header_value(agooReq req, const char *key, int *vlen) {
-    // Search for \r then check for \n and then the key followed by a :. Keep
-    // trying until the end of the header.
-    const char	*h = req->header.start;
-    const char	*hend = h + req->header.len;
-    const char	*value;
-    int		klen = (int)strlen(key);
-    
-    while (h < hend) {
-	if (0 == strncmp(key, h, klen) && ':' == h[klen]) {
-	    h += klen + 1;
-	    for (; ' ' == *h; h++) {
-	    }
-	    value = h;
-	    for (; '\r' != *h && '\0' != *h; h++) {
-	    }
-	    *vlen = (int)(h - value);
- 
-	    return value;
-	}
-	for (; h < hend; h++) {
-	    if ('\r' == *h && '\n' == *(h + 1)) {
-		h += 2;
-		break;
-	    }
-	}
-    }
-    return NULL;
+    return agoo_headers_value(&req->headers, req->msg, key, (int)strlen(key), vlen);
+}
+
+const char*
+agoo_req_header(agooReq req, agooHeaderId id, int *vlen) {
+    return agoo_headers_get(&req->headers, req->msg, id, vlen);
 }
 
@@ -5,8 +5,16 @@
 
 #include <stdint.h>
 
+#include "header.h"
 #include "hook.h"
 #include "kinds.h"
+#include "pool.h"
+#include "router.h"
+
+// Requests are pooled in classes by allocation size. Larger ones come from
+// the heap.
+#define AGOO_REQ_CLASS_CNT	4
+#define AGOO_REQ_CLASS_MIN	2048
 
 struct _agooUpgraded;
 struct _agooRes;
@@ -31,19 +39,38 @@ typedef struct _agooReq {
     struct _agooStr		path;
     struct _agooStr		query;
     struct _agooStr		header;
+    struct _agooHeaders		headers; // offsets are from msg
     struct _agooStr		body;
+    // Bodies read separately from the header are in body_buf or, when too
+    // large to keep in memory, in the unlinked temporary file body_fd which
+    // is mapped at body.start.
+    char			*body_buf;
+    int				body_fd;
+    size_t			body_size;
     void			*env;
     agooHook			hook;
+    double			queued; // when queued for evaluation
+    struct _agooParam		params[AGOO_PARAM_MAX]; // captured from the path
+    int				param_cnt;
     size_t			mlen;   // allocated msg length
     char			msg[8]; // expanded to be full message
 } *agooReq;
 
 extern agooReq		agoo_req_create(size_t mlen);
+// Uses one of the AGOO_REQ_CLASS_CNT pools if the request fits.
+extern agooReq		agoo_req_create_from(agooPool pools, size_t mlen);
 extern void		agoo_req_destroy(agooReq req);
 extern const char*	agoo_req_host(agooReq r, int *lenp);
 extern int		agoo_req_port(agooReq r);
 extern const char*	agoo_req_query_value(agooReq r, const char *key, int klen, int *vlenp);
+// Returns the path value captured for the '{name}' pattern segment or "*"
+// or "**" for the first wildcard of that kind. The value is not terminated.
+extern const char*	agoo_req_param(agooReq r, const char *key, int *vlenp);
 extern int		agoo_req_query_decode(char *s, int len);
-const char*		agoo_req_header_value(agooReq req, const char *key, int *vlen);
+// Copies up to size bytes of the body starting at off into buf. Returns the
+// number of bytes copied, 0 at the end of the body, or -1 on a read error.
+extern long		agoo_req_body_read(agooReq r, char *buf, size_t size, size_t off);
+extern const char*	agoo_req_header_value(agooReq req, const char *key, int *vlen);
+extern const char*	agoo_req_header(agooReq req, agooHeaderId id, int *vlen);
 
 #endif // AGOO_REQ_H
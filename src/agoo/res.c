@@ -1,44 +1,65 @@
 // Copyright (c) 2018, Peter Ohler, All rights reserved.
 
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include "con.h"
 #include "debug.h"
+#include "dtime.h"
+#include "metrics.h"
+#include "ready.h"
 #include "res.h"
+#include "server.h"
+
+void
+agoo_res_init(void *obj) {
+    agooRes	res = (agooRes)obj;
+
+    pthread_mutex_init(&res->lock, NULL);
+    pthread_cond_init(&res->drained, NULL);
+}
 
 agooRes
 agoo_res_create(agooCon con) {
-    agooRes	res = NULL;
+    agooRes	res;
 
-    pthread_mutex_lock(&con->loop->lock);
-    if (NULL != (res = con->loop->res_head)) {
-	con->loop->res_head = res->next;
-	if (NULL == con->loop->res_head) {
-	    con->loop->res_tail = NULL;
-	}
-    }
-    pthread_mutex_unlock(&con->loop->lock);
-
-    if (NULL == res) {
-	if (NULL == (res = (agooRes)AGOO_MALLOC(sizeof(struct _agooRes)))) {
-	    return NULL;
-	}
+    if (NULL == (res = (agooRes)agoo_pool_alloc(&con->loop->res_pool, sizeof(struct _agooRes)))) {
+	return NULL;
     }
     res->next = NULL;
     res->message = NULL;
-    pthread_mutex_init(&res->lock, NULL);
     res->con = con;
     res->con_kind = AGOO_CON_HTTP;
     res->final = false;
     res->close = false;
     res->ping = false;
     res->pong = false;
+    res->stream = false;
+    res->chunked = false;
+    res->wait = false;
+    res->gone = false;
+    res->pending = 0;
+    res->left = 0;
+    res->h2_id = 0;
+    res->h2_window = 0;
+    res->h2_off = 0;
+    res->h2_body = false;
+    res->h2_reset = false;
+    res->mid = 0;
+    res->ready = 0.0;
 
     return res;
 }
 
+void
+agoo_res_written(agooRes res) {
+    if (agoo_metrics_on && 0.0 < res->ready) {
+	agoo_metrics_record(res->mid, AGOO_METRIC_WRITE, dtime() - res->ready);
+    }
+}
+
 void
 agoo_res_destroy(agooRes res) {
     if (NULL != res) {
@@ -47,14 +68,7 @@ agoo_res_destroy(agooRes res) {
 	}
 	res->next = NULL;
 	res->message = NULL;
-	pthread_mutex_lock(&res->con->loop->lock);
-	if (NULL == res->con->loop->res_tail) {
-	    res->con->loop->res_head = res;
-	} else {
-	    res->con->loop->res_tail->next = res;
-	}
-	res->con->loop->res_tail = res;
-	pthread_mutex_unlock(&res->con->loop->lock);
+	agoo_pool_free(res);
     }
 }
 
@@ -75,7 +89,13 @@ agoo_res_message_push(agooRes res, agooText t) {
 	    end->next = t;
 	}
 	res->final = true;
+	if (agoo_metrics_on) {
+	    res->ready = dtime();
+	}
     }
+    // Touch while still locked so the connection can not be closed before
+    // the loop is told.
+    agoo_ready_touch(res->con->link);
     pthread_mutex_unlock(&res->lock);
 }
 
@@ -106,6 +126,7 @@ agoo_res_add_early(agooRes res, agooEarly early) {
 	}
 	res->final = false;
     }
+    agoo_ready_touch(res->con->link);
     pthread_mutex_unlock(&res->lock);
 }
 
@@ -129,6 +150,10 @@ agoo_res_message_next(agooRes res) {
 	agooText	t2 = res->message;
 
 	res->message = t2->next;
+	if (res->stream) {
+	    res->pending -= t2->len;
+	    pthread_cond_signal(&res->drained);
+	}
 	agoo_text_release(t2);
     }
     t = res->message;
@@ -136,3 +161,136 @@ agoo_res_message_next(agooRes res) {
 
     return t;
 }
+
+// Called with the lock held.
+static void
+stream_append(agooRes res, agooText t) {
+    agoo_text_ref(t);
+    if (NULL == res->message) {
+	res->message = t;
+    } else {
+	agooText	end = res->message;
+
+	for (; NULL != end->next; end = end->next) {
+	}
+	end->next = t;
+    }
+    res->pending += t->len;
+    agoo_ready_touch(res->con->link);
+}
+
+void
+agoo_res_stream_open(agooRes res, agooText head, long len, bool wait) {
+    pthread_mutex_lock(&res->lock);
+    res->stream = true;
+    res->chunked = (0 > len);
+    res->left = len;
+    res->wait = wait;
+    if (!res->gone) {
+	stream_append(res, head);
+    }
+    pthread_mutex_unlock(&res->lock);
+}
+
+int
+agoo_res_stream_write(agooErr err, agooRes res, const char *buf, size_t len) {
+    agooText	t;
+
+    // An empty chunk would end the body.
+    if (0 == len) {
+	return AGOO_ERR_OK;
+    }
+    // Texts are sized with an int so larger writes must be split.
+    if ((size_t)(INT_MAX - 32) < len) {
+	return agoo_err_set(err, AGOO_ERR_ARG, "stream write of %zu bytes is too large", len);
+    }
+    if (!res->chunked && res->left < (long)len) {
+	return agoo_err_set(err, AGOO_ERR_OVERFLOW, "stream write past the Content-Length");
+    }
+    if (NULL == (t = agoo_text_allocate((int)len + 16))) {
+	return AGOO_ERR_MEM(err, "Stream");
+    }
+    if (res->chunked) {
+	char	size[16];
+
+	t = agoo_text_append(t, size, snprintf(size, sizeof(size), "%zx\r\n", len));
+	t = agoo_text_append(t, buf, (int)len);
+	t = agoo_text_append(t, "\r\n", 2);
+    } else {
+	t = agoo_text_append(t, buf, (int)len);
+    }
+    if (NULL == t) {
+	return AGOO_ERR_MEM(err, "Stream");
+    }
+    if (!res->chunked) {
+	res->left -= len;
+    }
+    pthread_mutex_lock(&res->lock);
+    while (res->wait && !res->gone && (long)agoo_server.stream_max < res->pending) {
+	pthread_cond_wait(&res->drained, &res->lock);
+    }
+    if (res->gone) {
+	pthread_mutex_unlock(&res->lock);
+	agoo_text_release(t);
+	return agoo_err_set(err, AGOO_ERR_NETWORK, "connection closed");
+    }
+    stream_append(res, t);
+    pthread_mutex_unlock(&res->lock);
+
+    return AGOO_ERR_OK;
+}
+
+int
+agoo_res_stream_close(agooErr err, agooRes res) {
+    static const char	last_chunk[] = "0\r\n\r\n";
+
+    pthread_mutex_lock(&res->lock);
+    if (!res->chunked && 0 < res->left) {
+	// The client can only tell the body is short if the connection closes.
+	res->close = true;
+	agoo_err_set(err, AGOO_ERR_WRITE, "stream closed before the Content-Length was reached");
+    }
+    if (!res->gone) {
+	agooText	t;
+
+	// Something must be left to write so the con loop sees the end even
+	// if everything else has already gone out.
+	if (res->chunked) {
+	    t = agoo_text_create(last_chunk, sizeof(last_chunk) - 1);
+	} else {
+	    t = agoo_text_allocate(0);
+	}
+	if (NULL == t) {
+	    // Without the end the client can only tell by the close.
+	    res->close = true;
+	    AGOO_ERR_MEM(err, "Stream");
+	} else {
+	    stream_append(res, t);
+	}
+    }
+    res->final = true;
+    if (agoo_metrics_on) {
+	res->ready = dtime();
+    }
+    agoo_ready_touch(res->con->link);
+    pthread_mutex_unlock(&res->lock);
+
+    return err->code;
+}
+
+// Drops what was not written and wakes a waiting writer so it can find out
+// the connection is gone. The response is kept until the stream is closed.
+void
+agoo_res_stream_gone(agooRes res) {
+    agooText	t;
+
+    pthread_mutex_lock(&res->lock);
+    res->gone = true;
+    while (NULL != (t = res->message)) {
+	res->message = t->next;
+	agoo_text_release(t);
+    }
+    res->pending = 0;
+    pthread_cond_broadcast(&res->drained);
+    pthread_mutex_unlock(&res->lock);
+}
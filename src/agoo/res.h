@@ -5,12 +5,17 @@
 
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "atomic.h"
 #include "con.h"
 #include "early.h"
 #include "text.h"
 
+// Bytes a streamed response can have waiting to be written before the
+// writer is made to wait.
+#define AGOO_STREAM_MAX	(1024 * 1024)
+
 struct _agooCon;
 
 typedef struct _agooRes {
@@ -18,19 +23,46 @@ typedef struct _agooRes {
     struct _agooCon	*con;
     volatile agooText	message;
     pthread_mutex_t	lock; // a lock around message changes
+    pthread_cond_t	drained; // signaled as streamed texts are written
     volatile bool	final;
     agooConKind		con_kind;
     bool		close;
     bool		ping;
     bool		pong;
+    bool		stream;
+    bool		chunked;
+    bool		wait;    // false if the writer is on the con loop thread
+    bool		gone;    // connection closed while still streaming
+    long		pending; // streamed bytes not yet written
+    long		left;    // streamed body bytes still expected if not chunked
+    // HTTP/2 responses are framed from the HTTP/1.1 texts as they are written.
+    uint32_t		h2_id;     // stream or 0 if not HTTP/2
+    int64_t		h2_window; // stream send window
+    long		h2_off;    // how much of the first text has been framed
+    bool		h2_body;   // header sent so the texts are body
+    bool		h2_reset;  // stream reset by the client
+    int			mid;       // metrics route of the request
+    double		ready;     // when final was set if metrics are on
 } *agooRes;
 
+// Pool init function for the locks which are kept when a response is reused.
+extern void		agoo_res_init(void *obj);
 extern agooRes		agoo_res_create(struct _agooCon *con);
 extern void		agoo_res_destroy(agooRes res);
+// Called once the last byte has been written.
+extern void		agoo_res_written(agooRes res);
 
 extern void		agoo_res_message_push(agooRes res, agooText t);
 extern void		agoo_res_add_early(agooRes res, agooEarly early);
 extern agooText		agoo_res_message_peek(agooRes res);
 extern agooText		agoo_res_message_next(agooRes res);
 
+// A streamed response starts with a head that has the status line and
+// headers. If len is negative the body is sent with the chunked transfer
+// coding. Writes are queued and sent as the socket allows.
+extern void		agoo_res_stream_open(agooRes res, agooText head, long len, bool wait);
+extern int		agoo_res_stream_write(agooErr err, agooRes res, const char *buf, size_t len);
+extern int		agoo_res_stream_close(agooErr err, agooRes res);
+extern void		agoo_res_stream_gone(agooRes res);
+
 #endif // AGOO_RES_H
@@ -0,0 +1,605 @@
+// Copyright (c) 2018, Peter Ohler, All rights reserved.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "log.h"
+#include "router.h"
+
+// The router is a deterministic automaton over the characters of the
+// path. Each pattern is a sequence of literal characters, single segment
+// wildcards ('*' or '{name}') that take everything up to the next '/', and
+// a '**' that takes the rest of the path. A pattern position is a state and
+// each router node is the set of states a path prefix can be in. The sets
+// are worked out when the router is built so a lookup takes one step per
+// path character and never backtracks. Once the first registered hook that
+// fits is known its values are picked out of the path in a single pass.
+
+#define NODE_NONE	-1
+
+typedef struct _edge {
+    char	c;
+    int		to;
+} *Edge;
+
+typedef struct _agooRouteNode {
+    Edge	edges; // sorted by character
+    int		ecnt;
+    int		other; // for a character other than '/' with no edge
+    int		*ends; // routes that fit if the path ends here
+    int		end_cnt;
+    int		*rests; // routes that fit any non-empty rest of the path
+    int		rest_cnt;
+} *Node;
+
+// The hooks with patterns in hook order so the index is the precedence.
+typedef struct _agooRoute {
+    agooHook	hook;
+} *Route;
+
+// A pattern position used while building. The route is in the upper half
+// so sorted sets group by route.
+typedef uint64_t	State;
+
+typedef struct _set {
+    State	*states;
+    int		cnt;
+    int		size;
+} *Set;
+
+typedef struct _slot {
+    struct _slot	*next;
+    uint64_t		hash;
+    State		*states;
+    int			cnt;
+    int			node;
+} *Slot;
+
+#define SLOT_CNT	1024
+
+typedef struct _build {
+    agooRouter	r;
+    int		nsize;
+    Slot	slots[SLOT_CNT];
+    Slot	*work; // nodes not yet expanded
+    int		wcnt;
+    int		wsize;
+} *Build;
+
+static const char	one_key[] = "*";
+static const char	rest_key[] = "**";
+
+static inline State
+state_make(int route, int pos) {
+    return ((uint64_t)route << 32) | (uint32_t)pos;
+}
+
+static inline int
+state_route(State s) {
+    return (int)(s >> 32);
+}
+
+static inline int
+state_pos(State s) {
+    return (int)(uint32_t)s;
+}
+
+// Returns the position after a '{name}' that starts at pos or -1 if it is
+// not a parameter.
+static int
+param_end(const char *pat, int pos) {
+    int	i = pos + 1;
+
+    if ('{' != pat[pos]) {
+	return -1;
+    }
+    for (; '\0' != pat[i] && '}' != pat[i]; i++) {
+	if ('/' == pat[i] || '{' == pat[i]) {
+	    return -1;
+	}
+    }
+    if ('}' != pat[i] || pos + 1 == i) {
+	return -1;
+    }
+    return i + 1;
+}
+
+static bool
+is_rest(const char *pat, int pos) {
+    return '*' == pat[pos] && '*' == pat[pos + 1];
+}
+
+// Returns the position after a single segment wildcard at pos or -1.
+static int
+wild_end(const char *pat, int pos) {
+    if ('*' == pat[pos]) {
+	return is_rest(pat, pos) ? -1 : pos + 1;
+    }
+    return param_end(pat, pos);
+}
+
+static bool
+set_push(Set set, State s) {
+    int	i;
+
+    for (i = 0; i < set->cnt; i++) {
+	if (s == set->states[i]) {
+	    return true;
+	}
+    }
+    if (set->size <= set->cnt) {
+	int	size = (0 == set->size) ? 16 : set->size * 2;
+	State	*states = (State*)AGOO_REALLOC(set->states, sizeof(State) * size);
+
+	if (NULL == states) {
+	    return false;
+	}
+	set->states = states;
+	set->size = size;
+    }
+    set->states[set->cnt++] = s;
+
+    return true;
+}
+
+// Adds the state along with the states reached without taking a
+// character. A wildcard takes all it can so the pattern only continues
+// past it at a '/' or, if it took something, at the end.
+static bool
+set_add(Set set, Route routes, int route, int pos, bool took) {
+    const char	*pat = routes[route].hook->pattern;
+    int		after = wild_end(pat, pos);
+
+    if (!set_push(set, state_make(route, pos))) {
+	return false;
+    }
+    if (0 < after && ('/' == pat[after] || ('\0' == pat[after] && took))) {
+	return set_add(set, routes, route, after, false);
+    }
+    return true;
+}
+
+static int
+state_cmp(const void *a, const void *b) {
+    State	sa = *(const State*)a;
+    State	sb = *(const State*)b;
+
+    return (sa < sb) ? -1 : (sa > sb);
+}
+
+// The states reached from the set by c or by any other character than '/'
+// or a literal in the set if c is '\0'.
+static bool
+set_step(Set from, Route routes, char c, Set to) {
+    int	i;
+
+    to->cnt = 0;
+    for (i = 0; i < from->cnt; i++) {
+	int		route = state_route(from->states[i]);
+	int		pos = state_pos(from->states[i]);
+	const char	*pat = routes[route].hook->pattern;
+
+	if (is_rest(pat, pos)) {
+	    if (!set_push(to, from->states[i])) {
+		return false;
+	    }
+	} else if (0 < wild_end(pat, pos)) {
+	    if ('/' != c && !set_add(to, routes, route, pos, true)) {
+		return false;
+	    }
+	} else if ('\0' != c && c == pat[pos]) {
+	    if (!set_add(to, routes, route, pos + 1, false)) {
+		return false;
+	    }
+	}
+    }
+    qsort(to->states, to->cnt, sizeof(State), state_cmp);
+
+    return true;
+}
+
+static uint64_t
+set_hash(Set set) {
+    uint64_t	h = 14695981039346656037ULL;
+    int		i;
+
+    for (i = 0; i < set->cnt; i++) {
+	h = (h ^ set->states[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static int
+route_list(Set set, Route routes, bool rest, int **listp) {
+    int		*list = NULL;
+    int		cnt = 0;
+    int		i;
+
+    for (i = 0; i < set->cnt; i++) {
+	int		route = state_route(set->states[i]);
+	int		pos = state_pos(set->states[i]);
+	const char	*pat = routes[route].hook->pattern;
+
+	if (rest ? is_rest(pat, pos) : '\0' == pat[pos]) {
+	    if (NULL == list && NULL == (list = (int*)AGOO_MALLOC(sizeof(int) * set->cnt))) {
+		return -1;
+	    }
+	    // Sorted sets keep the routes in order.
+	    list[cnt++] = route;
+	}
+    }
+    *listp = list;
+
+    return cnt;
+}
+
+// Returns the node for the set, adding it if new. An empty set has no node
+// so NODE_NONE is returned and -2 is returned on a memory error or when the
+// node limit is reached.
+static int
+node_get(agooErr err, Build b, Set set) {
+    agooRouter	r = b->r;
+    uint64_t	h;
+    Slot	slot;
+    Node	n;
+
+    if (0 == set->cnt) {
+	return NODE_NONE;
+    }
+    h = set_hash(set);
+    for (slot = b->slots[h % SLOT_CNT]; NULL != slot; slot = slot->next) {
+	if (h == slot->hash && set->cnt == slot->cnt && 0 == memcmp(set->states, slot->states, sizeof(State) * set->cnt)) {
+	    return slot->node;
+	}
+    }
+    if (AGOO_ROUTER_NODE_MAX <= r->ncnt) {
+	agoo_err_set(err, AGOO_ERR_TOO_MANY, "Router limit of %d nodes reached.", AGOO_ROUTER_NODE_MAX);
+	return -2;
+    }
+    if (NULL == (slot = (Slot)AGOO_CALLOC(1, sizeof(struct _slot))) ||
+	NULL == (slot->states = (State*)AGOO_MALLOC(sizeof(State) * set->cnt))) {
+	AGOO_FREE(slot);
+	AGOO_ERR_MEM(err, "Route");
+	return -2;
+    }
+    memcpy(slot->states, set->states, sizeof(State) * set->cnt);
+    slot->cnt = set->cnt;
+    slot->hash = h;
+    slot->node = r->ncnt;
+    slot->next = b->slots[h % SLOT_CNT];
+    b->slots[h % SLOT_CNT] = slot;
+
+    if (b->nsize <= r->ncnt) {
+	int	size = (0 == b->nsize) ? 64 : b->nsize * 2;
+	Node	nodes = (Node)AGOO_REALLOC(r->nodes, sizeof(struct _agooRouteNode) * size);
+
+	if (NULL == nodes) {
+	    AGOO_ERR_MEM(err, "Route");
+	    return -2;
+	}
+	r->nodes = nodes;
+	b->nsize = size;
+    }
+    n = &r->nodes[r->ncnt];
+    memset(n, 0, sizeof(*n));
+    n->other = NODE_NONE;
+    r->ncnt++;
+    if (0 > (n->end_cnt = route_list(set, r->routes, false, &n->ends)) ||
+	0 > (n->rest_cnt = route_list(set, r->routes, true, &n->rests))) {
+	AGOO_ERR_MEM(err, "Route");
+	return -2;
+    }
+    if (b->wsize <= b->wcnt) {
+	int	size = (0 == b->wsize) ? 64 : b->wsize * 2;
+	Slot	*work = (Slot*)AGOO_REALLOC(b->work, sizeof(Slot) * size);
+
+	if (NULL == work) {
+	    AGOO_ERR_MEM(err, "Route");
+	    return -2;
+	}
+	b->work = work;
+	b->wsize = size;
+    }
+    b->work[b->wcnt++] = slot;
+
+    return slot->node;
+}
+
+// Sets the edges of a node, one for each character that leads somewhere
+// other than where any character does.
+static int
+node_expand(agooErr err, Build b, Slot slot, Set from, Set to) {
+    agooRouter	r = b->r;
+    char	chars[257];
+    int		ccnt = 0;
+    int		i;
+    int		j;
+    int		to_node;
+
+    from->cnt = 0;
+    for (i = 0; i < slot->cnt; i++) {
+	if (!set_push(from, slot->states[i])) {
+	    return AGOO_ERR_MEM(err, "Route");
+	}
+    }
+    chars[ccnt++] = '/';
+    for (i = 0; i < from->cnt; i++) {
+	const char	*pat = r->routes[state_route(from->states[i])].hook->pattern;
+	char		c = pat[state_pos(from->states[i])];
+
+	if ('\0' == c || '/' == c || 0 < wild_end(pat, state_pos(from->states[i])) || is_rest(pat, state_pos(from->states[i]))) {
+	    continue;
+	}
+	for (j = 0; j < ccnt && c != chars[j]; j++) {
+	}
+	if (j == ccnt) {
+	    chars[ccnt++] = c;
+	}
+    }
+    if (!set_step(from, r->routes, '\0', to)) {
+	return AGOO_ERR_MEM(err, "Route");
+    }
+    if (-2 == (to_node = node_get(err, b, to))) {
+	return err->code;
+    }
+    r->nodes[slot->node].other = to_node;
+    for (i = 0; i < ccnt; i++) {
+	Node	n;
+
+	if (!set_step(from, r->routes, chars[i], to)) {
+	    return AGOO_ERR_MEM(err, "Route");
+	}
+	if (-2 == (to_node = node_get(err, b, to))) {
+	    return err->code;
+	}
+	n = &r->nodes[slot->node];
+	if (NODE_NONE == to_node || ('/' != chars[i] && to_node == n->other)) {
+	    continue;
+	}
+	if (NULL == n->edges && NULL == (n->edges = (Edge)AGOO_MALLOC(sizeof(struct _edge) * ccnt))) {
+	    return AGOO_ERR_MEM(err, "Route");
+	}
+	// Insertion keeps the edges sorted for the lookup.
+	for (j = n->ecnt; 0 < j && chars[i] < n->edges[j - 1].c; j--) {
+	    n->edges[j] = n->edges[j - 1];
+	}
+	n->edges[j].c = chars[i];
+	n->edges[j].to = to_node;
+	n->ecnt++;
+    }
+    return AGOO_ERR_OK;
+}
+
+static int
+route_check(agooErr err, const char *pattern) {
+    int	cnt = 0;
+    int	pos;
+
+    for (pos = 0; '\0' != pattern[pos]; pos++) {
+	if (is_rest(pattern, pos)) {
+	    cnt++;
+	    break;
+	}
+	if (0 < wild_end(pattern, pos)) {
+	    cnt++;
+	}
+    }
+    if (AGOO_PARAM_MAX < cnt) {
+	return agoo_err_set(err, AGOO_ERR_ARG, "Too many parameters in route pattern %s.", pattern);
+    }
+    return AGOO_ERR_OK;
+}
+
+static void
+nodes_free(agooRouter r) {
+    int	i;
+
+    for (i = 0; i < r->ncnt; i++) {
+	AGOO_FREE(r->nodes[i].edges);
+	AGOO_FREE(r->nodes[i].ends);
+	AGOO_FREE(r->nodes[i].rests);
+    }
+    AGOO_FREE(r->nodes);
+    r->nodes = NULL;
+    r->ncnt = 0;
+}
+
+agooRouter
+agoo_router_create(agooErr err, agooHook hooks) {
+    agooRouter		r = (agooRouter)AGOO_CALLOC(1, sizeof(struct _agooRouter));
+    struct _build	b;
+    struct _set		from = { NULL, 0, 0 };
+    struct _set		to = { NULL, 0, 0 };
+    agooHook		h;
+    Slot		slot;
+    int			cnt = 0;
+    int			i;
+
+    if (NULL == r) {
+	AGOO_ERR_MEM(err, "Router");
+	return NULL;
+    }
+    memset(&b, 0, sizeof(b));
+    b.r = r;
+    for (h = hooks; NULL != h; h = h->next) {
+	if (NULL != h->pattern) {
+	    if (AGOO_ERR_OK != route_check(err, h->pattern)) {
+		AGOO_FREE(r);
+		return NULL;
+	    }
+	    cnt++;
+	}
+    }
+    if (0 < cnt && NULL == (r->routes = (Route)AGOO_MALLOC(sizeof(struct _agooRoute) * cnt))) {
+	AGOO_FREE(r);
+	AGOO_ERR_MEM(err, "Router");
+	return NULL;
+    }
+    for (h = hooks; NULL != h; h = h->next) {
+	if (NULL != h->pattern) {
+	    r->routes[r->cnt++].hook = h;
+	}
+    }
+    for (i = 0; i < r->cnt; i++) {
+	if (!set_add(&from, r->routes, i, 0, false)) {
+	    AGOO_ERR_MEM(err, "Router");
+	    goto FAIL;
+	}
+    }
+    qsort(from.states, from.cnt, sizeof(State), state_cmp);
+    if (-2 == (r->start = node_get(err, &b, &from))) {
+	goto FAIL;
+    }
+    while (0 < b.wcnt) {
+	if (AGOO_ERR_OK != node_expand(err, &b, b.work[--b.wcnt], &from, &to)) {
+	    goto FAIL;
+	}
+    }
+FAIL:
+    for (i = 0; i < SLOT_CNT; i++) {
+	while (NULL != (slot = b.slots[i])) {
+	    b.slots[i] = slot->next;
+	    AGOO_FREE(slot->states);
+	    AGOO_FREE(slot);
+	}
+    }
+    AGOO_FREE(b.work);
+    AGOO_FREE(from.states);
+    AGOO_FREE(to.states);
+    if (AGOO_ERR_TOO_MANY == err->code) {
+	// Too large so drop the automaton and check each hook in turn.
+	agoo_log_cat(&agoo_warn_cat, "%s Hooks will be checked in order.", err->msg);
+	agoo_err_clear(err);
+	nodes_free(r);
+	r->start = NODE_NONE;
+	r->hooks = hooks;
+    }
+    if (AGOO_ERR_OK != err->code) {
+	agoo_router_destroy(r);
+	return NULL;
+    }
+    return r;
+}
+
+void
+agoo_router_destroy(agooRouter r) {
+    if (NULL != r) {
+	nodes_free(r);
+	AGOO_FREE(r->routes);
+	AGOO_FREE(r);
+    }
+}
+
+// Lowers best to the first route in the list for the method.
+static int
+routes_check(agooRouter r, int *list, int cnt, agooMethod method, int best) {
+    int	i;
+
+    for (i = 0; i < cnt && (best < 0 || list[i] < best); i++) {
+	agooHook	h = r->routes[list[i]].hook;
+
+	if (method == h->method || AGOO_ALL == h->method) {
+	    return list[i];
+	}
+    }
+    return best;
+}
+
+static int
+edge_find(Node n, char c) {
+    int	lo = 0;
+    int	hi = n->ecnt - 1;
+
+    while (lo <= hi) {
+	int	mid = (lo + hi) / 2;
+
+	if (c == n->edges[mid].c) {
+	    return n->edges[mid].to;
+	}
+	if (c < n->edges[mid].c) {
+	    hi = mid - 1;
+	} else {
+	    lo = mid + 1;
+	}
+    }
+    return ('/' == c) ? NODE_NONE : n->other;
+}
+
+// Picks the wildcard values out of a path the pattern is known to fit.
+static int
+params_fill(const char *pat, const char *p, const char *end, agooParam params) {
+    int	cnt = 0;
+    int	pos = 0;
+    int	after;
+
+    while ('\0' != pat[pos] && p < end) {
+	if (is_rest(pat, pos)) {
+	    params[cnt].key = rest_key;
+	    params[cnt].klen = 2;
+	    params[cnt].value = p;
+	    params[cnt].vlen = (int)(end - p);
+	    cnt++;
+	    break;
+	}
+	if (0 < (after = wild_end(pat, pos))) {
+	    if ('*' == pat[pos]) {
+		params[cnt].key = one_key;
+		params[cnt].klen = 1;
+	    } else {
+		params[cnt].key = pat + pos + 1;
+		params[cnt].klen = after - pos - 2;
+	    }
+	    params[cnt].value = p;
+	    for (; p < end && '/' != *p; p++) {
+	    }
+	    params[cnt].vlen = (int)(p - params[cnt].value);
+	    cnt++;
+	    pos = after;
+	    continue;
+	}
+	pos++;
+	p++;
+    }
+    return cnt;
+}
+
+agooHook
+agoo_router_find(agooRouter r, agooMethod method, const agooSeg path, agooParam params, int *pcnt) {
+    const char	*p = path->start;
+    const char	*end = path->end;
+    int		node = r->start;
+    int		best = -1;
+    Node	n;
+
+    *pcnt = 0;
+    if (1 < end - p && '/' == *(end - 1)) {
+	end--;
+    }
+    if (NULL != r->hooks) {
+	agooHook	h = agoo_hook_find(r->hooks, method, path);
+
+	if (NULL != h) {
+	    *pcnt = params_fill(h->pattern, path->start, end, params);
+	}
+	return h;
+    }
+    for (; p < end && NODE_NONE != node; p++) {
+	n = &r->nodes[node];
+	if (0 < n->rest_cnt) {
+	    best = routes_check(r, n->rests, n->rest_cnt, method, best);
+	}
+	node = edge_find(n, *p);
+    }
+    if (NODE_NONE != node) {
+	n = &r->nodes[node];
+	best = routes_check(r, n->ends, n->end_cnt, method, best);
+    }
+    if (best < 0) {
+	return NULL;
+    }
+    *pcnt = params_fill(r->routes[best].hook->pattern, path->start, end, params);
+
+    return r->routes[best].hook;
+}
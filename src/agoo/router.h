@@ -0,0 +1,50 @@
+// Copyright (c) 2018, Peter Ohler, All rights reserved.
+
+#ifndef AGOO_ROUTER_H
+#define AGOO_ROUTER_H
+
+#include "err.h"
+#include "hook.h"
+#include "method.h"
+#include "seg.h"
+
+#define AGOO_PARAM_MAX	8
+// Most nodes in a router. Wildcards can make the number of nodes grow
+// exponentially with the number of patterns so past this limit the router
+// gives up on the automaton and lookups use agoo_hook_find() instead.
+#define AGOO_ROUTER_NODE_MAX	16384
+
+// A value captured from the request path by a '*', '**', or '{name}'
+// pattern segment. The key is the name without the braces or "*" and "**"
+// for the wildcards.
+typedef struct _agooParam {
+    const char	*key;
+    int		klen;
+    const char	*value;
+    int		vlen;
+} *agooParam;
+
+struct _agooRoute;
+struct _agooRouteNode;
+
+// An automaton compiled from the hook list. Lookups take one step for each
+// character of the path instead of trying each hook pattern in turn. When
+// more than one hook matches, the first registered wins just as with
+// agoo_hook_find(). A router is not changed once created.
+typedef struct _agooRouter {
+    struct _agooRoute		*routes;
+    int				cnt;
+    struct _agooRouteNode	*nodes;
+    int				ncnt;
+    int				start; // -1 if nothing can match
+    agooHook			hooks; // set if the node limit was reached
+} *agooRouter;
+
+extern agooRouter	agoo_router_create(agooErr err, agooHook hooks);
+extern void		agoo_router_destroy(agooRouter r);
+
+// Returns the matching hook or NULL. The params array must have room for
+// AGOO_PARAM_MAX entries and the count is set in pcnt.
+extern agooHook		agoo_router_find(agooRouter r, agooMethod method, const agooSeg path, agooParam params, int *pcnt);
+
+#endif // AGOO_ROUTER_H
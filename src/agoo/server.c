@@ -2,6 +2,12 @@
 
 #include <fcntl.h>
 #include <netdb.h>
+#ifdef HAVE_OPENSSL_SSL_H
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
+#endif
 #include <netinet/tcp.h>
 #include <poll.h>
 #include <string.h>
@@ -18,11 +24,16 @@
 #include "http.h"
 #include "hook.h"
 #include "log.h"
+#include "metrics.h"
 #include "page.h"
 #include "pub.h"
+#include "body.h"
+#include "pool.h"
 #include "res.h"
+#include "router.h"
 #include "text.h"
 #include "upgraded.h"
+#include "workers.h"
 
 #include "server.h"
 
@@ -30,15 +41,26 @@
 
 struct _agooServer	agoo_server = {false};
 
+// Connections accepted by the listen thread come from here.
+static struct _agooPool	listen_con_pool;
+
 double	agoo_io_loop_ratio = 0.5;
 
 int
 agoo_server_setup(agooErr err) {
     memset(&agoo_server, 0, sizeof(struct _agooServer));
     pthread_mutex_init(&agoo_server.up_lock, 0);
+    pthread_rwlock_init(&agoo_server.route_lock, 0);
     agoo_server.up_list = NULL;
     agoo_server.gsub_list = NULL;
     agoo_server.max_push_pending = 32;
+    agoo_server.body_spill = AGOO_BODY_SPILL;
+    agoo_server.body_max = AGOO_BODY_MAX;
+    agoo_server.stream_max = AGOO_STREAM_MAX;
+    agoo_server.ticket_rotate = AGOO_TICKET_ROTATE;
+    agoo_server.shed_policy = AGOO_SHED_REJECT;
+    agoo_server.shed_wait = AGOO_SHED_WAIT;
+    agoo_pool_init(&listen_con_pool, sizeof(struct _agooCon), 256, agoo_con_init);
 
     if (AGOO_ERR_OK != agoo_pages_init(err) ||
 	AGOO_ERR_OK != agoo_queue_multi_init(err, &agoo_server.con_queue, 1024, false, true) ||
@@ -59,6 +81,17 @@ agoo_server_setup(agooErr err) {
 }
 
 #ifdef HAVE_OPENSSL_SSL_H
+typedef struct _ticketKey {
+    unsigned char	name[16];
+    unsigned char	aes[32];
+    unsigned char	hmac[32];
+    double		made; // 0 if not set
+} *TicketKey;
+
+// The current key is first and the previous one second.
+static struct _ticketKey	ticket_keys[2];
+static pthread_mutex_t		ticket_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static int
 ssl_error(agooErr err, const char *filename, int line) {
     char		buf[224];
@@ -68,6 +101,109 @@ ssl_error(agooErr err, const char *filename, int line) {
 
     return agoo_err_set(err, AGOO_ERR_TLS, "%s at %s:%d", buf, filename, line);
 }
+
+// Called with the ticket lock held.
+static bool
+ticket_rotate(double now) {
+    struct _ticketKey	key;
+
+    if (0.0 < ticket_keys[0].made && now < ticket_keys[0].made + agoo_server.ticket_rotate) {
+	return true;
+    }
+    if (1 != RAND_bytes(key.name, sizeof(key.name)) ||
+	1 != RAND_bytes(key.aes, sizeof(key.aes)) ||
+	1 != RAND_bytes(key.hmac, sizeof(key.hmac))) {
+	return false;
+    }
+    key.made = now;
+    ticket_keys[1] = ticket_keys[0];
+    ticket_keys[0] = key;
+
+    return true;
+}
+
+// Tickets are encrypted with the current key. A ticket from the previous
+// key is accepted and replaced. Any other ticket falls back to a full
+// handshake.
+static int
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+ticket_key_cb(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ctx, EVP_MAC_CTX *hctx, int enc) {
+#else
+ticket_key_cb(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ctx, HMAC_CTX *hctx, int enc) {
+#endif
+    struct _ticketKey	key;
+    int			ret = 1;
+
+    pthread_mutex_lock(&ticket_lock);
+    if (!ticket_rotate(dtime())) {
+	pthread_mutex_unlock(&ticket_lock);
+	return -1;
+    }
+    if (enc || 0 == memcmp(name, ticket_keys[0].name, sizeof(key.name))) {
+	key = ticket_keys[0];
+    } else if (0.0 < ticket_keys[1].made && 0 == memcmp(name, ticket_keys[1].name, sizeof(key.name))) {
+	key = ticket_keys[1];
+	ret = 2;
+    } else {
+	pthread_mutex_unlock(&ticket_lock);
+	return 0;
+    }
+    pthread_mutex_unlock(&ticket_lock);
+
+    if (enc) {
+	memcpy(name, key.name, sizeof(key.name));
+	if (1 != RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) ||
+	    1 != EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key.aes, iv)) {
+	    return -1;
+	}
+    } else if (1 != EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key.aes, iv)) {
+	return -1;
+    }
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    {
+	OSSL_PARAM	params[3];
+
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac, sizeof(key.hmac));
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+	params[2] = OSSL_PARAM_construct_end();
+	if (1 != EVP_MAC_CTX_set_params(hctx, params)) {
+	    return -1;
+	}
+    }
+#else
+    if (1 != HMAC_Init_ex(hctx, key.hmac, sizeof(key.hmac), EVP_sha256(), NULL)) {
+	return -1;
+    }
+#endif
+    return ret;
+}
+
+static void
+ssl_info(const SSL *ssl, int where, int ret) {
+    if (SSL_CB_HANDSHAKE_DONE & where) {
+	if (SSL_session_reused((SSL*)ssl)) {
+	    atomic_fetch_add(&agoo_server.tls_resumed, 1);
+	} else {
+	    atomic_fetch_add(&agoo_server.tls_full, 1);
+	}
+#ifdef SSL_OP_ENABLE_KTLS
+	if (BIO_get_ktls_send(SSL_get_wbio(ssl))) {
+	    atomic_fetch_add(&agoo_server.tls_ktls, 1);
+	}
+#endif
+    }
+}
+
+// Offers HTTP/2 to clients that support it with HTTP/1.1 as the fallback.
+static int
+alpn_select(SSL *ssl, const unsigned char **out, unsigned char *outlen, const unsigned char *in, unsigned int inlen, void *arg) {
+    static const unsigned char	protos[] = "\x02h2\x08http/1.1";
+
+    if (OPENSSL_NPN_NEGOTIATED != SSL_select_next_proto((unsigned char**)out, outlen, protos, sizeof(protos) - 1, in, inlen)) {
+	return SSL_TLSEXT_ERR_NOACK;
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
 #endif
 
 int
@@ -79,6 +215,29 @@ agoo_server_ssl_init(agooErr err, const char *cert_pem, const char *key_pem) {
 	return ssl_error(err, __FILE__, __LINE__);
     }
     SSL_CTX_set_ecdh_auto(agoo_server.ssl_ctx, 1);
+    SSL_CTX_set_alpn_select_cb(agoo_server.ssl_ctx, alpn_select, NULL);
+    SSL_CTX_set_info_callback(agoo_server.ssl_ctx, ssl_info);
+
+    // Clients that come back resume with a ticket or from the session
+    // cache which is shared by all the con loops.
+    SSL_CTX_set_session_id_context(agoo_server.ssl_ctx, (const unsigned char*)"agoo", 4);
+    SSL_CTX_set_session_cache_mode(agoo_server.ssl_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(agoo_server.ssl_ctx, AGOO_TLS_CACHE_SIZE);
+    if (0.0 < agoo_server.ticket_rotate) {
+	SSL_CTX_set_timeout(agoo_server.ssl_ctx, (long)(agoo_server.ticket_rotate * 2.0));
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	SSL_CTX_set_tlsext_ticket_key_evp_cb(agoo_server.ssl_ctx, ticket_key_cb);
+#else
+	SSL_CTX_set_tlsext_ticket_key_cb(agoo_server.ssl_ctx, ticket_key_cb);
+#endif
+    } else {
+	SSL_CTX_set_options(agoo_server.ssl_ctx, SSL_OP_NO_TICKET);
+    }
+#ifdef SSL_OP_ENABLE_KTLS
+    // The kernel does the record encryption when it can so file bodies
+    // can be sent with sendfile.
+    SSL_CTX_set_options(agoo_server.ssl_ctx, SSL_OP_ENABLE_KTLS);
+#endif
 
     if (!SSL_CTX_use_certificate_file(agoo_server.ssl_ctx, cert_pem, SSL_FILETYPE_PEM)) {
 	return ssl_error(err, __FILE__, __LINE__);
@@ -93,10 +252,17 @@ agoo_server_ssl_init(agooErr err, const char *cert_pem, const char *key_pem) {
     return AGOO_ERR_OK;
 }
 
+void
+agoo_server_tls_stats(agooTlsStats stats) {
+    stats->full = (long)atomic_load(&agoo_server.tls_full);
+    stats->resumed = (long)atomic_load(&agoo_server.tls_resumed);
+    stats->ktls = (long)atomic_load(&agoo_server.tls_ktls);
+}
+
 static void
 add_con_loop() {
     struct _agooErr	err = AGOO_ERR_INIT;
-    agooConLoop		loop = agoo_conloop_create(&err, 0);
+    agooConLoop		loop = agoo_conloop_create(&err, agoo_server.loop_cnt);
 
     if (NULL != loop) {
 	loop->next = agoo_server.con_loops;
@@ -105,9 +271,29 @@ add_con_loop() {
     }
 }
 
+uint64_t
+agoo_server_con_id() {
+    return (uint64_t)atomic_fetch_add(&agoo_server.con_id, 1) + 1;
+}
+
+// Sets up a newly accepted socket. The socket is expected to be non-blocking
+// already.
+void
+agoo_server_sock_opts(int sock) {
+    int	optval = 1;
+
+#ifdef OSX_OS
+    setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &optval, sizeof(optval));
+#endif
+#ifdef PLATFORM_LINUX
+    setsockopt(sock, IPPROTO_TCP, TCP_QUICKACK, &optval, sizeof(optval));
+#endif
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &optval, sizeof(optval));
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+}
+
 static void*
 listen_loop(void *x) {
-    int			optval = 1;
     struct pollfd	pa[100];
     struct pollfd	*p;
     struct _agooErr	err = AGOO_ERR_INIT;
@@ -117,15 +303,22 @@ listen_loop(void *x) {
     socklen_t		alen = 0;
     agooCon		con;
     int			i;
-    uint64_t		cnt = 0;
     agooBind		b;
 
     for (b = agoo_server.binds, p = pa; NULL != b; b = b->next, p++, pcnt++) {
+	if (agoo_server.reuse_port && NULL == b->name) {
+	    // Accepted by the con loops. A negative fd is ignored by poll().
+	    p->fd = -1;
+	    p->events = 0;
+	    p->revents = 0;
+	    continue;
+	}
 	p->fd = b->fd;
 	p->events = POLLIN;
 	p->revents = 0;
     }
     memset(&client_addr, 0, sizeof(client_addr));
+    agoo_pool_own(&listen_con_pool);
     atomic_fetch_add(&agoo_server.running, 1);
     while (agoo_server.active) {
 	if (0 > (i = poll(pa, pcnt, 200))) {
@@ -143,25 +336,18 @@ listen_loop(void *x) {
 	    if (0 != (p->revents & POLLIN)) {
 		if (0 > (client_sock = accept(p->fd, (struct sockaddr*)&client_addr, &alen))) {
 		    agoo_log_cat(&agoo_error_cat, "Server with pid %d accept connection failed. %s.", getpid(), strerror(errno));
-		} else if (NULL == (con = agoo_con_create(&err, client_sock, ++cnt, b))) {
+		} else if (NULL == (con = agoo_con_create(&err, &listen_con_pool, client_sock, agoo_server_con_id(), b))) {
 		    agoo_log_cat(&agoo_error_cat, "Server with pid %d accept connection failed. %s.", getpid(), err.msg);
 		    close(client_sock);
-		    cnt--;
 		    agoo_err_clear(&err);
 		} else {
 		    int	con_cnt;
-#ifdef OSX_OS
-		    setsockopt(client_sock, SOL_SOCKET, SO_NOSIGPIPE, &optval, sizeof(optval));
-#endif
-#ifdef PLATFORM_LINUX
-		    setsockopt(client_sock, IPPROTO_TCP, TCP_QUICKACK, &optval, sizeof(optval));
-#endif
+
 		    fcntl(client_sock, F_SETFL, O_NONBLOCK);
 		    //fcntl(client_sock, F_SETFL, FNDELAY);
-		    setsockopt(client_sock, SOL_SOCKET, SO_KEEPALIVE, &optval, sizeof(optval));
-		    setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+		    agoo_server_sock_opts(client_sock);
 		    agoo_log_cat(&agoo_con_cat, "Server with pid %d accepted connection %llu on %s [%d]",
-				 getpid(), (unsigned long long)cnt, b->id, con->sock);
+				 getpid(), (unsigned long long)con->id, b->id, con->sock);
 
 		    con_cnt = atomic_fetch_add(&agoo_server.con_cnt, 1);
 		    if (agoo_server.loop_max > agoo_server.loop_cnt && agoo_server.loop_cnt * LOOP_UP < con_cnt) {
@@ -194,19 +380,39 @@ agoo_server_start(agooErr err, const char *app_name, const char *version) {
     double	giveup;
     int		xcnt = 0;
     int		stat;
+    bool	need_listen = true;
 
-    if (0 != (stat = pthread_create(&agoo_server.listen_thread, NULL, listen_loop, NULL))) {
-	return agoo_err_set(err, stat, "Failed to create server listener thread. %s", strerror(stat));
+    if (agoo_server.reuse_port) {
+	agooBind	b;
+
+	// The listen thread is only needed for named Unix sockets.
+	need_listen = false;
+	for (b = agoo_server.binds; NULL != b; b = b->next) {
+	    if (NULL != b->name) {
+		need_listen = true;
+		break;
+	    }
+	}
+    }
+    if (NULL == (agoo_server.router = agoo_router_create(err, agoo_server.hooks)) ||
+	AGOO_ERR_OK != agoo_metrics_start(err, agoo_server.hooks)) {
+	return err->code;
+    }
+    if (need_listen) {
+	if (0 != (stat = pthread_create(&agoo_server.listen_thread, NULL, listen_loop, NULL))) {
+	    return agoo_err_set(err, stat, "Failed to create server listener thread. %s", strerror(stat));
+	}
+	xcnt++;
     }
-    xcnt++;
     agoo_server.con_loops = agoo_conloop_create(err, 0);
     agoo_server.loop_cnt = 1;
     xcnt++;
 
     // If the eval thread count is 1 that implies the eval load is low so
     // might as well create the maximum number of con threads as is
-    // reasonable.
-    if (1 >= agoo_server.thread_cnt) {
+    // reasonable. Loops can not be added later when each loop accepts on
+    // its own socket so they are all created now in that case as well.
+    if (1 >= agoo_server.thread_cnt || agoo_server.reuse_port) {
 	while (agoo_server.loop_cnt < agoo_server.loop_max) {
 	    add_con_loop();
 	    xcnt++;
@@ -254,7 +460,9 @@ agoo_server_shutdown(const char *app_name, void (*stop)()) {
 	    double	giveup = dtime() + 1.0;
 
 	    agoo_server.active = false;
-	    pthread_detach(agoo_server.listen_thread);
+	    if (0 != agoo_server.listen_thread) {
+		pthread_detach(agoo_server.listen_thread);
+	    }
 	    for (loop = agoo_server.con_loops; NULL != loop; loop = loop->next) {
 		pthread_detach(loop->thread);
 	    }
@@ -267,17 +475,21 @@ agoo_server_shutdown(const char *app_name, void (*stop)()) {
 	    if (NULL != stop) {
 		stop();
 	    }
+	    agoo_router_destroy(agoo_server.router);
+	    agoo_server.router = NULL;
 	    while (NULL != agoo_server.hooks) {
 		agooHook	h = agoo_server.hooks;
 
 		agoo_server.hooks = h->next;
 		agoo_hook_destroy(h);
 	    }
+	    agoo_metrics_cleanup();
 	}
 	while (NULL != agoo_server.binds) {
 	    agooBind	b = agoo_server.binds;
 
 	    agoo_server.binds = b->next;
+	    agoo_bind_close(b);
 	    agoo_bind_destroy(b);
 	}
 	agoo_queue_cleanup(&agoo_server.con_queue);
@@ -285,7 +497,14 @@ agoo_server_shutdown(const char *app_name, void (*stop)()) {
 	    agoo_server.con_loops = loop->next;
 	    agoo_conloop_destroy(loop);
 	}
+	agoo_pool_cleanup(&listen_con_pool);
 	agoo_queue_cleanup(&agoo_server.eval_queue);
+	while (NULL != agoo_server.workers) {
+	    agooWorkers	w = agoo_server.workers;
+
+	    agoo_server.workers = w->next;
+	    agoo_workers_destroy(w);
+	}
 
 	agoo_pages_cleanup();
 	agoo_http_cleanup();
@@ -345,6 +564,43 @@ agoo_server_add_upgraded(agooUpgraded up) {
     pthread_mutex_unlock(&agoo_server.up_lock);
 }
 
+// Once started the router is replaced by one that includes the new hook.
+// The write lock waits for lookups on the old router to finish.
+static int
+add_hook(agooErr err, agooHook hook) {
+    agooHook	h;
+    agooHook	prev = NULL;
+    agooRouter	old;
+
+    pthread_rwlock_wrlock(&agoo_server.route_lock);
+    for (h = agoo_server.hooks; NULL != h; h = h->next) {
+	prev = h;
+    }
+    if (NULL != prev) {
+	prev->next = hook;
+    } else {
+	agoo_server.hooks = hook;
+    }
+    if (NULL != (old = agoo_server.router)) {
+	if (NULL == (agoo_server.router = agoo_router_create(err, agoo_server.hooks))) {
+	    agoo_server.router = old;
+	    if (NULL != prev) {
+		prev->next = NULL;
+	    } else {
+		agoo_server.hooks = NULL;
+	    }
+	    pthread_rwlock_unlock(&agoo_server.route_lock);
+	    agoo_hook_destroy(hook);
+
+	    return err->code;
+	}
+	agoo_router_destroy(old);
+    }
+    pthread_rwlock_unlock(&agoo_server.route_lock);
+
+    return AGOO_ERR_OK;
+}
+
 int
 agoo_server_add_func_hook(agooErr	err,
 			  agooMethod	method,
@@ -352,21 +608,48 @@ agoo_server_add_func_hook(agooErr	err,
 			  void		(*func)(agooReq req),
 			  agooQueue	queue,
 			  bool		quick) {
-    agooHook	h;
-    agooHook	prev = NULL;
     agooHook	hook = agoo_hook_func_create(method, pattern, func, queue);
 
     if (NULL == hook) {
 	return AGOO_ERR_MEM(err, "HTTP Server Hook");
     }
     hook->no_queue = quick;
+
+    return add_hook(err, hook);
+}
+
+int
+agoo_server_add_workers_hook(agooErr		err,
+			     agooMethod		method,
+			     const char		*pattern,
+			     void		(*func)(agooReq req),
+			     agooWorkers	workers) {
+    agooHook	hook;
+
+    if (NULL == workers) {
+	return agoo_err_set(err, AGOO_ERR_ARG, "a worker pool is required");
+    }
+    if (NULL == (hook = agoo_hook_func_create(method, pattern, func, &workers->queue))) {
+	return AGOO_ERR_MEM(err, "HTTP Server Hook");
+    }
+    hook->workers = workers;
+
+    return add_hook(err, hook);
+}
+
+int
+agoo_server_hook_priority(agooErr err, agooMethod method, const char *pattern, int priority) {
+    agooHook	h;
+    int		cnt = 0;
+
     for (h = agoo_server.hooks; NULL != h; h = h->next) {
-	prev = h;
+	if (method == h->method && NULL != h->pattern && 0 == strcmp(pattern, h->pattern)) {
+	    h->priority = priority;
+	    cnt++;
+	}
     }
-    if (NULL != prev) {
-	prev->next = hook;
-    } else {
-	agoo_server.hooks = hook;
+    if (0 == cnt) {
+	return agoo_err_set(err, AGOO_ERR_NOT_FOUND, "no hook for %s", pattern);
     }
     return AGOO_ERR_OK;
 }
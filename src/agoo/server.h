@@ -5,6 +5,7 @@
 
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #ifdef HAVE_OPENSSL_SSL_H
 #include <openssl/bio.h>
@@ -18,6 +19,14 @@
 #include "gqleval.h"
 #include "hook.h"
 #include "queue.h"
+#include "router.h"
+#include "shed.h"
+
+// Session ticket keys are replaced this often. Tickets from the previous
+// key are still accepted so a ticket is good for up to twice as long.
+#define AGOO_TICKET_ROTATE	3600.0
+#define AGOO_TLS_CACHE_SIZE	20480
+#define AGOO_SHED_WAIT		0.25
 
 struct _agooCon;
 struct _agooConLoop;
@@ -27,6 +36,12 @@ struct _agooUpgraded;
 struct _gqlSub;
 struct _gqlValue;
 
+typedef struct _agooTlsStats {
+    long	full;
+    long	resumed;
+    long	ktls;
+} *agooTlsStats;
+
 typedef struct _agooServer {
     volatile bool		inited;
     volatile bool		active;
@@ -35,29 +50,50 @@ typedef struct _agooServer {
     bool			root_first;
     bool			rack_early_hints;
     bool			tls;
+    // If true each con loop accepts on its own SO_REUSEPORT socket for
+    // TCP binds instead of connections coming from the listen thread.
+    bool			reuse_port;
     pthread_t			listen_thread;
     struct _agooQueue		con_queue;
     agooHook			hooks;
+    agooRouter			router; // compiled from hooks on start
+    pthread_rwlock_t		route_lock; // write locked to replace the router
     agooHook			hook404;
     agooBind			binds;
 
     struct _agooQueue		eval_queue;
+    struct _agooWorkers		*workers; // named pools for selected hooks
+    agooShedPolicy		shed_policy;
+    double			shed_deadline; // seconds a request may be queued, 0 for no limit
+    double			shed_wait; // average wait that sheds low priority routes
+    atomic_int			shed_wait_avg; // microseconds
+    atomic_int			shed_full;
+    atomic_int			shed_priority;
+    atomic_int			shed_expired;
 
     struct _agooConLoop		*con_loops;
     int				loop_max;
     int				loop_cnt;
     atomic_int			con_cnt;
+    atomic_ullong		con_id;
 
     struct _agooUpgraded	*up_list;
     struct _gqlSub		*gsub_list;
     pthread_mutex_t		up_lock;
     int				max_push_pending;
+    size_t			body_spill; // larger bodies go to a temp file
+    size_t			body_max;   // larger bodies are refused with a 413
+    size_t			stream_max; // streamed bytes waiting before writers block
     void			*env_nil_value;
     void			*ctx_nil_value;
 
 #ifdef HAVE_OPENSSL_SSL_H
     SSL_CTX			*ssl_ctx;
 #endif
+    double			ticket_rotate; // seconds, tickets are off if 0
+    atomic_int			tls_full;    // handshakes that made a session
+    atomic_int			tls_resumed; // handshakes that reused one
+    atomic_int			tls_ktls;    // handshakes that enabled kernel TLS
     // A count of the running threads from the wrapper or the server managed
     // threads.
     atomic_int			running;
@@ -67,9 +103,12 @@ extern int	agoo_server_setup(agooErr err);
 extern void	agoo_server_shutdown(const char *app_name, void (*stop)());
 extern void	agoo_server_bind(agooBind b);
 extern int	agoo_server_ssl_init(agooErr err, const char *cert_pem, const char *key_pem);
+extern void	agoo_server_tls_stats(agooTlsStats stats);
 
 extern int	setup_listen(agooErr err);
 extern int	agoo_server_start(agooErr err, const char *app_name, const char *version);
+extern void	agoo_server_sock_opts(int sock);
+extern uint64_t	agoo_server_con_id();
 
 extern void	agoo_server_add_upgraded(struct _agooUpgraded *up);
 extern int	agoo_server_add_func_hook(agooErr	err,
@@ -78,6 +117,14 @@ extern int	agoo_server_add_func_hook(agooErr	err,
 					  void		(*func)(struct _agooReq *req),
 					  agooQueue	queue,
 					  bool		quick);
+extern int	agoo_server_add_workers_hook(agooErr			err,
+					     agooMethod			method,
+					     const char			*pattern,
+					     void			(*func)(struct _agooReq *req),
+					     struct _agooWorkers	*workers);
+// Sets the priority of the hooks with the method and pattern. Only used with
+// the AGOO_SHED_PRIORITY policy.
+extern int	agoo_server_hook_priority(agooErr err, agooMethod method, const char *pattern, int priority);
 
 extern void	agoo_server_publish(struct _agooPub *pub);
 
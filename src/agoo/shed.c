@@ -0,0 +1,99 @@
+// Copyright (c) 2018, Peter Ohler, All rights reserved.
+
+#include <string.h>
+
+#include "dtime.h"
+#include "hook.h"
+#include "metrics.h"
+#include "req.h"
+#include "res.h"
+#include "server.h"
+#include "text.h"
+#include "shed.h"
+
+static const char	busy_msg[] = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n";
+
+// Low priority routes are shed once the queue is half full or requests wait
+// too long on average. Normal routes leave the last eighth of the queue for
+// high priority routes which are only turned away when the queue is full.
+static bool
+overloaded(agooQueue q, int priority) {
+    size_t	cap = q->mask + 1;
+    size_t	depth = (size_t)agoo_queue_count(q);
+
+    if (AGOO_PRIORITY_LOW >= priority) {
+	if (cap / 2 <= depth) {
+	    return true;
+	}
+	// The average is only updated as requests are taken so an empty
+	// queue means it is stale.
+	return (0 < depth && 0.0 < agoo_server.shed_wait &&
+		agoo_server.shed_wait * 1000000.0 <= (double)atomic_load(&agoo_server.shed_wait_avg));
+    }
+    return cap - cap / 8 <= depth;
+}
+
+bool
+agoo_shed_push(agooReq req) {
+    agooQueue	q = req->hook->queue;
+
+    req->queued = dtime();
+    switch (agoo_server.shed_policy) {
+    case AGOO_SHED_BLOCK:
+	agoo_queue_push(q, (void*)req);
+	return true;
+    case AGOO_SHED_PRIORITY:
+	if (AGOO_PRIORITY_HIGH > req->hook->priority && overloaded(q, req->hook->priority)) {
+	    atomic_fetch_add(&agoo_server.shed_priority, 1);
+	    return false;
+	}
+	break;
+    default:
+	break;
+    }
+    if (!agoo_queue_try_push(q, (void*)req)) {
+	atomic_fetch_add(&agoo_server.shed_full, 1);
+	return false;
+    }
+    return true;
+}
+
+bool
+agoo_shed_expired(agooReq req) {
+    double	wait;
+    int		avg;
+
+    if (0.0 >= req->queued) {
+	return false;
+    }
+    wait = dtime() - req->queued;
+    if (agoo_metrics_on) {
+	agoo_metrics_record(req->hook->mid, AGOO_METRIC_QUEUE, wait);
+    }
+
+    // A moving average in microseconds. Updates from different threads can
+    // race but the result is still close enough to judge the load.
+    avg = (int)(long)atomic_load(&agoo_server.shed_wait_avg);
+    avg += ((int)(wait * 1000000.0) - avg) / 8;
+    atomic_store(&agoo_server.shed_wait_avg, avg);
+
+    if (0.0 < agoo_server.shed_deadline && agoo_server.shed_deadline < wait && NULL != req->res) {
+	atomic_fetch_add(&agoo_server.shed_expired, 1);
+	agoo_shed_reply(req);
+	return true;
+    }
+    return false;
+}
+
+void
+agoo_shed_reply(agooReq req) {
+    agoo_res_message_push(req->res, agoo_text_create(busy_msg, sizeof(busy_msg) - 1));
+}
+
+void
+agoo_shed_stats(agooShedStats stats) {
+    stats->full = (long)atomic_load(&agoo_server.shed_full);
+    stats->priority = (long)atomic_load(&agoo_server.shed_priority);
+    stats->expired = (long)atomic_load(&agoo_server.shed_expired);
+    stats->wait = (double)(long)atomic_load(&agoo_server.shed_wait_avg) / 1000000.0;
+}
@@ -0,0 +1,43 @@
+// Copyright (c) 2018, Peter Ohler, All rights reserved.
+
+#ifndef AGOO_SHED_H
+#define AGOO_SHED_H
+
+#include <stdbool.h>
+
+#include "queue.h"
+
+#define AGOO_PRIORITY_LOW	-1
+#define AGOO_PRIORITY_NORMAL	0
+#define AGOO_PRIORITY_HIGH	1
+
+// How requests are handled when the eval threads fall behind.
+typedef enum {
+    AGOO_SHED_BLOCK	= 'b', // the con loop waits for room in the queue
+    AGOO_SHED_REJECT	= 'r', // 503 once the queue is full
+    AGOO_SHED_PRIORITY	= 'p', // also turn away lower priority routes early
+} agooShedPolicy;
+
+typedef struct _agooShedStats {
+    long	full;     // rejected with a full queue
+    long	priority; // shed because of route priority
+    long	expired;  // waited longer than the deadline
+    double	wait;     // average time spent in the queue
+} *agooShedStats;
+
+struct _agooReq;
+
+// Queues a request that has a hook according to the shed policy. Returns
+// false if the request was not queued and should be answered with
+// agoo_shed_reply().
+extern bool	agoo_shed_push(struct _agooReq *req);
+
+// Called by the eval threads on each request taken from a queue. Returns
+// true if the request waited past the deadline and has been answered and
+// should be destroyed without being evaluated.
+extern bool	agoo_shed_expired(struct _agooReq *req);
+
+extern void	agoo_shed_reply(struct _agooReq *req);
+extern void	agoo_shed_stats(agooShedStats stats);
+
+#endif // AGOO_SHED_H
@@ -1,13 +1,38 @@
 // Copyright 2016, 2018 by Peter Ohler, All Rights Reserved
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "debug.h"
+#include "pool.h"
 #include "text.h"
 
+#define TEXT_HEAD	(sizeof(struct _agooText) - AGOO_TEXT_MIN_SIZE)
+#define CLASS_MIN	128
+#define CLASS_MAX	(CLASS_MIN << (AGOO_TEXT_CLASS_CNT - 1))
+#define CACHE_BYTES	(256 * 1024) // per size class
+
+// A cache is owned by one thread at a time. When the thread exits the cache
+// is emptied and left on the list for the next new thread to take over since
+// texts from it may still be in use and will be freed back to it.
+typedef struct _cache {
+    struct _cache	*next;
+    struct _agooPool	pools[AGOO_TEXT_CLASS_CNT];
+    long		allocs;
+    long		misses;
+    bool		active;
+} *Cache;
+
+static Cache		caches = NULL;
+static pthread_mutex_t	caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t	cache_key;
+static pthread_once_t	cache_once = PTHREAD_ONCE_INIT;
+static __thread Cache	thread_cache = NULL;
+
 static const char	hex_chars[17] = "0123456789abcdef";
 
 static char	json_chars[256] = "\
@@ -42,17 +67,143 @@ json_size(const char *str, size_t len) {
 }
 
 
+static void
+cache_release(void *ptr) {
+    Cache	c = (Cache)ptr;
+    int		i;
+
+    pthread_mutex_lock(&caches_lock);
+    for (i = 0; i < AGOO_TEXT_CLASS_CNT; i++) {
+	agoo_pool_disown(c->pools + i);
+    }
+    c->active = false;
+    pthread_mutex_unlock(&caches_lock);
+}
+
+static void
+cache_key_create(void) {
+    pthread_key_create(&cache_key, cache_release);
+}
+
+// Called by the pools only when a new buffer has to be allocated.
+static void
+text_miss(void *obj) {
+    thread_cache->misses++;
+}
+
+static Cache
+cache_get(void) {
+    Cache	c;
+    int		i;
+
+    if (NULL != thread_cache) {
+	return thread_cache;
+    }
+    pthread_once(&cache_once, cache_key_create);
+    pthread_mutex_lock(&caches_lock);
+    for (c = caches; NULL != c; c = c->next) {
+	if (!c->active) {
+	    break;
+	}
+    }
+    if (NULL == c) {
+	if (NULL == (c = (Cache)AGOO_CALLOC(1, sizeof(struct _cache)))) {
+	    pthread_mutex_unlock(&caches_lock);
+	    return NULL;
+	}
+	for (i = 0; i < AGOO_TEXT_CLASS_CNT; i++) {
+	    size_t	size = CLASS_MIN << i;
+
+	    agoo_pool_init(c->pools + i, size, (int)(CACHE_BYTES / size), text_miss);
+	}
+	c->next = caches;
+	caches = c;
+    }
+    c->active = true;
+    pthread_mutex_unlock(&caches_lock);
+    for (i = 0; i < AGOO_TEXT_CLASS_CNT; i++) {
+	agoo_pool_own(c->pools + i);
+    }
+    pthread_setspecific(cache_key, c);
+    thread_cache = c;
+
+    return c;
+}
+
+// Allocates room for at least alen characters. Any space left in the size
+// class is added to alen.
+static agooText
+text_alloc(long alen) {
+    size_t	size;
+    agooText	t;
+    Cache	c;
+
+    if (alen < AGOO_TEXT_MIN_SIZE) {
+	alen = AGOO_TEXT_MIN_SIZE;
+    }
+    size = TEXT_HEAD + alen + 1;
+    if (size <= CLASS_MAX && NULL != (c = cache_get())) {
+	int	i;
+
+	for (i = 0; (size_t)(CLASS_MIN << i) < size; i++) {
+	}
+	c->allocs++;
+	if (NULL == (t = (agooText)agoo_pool_alloc(c->pools + i, 0))) {
+	    return NULL;
+	}
+	alen = (CLASS_MIN << i) - TEXT_HEAD - 1;
+    } else if (NULL == (t = (agooText)agoo_pool_alloc(NULL, size))) {
+	return NULL;
+    }
+    t->next = NULL;
+    t->len = 0;
+    t->alen = alen;
+    t->bin = false;
+    t->fd = -1;
+    t->flen = 0;
+    t->foff = 0;
+    atomic_init(&t->ref_cnt, 0);
+    *t->text = '\0';
+
+    return t;
+}
+
+// Moves the text to a larger buffer just as realloc would.
+static agooText
+text_grow(agooText t, long alen) {
+    size_t	size = TEXT_HEAD + alen + 1;
+    agooText	nt;
+
+    if (CLASS_MAX < size) {
+	if (NULL == (nt = (agooText)agoo_pool_realloc(t, size))) {
+	    return NULL;
+	}
+	nt->alen = alen;
+
+	return nt;
+    }
+    if (NULL == (nt = text_alloc(alen))) {
+	return NULL;
+    }
+    nt->next = t->next;
+    nt->len = t->len;
+    nt->bin = t->bin;
+    nt->fd = t->fd;
+    nt->flen = t->flen;
+    nt->foff = t->foff;
+    atomic_store(&nt->ref_cnt, atomic_load(&t->ref_cnt));
+    memcpy(nt->text, t->text, t->len + 1);
+    agoo_pool_free(t);
+
+    return nt;
+}
+
 agooText
 agoo_text_create(const char *str, int len) {
-    size_t	alen = (AGOO_TEXT_MIN_SIZE <= len) ? len : AGOO_TEXT_MIN_SIZE;
-    agooText	t = (agooText)AGOO_MALLOC(sizeof(struct _agooText) + alen + 1);
+    agooText	t = text_alloc(len);
 
     if (NULL != t) {
-	t->next = NULL;
 	t->len = len;
-	t->alen = alen;
-	t->bin = false;
-	atomic_init(&t->ref_cnt, 0);
 	memcpy(t->text, str, len);
 	t->text[len] = '\0';
     }
@@ -64,12 +215,8 @@ agoo_text_dup(agooText t0) {
     agooText	t = NULL;
 
     if (NULL != t0) {
-	if (NULL != (t = (agooText)AGOO_MALLOC(sizeof(struct _agooText) - AGOO_TEXT_MIN_SIZE + t0->alen + 1))) {
-	    t->next = NULL;
+	if (NULL != (t = text_alloc(t0->alen))) {
 	    t->len = t0->len;
-	    t->alen = t0->alen;
-	    t->bin = false;
-	    atomic_init(&t->ref_cnt, 0);
 	    memcpy(t->text, t0->text, t0->len + 1);
 	}
     }
@@ -78,18 +225,7 @@ agoo_text_dup(agooText t0) {
 
 agooText
 agoo_text_allocate(int len) {
-    size_t	alen = (AGOO_TEXT_MIN_SIZE <= len) ? len : AGOO_TEXT_MIN_SIZE;
-    agooText	t = (agooText)AGOO_MALLOC(sizeof(struct _agooText) + alen + 1);
-
-    if (NULL != t) {
-	t->next = NULL;
-	t->len = 0;
-	t->alen = alen;
-	t->bin = false;
-	atomic_init(&t->ref_cnt, 0);
-	*t->text = '\0';
-    }
-    return t;
+    return text_alloc(len);
 }
 
 void
@@ -100,7 +236,10 @@ agoo_text_ref(agooText t) {
 void
 agoo_text_release(agooText t) {
     if (1 >= atomic_fetch_sub(&t->ref_cnt, 1)) {
-	AGOO_FREE(t);
+	if (0 <= t->fd) {
+	    close(t->fd);
+	}
+	agoo_pool_free(t);
     }
 }
 
@@ -114,12 +253,10 @@ agoo_text_append(agooText t, const char *s, int len) {
     }
     if (t->alen <= t->len + len) {
 	long	new_len = t->alen + len + t->alen / 2;
-	size_t	size = sizeof(struct _agooText) - AGOO_TEXT_MIN_SIZE + new_len + 1;
 
-	if (NULL == (t = (agooText)AGOO_REALLOC(t, size))) {
+	if (NULL == (t = text_grow(t, new_len))) {
 	    return NULL;
 	}
-	t->alen = new_len;
     }
     memcpy(t->text + t->len, s, len);
     t->len += len;
@@ -135,12 +272,10 @@ agoo_text_append_char(agooText t, const char c) {
     }
     if (t->alen <= t->len + 1) {
 	long	new_len = t->alen + 1 + t->alen / 2;
-	size_t	size = sizeof(struct _agooText) - AGOO_TEXT_MIN_SIZE + new_len + 1;
 
-	if (NULL == (t = (agooText)AGOO_REALLOC(t, size))) {
+	if (NULL == (t = text_grow(t, new_len))) {
 	    return NULL;
 	}
-	t->alen = new_len;
     }
     *(t->text + t->len) = c;
     t->len++;
@@ -159,12 +294,10 @@ agoo_text_prepend(agooText t, const char *s, int len) {
     }
     if (t->alen <= t->len + len) {
 	long	new_len = t->alen + len + t->alen / 2;
-	size_t	size = sizeof(struct _agooText) - AGOO_TEXT_MIN_SIZE + new_len + 1;
 
-	if (NULL == (t = (agooText)AGOO_REALLOC(t, size))) {
+	if (NULL == (t = text_grow(t, new_len))) {
 	    return NULL;
 	}
-	t->alen = new_len;
     }
     memmove(t->text + len, t->text, t->len + 1);
     memcpy(t->text, s, len);
@@ -186,12 +319,10 @@ agoo_text_append_json(agooText t, const char *s, int len) {
     jlen = json_size(s, len);
     if (t->alen <= (long)(t->len + jlen)) {
 	long	new_len = t->alen + jlen + t->alen / 2;
-	size_t	size = sizeof(struct _agooText) - AGOO_TEXT_MIN_SIZE + new_len + 1;
 
-	if (NULL == (t = (agooText)AGOO_REALLOC(t, size))) {
+	if (NULL == (t = text_grow(t, new_len))) {
 	    return NULL;
 	}
-	t->alen = new_len;
     }
     if (jlen == (size_t)len) {
 	memcpy(t->text + t->len, s, len);
@@ -239,3 +370,23 @@ void
 agoo_text_reset(agooText t) {
     t->len = 0;
 }
+
+void
+agoo_text_stats(agooTextStats stats) {
+    Cache	c;
+    int		i;
+
+    memset(stats, 0, sizeof(struct _agooTextStats));
+    pthread_mutex_lock(&caches_lock);
+    for (c = caches; NULL != c; c = c->next) {
+	for (i = 0; i < AGOO_TEXT_CLASS_CNT; i++) {
+	    stats->cached[i] += c->pools[i].cnt;
+	}
+	stats->hits += c->allocs - c->misses;
+	stats->misses += c->misses;
+	if (c->active) {
+	    stats->caches++;
+	}
+    }
+    pthread_mutex_unlock(&caches_lock);
+}
@@ -9,15 +9,31 @@
 
 #define AGOO_TEXT_MIN_SIZE	8
 
+// Texts up to 64K come from per-thread caches with power of two size
+// classes starting at 128 bytes. Larger texts come from the heap.
+#define AGOO_TEXT_CLASS_CNT	10
+
 typedef struct _agooText {
     struct _agooText	*next;
     long		len;  // length of valid text
     long		alen; // size of allocated text
     atomic_int		ref_cnt;
     bool		bin;
+    int			fd;   // if not -1 flen bytes from the file follow the text
+    long		flen;
+    long		foff; // file offset of the first byte to send
     char		text[AGOO_TEXT_MIN_SIZE];
 } *agooText;
 
+// Counts are read without stopping the owning threads so they are
+// approximate.
+typedef struct _agooTextStats {
+    long	cached[AGOO_TEXT_CLASS_CNT]; // buffers waiting for reuse
+    long	hits;    // allocations served from a cache
+    long	misses;  // allocations that went to the heap
+    int		caches;  // threads with a cache
+} *agooTextStats;
+
 extern agooText	agoo_text_create(const char *str, int len);
 extern agooText	agoo_text_dup(agooText t);
 extern agooText	agoo_text_allocate(int len);
@@ -30,4 +46,6 @@ extern agooText	agoo_text_append_char(agooText t, const char c);
 
 extern void	agoo_text_reset(agooText t);
 
+extern void	agoo_text_stats(agooTextStats stats);
+
 #endif // AGOO_TEXT_H
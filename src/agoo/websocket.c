@@ -30,7 +30,7 @@ agoo_ws_add_headers(agooReq req, agooText t) {
     const char	*key;
 
     t = agoo_text_append(t, up_con, sizeof(up_con) - 1);
-    if (NULL != (key = agoo_con_header_value(req->header.start, req->header.len, "Sec-WebSocket-Key", &klen)) &&
+    if (NULL != (key = agoo_req_header(req, AGOO_HDR_SEC_WEBSOCKET_KEY, &klen)) &&
 	klen + sizeof(ws_magic) < MAX_KEY_LEN) {
 	char		buf[MAX_KEY_LEN];
 	unsigned char	sha[32];
@@ -45,7 +45,7 @@ agoo_ws_add_headers(agooReq req, agooText t) {
 	t = agoo_text_append(t, buf, len);
 	t = agoo_text_append(t, "\r\n", 2);
     }
-    if (NULL != (key = agoo_con_header_value(req->header.start, req->header.len, "Sec-WebSocket-Protocol", &klen))) {
+    if (NULL != (key = agoo_req_header(req, AGOO_HDR_SEC_WEBSOCKET_PROTOCOL, &klen))) {
 	t = agoo_text_append(t, ws_protocol, sizeof(ws_protocol) - 1);
 	t = agoo_text_append(t, key, klen);
 	t = agoo_text_append(t, "\r\n", 2);
@@ -168,7 +168,7 @@ bool
 agoo_ws_create_req(agooCon c, long mlen) {
     uint8_t	op = 0x0F & *c->buf;
 
-    if (NULL == (c->req = agoo_req_create(mlen))) {
+    if (NULL == (c->req = agoo_req_create_from(c->loop->req_pools, mlen))) {
 	agoo_log_cat(&agoo_error_cat, "Out of memory attempting to allocate request.");
 	return true;
     }
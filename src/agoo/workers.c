@@ -0,0 +1,151 @@
+// Copyright (c) 2018, Peter Ohler, All rights reserved.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "hook.h"
+#include "log.h"
+#include "metrics.h"
+#include "req.h"
+#include "server.h"
+#include "shed.h"
+#include "workers.h"
+
+// How long a thread waits on the queue before checking for shutdown.
+#define POP_WAIT	0.1
+
+static void*
+workers_loop(void *ptr) {
+    agooWorkers	w = (agooWorkers)ptr;
+    agooReq	req;
+
+    atomic_fetch_add(&agoo_server.running, 1);
+    while (agoo_server.active) {
+	if (NULL != (req = (agooReq)agoo_queue_pop(&w->queue, POP_WAIT))) {
+	    if (!agoo_shed_expired(req)) {
+		agoo_metrics_call(req);
+	    }
+	    agoo_req_destroy(req);
+	    agoo_workers_done(w);
+	}
+    }
+    atomic_fetch_sub(&agoo_server.running, 1);
+
+    return NULL;
+}
+
+agooWorkers
+agoo_workers_create(agooErr err, const char *name, int thread_cnt, int qsize, int max_inflight) {
+    agooWorkers	w;
+
+    if (NULL == name || '\0' == *name) {
+	agoo_err_set(err, AGOO_ERR_ARG, "worker pool name is required");
+	return NULL;
+    }
+    if (NULL != agoo_workers_find(name)) {
+	agoo_err_set(err, AGOO_ERR_IN_USE, "worker pool %s already exists", name);
+	return NULL;
+    }
+    if (thread_cnt < 1 || qsize < 1 || max_inflight < 0) {
+	agoo_err_set(err, AGOO_ERR_ARG, "worker pool %s must have at least one thread and a queue", name);
+	return NULL;
+    }
+    if (NULL == (w = (agooWorkers)AGOO_CALLOC(1, sizeof(struct _agooWorkers)))) {
+	AGOO_ERR_MEM(err, "Worker Pool");
+	return NULL;
+    }
+    if (NULL == (w->name = AGOO_STRDUP(name)) ||
+	NULL == (w->threads = (pthread_t*)AGOO_CALLOC(thread_cnt, sizeof(pthread_t)))) {
+	AGOO_FREE(w->name);
+	AGOO_FREE(w);
+	AGOO_ERR_MEM(err, "Worker Pool");
+	return NULL;
+    }
+    // With a limit the queue holds every request let in so a push never
+    // blocks the con loop.
+    if (qsize < max_inflight) {
+	qsize = max_inflight;
+    }
+    if (AGOO_ERR_OK != agoo_queue_multi_init(err, &w->queue, qsize, true, true)) {
+	AGOO_FREE(w->threads);
+	AGOO_FREE(w->name);
+	AGOO_FREE(w);
+	return NULL;
+    }
+    w->thread_cnt = thread_cnt;
+    w->max_inflight = max_inflight;
+    atomic_init(&w->inflight, 0);
+    atomic_init(&w->rejected, 0);
+
+    w->next = agoo_server.workers;
+    agoo_server.workers = w;
+
+    if (agoo_server.active && AGOO_ERR_OK != agoo_workers_start(err, w)) {
+	return NULL;
+    }
+    return w;
+}
+
+int
+agoo_workers_start(agooErr err, agooWorkers w) {
+    int	i;
+
+    if (w->started) {
+	return AGOO_ERR_OK;
+    }
+    w->started = true;
+    for (i = 0; i < w->thread_cnt; i++) {
+	if (0 != pthread_create(&w->threads[i], NULL, workers_loop, w)) {
+	    return agoo_err_no(err, "failed to start worker pool %s threads", w->name);
+	}
+	pthread_detach(w->threads[i]);
+    }
+    agoo_log_cat(&agoo_info_cat, "Worker pool %s started with %d threads.", w->name, w->thread_cnt);
+
+    return AGOO_ERR_OK;
+}
+
+void
+agoo_workers_destroy(agooWorkers w) {
+    agooReq	req;
+
+    // Requests never taken by a thread still have to be released.
+    while (NULL != (req = (agooReq)agoo_queue_pop(&w->queue, 0.0))) {
+	agoo_req_destroy(req);
+    }
+    agoo_queue_cleanup(&w->queue);
+    AGOO_FREE(w->threads);
+    AGOO_FREE(w->name);
+    AGOO_FREE(w);
+}
+
+agooWorkers
+agoo_workers_find(const char *name) {
+    agooWorkers	w;
+
+    for (w = agoo_server.workers; NULL != w; w = w->next) {
+	if (0 == strcmp(name, w->name)) {
+	    break;
+	}
+    }
+    return w;
+}
+
+bool
+agoo_workers_admit(agooWorkers w) {
+    if (0 < w->max_inflight && w->max_inflight <= atomic_fetch_add(&w->inflight, 1)) {
+	atomic_fetch_sub(&w->inflight, 1);
+	atomic_fetch_add(&w->rejected, 1);
+	return false;
+    }
+    if (0 == w->max_inflight) {
+	atomic_fetch_add(&w->inflight, 1);
+    }
+    return true;
+}
+
+void
+agoo_workers_done(agooWorkers w) {
+    atomic_fetch_sub(&w->inflight, 1);
+}
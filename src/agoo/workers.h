@@ -0,0 +1,40 @@
+// Copyright (c) 2018, Peter Ohler, All rights reserved.
+
+#ifndef AGOO_WORKERS_H
+#define AGOO_WORKERS_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "atomic.h"
+#include "err.h"
+#include "queue.h"
+
+// A named set of eval threads with its own queue. Hooks attached to a pool
+// only run on its threads so a slow route can not starve the others.
+typedef struct _agooWorkers {
+    struct _agooWorkers	*next;
+    char		*name;
+    struct _agooQueue	queue;
+    pthread_t		*threads;
+    int			thread_cnt;
+    int			max_inflight; // 0 for no limit
+    bool		started;
+    atomic_int		inflight; // queued or running
+    atomic_int		rejected; // turned away at max_inflight
+} *agooWorkers;
+
+// The pool is added to the server and its threads are started with the
+// server or right away if the server is already running.
+extern agooWorkers	agoo_workers_create(agooErr err, const char *name, int thread_cnt, int qsize, int max_inflight);
+extern int		agoo_workers_start(agooErr err, agooWorkers w);
+extern void		agoo_workers_destroy(agooWorkers w);
+extern agooWorkers	agoo_workers_find(const char *name);
+
+// Reserves a place for a request. Returns false if the pool is already at
+// max_inflight.
+extern bool		agoo_workers_admit(agooWorkers w);
+// Gives back the place once the request is finished or was not queued.
+extern void		agoo_workers_done(agooWorkers w);
+
+#endif // AGOO_WORKERS_H